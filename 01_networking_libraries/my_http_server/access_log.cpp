@@ -0,0 +1,365 @@
+#include "access_log.h"
+#include "defs.h"
+#include "logging.h"
+#include "metrics.h"
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/uio.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <ctime>
+
+static_assert((ACCESS_LOG_RING_RECORDS & (ACCESS_LOG_RING_RECORDS - 1)) == 0, "the ring size is a power of two");
+static_assert((ACCESS_LOG_PATH_CACHE_SIZE & (ACCESS_LOG_PATH_CACHE_SIZE - 1)) == 0, "the path cache size is a power of two");
+
+// From earlier to later in microseconds, 0 if later is not, and at most
+// UINT32_MAX.
+static uint32_t elapsed_us(uint64_t earlier_ns, uint64_t later_ns)
+{
+    return (later_ns > earlier_ns) ? static_cast<uint32_t>(std::min<uint64_t>((later_ns - earlier_ns) / 1000, UINT32_MAX)) : 0;
+}
+
+AccessLog::AccessLog(const std::string& path, int worker)
+    : m_path(path),
+      m_worker(static_cast<uint16_t>(worker)),
+      m_pid(0),
+      m_fd(-1),
+      m_clock_offset_ns(0),
+      m_sequence(0),
+      m_seen_paths(ACCESS_LOG_PATH_CACHE_SIZE, 0),
+      m_ring(new Slot[ACCESS_LOG_RING_RECORDS]),
+      m_head(0),
+      m_tail_cache(0),
+      m_wake_at(ACCESS_LOG_RING_RECORDS / 2),
+      m_tail(0),
+      m_stopping(false),
+      m_write_failed(false)
+{
+
+}
+
+AccessLog::~AccessLog()
+{
+    if (m_flusher.joinable())
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stopping = true;
+        }
+        m_wakeup.notify_one();
+        m_flusher.join();
+    }
+
+    if (m_fd >= 0)
+    {
+        flush();
+        close(m_fd);
+    }
+}
+
+bool AccessLog::start()
+{
+    m_fd = open(m_path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (m_fd < 0)
+    {
+        LOGE("Access log " + m_path + " cannot be opened");
+        return false;
+    }
+    m_pid = static_cast<uint32_t>(getpid());
+    m_clock.calibrate();
+    timespec wall;
+    clock_gettime(CLOCK_REALTIME, &wall);
+    uint64_t wall_ns = static_cast<uint64_t>(wall.tv_sec) * 1000000000 + wall.tv_nsec;
+    m_clock_offset_ns = static_cast<int64_t>(wall_ns - TscClock::monotonic_ns());
+
+    AccessLogHeader header;
+    std::memset(&header, 0, sizeof(header));
+    header.type = ACCESS_RECORD_HEADER;
+    header.version = ACCESS_LOG_VERSION;
+    header.worker = m_worker;
+    header.pid = m_pid;
+    header.magic = ACCESS_LOG_MAGIC;
+    header.record_size = ACCESS_LOG_RECORD_SIZE;
+    header.start_ns = wall_ns;
+    push(header);
+
+    m_flusher = std::thread(&AccessLog::run_flusher, this);
+    return true;
+}
+
+void AccessLog::begin(AccessEntry& entry, const HTTPRequest& request, uint64_t arrival_us, uint64_t ready_us, bool tls)
+{
+    std::size_t length = std::min(request.m_path.find('?'), request.m_path.length());
+    uint64_t hash = hash_path(request.m_path.data(), length);
+
+    // Paths are few next to requests: each is written once, and again
+    // only after another one has taken its slot.
+    uint64_t& seen = m_seen_paths[hash & (ACCESS_LOG_PATH_CACHE_SIZE - 1)];
+    if (seen != hash && log_path(hash, request.m_path, length))
+    {
+        seen = hash;
+    }
+
+    entry.active = true;
+    entry.method = method_code(request.m_method);
+    bool http11 = request.m_version.length() == 8 && std::memcmp(request.m_version.data(), "HTTP/1.1", 8) == 0;
+    entry.flags = (http11 ? ACCESS_FLAG_HTTP11 : 0) | (tls ? ACCESS_FLAG_TLS : 0);
+    entry.status = 0;
+    entry.read_us = elapsed_us(arrival_us * 1000, ready_us * 1000);
+    entry.ready_ns = ready_us * 1000;
+    entry.path_hash = hash;
+    entry.request_bytes = 0;
+    entry.bytes = 0;
+}
+
+void AccessLog::end(AccessEntry& entry, uint64_t client)
+{
+    if (!entry.active)
+    {
+        return;
+    }
+    entry.active = false;
+
+    uint64_t now_ns = m_clock.now_ns();
+    AccessRecord record;
+    record.type = ACCESS_RECORD_REQUEST;
+    record.method = entry.method;
+    record.flags = entry.flags;
+    record.unused = 0;
+    record.status = entry.status;
+    record.worker = m_worker;
+    record.pid = m_pid;
+    record.read_us = entry.read_us;
+    record.handle_us = elapsed_us(entry.ready_ns, now_ns);
+    record.request_bytes = static_cast<uint32_t>(std::min<uint64_t>(entry.request_bytes, UINT32_MAX));
+    record.time_ns = now_ns + m_clock_offset_ns;
+    record.sequence = m_sequence++;
+    record.client = client;
+    record.path_hash = entry.path_hash;
+    record.bytes = entry.bytes;
+    push(record);
+}
+
+// Both halves of the 128-bit product, folded.
+static uint64_t hash_mix(uint64_t a, uint64_t b)
+{
+    unsigned __int128 product = static_cast<unsigned __int128>(a) * b;
+    return static_cast<uint64_t>(product) ^ static_cast<uint64_t>(product >> 64);
+}
+
+static uint64_t read_word(const char* bytes)
+{
+    uint64_t word;
+    std::memcpy(&word, bytes, sizeof(word));
+    return word;
+}
+
+static uint64_t read_half_word(const char* bytes)
+{
+    uint32_t word;
+    std::memcpy(&word, bytes, sizeof(word));
+    return word;
+}
+
+uint64_t AccessLog::hash_path(const char* path, std::size_t length)
+{
+    // wyhash's scheme: 16 bytes per multiplication, and the last bytes
+    // read with loads of fixed size that may overlap earlier ones.
+    const uint64_t secret0 = 0xa0761d6478bd642fULL;
+    const uint64_t secret1 = 0xe7037ed1a0b428dbULL;
+    uint64_t hash = secret1 ^ length;
+    uint64_t first = 0;
+    uint64_t second = 0;
+    if (length > 16)
+    {
+        std::size_t i = 0;
+        for (; i + 16 < length; i += 16)
+        {
+            hash = hash_mix(read_word(path + i) ^ secret0, read_word(path + i + 8) ^ hash);
+        }
+        first = read_word(path + length - 16);
+        second = read_word(path + length - 8);
+    }
+    else if (length >= 8)
+    {
+        first = read_word(path);
+        second = read_word(path + length - 8);
+    }
+    else if (length >= 4)
+    {
+        first = read_half_word(path);
+        second = read_half_word(path + length - 4);
+    }
+    else if (length > 0)
+    {
+        first = (static_cast<uint64_t>(static_cast<unsigned char>(path[0])) << 16) |
+                (static_cast<uint64_t>(static_cast<unsigned char>(path[length / 2])) << 8) |
+                static_cast<unsigned char>(path[length - 1]);
+    }
+    hash = hash_mix(first ^ secret0, second ^ hash);
+    hash = hash_mix(hash ^ secret1, length ^ secret0);
+    return (hash != 0) ? hash : 1;
+}
+
+uint8_t AccessLog::method_code(const std::string& method)
+{
+    // Lengths first, so that most methods are told apart without a
+    // comparison of their names.
+    struct MethodName
+    {
+        const char* name;
+        std::size_t length;
+        uint8_t code;
+    };
+    static const MethodName names[] = {
+        {"GET", 3, ACCESS_METHOD_GET},
+        {"HEAD", 4, ACCESS_METHOD_HEAD},
+        {"POST", 4, ACCESS_METHOD_POST},
+        {"PUT", 3, ACCESS_METHOD_PUT},
+        {"DELETE", 6, ACCESS_METHOD_DELETE},
+        {"OPTIONS", 7, ACCESS_METHOD_OPTIONS},
+        {"PATCH", 5, ACCESS_METHOD_PATCH},
+        {"CONNECT", 7, ACCESS_METHOD_CONNECT},
+        {"TRACE", 5, ACCESS_METHOD_TRACE}
+    };
+    for (const MethodName& entry : names)
+    {
+        if (method.length() == entry.length && std::memcmp(method.data(), entry.name, entry.length) == 0)
+        {
+            return entry.code;
+        }
+    }
+    return ACCESS_METHOD_OTHER;
+}
+
+template <typename Record>
+bool AccessLog::push(const Record& record)
+{
+    static_assert(sizeof(Record) == sizeof(Slot), "records fill a slot");
+
+    // The flusher's index is read again only when the ring looks full.
+    uint64_t head = m_head.load(std::memory_order_relaxed);
+    if (head - m_tail_cache >= ACCESS_LOG_RING_RECORDS)
+    {
+        m_tail_cache = m_tail.load(std::memory_order_acquire);
+        if (head - m_tail_cache >= ACCESS_LOG_RING_RECORDS)
+        {
+            METRIC_INC(METRIC_ACCESS_LOG_DROPPED);
+            return false;
+        }
+    }
+    std::memcpy(m_ring[head & (ACCESS_LOG_RING_RECORDS - 1)].bytes, &record, sizeof(record));
+    head++;
+    m_head.store(head, std::memory_order_release);
+
+    // The flusher is woken once the ring is half full, and again every
+    // eighth of it while it stays that way. Taking the mutex before the
+    // notification keeps it from being lost between the flusher's check
+    // and its wait.
+    if (head >= m_wake_at)
+    {
+        m_tail_cache = m_tail.load(std::memory_order_acquire);
+        if (head - m_tail_cache < ACCESS_LOG_RING_RECORDS / 2)
+        {
+            m_wake_at = m_tail_cache + ACCESS_LOG_RING_RECORDS / 2;
+            return true;
+        }
+        m_wake_at = head + ACCESS_LOG_RING_RECORDS / 8;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+        }
+        m_wakeup.notify_one();
+    }
+    return true;
+}
+
+bool AccessLog::log_path(uint64_t hash, const std::string& path, std::size_t length)
+{
+    AccessPathRecord record;
+    std::memset(&record, 0, sizeof(record));
+    record.type = ACCESS_RECORD_PATH;
+    record.length = static_cast<uint8_t>(std::min<std::size_t>(length, ACCESS_LOG_PATH_LENGTH));
+    record.truncated = (length > ACCESS_LOG_PATH_LENGTH) ? 1 : 0;
+    record.pid = m_pid;
+    record.path_hash = hash;
+    std::memcpy(record.path, path.data(), record.length);
+    return push(record);
+}
+
+void AccessLog::run_flusher()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (!m_stopping)
+    {
+        m_wakeup.wait_for(lock, std::chrono::milliseconds(ACCESS_LOG_FLUSH_INTERVAL_MS), [this]
+        {
+            return m_stopping || m_head.load(std::memory_order_acquire) - m_tail.load(std::memory_order_relaxed) >= ACCESS_LOG_RING_RECORDS / 2;
+        });
+        lock.unlock();
+        m_clock.recalibrate();
+        flush();
+        lock.lock();
+    }
+}
+
+std::size_t AccessLog::flush()
+{
+    uint64_t tail = m_tail.load(std::memory_order_relaxed);
+    uint64_t head = m_head.load(std::memory_order_acquire);
+    std::size_t count = head - tail;
+    if (count == 0)
+    {
+        return 0;
+    }
+
+    // Straight from the ring, in at most two pieces when it wraps around.
+    std::size_t start = tail & (ACCESS_LOG_RING_RECORDS - 1);
+    std::size_t first = std::min<std::size_t>(count, ACCESS_LOG_RING_RECORDS - start);
+    iovec iov[2];
+    iov[0].iov_base = m_ring[start].bytes;
+    iov[0].iov_len = first * sizeof(Slot);
+    iov[1].iov_base = m_ring[0].bytes;
+    iov[1].iov_len = (count - first) * sizeof(Slot);
+    int iov_count = (count > first) ? 2 : 1;
+
+    int index = 0;
+    while (index < iov_count)
+    {
+        ssize_t written = writev(m_fd, iov + index, iov_count - index);
+        if (written < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (written < 0)
+        {
+            if (!m_write_failed)
+            {
+                LOGE("Access log " + m_path + " write failed, records are dropped");
+                m_write_failed = true;
+            }
+            METRIC_ADD(METRIC_ACCESS_LOG_DROPPED, count);
+            break;
+        }
+        while (index < iov_count && static_cast<std::size_t>(written) >= iov[index].iov_len)
+        {
+            written -= iov[index].iov_len;
+            index++;
+        }
+        if (index < iov_count)
+        {
+            iov[index].iov_base = static_cast<char*>(iov[index].iov_base) + written;
+            iov[index].iov_len -= written;
+        }
+    }
+    if (index == iov_count)
+    {
+        METRIC_ADD(METRIC_ACCESS_LOG_RECORDS, count);
+    }
+
+    m_tail.store(head, std::memory_order_release);
+    return count;
+}
@@ -0,0 +1,202 @@
+#ifndef ACCESS_LOG_H
+#define ACCESS_LOG_H
+
+#include "http_request.h"
+#include "tsc_clock.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// The file format: a sequence of ACCESS_LOG_RECORD_SIZE-byte records in
+// host byte order, told apart by their first byte. Every process starts
+// with a header record; a path record maps a path hash to the path the
+// first time the process logs it; the rest are request records.
+#define ACCESS_LOG_MAGIC (0x4c415448) // "HTAL"
+#define ACCESS_LOG_VERSION (1)
+#define ACCESS_LOG_RECORD_SIZE (64)
+#define ACCESS_LOG_PATH_LENGTH (48)
+
+enum AccessRecordType
+{
+    ACCESS_RECORD_HEADER = 1,
+    ACCESS_RECORD_PATH = 2,
+    ACCESS_RECORD_REQUEST = 3
+};
+
+enum AccessMethod
+{
+    ACCESS_METHOD_OTHER,
+    ACCESS_METHOD_GET,
+    ACCESS_METHOD_HEAD,
+    ACCESS_METHOD_POST,
+    ACCESS_METHOD_PUT,
+    ACCESS_METHOD_DELETE,
+    ACCESS_METHOD_OPTIONS,
+    ACCESS_METHOD_PATCH,
+    ACCESS_METHOD_CONNECT,
+    ACCESS_METHOD_TRACE
+};
+
+enum AccessFlags
+{
+    ACCESS_FLAG_HTTP11 = 1,
+    ACCESS_FLAG_TLS = 2,
+    // The connection was closed after the response
+    ACCESS_FLAG_CLOSE = 4,
+    // The connection ended before the response was complete
+    ACCESS_FLAG_TRUNCATED = 8
+};
+
+struct AccessLogHeader
+{
+    uint8_t type;
+    uint8_t version;
+    uint16_t worker;
+    uint32_t pid;
+    uint32_t magic;
+    uint32_t record_size;
+    // Wall clock when the process opened the log
+    uint64_t start_ns;
+    uint8_t unused[40];
+};
+
+struct AccessPathRecord
+{
+    uint8_t type;
+    // Bytes of path used, at most ACCESS_LOG_PATH_LENGTH
+    uint8_t length;
+    // The path is longer than what is kept of it
+    uint8_t truncated;
+    uint8_t unused;
+    uint32_t pid;
+    uint64_t path_hash;
+    char path[ACCESS_LOG_PATH_LENGTH];
+};
+
+struct AccessRecord
+{
+    uint8_t type;
+    uint8_t method;
+    uint8_t flags;
+    uint8_t unused;
+    uint16_t status;
+    uint16_t worker;
+    uint32_t pid;
+    // First byte of the request to the wakeup with the whole head, then to
+    // the response being complete, queueing on the loop included
+    uint32_t read_us;
+    uint32_t handle_us;
+    // Request bytes read, head and body, up to UINT32_MAX
+    uint32_t request_bytes;
+    // Wall clock when the response was complete
+    uint64_t time_ns;
+    // Counts the request records of the process, dropped ones included
+    uint64_t sequence;
+    // RateLimiter key: an IPv4 address, or the /64 prefix of an IPv6 one
+    uint64_t client;
+    // Of the path without its query string
+    uint64_t path_hash;
+    // Response bytes queued for the client
+    uint64_t bytes;
+};
+
+static_assert(sizeof(AccessLogHeader) == ACCESS_LOG_RECORD_SIZE, "access log records have a fixed size");
+static_assert(sizeof(AccessPathRecord) == ACCESS_LOG_RECORD_SIZE, "access log records have a fixed size");
+static_assert(sizeof(AccessRecord) == ACCESS_LOG_RECORD_SIZE, "access log records have a fixed size");
+
+// What a connection keeps of the request it is answering until the record
+// is written.
+struct AccessEntry
+{
+    bool active = false;
+    uint8_t method = ACCESS_METHOD_OTHER;
+    uint8_t flags = 0;
+    uint16_t status = 0;
+    uint32_t read_us = 0;
+    uint64_t ready_ns = 0;
+    uint64_t path_hash = 0;
+    uint64_t request_bytes = 0;
+    uint64_t bytes = 0;
+};
+
+// Binary access log of one event loop. The loop appends fixed-size records
+// to a single-producer ring without locks or system calls, and a flusher
+// thread writes whatever has accumulated with one writev() per batch. The
+// file is opened with O_APPEND and every batch is whole records, so the
+// workers of a prefork server can share it; each record names its process.
+// While the disk is slower than the requests, records that find the ring
+// full are dropped and counted. A request costs one clock read, from a
+// TscClock, when it ends; the loop's wakeup times give the rest. Started
+// after the workers are forked.
+class AccessLog
+{
+public:
+    AccessLog(const std::string& path, int worker);
+    // Writes what is left in the ring.
+    ~AccessLog();
+
+    AccessLog(const AccessLog&) = delete;
+    AccessLog& operator=(const AccessLog&) = delete;
+
+    bool start();
+
+    // From the loop: the head of the request has been parsed. arrival_us
+    // is when its first byte was read and ready_us when the loop woke up
+    // with all of the head, both on CLOCK_MONOTONIC.
+    void begin(AccessEntry& entry, const HTTPRequest& request, uint64_t arrival_us, uint64_t ready_us, bool tls);
+    // From the loop: the response is complete, or will never be. The
+    // connection has set the status and flags of the entry by then.
+    void end(AccessEntry& entry, uint64_t client);
+
+    // Never 0, which marks an empty slot of the path cache.
+    static uint64_t hash_path(const char* path, std::size_t length);
+    static uint8_t method_code(const std::string& method);
+
+private:
+    struct alignas(ACCESS_LOG_RECORD_SIZE) Slot
+    {
+        unsigned char bytes[ACCESS_LOG_RECORD_SIZE];
+    };
+
+    template <typename Record>
+    bool push(const Record& record);
+    bool log_path(uint64_t hash, const std::string& path, std::size_t length);
+    void run_flusher();
+    // Returns the number of records taken from the ring.
+    std::size_t flush();
+
+private:
+    std::string m_path;
+    uint16_t m_worker;
+    uint32_t m_pid;
+    int m_fd;
+    TscClock m_clock;
+    // Added to a monotonic time to get the wall clock
+    int64_t m_clock_offset_ns;
+    uint64_t m_sequence;
+    std::vector<uint64_t> m_seen_paths;
+    std::unique_ptr<Slot[]> m_ring;
+
+    // Written by the loop, read by the flusher; each on a cache line of
+    // its own, with the loop's cached copy of the other index and the head
+    // at which it looks at the flusher's progress again.
+    alignas(64) std::atomic<uint64_t> m_head;
+    uint64_t m_tail_cache;
+    uint64_t m_wake_at;
+    alignas(64) std::atomic<uint64_t> m_tail;
+
+    std::thread m_flusher;
+    std::mutex m_mutex;
+    std::condition_variable m_wakeup;
+    bool m_stopping;
+    bool m_write_failed;
+};
+
+#endif // ACCESS_LOG_H
@@ -0,0 +1,283 @@
+#include "async_socket.h"
+#include "utils.h"
+
+#include <arpa/inet.h>
+#include <cerrno>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+AsyncSocket::Operation::Operation(AsyncSocket& socket, OperationKind kind, const char* data, std::size_t length)
+    : m_socket(socket),
+      m_kind(kind),
+      m_data(data),
+      m_length(length),
+      m_done(0),
+      m_started(false),
+      m_result(-1),
+      m_error(0)
+{
+
+}
+
+AsyncSocket::Operation::~Operation()
+{
+    if (m_socket.m_waiting == this)
+    {
+        m_socket.stop_waiting();
+    }
+}
+
+bool AsyncSocket::Operation::await_ready()
+{
+    return attempt();
+}
+
+void AsyncSocket::Operation::await_suspend(std::coroutine_handle<> waiter)
+{
+    m_waiter = waiter;
+    uint32_t interest = (m_kind == READ) ? EPOLLIN | EPOLLRDHUP : EPOLLOUT;
+    if (!m_socket.wait(this, interest))
+    {
+        // Resumed by the loop all the same, so the coroutine never
+        // continues inside its own co_await.
+        complete(-1, errno);
+        m_socket.m_loop.timers().schedule(&m_socket.m_timer, 0);
+        m_socket.m_waiting = this;
+    }
+}
+
+ssize_t AsyncSocket::Operation::await_resume()
+{
+    if (m_result < 0)
+    {
+        errno = m_error;
+    }
+    return m_result;
+}
+
+bool AsyncSocket::Operation::attempt()
+{
+    int sock = m_socket.m_sock;
+    switch (m_kind)
+    {
+        case CONNECT:
+        {
+            if (m_started)
+            {
+                int error = 0;
+                socklen_t error_length = sizeof(error);
+                getsockopt(sock, SOL_SOCKET, SO_ERROR, &error, &error_length);
+                complete(error == 0 ? 0 : -1, error);
+                return true;
+            }
+
+            m_started = true;
+            sockaddr_in address = {};
+            address.sin_family = AF_INET;
+            address.sin_port = htons(m_socket.m_port);
+            if (sock >= 0 || inet_pton(AF_INET, m_socket.m_host.c_str(), &address.sin_addr) != 1)
+            {
+                complete(-1, sock >= 0 ? EISCONN : EINVAL);
+                return true;
+            }
+            sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+            if (sock < 0)
+            {
+                complete(-1, errno);
+                return true;
+            }
+            m_socket.m_sock = sock;
+            int one = 1;
+            setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            if (::connect(sock, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == 0)
+            {
+                complete(0, 0);
+                return true;
+            }
+            if (errno == EINPROGRESS)
+            {
+                return false;
+            }
+            complete(-1, errno);
+            return true;
+        }
+
+        case READ:
+        {
+            while (true)
+            {
+                ssize_t received = recv(sock, const_cast<char*>(m_data), m_length, 0);
+                if (received >= 0)
+                {
+                    complete(received, 0);
+                    return true;
+                }
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                {
+                    return false;
+                }
+                complete(-1, errno);
+                return true;
+            }
+        }
+
+        case WRITE:
+        {
+            while (m_done < m_length)
+            {
+                ssize_t sent = send(sock, m_data + m_done, m_length - m_done, MSG_NOSIGNAL);
+                if (sent > 0)
+                {
+                    m_done += sent;
+                    continue;
+                }
+                if (sent < 0 && errno == EINTR)
+                {
+                    continue;
+                }
+                if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                {
+                    return false;
+                }
+                complete(-1, sent < 0 ? errno : EPIPE);
+                return true;
+            }
+            complete(m_length, 0);
+            return true;
+        }
+    }
+    return true;
+}
+
+void AsyncSocket::Operation::complete(ssize_t result, int error)
+{
+    m_result = result;
+    m_error = error;
+}
+
+AsyncSocket::AsyncSocket(EventLoop& loop)
+    : m_loop(loop),
+      m_sock(-1),
+      m_port(0),
+      m_timeout_ms(0),
+      m_timer(this),
+      m_waiting(nullptr)
+{
+
+}
+
+AsyncSocket::AsyncSocket(EventLoop& loop, int sock)
+    : AsyncSocket(loop)
+{
+    m_sock = sock;
+    set_socket_nonblocking(sock);
+}
+
+AsyncSocket::~AsyncSocket()
+{
+    close();
+}
+
+int AsyncSocket::get_socket() const
+{
+    return m_sock;
+}
+
+void AsyncSocket::set_timeout(int timeout_ms)
+{
+    m_timeout_ms = timeout_ms;
+}
+
+void AsyncSocket::close()
+{
+    stop_waiting();
+    if (m_sock >= 0)
+    {
+        ::close(m_sock);
+        m_sock = -1;
+    }
+}
+
+AsyncSocket::Operation AsyncSocket::connect(const std::string& host, int port)
+{
+    m_host = host;
+    m_port = port;
+    return Operation(*this, CONNECT, nullptr, 0);
+}
+
+AsyncSocket::Operation AsyncSocket::read(char* buffer, std::size_t length)
+{
+    return Operation(*this, READ, buffer, length);
+}
+
+AsyncSocket::Operation AsyncSocket::write(const char* data, std::size_t length)
+{
+    return Operation(*this, WRITE, data, length);
+}
+
+void AsyncSocket::handle_event(uint32_t)
+{
+    Operation* operation = m_waiting;
+    if (operation == nullptr || !operation->attempt())
+    {
+        return;
+    }
+
+    // Last: the coroutine may destroy this socket before it suspends again.
+    stop_waiting();
+    operation->m_waiter.resume();
+}
+
+void AsyncSocket::handle_timeout(TimerNode*)
+{
+    Operation* operation = m_waiting;
+    if (operation == nullptr)
+    {
+        return;
+    }
+
+    // An operation that failed to wait already has its result.
+    if (operation->m_error == 0)
+    {
+        operation->complete(-1, ETIMEDOUT);
+    }
+    stop_waiting();
+    operation->m_waiter.resume();
+}
+
+bool AsyncSocket::wait(Operation* operation, uint32_t interest)
+{
+    if (m_sock < 0 || !m_loop.add(m_sock, interest, this))
+    {
+        errno = (m_sock < 0) ? EBADF : errno;
+        return false;
+    }
+
+    m_waiting = operation;
+    if (m_timeout_ms > 0)
+    {
+        m_loop.timers().schedule(&m_timer, m_timeout_ms);
+    }
+    return true;
+}
+
+void AsyncSocket::stop_waiting()
+{
+    if (m_waiting == nullptr)
+    {
+        return;
+    }
+
+    m_waiting = nullptr;
+    m_loop.timers().cancel(&m_timer);
+    if (m_sock >= 0)
+    {
+        m_loop.remove(m_sock);
+    }
+}
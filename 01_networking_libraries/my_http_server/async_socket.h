@@ -0,0 +1,100 @@
+#ifndef ASYNC_SOCKET_H
+#define ASYNC_SOCKET_H
+
+#include "event_loop.h"
+#include "timer_wheel.h"
+
+#include <coroutine>
+#include <cstddef>
+#include <string>
+#include <sys/types.h>
+
+// A non-blocking socket for coroutine handlers. connect(), read() and
+// write() are awaited; each is tried right away and only suspends the
+// coroutine when the socket is not ready, in which case the event loop
+// resumes it once it is, on the loop's own thread. The socket is only
+// registered with the loop while an operation waits, and at most one
+// operation may wait at a time. Destroying a waiting operation, as a
+// cancelled coroutine does, unregisters it.
+class AsyncSocket : public EventHandler, public TimerHandler
+{
+public:
+    enum OperationKind
+    {
+        CONNECT,
+        READ,
+        WRITE
+    };
+
+    // What the coroutine awaits. The result follows the system calls:
+    // read() returns the bytes read, 0 at the end of the stream; connect()
+    // returns 0; write() returns length once all of it is written. Any
+    // failure returns -1 with errno set, ETIMEDOUT past the timeout.
+    class Operation
+    {
+    public:
+        Operation(AsyncSocket& socket, OperationKind kind, const char* data, std::size_t length);
+        ~Operation();
+
+        Operation(const Operation&) = delete;
+        Operation& operator=(const Operation&) = delete;
+
+        bool await_ready();
+        void await_suspend(std::coroutine_handle<> waiter);
+        ssize_t await_resume();
+
+    private:
+        friend class AsyncSocket;
+
+        // Returns true once the operation has completed.
+        bool attempt();
+        void complete(ssize_t result, int error);
+
+    private:
+        AsyncSocket& m_socket;
+        OperationKind m_kind;
+        const char* m_data;
+        std::size_t m_length;
+        std::size_t m_done;
+        bool m_started;
+        ssize_t m_result;
+        int m_error;
+        std::coroutine_handle<> m_waiter;
+    };
+
+    explicit AsyncSocket(EventLoop& loop);
+    // Takes over a connected socket, which is made non-blocking.
+    AsyncSocket(EventLoop& loop, int sock);
+    ~AsyncSocket();
+
+    AsyncSocket(const AsyncSocket&) = delete;
+    AsyncSocket& operator=(const AsyncSocket&) = delete;
+
+    int get_socket() const;
+    // Operations that wait longer than timeout_ms fail; 0 waits forever.
+    void set_timeout(int timeout_ms);
+    void close();
+
+    // host is a numeric IPv4 address; nothing here may block on DNS.
+    Operation connect(const std::string& host, int port);
+    Operation read(char* buffer, std::size_t length);
+    Operation write(const char* data, std::size_t length);
+
+    void handle_event(uint32_t events) override;
+    void handle_timeout(TimerNode* timer) override;
+
+private:
+    bool wait(Operation* operation, uint32_t interest);
+    void stop_waiting();
+
+private:
+    EventLoop& m_loop;
+    int m_sock;
+    std::string m_host;
+    int m_port;
+    int m_timeout_ms;
+    TimerNode m_timer;
+    Operation* m_waiting;
+};
+
+#endif // ASYNC_SOCKET_H
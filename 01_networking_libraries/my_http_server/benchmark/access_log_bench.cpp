@@ -0,0 +1,211 @@
+// Access log benchmark.
+//
+// Logs --requests requests over --paths distinct paths through an
+// AccessLog writing to --file, and reports the time per logged request:
+// begin() and end(), which is what the log adds to each request on the
+// loop. Requests are logged in bursts of --burst with an untimed pause of
+// --pause-us after each, so that the flusher keeps up as it would behind a
+// server that spends time on the requests themselves; the records written
+// and dropped are reported. For comparison, the same requests are then
+// formatted as text lines with snprintf() and written with fwrite(), the
+// way a conventional access log would on the loop.
+
+#include "../access_log.h"
+#include "../defs.h"
+#include "../metrics.h"
+#include "../utils.h"
+
+#include <arpa/inet.h>
+#include <getopt.h>
+#include <netinet/in.h>
+#include <unistd.h>
+
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace
+{
+    struct Options
+    {
+        std::string file = "/dev/null";
+        long requests = 10000000;
+        int paths = 64;
+        int burst = 1000;
+        int pause_us = 20;
+    };
+
+    uint64_t now_ns()
+    {
+        timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return static_cast<uint64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+    }
+
+    std::vector<HTTPRequest> make_requests(int paths)
+    {
+        static const char* const methods[] = {"GET", "GET", "GET", "POST", "HEAD"};
+        std::vector<HTTPRequest> requests;
+        for (int i = 0; i < paths; i++)
+        {
+            HTTPRequest request;
+            request.m_method = methods[i % 5];
+            request.m_path = "/static/assets/file-" + std::to_string(i) + ".html?v=" + std::to_string(i * 7);
+            request.m_version = "HTTP/1.1";
+            requests.push_back(request);
+        }
+        return requests;
+    }
+
+    void pause(int pause_us)
+    {
+        if (pause_us > 0)
+        {
+            usleep(pause_us);
+        }
+    }
+
+    bool run_binary(const Options& options, const std::vector<HTTPRequest>& requests)
+    {
+        std::unique_ptr<AccessLog> log(new AccessLog(options.file, 0));
+        if (!log->start())
+        {
+            return false;
+        }
+
+        AccessEntry entry;
+        uint64_t timed_ns = 0;
+        long logged = 0;
+        while (logged < options.requests)
+        {
+            uint64_t ready_us = monotonic_us();
+            uint64_t start_ns = now_ns();
+            for (int i = 0; i < options.burst && logged < options.requests; i++, logged++)
+            {
+                log->begin(entry, requests[logged % requests.size()], ready_us, ready_us, false);
+                entry.status = HTTP_200;
+                entry.bytes = 1024 + logged % 512;
+                log->end(entry, (1ULL << 32) | (0x7f000001 + logged % 256));
+            }
+            timed_ns += now_ns() - start_ns;
+            pause(options.pause_us);
+        }
+        log.reset();
+
+        printf("Binary log:   %8.1f ns per request, %" PRId64 " records written, %" PRId64 " dropped\n",
+               static_cast<double>(timed_ns) / logged,
+               Metrics::getInstance().get(METRIC_ACCESS_LOG_RECORDS),
+               Metrics::getInstance().get(METRIC_ACCESS_LOG_DROPPED));
+        return true;
+    }
+
+    bool run_text(const Options& options, const std::vector<HTTPRequest>& requests)
+    {
+        FILE* file = fopen(options.file.c_str(), "a");
+        if (file == nullptr)
+        {
+            return false;
+        }
+
+        uint64_t timed_ns = 0;
+        long logged = 0;
+        while (logged < options.requests)
+        {
+            uint64_t start_ns = now_ns();
+            for (int i = 0; i < options.burst && logged < options.requests; i++, logged++)
+            {
+                const HTTPRequest& request = requests[logged % requests.size()];
+                timespec wall;
+                clock_gettime(CLOCK_REALTIME, &wall);
+                tm utc;
+                gmtime_r(&wall.tv_sec, &utc);
+                char time_text[32];
+                strftime(time_text, sizeof(time_text), "%d/%b/%Y:%H:%M:%S +0000", &utc);
+                in_addr address;
+                address.s_addr = htonl(0x7f000001 + logged % 256);
+                char client[INET_ADDRSTRLEN];
+                inet_ntop(AF_INET, &address, client, sizeof(client));
+                char line[512];
+                int length = snprintf(line, sizeof(line), "%s - - [%s] \"%s %s %s\" %d %ld\n", client, time_text,
+                                      request.m_method.c_str(), request.m_path.c_str(), request.m_version.c_str(),
+                                      HTTP_200, 1024 + logged % 512);
+                fwrite(line, 1, length, file);
+            }
+            timed_ns += now_ns() - start_ns;
+            pause(options.pause_us);
+        }
+        fclose(file);
+
+        printf("Text lines:   %8.1f ns per request\n", static_cast<double>(timed_ns) / logged);
+        return true;
+    }
+}
+
+void print_usage(const char* program_name)
+{
+    fprintf(stderr, "Usage: %s [options]\n", program_name);
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "  --file <path>         Log file (default: /dev/null)\n");
+    fprintf(stderr, "  --requests <n>        Requests to log (default: 10000000)\n");
+    fprintf(stderr, "  --paths <n>           Distinct request paths (default: 64)\n");
+    fprintf(stderr, "  --burst <n>           Requests logged back to back (default: 1000)\n");
+    fprintf(stderr, "  --pause-us <usecs>    Pause after each burst (default: 20)\n");
+}
+
+bool parse_arguments(int argc, char** argv, Options& options)
+{
+    enum
+    {
+        OPT_FILE = 256,
+        OPT_REQUESTS,
+        OPT_PATHS,
+        OPT_BURST,
+        OPT_PAUSE_US,
+    };
+
+    static const option long_options[] = {
+        {"file", required_argument, nullptr, OPT_FILE},
+        {"requests", required_argument, nullptr, OPT_REQUESTS},
+        {"paths", required_argument, nullptr, OPT_PATHS},
+        {"burst", required_argument, nullptr, OPT_BURST},
+        {"pause-us", required_argument, nullptr, OPT_PAUSE_US},
+        {nullptr, 0, nullptr, 0}
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", long_options, nullptr)) != -1)
+    {
+        switch (opt)
+        {
+            case OPT_FILE:     options.file = optarg; break;
+            case OPT_REQUESTS: options.requests = std::stol(optarg); break;
+            case OPT_PATHS:    options.paths = std::stoi(optarg); break;
+            case OPT_BURST:    options.burst = std::stoi(optarg); break;
+            case OPT_PAUSE_US: options.pause_us = std::stoi(optarg); break;
+            default:           return false;
+        }
+    }
+    return optind == argc && options.requests > 0 && options.paths > 0 && options.burst > 0 && options.pause_us >= 0;
+}
+
+int main(int argc, char** argv)
+{
+    Options options;
+    if (!parse_arguments(argc, argv, options))
+    {
+        print_usage(argv[0]);
+        return -1;
+    }
+
+    std::vector<HTTPRequest> requests = make_requests(options.paths);
+    if (!run_binary(options, requests) || !run_text(options, requests))
+    {
+        fprintf(stderr, "Cannot write to %s\n", options.file.c_str());
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,604 @@
+// Server-Sent Events fan-out benchmark.
+//
+// Subscribes --subscribers connections to STR_EVENTS_PATH<topic>, spread
+// over --sources loopback addresses like idle_bench, then publishes --events
+// events of --size bytes, one every --interval milliseconds, with a POST on
+// a connection of its own. Each event's data starts with its number; for
+// every event the latency from the POST until each subscriber has read it
+// is recorded, and the time until the last one has (the fan-out latency) is
+// the figure to watch. The server's own event_fanout_us from /metrics, the
+// time it spent queuing and writing the events, is printed as well.
+//
+// Both ends need a descriptor per subscriber: raise the hard limit on open
+// files first, and run the server with --max-connections above
+// --subscribers.
+//
+// With --local there is no server: the subscribers are body streams of
+// this process, each writing to an output queue of its own as a connection
+// would, and only the time TopicRegistry::publish() takes to queue an event
+// for all of them is measured, next to the time it takes to queue a copy
+// for each. The queues are emptied between events, outside the timing.
+
+#include "../body_stream.h"
+#include "../defs.h"
+#include "../event_loop.h"
+#include "../metrics.h"
+#include "../output_queue.h"
+#include "../topic_registry.h"
+#include "../utils.h"
+
+#include <arpa/inet.h>
+#include <getopt.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace
+{
+    struct Options
+    {
+        std::string host = STR_LOCALHOST_IP;
+        int port = 8080;
+        long subscribers = 100000;
+        int sources = 0;
+        int concurrency = 1000;
+        std::string topic = "bench";
+        int events = 20;
+        int interval_ms = 500;
+        int size = 64;
+        bool local = false;
+    };
+
+    // An in-process subscriber connection: queues what its stream writes
+    // and never sends it.
+    class LocalClient : public UpstreamClient
+    {
+    public:
+        bool upstream_data(const std::string& data) override
+        {
+            m_output.append(data);
+            return true;
+        }
+
+        bool upstream_shared(const std::shared_ptr<const std::string>& buffer, std::size_t offset, std::size_t length) override
+        {
+            m_output.append_shared(buffer, offset, length);
+            return m_output.segment_count() < OUTPUT_MAX_SHARED_SEGMENTS;
+        }
+
+        void upstream_complete(bool) override
+        {
+
+        }
+
+        void upstream_failed(int) override
+        {
+
+        }
+
+    public:
+        OutputQueue m_output;
+        std::unique_ptr<BodyStream> m_stream;
+    };
+
+    struct Subscriber
+    {
+        int sock = -1;
+        bool sent = false;
+        bool subscribed = false;
+        std::string input;
+    };
+
+    // The publisher connection is told apart from subscribers by this tag.
+    const uint64_t PUBLISHER_TAG = UINT64_MAX;
+
+    sockaddr_in server_address(const Options& options)
+    {
+        sockaddr_in server;
+        std::memset(&server, 0, sizeof(server));
+        server.sin_family = AF_INET;
+        server.sin_port = htons(options.port);
+        inet_pton(AF_INET, options.host.c_str(), &server.sin_addr);
+        return server;
+    }
+
+    int open_connection(const Options& options, long index)
+    {
+        int sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (sock < 0)
+        {
+            return -1;
+        }
+
+        int one = 1;
+        setsockopt(sock, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &one, sizeof(one));
+
+        sockaddr_in source;
+        std::memset(&source, 0, sizeof(source));
+        source.sin_family = AF_INET;
+        source.sin_addr.s_addr = htonl((127u << 24) + 2 + index % options.sources);
+        sockaddr_in server = server_address(options);
+        if (bind(sock, reinterpret_cast<sockaddr*>(&source), sizeof(source)) != 0 ||
+            (connect(sock, reinterpret_cast<sockaddr*>(&server), sizeof(server)) != 0 && errno != EINPROGRESS))
+        {
+            close(sock);
+            return -1;
+        }
+        return sock;
+    }
+
+    // Reads what has arrived; false if the connection is gone.
+    bool read_available(int sock, std::string& input)
+    {
+        char buffer[16 * 1024];
+        while (true)
+        {
+            ssize_t received = recv(sock, buffer, sizeof(buffer), 0);
+            if (received > 0)
+            {
+                input.append(buffer, received);
+                continue;
+            }
+            return received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+        }
+    }
+
+    // Takes the complete events out of input and returns their numbers.
+    // Each one's data starts with its number.
+    void take_events(std::string& input, std::vector<long>& numbers)
+    {
+        std::size_t start = 0;
+        while (true)
+        {
+            std::size_t field = input.find("data: ", start);
+            if (field == std::string::npos || input.find("\n\n", field) == std::string::npos)
+            {
+                break;
+            }
+            numbers.push_back(std::strtol(input.c_str() + field + 6, nullptr, 10));
+            start = input.find("\n\n", field) + 2;
+        }
+        input.erase(0, start);
+    }
+
+    std::string fetch_metric(const Options& options, const std::string& name)
+    {
+        int sock = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        sockaddr_in server = server_address(options);
+        if (sock < 0 || connect(sock, reinterpret_cast<sockaddr*>(&server), sizeof(server)) != 0)
+        {
+            if (sock >= 0)
+            {
+                close(sock);
+            }
+            return "0";
+        }
+
+        std::string request = std::string("GET ") + STR_METRICS_PATH + " HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n";
+        send(sock, request.data(), request.length(), MSG_NOSIGNAL);
+        std::string response;
+        char buffer[MESSAGE_SIZE];
+        ssize_t received;
+        while ((received = recv(sock, buffer, sizeof(buffer), 0)) > 0)
+        {
+            response.append(buffer, received);
+        }
+        close(sock);
+
+        std::istringstream lines(response);
+        std::string line;
+        while (std::getline(lines, line))
+        {
+            if (line.compare(0, name.length() + 1, name + " ") == 0)
+            {
+                return line.substr(name.length() + 1);
+            }
+        }
+        return "0";
+    }
+
+    uint64_t percentile(std::vector<uint64_t>& values, double fraction)
+    {
+        if (values.empty())
+        {
+            return 0;
+        }
+        std::size_t index = std::min(values.size() - 1, static_cast<std::size_t>(fraction * values.size()));
+        std::nth_element(values.begin(), values.begin() + index, values.end());
+        return values[index];
+    }
+
+    // Opens every subscription and waits for the heads of the responses.
+    long subscribe_all(const Options& options, int epoll_fd, std::vector<Subscriber>& subscribers)
+    {
+        std::string request = "GET " + std::string(STR_EVENTS_PATH) + options.topic + " HTTP/1.1\r\nHost: localhost\r\n\r\n";
+        long opened = 0;
+        long connecting = 0;
+        long subscribed = 0;
+        long failed = 0;
+        uint64_t report_ms = monotonic_ms();
+        epoll_event events[256];
+        while (subscribed + failed < options.subscribers)
+        {
+            while (opened < options.subscribers && connecting < options.concurrency)
+            {
+                Subscriber& subscriber = subscribers[opened];
+                subscriber.sock = open_connection(options, opened);
+                epoll_event event = {};
+                event.events = EPOLLOUT;
+                event.data.u64 = opened;
+                opened++;
+                if (subscriber.sock < 0 || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, subscriber.sock, &event) != 0)
+                {
+                    failed++;
+                    continue;
+                }
+                connecting++;
+            }
+
+            int ready = epoll_wait(epoll_fd, events, 256, 1000);
+            for (int i = 0; i < ready; i++)
+            {
+                Subscriber& subscriber = subscribers[events[i].data.u64];
+                bool ok = true;
+                if (!subscriber.sent)
+                {
+                    int error = 0;
+                    socklen_t length = sizeof(error);
+                    ok = getsockopt(subscriber.sock, SOL_SOCKET, SO_ERROR, &error, &length) == 0 && error == 0 &&
+                         send(subscriber.sock, request.data(), request.length(), MSG_NOSIGNAL) == static_cast<ssize_t>(request.length());
+                    subscriber.sent = true;
+                    epoll_event event = {};
+                    event.events = EPOLLIN;
+                    event.data.u64 = events[i].data.u64;
+                    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, subscriber.sock, &event);
+                }
+                else
+                {
+                    ok = read_available(subscriber.sock, subscriber.input);
+                    std::size_t head_end = subscriber.input.find("\r\n\r\n");
+                    if (ok && head_end != std::string::npos)
+                    {
+                        ok = subscriber.input.compare(0, 12, "HTTP/1.1 200") == 0;
+                        subscriber.input.erase(0, head_end + 4);
+                        subscriber.subscribed = ok;
+                        subscribed += ok ? 1 : 0;
+                        connecting--;
+                        if (!ok)
+                        {
+                            failed++;
+                        }
+                        continue;
+                    }
+                }
+                if (!ok)
+                {
+                    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, subscriber.sock, nullptr);
+                    close(subscriber.sock);
+                    subscriber.sock = -1;
+                    connecting--;
+                    failed++;
+                }
+            }
+
+            if (monotonic_ms() - report_ms >= 1000)
+            {
+                report_ms = monotonic_ms();
+                printf("%ld subscribed, %ld failed\n", subscribed, failed);
+                fflush(stdout);
+            }
+        }
+        return subscribed;
+    }
+
+    bool run_local(const Options& options)
+    {
+        EventLoop loop;
+        TopicRegistry& registry = TopicRegistry::getInstance();
+        std::vector<std::unique_ptr<LocalClient>> clients;
+        clients.reserve(options.subscribers);
+        for (long i = 0; i < options.subscribers; i++)
+        {
+            clients.emplace_back(new LocalClient());
+            LocalClient& client = *clients.back();
+            client.m_stream.reset(new BodyStream(loop, registry.subscribe(options.topic), true, &client));
+            client.m_stream->start();
+        }
+        // The streams call their subscribers in, to join the topic, from
+        // the loop.
+        while (Metrics::getInstance().get(METRIC_EVENT_SUBSCRIBERS) < options.subscribers)
+        {
+            loop.run_once();
+        }
+
+        std::vector<uint64_t> shared_us;
+        std::vector<uint64_t> copied_us;
+        for (int event = 1; event <= options.events; event++)
+        {
+            std::string data = std::to_string(event) + " ";
+            data.resize(options.size, 'x');
+
+            uint64_t start_us = monotonic_us();
+            EventDelivery delivery = registry.publish(options.topic, data);
+            shared_us.push_back(monotonic_us() - start_us);
+            if (delivery.delivered != static_cast<std::size_t>(options.subscribers))
+            {
+                fprintf(stderr, "Event %d reached %zu subscribers\n", event, delivery.delivered);
+                return false;
+            }
+            for (auto& client : clients)
+            {
+                client->m_output.clear();
+            }
+
+            // The same data written the usual way, framed and copied for
+            // each stream
+            start_us = monotonic_us();
+            for (auto& client : clients)
+            {
+                client->m_stream->write(data);
+            }
+            copied_us.push_back(monotonic_us() - start_us);
+            for (auto& client : clients)
+            {
+                client->m_output.clear();
+            }
+        }
+
+        uint64_t shared = percentile(shared_us, 0.5);
+        uint64_t copied = percentile(copied_us, 0.5);
+        printf("subscribers  %ld\n", options.subscribers);
+        printf("shared       %.2f ms per event, %.0f ns per subscriber (p99 %.2f ms)\n", shared / 1e3,
+               shared * 1e3 / options.subscribers, percentile(shared_us, 0.99) / 1e3);
+        printf("copied       %.2f ms per event, %.0f ns per subscriber (p99 %.2f ms)\n", copied / 1e3,
+               copied * 1e3 / options.subscribers, percentile(copied_us, 0.99) / 1e3);
+        fflush(stdout);
+        return true;
+    }
+
+    bool run(const Options& options)
+    {
+        int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (epoll_fd < 0)
+        {
+            return false;
+        }
+
+        std::vector<Subscriber> subscribers(options.subscribers);
+        uint64_t start_ms = monotonic_ms();
+        long subscribed = subscribe_all(options, epoll_fd, subscribers);
+        printf("subscribers  %ld in %.3f s\n", subscribed, (monotonic_ms() - start_ms) / 1e3);
+        fflush(stdout);
+        if (subscribed == 0)
+        {
+            return false;
+        }
+
+        int publisher = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        sockaddr_in server = server_address(options);
+        if (publisher < 0 || connect(publisher, reinterpret_cast<sockaddr*>(&server), sizeof(server)) != 0)
+        {
+            fprintf(stderr, "Cannot connect the publisher\n");
+            return false;
+        }
+        set_socket_nonblocking(publisher);
+        epoll_event publisher_event = {};
+        publisher_event.events = EPOLLIN;
+        publisher_event.data.u64 = PUBLISHER_TAG;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, publisher, &publisher_event);
+        std::string publisher_input;
+
+        int64_t fanout_us_before = std::stoll(fetch_metric(options, "event_fanout_us"));
+        int64_t dropped_before = std::stoll(fetch_metric(options, "events_dropped"));
+
+        std::vector<uint64_t> published_us(options.events + 1, 0);
+        std::vector<uint64_t> responded_us(options.events + 1, 0);
+        std::vector<std::vector<uint64_t>> latencies(options.events + 1);
+        std::vector<long> numbers;
+        long received = 0;
+        int published = 0;
+        uint64_t next_us = monotonic_us();
+        uint64_t end_us = next_us + (options.events * static_cast<uint64_t>(options.interval_ms) + 2000) * 1000;
+        epoll_event events[256];
+        while (monotonic_us() < end_us && received < static_cast<long>(options.events) * subscribed)
+        {
+            if (published < options.events && monotonic_us() >= next_us)
+            {
+                published++;
+                std::string data = std::to_string(published) + " ";
+                data.resize(options.size, 'x');
+                std::string request = "POST " + std::string(STR_EVENTS_PATH) + options.topic + " HTTP/1.1\r\nHost: localhost\r\n"
+                                      "Content-Length: " + std::to_string(data.length()) + "\r\n\r\n" + data;
+                published_us[published] = monotonic_us();
+                send(publisher, request.data(), request.length(), MSG_NOSIGNAL);
+                next_us += options.interval_ms * 1000ULL;
+            }
+
+            int ready = epoll_wait(epoll_fd, events, 256, 1);
+            uint64_t now_us = monotonic_us();
+            for (int i = 0; i < ready; i++)
+            {
+                if (events[i].data.u64 == PUBLISHER_TAG)
+                {
+                    read_available(publisher, publisher_input);
+                    std::size_t done;
+                    while ((done = publisher_input.find("dropped ")) != std::string::npos &&
+                           publisher_input.find('\n', done) != std::string::npos)
+                    {
+                        for (int event = 1; event <= published; event++)
+                        {
+                            if (responded_us[event] == 0)
+                            {
+                                responded_us[event] = now_us;
+                                break;
+                            }
+                        }
+                        publisher_input.erase(0, publisher_input.find('\n', done) + 1);
+                    }
+                    continue;
+                }
+
+                Subscriber& subscriber = subscribers[events[i].data.u64];
+                if (!read_available(subscriber.sock, subscriber.input))
+                {
+                    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, subscriber.sock, nullptr);
+                }
+                numbers.clear();
+                take_events(subscriber.input, numbers);
+                for (long number : numbers)
+                {
+                    if (number >= 1 && number <= published)
+                    {
+                        latencies[number].push_back(now_us - published_us[number]);
+                        received++;
+                    }
+                }
+            }
+        }
+
+        int64_t fanout_us = std::stoll(fetch_metric(options, "event_fanout_us")) - fanout_us_before;
+        int64_t dropped = std::stoll(fetch_metric(options, "events_dropped")) - dropped_before;
+
+        printf("%6s %10s %10s %10s %10s %10s\n", "event", "received", "publish", "p50", "p99", "last");
+        std::vector<uint64_t> p50s;
+        std::vector<uint64_t> p99s;
+        std::vector<uint64_t> lasts;
+        for (int event = 1; event <= published; event++)
+        {
+            std::vector<uint64_t>& values = latencies[event];
+            uint64_t publish_us = (responded_us[event] > 0) ? responded_us[event] - published_us[event] : 0;
+            uint64_t last = values.empty() ? 0 : *std::max_element(values.begin(), values.end());
+            uint64_t p50 = percentile(values, 0.50);
+            uint64_t p99 = percentile(values, 0.99);
+            printf("%6d %10zu %8.1f ms %7.1f ms %7.1f ms %7.1f ms\n", event, values.size(), publish_us / 1e3, p50 / 1e3, p99 / 1e3, last / 1e3);
+            p50s.push_back(p50);
+            p99s.push_back(p99);
+            lasts.push_back(last);
+        }
+        printf("median       p50 %.1f ms, p99 %.1f ms, last %.1f ms\n", percentile(p50s, 0.5) / 1e3, percentile(p99s, 0.5) / 1e3,
+               percentile(lasts, 0.5) / 1e3);
+        printf("received     %ld of %ld\n", received, static_cast<long>(published) * subscribed);
+        printf("server       %.1f ms fan-out per event, %lld dropped\n", published > 0 ? fanout_us / 1e3 / published : 0.0,
+               static_cast<long long>(dropped));
+        fflush(stdout);
+
+        close(publisher);
+        for (Subscriber& subscriber : subscribers)
+        {
+            if (subscriber.sock >= 0)
+            {
+                close(subscriber.sock);
+            }
+        }
+        close(epoll_fd);
+        return received == static_cast<long>(published) * subscribed;
+    }
+}
+
+void print_usage(const char* program_name)
+{
+    fprintf(stderr, "Usage: %s [options]\n", program_name);
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "  --host <ip>           Server address (default: %s)\n", STR_LOCALHOST_IP);
+    fprintf(stderr, "  --port <port>         Server port (default: 8080)\n");
+    fprintf(stderr, "  --subscribers <n>     Subscriber connections (default: 100000)\n");
+    fprintf(stderr, "  --sources <n>         Loopback source addresses, from 127.0.0.2 (default: one per 25000 connections)\n");
+    fprintf(stderr, "  --concurrency <n>     Subscriptions being set up at a time (default: 1000)\n");
+    fprintf(stderr, "  --topic <name>        Topic to subscribe and publish to (default: bench)\n");
+    fprintf(stderr, "  --events <n>          Events to publish (default: 20)\n");
+    fprintf(stderr, "  --interval <ms>       Time between events (default: 500)\n");
+    fprintf(stderr, "  --size <bytes>        Event data size (default: 64)\n");
+    fprintf(stderr, "  --local               Time the fan-out to in-process subscribers instead\n");
+}
+
+bool parse_arguments(int argc, char** argv, Options& options)
+{
+    enum
+    {
+        OPT_HOST = 256,
+        OPT_PORT,
+        OPT_SUBSCRIBERS,
+        OPT_SOURCES,
+        OPT_CONCURRENCY,
+        OPT_TOPIC,
+        OPT_EVENTS,
+        OPT_INTERVAL,
+        OPT_SIZE,
+        OPT_LOCAL,
+    };
+
+    static const option long_options[] = {
+        {"host", required_argument, nullptr, OPT_HOST},
+        {"port", required_argument, nullptr, OPT_PORT},
+        {"subscribers", required_argument, nullptr, OPT_SUBSCRIBERS},
+        {"sources", required_argument, nullptr, OPT_SOURCES},
+        {"concurrency", required_argument, nullptr, OPT_CONCURRENCY},
+        {"topic", required_argument, nullptr, OPT_TOPIC},
+        {"events", required_argument, nullptr, OPT_EVENTS},
+        {"interval", required_argument, nullptr, OPT_INTERVAL},
+        {"size", required_argument, nullptr, OPT_SIZE},
+        {"local", no_argument, nullptr, OPT_LOCAL},
+        {nullptr, 0, nullptr, 0}
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", long_options, nullptr)) != -1)
+    {
+        switch (opt)
+        {
+            case OPT_HOST:        options.host = optarg; break;
+            case OPT_PORT:        options.port = std::stoi(optarg); break;
+            case OPT_SUBSCRIBERS: options.subscribers = std::stol(optarg); break;
+            case OPT_SOURCES:     options.sources = std::stoi(optarg); break;
+            case OPT_CONCURRENCY: options.concurrency = std::stoi(optarg); break;
+            case OPT_TOPIC:       options.topic = optarg; break;
+            case OPT_EVENTS:      options.events = std::stoi(optarg); break;
+            case OPT_INTERVAL:    options.interval_ms = std::stoi(optarg); break;
+            case OPT_SIZE:        options.size = std::stoi(optarg); break;
+            case OPT_LOCAL:       options.local = true; break;
+            default:              return false;
+        }
+    }
+
+    if (options.sources == 0)
+    {
+        options.sources = static_cast<int>((options.subscribers + 24999) / 25000);
+    }
+    // The data has to hold the event number and a space.
+    options.size = std::max(options.size, 8);
+    return optind == argc && options.subscribers > 0 && options.sources > 0 && options.sources < 250 &&
+           options.concurrency > 0 && options.events > 0 && options.interval_ms > 0;
+}
+
+int main(int argc, char** argv)
+{
+    Options options;
+    if (!parse_arguments(argc, argv, options))
+    {
+        print_usage(argv[0]);
+        return -1;
+    }
+    if (options.local)
+    {
+        return run_local(options) ? 0 : -1;
+    }
+
+    std::size_t descriptors = options.subscribers + FD_LIMIT_RESERVE;
+    if (raise_fd_limit(descriptors) < descriptors)
+    {
+        fprintf(stderr, "The limit on open files is too low for %ld subscribers\n", options.subscribers);
+        return -1;
+    }
+    return run(options) ? 0 : -1;
+}
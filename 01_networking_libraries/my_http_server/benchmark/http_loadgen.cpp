@@ -0,0 +1,819 @@
+// Closed-loop HTTP load generator for HTTPServer.
+//
+// Keeps --connections connections busy until --requests responses have
+// arrived, then prints throughput, latency percentiles and the number of
+// failed requests. In h1 mode each connection has one keep-alive request
+// in flight; in h2 mode (prior knowledge) each connection multiplexes up to
+// --streams concurrent streams. A connection closed by the server is
+// reopened; requests lost with it are counted as errors, except h2 streams
+// the server refused or left out of its GOAWAY, which are sent again. h1
+// responses may be framed by Content-Length or chunked. With --close every
+// h1 request asks for its connection to be closed, which measures the cost
+// of accepting connections rather than of serving requests. With --rate
+// the load is open-loop instead: requests are sent at a fixed rate on
+// whichever connection is free, and each latency counts from the time its
+// request was due, so a server that falls behind cannot hide its queueing.
+
+#include "../hpack.h"
+#include "../chunked_decoder.h"
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <signal.h>
+#include <strings.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <deque>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#define H2_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define H2_WINDOW_SIZE (0x7fffffff)
+
+namespace
+{
+    enum Mode
+    {
+        MODE_H1,
+        MODE_H2
+    };
+
+    struct Options
+    {
+        std::string host = "127.0.0.1";
+        int port = 8080;
+        std::string path = "/";
+        int connections = 2;
+        long requests = 10000;
+        int streams = 10;
+        Mode mode = MODE_H1;
+        bool close = false;
+        // Requests per second over all connections, closed-loop while zero
+        long rate = 0;
+    };
+
+    uint64_t now_ns()
+    {
+        timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return static_cast<uint64_t>(ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+    }
+
+    void append_u32(std::string& output, uint32_t value)
+    {
+        output.push_back(static_cast<char>(value >> 24));
+        output.push_back(static_cast<char>(value >> 16));
+        output.push_back(static_cast<char>(value >> 8));
+        output.push_back(static_cast<char>(value));
+    }
+
+    uint32_t read_u32(const uint8_t* data)
+    {
+        return (static_cast<uint32_t>(data[0]) << 24) | (data[1] << 16) | (data[2] << 8) | data[3];
+    }
+
+    void append_frame(std::string& output, uint8_t type, uint8_t flags, uint32_t stream_id, const std::string& payload)
+    {
+        output.push_back(static_cast<char>(payload.length() >> 16));
+        output.push_back(static_cast<char>(payload.length() >> 8));
+        output.push_back(static_cast<char>(payload.length()));
+        output.push_back(static_cast<char>(type));
+        output.push_back(static_cast<char>(flags));
+        append_u32(output, stream_id);
+        output.append(payload);
+    }
+
+    struct Connection
+    {
+        int fd = -1;
+        bool connected = false;
+        std::string input;
+        std::string output;
+        uint32_t interest = 0;
+
+        // h1: send times of the requests in flight, oldest first
+        std::deque<uint64_t> pending;
+
+        // h2: send time of each open stream
+        std::map<uint32_t, uint64_t> streams;
+        uint32_t next_stream_id = 1;
+        std::unique_ptr<HPACKEncoder> encoder;
+        std::unique_ptr<HPACKDecoder> decoder;
+        std::string header_block;
+        bool header_end_stream = false;
+        // GOAWAY received: no new streams, close once the open ones finish
+        bool goaway = false;
+    };
+}
+
+class LoadGenerator
+{
+public:
+    explicit LoadGenerator(const Options& options)
+        : m_options(options),
+          m_epoll(epoll_create1(0)),
+          m_sent(0),
+          m_completed(0),
+          m_errors(0),
+          m_reconnects(0),
+          m_retries(0),
+          m_next_send_ns(0),
+          m_interval_ns(0)
+    {
+        m_latencies.reserve(options.requests);
+    }
+
+    ~LoadGenerator()
+    {
+        for (Connection& connection : m_connections)
+        {
+            if (connection.fd >= 0)
+            {
+                close(connection.fd);
+            }
+        }
+        close(m_epoll);
+    }
+
+    bool run()
+    {
+        m_connections.resize(m_options.connections);
+        uint64_t started = now_ns();
+        for (Connection& connection : m_connections)
+        {
+            if (!open_connection(connection))
+            {
+                return false;
+            }
+        }
+
+        if (m_options.rate > 0)
+        {
+            m_interval_ns = 1000000000ULL / m_options.rate;
+            m_next_send_ns = started;
+        }
+
+        epoll_event events[64];
+        bool waiting_for_connection = false;
+        while (m_completed + m_errors < m_options.requests)
+        {
+            // Sleeps until the next request is due, unless it is overdue and
+            // waits for a connection to become free.
+            timespec timeout = { 1, 0 };
+            if (m_options.rate > 0 && m_sent < m_options.requests && !waiting_for_connection)
+            {
+                uint64_t now = now_ns();
+                uint64_t wait_ns = (m_next_send_ns > now) ? m_next_send_ns - now : 0;
+                timeout = { static_cast<time_t>(wait_ns / 1000000000ULL), static_cast<long>(wait_ns % 1000000000ULL) };
+            }
+
+            int count = epoll_pwait2(m_epoll, events, 64, &timeout, nullptr);
+            if (count < 0 && errno != EINTR)
+            {
+                perror("epoll_pwait2");
+                return false;
+            }
+            for (int i = 0; i < count; i++)
+            {
+                handle_event(*static_cast<Connection*>(events[i].data.ptr), events[i].events);
+            }
+            if (m_options.rate > 0)
+            {
+                waiting_for_connection = !send_due_requests();
+            }
+        }
+
+        report(now_ns() - started);
+        return true;
+    }
+
+private:
+    bool open_connection(Connection& connection)
+    {
+        connection = Connection();
+        connection.fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (connection.fd < 0)
+        {
+            perror("socket");
+            return false;
+        }
+
+        int one = 1;
+        setsockopt(connection.fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        sockaddr_in address;
+        memset(&address, 0, sizeof(address));
+        address.sin_family = AF_INET;
+        address.sin_port = htons(m_options.port);
+        if (inet_pton(AF_INET, m_options.host.c_str(), &address.sin_addr) != 1)
+        {
+            fprintf(stderr, "Invalid host address: %s\n", m_options.host.c_str());
+            return false;
+        }
+        if (connect(connection.fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0 && errno != EINPROGRESS)
+        {
+            perror("connect");
+            return false;
+        }
+
+        if (m_options.mode == MODE_H2)
+        {
+            connection.encoder.reset(new HPACKEncoder());
+            connection.decoder.reset(new HPACKDecoder(4096));
+
+            std::string settings;
+            settings.push_back(0);
+            settings.push_back(0x4); // SETTINGS_INITIAL_WINDOW_SIZE
+            append_u32(settings, H2_WINDOW_SIZE);
+            std::string increment;
+            append_u32(increment, H2_WINDOW_SIZE - 65535);
+
+            connection.output.append(H2_PREFACE);
+            append_frame(connection.output, 0x4, 0, 0, settings);
+            append_frame(connection.output, 0x8, 0, 0, increment);
+        }
+
+        connection.interest = EPOLLIN | EPOLLOUT;
+        epoll_event event;
+        event.events = connection.interest;
+        event.data.ptr = &connection;
+        epoll_ctl(m_epoll, EPOLL_CTL_ADD, connection.fd, &event);
+        return true;
+    }
+
+    void close_connection(Connection& connection)
+    {
+        // Whatever was in flight is lost with the connection.
+        m_errors += connection.pending.size() + connection.streams.size();
+        epoll_ctl(m_epoll, EPOLL_CTL_DEL, connection.fd, nullptr);
+        close(connection.fd);
+        connection.fd = -1;
+
+        if (m_sent < m_options.requests)
+        {
+            m_reconnects++;
+            open_connection(connection);
+        }
+    }
+
+    void handle_event(Connection& connection, uint32_t events)
+    {
+        if (!connection.connected && (events & (EPOLLOUT | EPOLLERR | EPOLLHUP)))
+        {
+            int error = 0;
+            socklen_t length = sizeof(error);
+            getsockopt(connection.fd, SOL_SOCKET, SO_ERROR, &error, &length);
+            if (error != 0)
+            {
+                fprintf(stderr, "connect: %s\n", strerror(error));
+                m_errors++;
+                close_connection(connection);
+                return;
+            }
+            connection.connected = true;
+            send_requests(connection);
+        }
+
+        if (events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+        {
+            char buffer[65536];
+            while (true)
+            {
+                ssize_t rc_recv = recv(connection.fd, buffer, sizeof(buffer), 0);
+                if (rc_recv > 0)
+                {
+                    connection.input.append(buffer, rc_recv);
+                    continue;
+                }
+                if (rc_recv < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                {
+                    break;
+                }
+                if (rc_recv < 0 && errno == EINTR)
+                {
+                    continue;
+                }
+
+                bool ok = (m_options.mode == MODE_H1) ? parse_h1(connection) : parse_h2(connection);
+                (void)ok;
+                close_connection(connection);
+                return;
+            }
+
+            bool ok = (m_options.mode == MODE_H1) ? parse_h1(connection) : parse_h2(connection);
+            if (!ok)
+            {
+                close_connection(connection);
+                return;
+            }
+            send_requests(connection);
+        }
+
+        if (!flush(connection))
+        {
+            close_connection(connection);
+        }
+    }
+
+    void send_requests(Connection& connection)
+    {
+        if (!connection.connected)
+        {
+            return;
+        }
+
+        // Paced requests are sent by send_due_requests() instead.
+        if (connection.goaway || m_options.rate > 0)
+        {
+            return;
+        }
+
+        while (m_sent < m_options.requests && has_room(connection))
+        {
+            send_request(connection, now_ns());
+        }
+    }
+
+    // Returns false if a request is due but no connection is free for it.
+    bool send_due_requests()
+    {
+        uint64_t now = now_ns();
+        while (m_sent < m_options.requests && m_next_send_ns <= now)
+        {
+            auto free = std::find_if(m_connections.begin(), m_connections.end(),
+                                     [this](const Connection& connection) { return has_room(connection); });
+            if (free == m_connections.end())
+            {
+                return false;
+            }
+
+            send_request(*free, m_next_send_ns);
+            m_next_send_ns += m_interval_ns;
+            if (!flush(*free))
+            {
+                close_connection(*free);
+            }
+        }
+        return true;
+    }
+
+    bool has_room(const Connection& connection) const
+    {
+        std::size_t depth = (m_options.mode == MODE_H1) ? 1 : m_options.streams;
+        return connection.fd >= 0 && connection.connected && !connection.goaway &&
+               connection.pending.size() + connection.streams.size() < depth;
+    }
+
+    void send_request(Connection& connection, uint64_t sent_ns)
+    {
+        m_sent++;
+        if (m_options.mode == MODE_H1)
+        {
+            connection.output.append("GET " + m_options.path + " HTTP/1.1\r\nHost: " + m_options.host + "\r\n" +
+                                     (m_options.close ? "Connection: close\r\n\r\n" : "\r\n"));
+            connection.pending.push_back(sent_ns);
+            return;
+        }
+
+        std::vector<HeaderField> headers = {
+            {":method", "GET"},
+            {":scheme", "http"},
+            {":authority", m_options.host},
+            {":path", m_options.path}
+        };
+        std::string block;
+        connection.encoder->encode(headers, block);
+        // HEADERS with END_STREAM | END_HEADERS
+        append_frame(connection.output, 0x1, 0x5, connection.next_stream_id, block);
+        connection.streams[connection.next_stream_id] = sent_ns;
+        connection.next_stream_id += 2;
+    }
+
+    bool flush(Connection& connection)
+    {
+        while (connection.connected && !connection.output.empty())
+        {
+            ssize_t rc_send = send(connection.fd, connection.output.data(), connection.output.length(), MSG_NOSIGNAL);
+            if (rc_send < 0)
+            {
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                {
+                    break;
+                }
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                return false;
+            }
+            connection.output.erase(0, rc_send);
+        }
+
+        uint32_t interest = EPOLLIN | ((!connection.connected || !connection.output.empty()) ? static_cast<uint32_t>(EPOLLOUT) : 0u);
+        if (interest != connection.interest)
+        {
+            epoll_event event;
+            event.events = interest;
+            event.data.ptr = &connection;
+            epoll_ctl(m_epoll, EPOLL_CTL_MOD, connection.fd, &event);
+            connection.interest = interest;
+        }
+        return true;
+    }
+
+    void complete(uint64_t sent_at, bool success)
+    {
+        if (success)
+        {
+            m_completed++;
+            m_latencies.push_back(now_ns() - sent_at);
+        }
+        else
+        {
+            m_errors++;
+        }
+    }
+
+    bool parse_h1(Connection& connection)
+    {
+        while (!connection.pending.empty())
+        {
+            std::size_t header_end = connection.input.find("\r\n\r\n");
+            if (header_end == std::string::npos)
+            {
+                return true;
+            }
+
+            std::size_t body_length = 0;
+            bool chunked = false;
+            bool close_after = false;
+            std::size_t line = connection.input.find("\r\n");
+            while (line < header_end)
+            {
+                std::size_t next = connection.input.find("\r\n", line + 2);
+                std::string header = connection.input.substr(line + 2, next - line - 2);
+                if (strncasecmp(header.c_str(), "Content-Length:", 15) == 0)
+                {
+                    body_length = strtoul(header.c_str() + 15, nullptr, 10);
+                }
+                else if (strncasecmp(header.c_str(), "Transfer-Encoding:", 18) == 0 && strcasestr(header.c_str() + 18, "chunked") != nullptr)
+                {
+                    chunked = true;
+                }
+                else if (strncasecmp(header.c_str(), "Connection:", 11) == 0 && strcasestr(header.c_str() + 11, "close") != nullptr)
+                {
+                    close_after = true;
+                }
+                line = next;
+            }
+
+            if (chunked)
+            {
+                // Decoded from the start each time; only the end matters.
+                ChunkedDecoder decoder;
+                body_length = decoder.feed(connection.input.data() + header_end + 4, connection.input.length() - header_end - 4, nullptr);
+                if (decoder.has_error())
+                {
+                    return false;
+                }
+                if (!decoder.is_done())
+                {
+                    return true;
+                }
+            }
+
+            std::size_t response_length = header_end + 4 + body_length;
+            if (connection.input.length() < response_length)
+            {
+                return true;
+            }
+
+            int status = atoi(connection.input.c_str() + 9);
+            complete(connection.pending.front(), status >= 200 && status < 300);
+            connection.pending.pop_front();
+            connection.input.erase(0, response_length);
+            if (close_after)
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool parse_h2(Connection& connection)
+    {
+        std::size_t offset = 0;
+        while (connection.input.length() - offset >= 9)
+        {
+            const uint8_t* header = reinterpret_cast<const uint8_t*>(connection.input.data() + offset);
+            std::size_t length = (header[0] << 16) | (header[1] << 8) | header[2];
+            if (connection.input.length() - offset < 9 + length)
+            {
+                break;
+            }
+
+            uint8_t type = header[3];
+            uint8_t flags = header[4];
+            uint32_t stream_id = ((header[5] << 24) | (header[6] << 16) | (header[7] << 8) | header[8]) & 0x7fffffff;
+            const uint8_t* payload = header + 9;
+            offset += 9 + length;
+
+            bool end_stream = false;
+            bool success = true;
+            switch (type)
+            {
+                case 0x0: // DATA
+                    end_stream = (flags & 0x1) != 0;
+                    if (length > 0)
+                    {
+                        std::string increment;
+                        append_u32(increment, length);
+                        append_frame(connection.output, 0x8, 0, 0, increment);
+                    }
+                    break;
+
+                case 0x1: // HEADERS
+                case 0x9: // CONTINUATION
+                {
+                    std::size_t skip = 0;
+                    std::size_t padding = 0;
+                    if (type == 0x1 && (flags & 0x8))
+                    {
+                        padding = payload[0];
+                        skip = 1;
+                    }
+                    if (type == 0x1 && (flags & 0x20))
+                    {
+                        skip += 5;
+                    }
+                    if (type == 0x1)
+                    {
+                        connection.header_block.clear();
+                        connection.header_end_stream = (flags & 0x1) != 0;
+                    }
+                    connection.header_block.append(reinterpret_cast<const char*>(payload) + skip, length - skip - padding);
+                    if ((flags & 0x4) == 0)
+                    {
+                        break;
+                    }
+
+                    std::vector<HeaderField> fields;
+                    const uint8_t* block = reinterpret_cast<const uint8_t*>(connection.header_block.data());
+                    if (!connection.decoder->decode(block, connection.header_block.length(), fields))
+                    {
+                        fprintf(stderr, "HPACK decoding failed\n");
+                        return false;
+                    }
+                    end_stream = connection.header_end_stream;
+                    for (const HeaderField& field : fields)
+                    {
+                        if (field.first == ":status")
+                        {
+                            int status = atoi(field.second.c_str());
+                            success = status >= 200 && status < 300;
+                            if (!success)
+                            {
+                                // Finish the stream as failed, its body still follows.
+                                auto it = connection.streams.find(stream_id);
+                                if (it != connection.streams.end())
+                                {
+                                    complete(it->second, false);
+                                    it->second = 0;
+                                }
+                            }
+                        }
+                    }
+                    break;
+                }
+
+                case 0x3: // RST_STREAM
+                    if (length == 4 && read_u32(payload) == 0x7)
+                    {
+                        // REFUSED_STREAM: not processed, safe to send again.
+                        retry_stream(connection, stream_id);
+                        break;
+                    }
+                    end_stream = true;
+                    success = false;
+                    break;
+
+                case 0x4: // SETTINGS
+                    if ((flags & 0x1) == 0)
+                    {
+                        append_frame(connection.output, 0x4, 0x1, 0, std::string());
+                    }
+                    break;
+
+                case 0x6: // PING
+                    if ((flags & 0x1) == 0)
+                    {
+                        append_frame(connection.output, 0x6, 0x1, 0, std::string(reinterpret_cast<const char*>(payload), length));
+                    }
+                    break;
+
+                case 0x7: // GOAWAY
+                {
+                    // Streams above the last one the server processed will
+                    // never be answered on this connection; send them again.
+                    uint32_t last_stream_id = (length >= 4) ? (read_u32(payload) & 0x7fffffff) : 0;
+                    std::vector<uint32_t> unprocessed;
+                    for (const auto& stream : connection.streams)
+                    {
+                        if (stream.first > last_stream_id)
+                        {
+                            unprocessed.push_back(stream.first);
+                        }
+                    }
+                    for (uint32_t id : unprocessed)
+                    {
+                        retry_stream(connection, id);
+                    }
+                    connection.goaway = true;
+                    break;
+                }
+
+                default:
+                    break;
+            }
+
+            if (end_stream)
+            {
+                auto it = connection.streams.find(stream_id);
+                if (it != connection.streams.end())
+                {
+                    if (it->second != 0)
+                    {
+                        complete(it->second, success);
+                    }
+                    connection.streams.erase(it);
+                }
+            }
+        }
+
+        connection.input.erase(0, offset);
+        return !(connection.goaway && connection.streams.empty());
+    }
+
+    void retry_stream(Connection& connection, uint32_t stream_id)
+    {
+        if (connection.streams.erase(stream_id) > 0)
+        {
+            m_sent--;
+            m_retries++;
+        }
+    }
+
+    void report(uint64_t elapsed_ns)
+    {
+        std::sort(m_latencies.begin(), m_latencies.end());
+        auto percentile = [this](double p) -> double
+        {
+            if (m_latencies.empty())
+            {
+                return 0.0;
+            }
+            std::size_t index = static_cast<std::size_t>(p * (m_latencies.size() - 1));
+            return m_latencies[index] / 1000.0;
+        };
+
+        double seconds = elapsed_ns / 1e9;
+        printf("mode         %s\n", m_options.mode == MODE_H1 ? "h1" : "h2");
+        printf("connections  %d\n", m_options.connections);
+        if (m_options.mode == MODE_H2)
+        {
+            printf("streams      %d\n", m_options.streams);
+        }
+        printf("requests     %ld\n", m_completed);
+        printf("errors       %ld\n", m_errors);
+        printf("reconnects   %ld\n", m_reconnects);
+        if (m_options.mode == MODE_H2)
+        {
+            printf("retries      %ld\n", m_retries);
+        }
+        printf("duration     %.3f s\n", seconds);
+        printf("throughput   %.0f req/s\n", m_completed / seconds);
+        printf("latency p50  %.1f us\n", percentile(0.50));
+        printf("latency p99  %.1f us\n", percentile(0.99));
+        printf("latency max  %.1f us\n", percentile(1.0));
+    }
+
+private:
+    Options m_options;
+    int m_epoll;
+    std::vector<Connection> m_connections;
+    std::vector<uint64_t> m_latencies;
+    long m_sent;
+    long m_completed;
+    long m_errors;
+    long m_reconnects;
+    long m_retries;
+    uint64_t m_next_send_ns;
+    uint64_t m_interval_ns;
+};
+
+void print_usage(const char* program_name)
+{
+    fprintf(stderr, "Usage: %s [options]\n", program_name);
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "  --host <ipv4>         Server address (default: 127.0.0.1)\n");
+    fprintf(stderr, "  --port <port>         Server port (default: 8080)\n");
+    fprintf(stderr, "  --path <path>         Request path (default: /)\n");
+    fprintf(stderr, "  --mode <h1|h2>        HTTP/1.1 keep-alive or h2c prior knowledge (default: h1)\n");
+    fprintf(stderr, "  --connections <n>     Concurrent connections (default: 2)\n");
+    fprintf(stderr, "  --requests <n>        Total requests (default: 10000)\n");
+    fprintf(stderr, "  --streams <n>         Concurrent streams per h2 connection (default: 10)\n");
+    fprintf(stderr, "  --close               New connection for every h1 request\n");
+    fprintf(stderr, "  --rate <n>            Send n requests per second, open-loop (default: closed-loop)\n");
+}
+
+bool parse_arguments(int argc, char** argv, Options& options)
+{
+    enum
+    {
+        OPT_HOST = 256,
+        OPT_PORT,
+        OPT_PATH,
+        OPT_MODE,
+        OPT_CONNECTIONS,
+        OPT_REQUESTS,
+        OPT_STREAMS,
+        OPT_CLOSE,
+        OPT_RATE,
+    };
+
+    static const option long_options[] = {
+        {"host", required_argument, nullptr, OPT_HOST},
+        {"port", required_argument, nullptr, OPT_PORT},
+        {"path", required_argument, nullptr, OPT_PATH},
+        {"mode", required_argument, nullptr, OPT_MODE},
+        {"connections", required_argument, nullptr, OPT_CONNECTIONS},
+        {"requests", required_argument, nullptr, OPT_REQUESTS},
+        {"streams", required_argument, nullptr, OPT_STREAMS},
+        {"close", no_argument, nullptr, OPT_CLOSE},
+        {"rate", required_argument, nullptr, OPT_RATE},
+        {nullptr, 0, nullptr, 0}
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", long_options, nullptr)) != -1)
+    {
+        switch (opt)
+        {
+            case OPT_HOST:        options.host = optarg; break;
+            case OPT_PORT:        options.port = std::stoi(optarg); break;
+            case OPT_PATH:        options.path = optarg; break;
+            case OPT_CONNECTIONS: options.connections = std::stoi(optarg); break;
+            case OPT_REQUESTS:    options.requests = std::stol(optarg); break;
+            case OPT_STREAMS:     options.streams = std::stoi(optarg); break;
+            case OPT_CLOSE:       options.close = true; break;
+            case OPT_RATE:        options.rate = std::stol(optarg); break;
+            case OPT_MODE:
+                if (strcmp(optarg, "h1") == 0)
+                {
+                    options.mode = MODE_H1;
+                }
+                else if (strcmp(optarg, "h2") == 0)
+                {
+                    options.mode = MODE_H2;
+                }
+                else
+                {
+                    return false;
+                }
+                break;
+            default:
+                return false;
+        }
+    }
+
+    return optind == argc && options.connections > 0 && options.requests > 0 && options.streams > 0 &&
+           options.rate >= 0 && options.rate <= 1000000000L;
+}
+
+int main(int argc, char** argv)
+{
+    signal(SIGPIPE, SIG_IGN);
+
+    Options options;
+    if (!parse_arguments(argc, argv, options))
+    {
+        print_usage(argv[0]);
+        return -1;
+    }
+
+    LoadGenerator generator(options);
+    return generator.run() ? 0 : -1;
+}
@@ -0,0 +1,389 @@
+// Idle keep-alive connections benchmark.
+//
+// Opens --connections connections to the server, --concurrency at a time,
+// sends one keep-alive request on each and reads the response, then leaves
+// them all open and idle. Each source address of the loopback range can
+// only reach the server's port from about as many ephemeral ports as
+// ip_local_port_range holds, so the connections are spread over --sources
+// addresses starting at 127.0.0.2. Once all are idle the server's /metrics
+// are fetched and its idle connection counters are printed; with
+// --server-pid, the growth of the server's resident memory per connection
+// is printed as well. The connections are held for --hold seconds.
+//
+// Both ends need a descriptor per connection: raise the hard limit on open
+// files (ulimit -Hn, fs.nr_open) first, and run the server with
+// --compact-idle --max-connections above --connections.
+
+#include "../defs.h"
+#include "../utils.h"
+
+#include <arpa/inet.h>
+#include <getopt.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <strings.h>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace
+{
+    struct Options
+    {
+        std::string host = STR_LOCALHOST_IP;
+        int port = 8080;
+        long connections = 1000000;
+        int sources = 0;
+        int concurrency = 1000;
+        std::string path = "/";
+        int hold_sec = 0;
+        int server_pid = 0;
+    };
+
+    // A connection until its response has been read.
+    struct Pending
+    {
+        std::string input;
+        bool sent = false;
+    };
+
+    // Resident memory of a process in bytes, 0 if it cannot be read.
+    long resident_bytes(int pid)
+    {
+        std::ifstream status("/proc/" + std::to_string(pid) + "/status");
+        std::string line;
+        while (std::getline(status, line))
+        {
+            if (line.compare(0, 6, "VmRSS:") == 0)
+            {
+                return std::stol(line.substr(6)) * 1024;
+            }
+        }
+        return 0;
+    }
+
+    // True once input holds a whole response.
+    bool response_complete(const std::string& input)
+    {
+        std::size_t header_end = input.find("\r\n\r\n");
+        if (header_end == std::string::npos)
+        {
+            return false;
+        }
+
+        std::size_t body_length = 0;
+        const char* field = strcasestr(input.c_str(), "\r\nContent-Length:");
+        if (field != nullptr && static_cast<std::size_t>(field - input.c_str()) < header_end)
+        {
+            body_length = std::stoul(field + 17);
+        }
+        return input.length() >= header_end + 4 + body_length;
+    }
+
+    int open_connection(const Options& options, long index)
+    {
+        int sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (sock < 0)
+        {
+            return -1;
+        }
+
+        // The port is picked at connect(), per destination, rather than
+        // at bind(), which would keep it from every other destination.
+        int one = 1;
+        setsockopt(sock, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &one, sizeof(one));
+
+        sockaddr_in source;
+        std::memset(&source, 0, sizeof(source));
+        source.sin_family = AF_INET;
+        source.sin_addr.s_addr = htonl((127u << 24) + 2 + index % options.sources);
+        sockaddr_in server;
+        std::memset(&server, 0, sizeof(server));
+        server.sin_family = AF_INET;
+        server.sin_port = htons(options.port);
+        inet_pton(AF_INET, options.host.c_str(), &server.sin_addr);
+
+        if (bind(sock, reinterpret_cast<sockaddr*>(&source), sizeof(source)) != 0 ||
+            (connect(sock, reinterpret_cast<sockaddr*>(&server), sizeof(server)) != 0 && errno != EINPROGRESS))
+        {
+            close(sock);
+            return -1;
+        }
+        return sock;
+    }
+
+    // Sends the request once connected, then reads the response. Returns
+    // -1 on failure, 1 once the response is complete, 0 meanwhile.
+    int advance(int sock, Pending& pending, const std::string& request)
+    {
+        if (!pending.sent)
+        {
+            int error = 0;
+            socklen_t length = sizeof(error);
+            if (getsockopt(sock, SOL_SOCKET, SO_ERROR, &error, &length) != 0 || error != 0 ||
+                send(sock, request.data(), request.length(), MSG_NOSIGNAL) != static_cast<ssize_t>(request.length()))
+            {
+                return -1;
+            }
+            pending.sent = true;
+            return 0;
+        }
+
+        char buffer[MESSAGE_SIZE];
+        while (true)
+        {
+            ssize_t received = recv(sock, buffer, sizeof(buffer), 0);
+            if (received > 0)
+            {
+                pending.input.append(buffer, received);
+                continue;
+            }
+            if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            {
+                break;
+            }
+            return -1;
+        }
+        return response_complete(pending.input) ? 1 : 0;
+    }
+
+    std::string fetch_metrics(const Options& options)
+    {
+        int sock = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        sockaddr_in server;
+        std::memset(&server, 0, sizeof(server));
+        server.sin_family = AF_INET;
+        server.sin_port = htons(options.port);
+        inet_pton(AF_INET, options.host.c_str(), &server.sin_addr);
+        if (sock < 0 || connect(sock, reinterpret_cast<sockaddr*>(&server), sizeof(server)) != 0)
+        {
+            if (sock >= 0)
+            {
+                close(sock);
+            }
+            return "";
+        }
+
+        std::string request = std::string("GET ") + STR_METRICS_PATH + " HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n";
+        send(sock, request.data(), request.length(), MSG_NOSIGNAL);
+        std::string response;
+        char buffer[MESSAGE_SIZE];
+        ssize_t received;
+        while ((received = recv(sock, buffer, sizeof(buffer), 0)) > 0)
+        {
+            response.append(buffer, received);
+        }
+        close(sock);
+        return response;
+    }
+
+    void print_metrics(const std::string& response)
+    {
+        std::istringstream lines(response.substr(response.find("\r\n\r\n") + 4));
+        std::string line;
+        while (std::getline(lines, line))
+        {
+            if (line.compare(0, 17, "connections_open ") == 0 || line.compare(0, 17, "connections_idle ") == 0 ||
+                line.compare(0, 21, "idle_connection_bytes") == 0)
+            {
+                printf("server %s\n", line.c_str());
+            }
+        }
+    }
+
+    bool run(const Options& options)
+    {
+        int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (epoll_fd < 0)
+        {
+            return false;
+        }
+
+        std::string request = "GET " + options.path + " HTTP/1.1\r\nHost: localhost\r\n\r\n";
+        std::unordered_map<int, Pending> pending;
+        std::vector<int> idle;
+        idle.reserve(options.connections);
+        long opened = 0;
+        long failed = 0;
+        long rss_before = (options.server_pid > 0) ? resident_bytes(options.server_pid) : 0;
+        uint64_t start_ms = monotonic_ms();
+        uint64_t report_ms = start_ms;
+
+        epoll_event events[256];
+        while (opened < options.connections || !pending.empty())
+        {
+            while (opened < options.connections && static_cast<int>(pending.size()) < options.concurrency)
+            {
+                int sock = open_connection(options, opened++);
+                epoll_event event = {};
+                event.events = EPOLLOUT;
+                event.data.fd = sock;
+                if (sock < 0 || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sock, &event) != 0)
+                {
+                    if (sock >= 0)
+                    {
+                        close(sock);
+                    }
+                    failed++;
+                    continue;
+                }
+                pending[sock];
+            }
+
+            int ready = epoll_wait(epoll_fd, events, 256, 1000);
+            for (int i = 0; i < ready; i++)
+            {
+                int sock = events[i].data.fd;
+                int state = advance(sock, pending[sock], request);
+                if (state == 0)
+                {
+                    // Sent: now waiting for the response.
+                    epoll_event event = {};
+                    event.events = EPOLLIN;
+                    event.data.fd = sock;
+                    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, sock, &event);
+                    continue;
+                }
+
+                // Done with, idle or failed: the connection leaves the set.
+                epoll_ctl(epoll_fd, EPOLL_CTL_DEL, sock, nullptr);
+                pending.erase(sock);
+                if (state > 0)
+                {
+                    idle.push_back(sock);
+                }
+                else
+                {
+                    close(sock);
+                    failed++;
+                }
+            }
+
+            if (monotonic_ms() - report_ms >= 1000)
+            {
+                report_ms = monotonic_ms();
+                printf("%ld idle, %ld failed\n", static_cast<long>(idle.size()), failed);
+                fflush(stdout);
+            }
+        }
+        close(epoll_fd);
+
+        double seconds = (monotonic_ms() - start_ms) / 1e3;
+        printf("connections  %ld\n", static_cast<long>(idle.size()));
+        printf("failed       %ld\n", failed);
+        printf("duration     %.3f s\n", seconds);
+
+        // A server compacts a connection only after the response is sent,
+        // and in prefork mode another worker may answer /metrics first.
+        usleep(100000);
+        print_metrics(fetch_metrics(options));
+        if (options.server_pid > 0 && !idle.empty())
+        {
+            long rss_after = resident_bytes(options.server_pid);
+            printf("server rss   %ld -> %ld bytes, %ld per connection\n", rss_before, rss_after,
+                   (rss_after - rss_before) / static_cast<long>(idle.size()));
+        }
+        fflush(stdout);
+
+        if (options.hold_sec > 0)
+        {
+            sleep(options.hold_sec);
+        }
+        for (int sock : idle)
+        {
+            close(sock);
+        }
+        return failed == 0;
+    }
+}
+
+void print_usage(const char* program_name)
+{
+    fprintf(stderr, "Usage: %s [options]\n", program_name);
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "  --host <ip>           Server address (default: %s)\n", STR_LOCALHOST_IP);
+    fprintf(stderr, "  --port <port>         Server port (default: 8080)\n");
+    fprintf(stderr, "  --connections <n>     Idle connections to open (default: 1000000)\n");
+    fprintf(stderr, "  --sources <n>         Loopback source addresses, from 127.0.0.2 (default: one per 25000 connections)\n");
+    fprintf(stderr, "  --concurrency <n>     Connections being set up at a time (default: 1000)\n");
+    fprintf(stderr, "  --path <path>         Path of the request made on each connection (default: /)\n");
+    fprintf(stderr, "  --hold <sec>          Keep the connections open this long at the end (default: 0)\n");
+    fprintf(stderr, "  --server-pid <pid>    Report the server's resident memory per connection\n");
+}
+
+bool parse_arguments(int argc, char** argv, Options& options)
+{
+    enum
+    {
+        OPT_HOST = 256,
+        OPT_PORT,
+        OPT_CONNECTIONS,
+        OPT_SOURCES,
+        OPT_CONCURRENCY,
+        OPT_PATH,
+        OPT_HOLD,
+        OPT_SERVER_PID,
+    };
+
+    static const option long_options[] = {
+        {"host", required_argument, nullptr, OPT_HOST},
+        {"port", required_argument, nullptr, OPT_PORT},
+        {"connections", required_argument, nullptr, OPT_CONNECTIONS},
+        {"sources", required_argument, nullptr, OPT_SOURCES},
+        {"concurrency", required_argument, nullptr, OPT_CONCURRENCY},
+        {"path", required_argument, nullptr, OPT_PATH},
+        {"hold", required_argument, nullptr, OPT_HOLD},
+        {"server-pid", required_argument, nullptr, OPT_SERVER_PID},
+        {nullptr, 0, nullptr, 0}
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", long_options, nullptr)) != -1)
+    {
+        switch (opt)
+        {
+            case OPT_HOST:        options.host = optarg; break;
+            case OPT_PORT:        options.port = std::stoi(optarg); break;
+            case OPT_CONNECTIONS: options.connections = std::stol(optarg); break;
+            case OPT_SOURCES:     options.sources = std::stoi(optarg); break;
+            case OPT_CONCURRENCY: options.concurrency = std::stoi(optarg); break;
+            case OPT_PATH:        options.path = optarg; break;
+            case OPT_HOLD:        options.hold_sec = std::stoi(optarg); break;
+            case OPT_SERVER_PID:  options.server_pid = std::stoi(optarg); break;
+            default:              return false;
+        }
+    }
+
+    if (options.sources == 0)
+    {
+        options.sources = static_cast<int>((options.connections + 24999) / 25000);
+    }
+    return optind == argc && options.connections > 0 && options.sources > 0 && options.sources < 250 &&
+           options.concurrency > 0 && options.hold_sec >= 0;
+}
+
+int main(int argc, char** argv)
+{
+    Options options;
+    if (!parse_arguments(argc, argv, options))
+    {
+        print_usage(argv[0]);
+        return -1;
+    }
+
+    std::size_t descriptors = options.connections + options.concurrency + FD_LIMIT_RESERVE;
+    if (raise_fd_limit(descriptors) < descriptors)
+    {
+        fprintf(stderr, "The limit on open files is too low for %ld connections\n", options.connections);
+        return -1;
+    }
+    return run(options) ? 0 : -1;
+}
@@ -0,0 +1,252 @@
+// Skewed-load benchmark for WorkStealingScheduler.
+//
+// An event loop submits --jobs CPU-bound jobs open-loop, --rate per second,
+// each spinning for --work microseconds. --skew percent of them have the
+// same affinity and so land on one thread's deque; the rest are spread over
+// all threads. The run is made once with stealing and once without, and
+// for each the latency from a job's due time to its completion on the loop
+// is reported, so a thread that falls behind shows up in the tail. Jobs
+// the scheduler could not queue are run on the loop and counted as inline.
+
+#include "../defs.h"
+#include "../event_loop.h"
+#include "../timer_wheel.h"
+#include "../utils.h"
+#include "../work_stealing_scheduler.h"
+
+#include <getopt.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+namespace
+{
+    struct Options
+    {
+        int threads = 4;
+        long jobs = 50000;
+        long rate = 25000;
+        int work_us = 40;
+        int skew = 95;
+    };
+
+    class BenchJob : public OffloadJob
+    {
+    public:
+        BenchJob(int work_us, uint64_t due_us, std::vector<uint64_t>& latencies)
+            : m_work_us(work_us),
+              m_due_us(due_us),
+              m_latencies(latencies)
+        {
+
+        }
+
+        void run() override
+        {
+            uint64_t until = monotonic_us() + m_work_us;
+            while (monotonic_us() < until)
+            {
+            }
+        }
+
+        void complete() override
+        {
+            m_latencies.push_back(monotonic_us() - m_due_us);
+        }
+
+    private:
+        int m_work_us;
+        uint64_t m_due_us;
+        std::vector<uint64_t>& m_latencies;
+    };
+
+    // Submits the jobs that are due on every millisecond tick.
+    class Submitter : public TimerHandler
+    {
+    public:
+        Submitter(EventLoop& loop, WorkStealingScheduler& scheduler, const Options& options, std::vector<uint64_t>& latencies)
+            : m_loop(loop),
+              m_scheduler(scheduler),
+              m_options(options),
+              m_latencies(latencies),
+              m_timer(this),
+              m_start_us(monotonic_us()),
+              m_submitted(0),
+              m_inline(0)
+        {
+
+        }
+
+        ~Submitter()
+        {
+            m_loop.timers().cancel(&m_timer);
+        }
+
+        void start()
+        {
+            handle_timeout(&m_timer);
+        }
+
+        bool is_done() const
+        {
+            return m_submitted == m_options.jobs;
+        }
+
+        long get_inline() const
+        {
+            return m_inline;
+        }
+
+        void handle_timeout(TimerNode*) override
+        {
+            uint64_t now_us = monotonic_us();
+            while (m_submitted < m_options.jobs)
+            {
+                uint64_t due_us = m_start_us + m_submitted * 1000000 / m_options.rate;
+                if (due_us > now_us)
+                {
+                    break;
+                }
+
+                std::unique_ptr<OffloadJob> job(new BenchJob(m_options.work_us, due_us, m_latencies));
+                // A fixed pattern rather than a random one, so both runs
+                // see the same load.
+                bool hot = (m_submitted * 37 % 100) < m_options.skew;
+                job->set_affinity(hot ? 0 : m_submitted);
+                if (!m_scheduler.submit(job))
+                {
+                    job->run();
+                    job->complete();
+                    m_inline++;
+                }
+                m_submitted++;
+            }
+
+            if (!is_done())
+            {
+                m_loop.timers().schedule(&m_timer, 1);
+            }
+        }
+
+    private:
+        EventLoop& m_loop;
+        WorkStealingScheduler& m_scheduler;
+        const Options& m_options;
+        std::vector<uint64_t>& m_latencies;
+        TimerNode m_timer;
+        uint64_t m_start_us;
+        long m_submitted;
+        long m_inline;
+    };
+
+    bool run(const Options& options, bool stealing)
+    {
+        EventLoop loop;
+        std::vector<uint64_t> latencies;
+        latencies.reserve(options.jobs);
+        uint64_t start_us = monotonic_us();
+        long inline_jobs;
+        {
+            WorkStealingScheduler scheduler(loop, options.threads, stealing);
+            if (!loop.is_valid() || !scheduler.start())
+            {
+                fprintf(stderr, "Scheduler could not start\n");
+                return false;
+            }
+
+            Submitter submitter(loop, scheduler, options, latencies);
+            submitter.start();
+            while (static_cast<long>(latencies.size()) < options.jobs)
+            {
+                loop.run_once();
+            }
+            inline_jobs = submitter.get_inline();
+        }
+        double seconds = (monotonic_us() - start_us) / 1e6;
+
+        std::sort(latencies.begin(), latencies.end());
+        auto percentile = [&latencies](double p) -> double
+        {
+            std::size_t index = static_cast<std::size_t>(p * (latencies.size() - 1));
+            return static_cast<double>(latencies[index]);
+        };
+
+        printf("stealing     %s\n", stealing ? "on" : "off");
+        printf("jobs         %ld\n", options.jobs);
+        printf("inline       %ld\n", inline_jobs);
+        printf("duration     %.3f s\n", seconds);
+        printf("latency p50  %.1f us\n", percentile(0.50));
+        printf("latency p99  %.1f us\n", percentile(0.99));
+        printf("latency max  %.1f us\n", percentile(1.0));
+        return true;
+    }
+}
+
+void print_usage(const char* program_name)
+{
+    fprintf(stderr, "Usage: %s [options]\n", program_name);
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "  --threads <n>         Scheduler threads (default: 4)\n");
+    fprintf(stderr, "  --jobs <n>            Jobs per run (default: 50000)\n");
+    fprintf(stderr, "  --rate <n>            Jobs submitted per second (default: 25000)\n");
+    fprintf(stderr, "  --work <us>           CPU time each job spins for (default: 40)\n");
+    fprintf(stderr, "  --skew <percent>      Share of the jobs queued for the first thread (default: 95)\n");
+}
+
+bool parse_arguments(int argc, char** argv, Options& options)
+{
+    enum
+    {
+        OPT_THREADS = 256,
+        OPT_JOBS,
+        OPT_RATE,
+        OPT_WORK,
+        OPT_SKEW,
+    };
+
+    static const option long_options[] = {
+        {"threads", required_argument, nullptr, OPT_THREADS},
+        {"jobs", required_argument, nullptr, OPT_JOBS},
+        {"rate", required_argument, nullptr, OPT_RATE},
+        {"work", required_argument, nullptr, OPT_WORK},
+        {"skew", required_argument, nullptr, OPT_SKEW},
+        {nullptr, 0, nullptr, 0}
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", long_options, nullptr)) != -1)
+    {
+        switch (opt)
+        {
+            case OPT_THREADS: options.threads = std::stoi(optarg); break;
+            case OPT_JOBS:    options.jobs = std::stol(optarg); break;
+            case OPT_RATE:    options.rate = std::stol(optarg); break;
+            case OPT_WORK:    options.work_us = std::stoi(optarg); break;
+            case OPT_SKEW:    options.skew = std::stoi(optarg); break;
+            default:          return false;
+        }
+    }
+
+    return optind == argc && options.threads > 0 && options.threads <= SCHEDULER_MAX_THREADS && options.jobs > 0 &&
+           options.rate > 0 && options.rate <= 1000000 && options.work_us >= 0 && options.skew >= 0 && options.skew <= 100;
+}
+
+int main(int argc, char** argv)
+{
+    Options options;
+    if (!parse_arguments(argc, argv, options))
+    {
+        print_usage(argv[0]);
+        return -1;
+    }
+
+    if (!run(options, true))
+    {
+        return -1;
+    }
+    printf("\n");
+    return run(options, false) ? 0 : -1;
+}
@@ -0,0 +1,509 @@
+// WebSocket benchmark.
+//
+// Echo mode (default): opens --connections WebSocket connections to the
+// server's echo route, keeps --window messages of --size bytes in flight
+// on each for --duration seconds, and reports the messages echoed per
+// second and their round-trip latency. With --server-pid the server's CPU
+// time over the run is read from /proc, and the messages per second of
+// server CPU, i.e. per core, are reported as well. With --deflate the
+// client offers permessage-deflate and, if the server accepts, sends every
+// message compressed (the server needs --websocket-deflate).
+//
+// Unmask mode (--unmask): times websocket_mask() and each implementation
+// it picks from over payloads of several sizes, in memory only.
+
+#include "../defs.h"
+#include "../permessage_deflate.h"
+#include "../utils.h"
+#include "../websocket_mask.h"
+
+#include <arpa/inet.h>
+#include <getopt.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <strings.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace
+{
+    struct Options
+    {
+        std::string host = STR_LOCALHOST_IP;
+        int port = 8080;
+        std::string path = STR_ECHO_PATH;
+        int connections = 16;
+        std::size_t size = 64;
+        int window = 16;
+        int duration_sec = 5;
+        bool binary = false;
+        bool deflate = false;
+        int server_pid = 0;
+        bool unmask = false;
+    };
+
+    struct Connection
+    {
+        int sock = -1;
+        std::string input;
+        std::string output;
+        // When each message in flight was sent
+        std::deque<uint64_t> sent_us;
+        bool want_write = false;
+    };
+
+    // utime + stime of a process, in seconds, or -1 if it cannot be read.
+    double cpu_seconds(int pid)
+    {
+        std::ifstream stat("/proc/" + std::to_string(pid) + "/stat");
+        std::string line;
+        if (!std::getline(stat, line))
+        {
+            return -1;
+        }
+        // Fields 14 and 15, counted after the command name in parentheses
+        std::size_t position = line.rfind(')');
+        std::vector<std::string> fields;
+        std::size_t begin = position + 2;
+        while (begin < line.length())
+        {
+            std::size_t end = line.find(' ', begin);
+            if (end == std::string::npos)
+            {
+                end = line.length();
+            }
+            fields.push_back(line.substr(begin, end - begin));
+            begin = end + 1;
+        }
+        if (fields.size() < 13)
+        {
+            return -1;
+        }
+        return (std::stod(fields[11]) + std::stod(fields[12])) / sysconf(_SC_CLK_TCK);
+    }
+
+    // Compressible text, like a JSON update
+    std::string make_payload(std::size_t size)
+    {
+        static const char words[] = "{\"symbol\":\"ABC\",\"price\":101.25,\"volume\":1200,\"side\":\"buy\"} ";
+        std::string payload;
+        while (payload.length() < size)
+        {
+            payload += words;
+        }
+        payload.resize(size);
+        return payload;
+    }
+
+    // A masked client frame; the key is the same for all, which the server
+    // cannot tell.
+    std::string make_frame(const std::string& payload, bool binary, bool compressed)
+    {
+        std::string frame;
+        frame.push_back(static_cast<char>(0x80 | (compressed ? 0x40 : 0) | (binary ? 0x2 : 0x1)));
+        if (payload.length() <= 125)
+        {
+            frame.push_back(static_cast<char>(0x80 | payload.length()));
+        }
+        else if (payload.length() <= 0xffff)
+        {
+            frame.push_back(static_cast<char>(0x80 | 126));
+            frame.push_back(static_cast<char>(payload.length() >> 8));
+            frame.push_back(static_cast<char>(payload.length()));
+        }
+        else
+        {
+            frame.push_back(static_cast<char>(0x80 | 127));
+            for (int shift = 56; shift >= 0; shift -= 8)
+            {
+                frame.push_back(static_cast<char>(static_cast<uint64_t>(payload.length()) >> shift));
+            }
+        }
+        const uint8_t key[4] = {0x37, 0xfa, 0x21, 0x3d};
+        frame.append(reinterpret_cast<const char*>(key), 4);
+        std::size_t start = frame.length();
+        frame += payload;
+        websocket_mask(reinterpret_cast<uint8_t*>(&frame[start]), payload.length(), key);
+        return frame;
+    }
+
+    // Connects and completes the opening handshake. Returns the socket, or
+    // -1; deflate is set to whether the server accepted the extension.
+    int open_websocket(const Options& options, bool& deflate)
+    {
+        int sock = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        sockaddr_in server;
+        std::memset(&server, 0, sizeof(server));
+        server.sin_family = AF_INET;
+        server.sin_port = htons(options.port);
+        inet_pton(AF_INET, options.host.c_str(), &server.sin_addr);
+        if (sock < 0 || connect(sock, reinterpret_cast<sockaddr*>(&server), sizeof(server)) != 0)
+        {
+            if (sock >= 0)
+            {
+                close(sock);
+            }
+            return -1;
+        }
+        int one = 1;
+        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        std::string request = "GET " + options.path + " HTTP/1.1\r\nHost: localhost\r\nUpgrade: websocket\r\n"
+                              "Connection: Upgrade\r\nSec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+                              "Sec-WebSocket-Version: 13\r\n";
+        if (options.deflate)
+        {
+            request += "Sec-WebSocket-Extensions: permessage-deflate; client_no_context_takeover\r\n";
+        }
+        request += "\r\n";
+        send(sock, request.data(), request.length(), MSG_NOSIGNAL);
+
+        // Byte by byte, so no frame is read past the end of the response.
+        std::string response;
+        char c;
+        while (response.find("\r\n\r\n") == std::string::npos && recv(sock, &c, 1, 0) == 1)
+        {
+            response.push_back(c);
+        }
+        if (response.compare(0, 12, "HTTP/1.1 101") != 0)
+        {
+            close(sock);
+            return -1;
+        }
+        deflate = strcasestr(response.c_str(), "permessage-deflate") != nullptr;
+        set_socket_nonblocking(sock);
+        return sock;
+    }
+
+    // Sends what the socket takes; false on a socket error.
+    bool flush(Connection& connection)
+    {
+        while (!connection.output.empty())
+        {
+            ssize_t sent = send(connection.sock, connection.output.data(), connection.output.length(), MSG_NOSIGNAL);
+            if (sent > 0)
+            {
+                connection.output.erase(0, sent);
+                continue;
+            }
+            if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            {
+                break;
+            }
+            return false;
+        }
+        return true;
+    }
+
+    // Takes the complete frames out of input. Returns how many messages
+    // came back, or -1 if the server closed the session.
+    long read_frames(Connection& connection)
+    {
+        long messages = 0;
+        std::size_t offset = 0;
+        const std::string& input = connection.input;
+        while (input.length() - offset >= 2)
+        {
+            const uint8_t* frame = reinterpret_cast<const uint8_t*>(input.data() + offset);
+            uint64_t length = frame[1] & 0x7f;
+            std::size_t header_length = (length == 126) ? 4 : (length == 127) ? 10 : 2;
+            if (input.length() - offset < header_length)
+            {
+                break;
+            }
+            if (header_length > 2)
+            {
+                length = 0;
+                for (std::size_t i = 2; i < header_length; i++)
+                {
+                    length = (length << 8) | frame[i];
+                }
+            }
+            if (input.length() - offset < header_length + length)
+            {
+                break;
+            }
+            uint8_t opcode = frame[0] & 0x0f;
+            if (opcode == 0x8)
+            {
+                return -1;
+            }
+            if (opcode != 0x9 && opcode != 0xa && (frame[0] & 0x80))
+            {
+                messages++;
+            }
+            offset += header_length + length;
+        }
+        connection.input.erase(0, offset);
+        return messages;
+    }
+
+    bool run_echo(const Options& options)
+    {
+        int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        std::string payload = make_payload(options.size);
+        std::string frame;
+        std::vector<Connection> connections(options.connections);
+        bool deflate_used = false;
+        for (int i = 0; i < options.connections; i++)
+        {
+            bool deflate = false;
+            connections[i].sock = open_websocket(options, deflate);
+            if (connections[i].sock < 0)
+            {
+                fprintf(stderr, "WebSocket handshake failed\n");
+                return false;
+            }
+            if (frame.empty())
+            {
+                std::string compressed;
+                PerMessageDeflate encoder;
+                deflate_used = deflate && encoder.compress(payload.data(), payload.length(), compressed);
+                frame = deflate_used ? make_frame(compressed, options.binary, true) : make_frame(payload, options.binary, false);
+            }
+            epoll_event event = {};
+            event.events = EPOLLIN;
+            event.data.u32 = i;
+            epoll_ctl(epoll_fd, EPOLL_CTL_ADD, connections[i].sock, &event);
+        }
+
+        double cpu_before = (options.server_pid > 0) ? cpu_seconds(options.server_pid) : -1;
+        uint64_t start_us = monotonic_us();
+        uint64_t end_us = start_us + options.duration_sec * 1000000ULL;
+        for (Connection& connection : connections)
+        {
+            for (int i = 0; i < options.window; i++)
+            {
+                connection.output += frame;
+                connection.sent_us.push_back(start_us);
+            }
+            flush(connection);
+        }
+
+        long messages = 0;
+        long errors = 0;
+        std::vector<uint64_t> latencies;
+        latencies.reserve(1 << 20);
+        epoll_event events[256];
+        char buffer[65536];
+        while (monotonic_us() < end_us)
+        {
+            int ready = epoll_wait(epoll_fd, events, 256, 100);
+            uint64_t now_us = monotonic_us();
+            for (int i = 0; i < ready; i++)
+            {
+                Connection& connection = connections[events[i].data.u32];
+                if (connection.sock < 0)
+                {
+                    continue;
+                }
+                ssize_t received;
+                while ((received = recv(connection.sock, buffer, sizeof(buffer), 0)) > 0)
+                {
+                    connection.input.append(buffer, received);
+                }
+                long echoed = read_frames(connection);
+                if (echoed < 0 || received == 0 || !flush(connection))
+                {
+                    errors++;
+                    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, connection.sock, nullptr);
+                    close(connection.sock);
+                    connection.sock = -1;
+                    continue;
+                }
+
+                // Every echo puts the next message in flight.
+                for (long j = 0; j < echoed && !connection.sent_us.empty(); j++)
+                {
+                    latencies.push_back(now_us - connection.sent_us.front());
+                    connection.sent_us.pop_front();
+                    connection.output += frame;
+                    connection.sent_us.push_back(now_us);
+                }
+                messages += echoed;
+                if (!flush(connection))
+                {
+                    errors++;
+                }
+
+                bool want_write = !connection.output.empty();
+                if (want_write != connection.want_write)
+                {
+                    epoll_event event = {};
+                    event.events = EPOLLIN | (want_write ? static_cast<uint32_t>(EPOLLOUT) : 0u);
+                    event.data.u32 = events[i].data.u32;
+                    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, connection.sock, &event);
+                    connection.want_write = want_write;
+                }
+            }
+        }
+        double seconds = (monotonic_us() - start_us) / 1e6;
+        double cpu_after = (options.server_pid > 0) ? cpu_seconds(options.server_pid) : -1;
+
+        for (Connection& connection : connections)
+        {
+            if (connection.sock >= 0)
+            {
+                close(connection.sock);
+            }
+        }
+        close(epoll_fd);
+
+        std::sort(latencies.begin(), latencies.end());
+        printf("connections  %d\n", options.connections);
+        printf("message      %zu bytes%s\n", options.size, deflate_used ? ", deflated" : "");
+        printf("messages     %ld\n", messages);
+        printf("errors       %ld\n", errors);
+        printf("rate         %.0f messages/s\n", messages / seconds);
+        if (!latencies.empty())
+        {
+            printf("latency p50  %.1f us\n", static_cast<double>(latencies[latencies.size() / 2]));
+            printf("latency p99  %.1f us\n", static_cast<double>(latencies[latencies.size() * 99 / 100]));
+        }
+        if (cpu_before >= 0 && cpu_after > cpu_before)
+        {
+            printf("server cpu   %.2f s, %.0f messages per CPU second\n", cpu_after - cpu_before, messages / (cpu_after - cpu_before));
+        }
+        return errors == 0;
+    }
+
+    void run_unmask()
+    {
+        const std::size_t sizes[] = {16, 125, 1024, 16384, 1024 * 1024};
+        const uint8_t key[4] = {0x37, 0xfa, 0x21, 0x3d};
+        printf("%-10s %12s %12s %12s %12s\n", "bytes", "scalar", "sse2", "avx2", "dispatched");
+        for (std::size_t size : sizes)
+        {
+            std::vector<uint8_t> data(size, 0x5a);
+            printf("%-10zu", size);
+            for (int variant = 0; variant < 4; variant++)
+            {
+                // Enough rounds for about 256 MB per variant
+                long rounds = std::max<long>(256L * 1024 * 1024 / size, 1);
+                uint64_t start_us = monotonic_us();
+                bool supported = true;
+                for (long i = 0; i < rounds && supported; i++)
+                {
+                    switch (variant)
+                    {
+                        case 0: websocket_mask_scalar(data.data(), size, key); break;
+                        case 1: supported = websocket_mask_sse2(data.data(), size, key); break;
+                        case 2: supported = websocket_mask_avx2(data.data(), size, key); break;
+                        default: websocket_mask(data.data(), size, key); break;
+                    }
+                }
+                double seconds = (monotonic_us() - start_us) / 1e6;
+                if (supported)
+                {
+                    printf(" %7.2f GB/s", rounds * static_cast<double>(size) / seconds / 1e9);
+                }
+                else
+                {
+                    printf(" %12s", "n/a");
+                }
+            }
+            // Keeps the work from being optimized away.
+            printf("%s\n", data[0] == 0x42 ? " " : "");
+        }
+    }
+}
+
+void print_usage(const char* program_name)
+{
+    fprintf(stderr, "Usage: %s [options]\n", program_name);
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "  --host <ip>           Server address (default: %s)\n", STR_LOCALHOST_IP);
+    fprintf(stderr, "  --port <port>         Server port (default: 8080)\n");
+    fprintf(stderr, "  --path <path>         WebSocket echo route (default: %s)\n", STR_ECHO_PATH);
+    fprintf(stderr, "  --connections <n>     WebSocket connections (default: 16)\n");
+    fprintf(stderr, "  --size <bytes>        Message size (default: 64)\n");
+    fprintf(stderr, "  --window <n>          Messages in flight per connection (default: 16)\n");
+    fprintf(stderr, "  --duration <sec>      Length of the run (default: 5)\n");
+    fprintf(stderr, "  --binary              Send binary messages instead of text\n");
+    fprintf(stderr, "  --deflate             Offer permessage-deflate and send compressed messages\n");
+    fprintf(stderr, "  --server-pid <pid>    Report the messages per second of server CPU\n");
+    fprintf(stderr, "  --unmask              Time the unmasking implementations instead\n");
+}
+
+bool parse_arguments(int argc, char** argv, Options& options)
+{
+    enum
+    {
+        OPT_HOST = 256,
+        OPT_PORT,
+        OPT_PATH,
+        OPT_CONNECTIONS,
+        OPT_SIZE,
+        OPT_WINDOW,
+        OPT_DURATION,
+        OPT_BINARY,
+        OPT_DEFLATE,
+        OPT_SERVER_PID,
+        OPT_UNMASK,
+    };
+
+    static const option long_options[] = {
+        {"host", required_argument, nullptr, OPT_HOST},
+        {"port", required_argument, nullptr, OPT_PORT},
+        {"path", required_argument, nullptr, OPT_PATH},
+        {"connections", required_argument, nullptr, OPT_CONNECTIONS},
+        {"size", required_argument, nullptr, OPT_SIZE},
+        {"window", required_argument, nullptr, OPT_WINDOW},
+        {"duration", required_argument, nullptr, OPT_DURATION},
+        {"binary", no_argument, nullptr, OPT_BINARY},
+        {"deflate", no_argument, nullptr, OPT_DEFLATE},
+        {"server-pid", required_argument, nullptr, OPT_SERVER_PID},
+        {"unmask", no_argument, nullptr, OPT_UNMASK},
+        {nullptr, 0, nullptr, 0}
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", long_options, nullptr)) != -1)
+    {
+        switch (opt)
+        {
+            case OPT_HOST:        options.host = optarg; break;
+            case OPT_PORT:        options.port = std::stoi(optarg); break;
+            case OPT_PATH:        options.path = optarg; break;
+            case OPT_CONNECTIONS: options.connections = std::stoi(optarg); break;
+            case OPT_SIZE:        options.size = std::stoul(optarg); break;
+            case OPT_WINDOW:      options.window = std::stoi(optarg); break;
+            case OPT_DURATION:    options.duration_sec = std::stoi(optarg); break;
+            case OPT_BINARY:      options.binary = true; break;
+            case OPT_DEFLATE:     options.deflate = true; break;
+            case OPT_SERVER_PID:  options.server_pid = std::stoi(optarg); break;
+            case OPT_UNMASK:      options.unmask = true; break;
+            default:              return false;
+        }
+    }
+    return optind == argc && options.connections > 0 && options.window > 0 && options.duration_sec > 0 &&
+           options.size <= WEBSOCKET_MAX_MESSAGE_SIZE;
+}
+
+int main(int argc, char** argv)
+{
+    Options options;
+    if (!parse_arguments(argc, argv, options))
+    {
+        print_usage(argv[0]);
+        return -1;
+    }
+
+    if (options.unmask)
+    {
+        run_unmask();
+        return 0;
+    }
+    return run_echo(options) ? 0 : -1;
+}
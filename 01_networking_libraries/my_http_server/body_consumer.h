@@ -0,0 +1,44 @@
+#ifndef BODY_CONSUMER_H
+#define BODY_CONSUMER_H
+
+#include "http_response.h"
+
+#include <cerrno>
+#include <cstddef>
+#include <sys/types.h>
+
+// Takes a request body piece by piece as it arrives, for routes whose
+// bodies may be too large to be buffered whole. The connection owns the
+// consumer from the end of the request head until the end of the body.
+class BodyConsumer
+{
+public:
+    virtual ~BodyConsumer() = default;
+
+    // Returns false once the body is refused; the rest of it is then not
+    // read and finish() answers with the reason.
+    virtual bool consume(const char* data, std::size_t length) = 0;
+
+    // A consumer that can move the body without copying it through user
+    // space takes it straight from the socket instead, up to length bytes
+    // at a time. Only used for plaintext bodies framed by Content-Length.
+    virtual bool can_splice() const
+    {
+        return false;
+    }
+    // Returns the number of bytes taken, 0 at the end of the stream, or -1
+    // with errno set, as recv() would.
+    virtual ssize_t consume_from(int sock, std::size_t length)
+    {
+        (void)sock;
+        (void)length;
+        errno = EOPNOTSUPP;
+        return -1;
+    }
+
+    // The body has ended, whole when complete is true, and the response is
+    // returned. A consumer is not used afterwards.
+    virtual HTTPResponse finish(bool complete) = 0;
+};
+
+#endif // BODY_CONSUMER_H
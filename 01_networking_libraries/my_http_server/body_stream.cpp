@@ -0,0 +1,164 @@
+#include "body_stream.h"
+#include "chunked_encoder.h"
+#include "defs.h"
+
+BodyStream::BodyStream(EventLoop& loop, std::shared_ptr<BodyProducer> producer, bool chunked, UpstreamClient* client)
+    : m_loop(loop),
+      m_producer(std::move(producer)),
+      m_chunked(chunked),
+      m_client(client),
+      m_timer(this),
+      m_paused(true),
+      m_ended(false)
+{
+
+}
+
+BodyStream::~BodyStream()
+{
+    m_loop.timers().cancel(&m_timer);
+}
+
+void BodyStream::start()
+{
+    resume();
+}
+
+bool BodyStream::write(const std::string& data)
+{
+    if (!is_open())
+    {
+        return false;
+    }
+    if (data.empty())
+    {
+        return !m_paused;
+    }
+
+    std::string chunk;
+    if (m_chunked)
+    {
+        ChunkedEncoder::append_chunk(chunk, data.data(), data.length());
+    }
+    else
+    {
+        chunk = data;
+    }
+
+    if (!m_client->upstream_data(chunk))
+    {
+        m_paused = true;
+    }
+    return is_open() && !m_paused;
+}
+
+bool BodyStream::write(const SharedChunk& chunk)
+{
+    if (!is_open())
+    {
+        return false;
+    }
+
+    bool more = m_chunked ? m_client->upstream_shared(chunk.framed, 0, chunk.framed->length())
+                          : m_client->upstream_shared(chunk.framed, chunk.data_offset, chunk.data_length);
+    if (!more)
+    {
+        m_paused = true;
+    }
+    return is_open() && !m_paused;
+}
+
+void BodyStream::end()
+{
+    if (!is_open())
+    {
+        return;
+    }
+
+    m_ended = true;
+    if (m_chunked)
+    {
+        std::string last_chunk;
+        ChunkedEncoder::append_last_chunk(last_chunk);
+        m_client->upstream_data(last_chunk);
+    }
+    // The client may start its next response, and free this stream, as
+    // soon as it learns that the body is complete.
+    m_loop.timers().schedule(&m_timer, 0);
+}
+
+void BodyStream::fail()
+{
+    if (!is_open())
+    {
+        return;
+    }
+
+    m_ended = true;
+    m_loop.timers().cancel(&m_timer);
+    UpstreamClient* client = m_client;
+    m_client = nullptr;
+    client->upstream_failed(HTTP_500);
+}
+
+bool BodyStream::is_open() const
+{
+    return m_client != nullptr && !m_ended;
+}
+
+EventLoop& BodyStream::get_loop() const
+{
+    return m_loop;
+}
+
+SharedChunk BodyStream::share(const std::string& data)
+{
+    std::string framed;
+    ChunkedEncoder::append_chunk(framed, data.data(), data.length());
+
+    SharedChunk chunk;
+    // The chunk ends with CRLF after the data; empty data has no chunk.
+    chunk.data_offset = data.empty() ? 0 : framed.length() - data.length() - 2;
+    chunk.data_length = data.length();
+    chunk.framed = std::make_shared<const std::string>(std::move(framed));
+    return chunk;
+}
+
+void BodyStream::resume()
+{
+    if (!m_paused || !is_open())
+    {
+        return;
+    }
+
+    m_paused = false;
+    m_loop.timers().schedule(&m_timer, 0);
+}
+
+void BodyStream::detach()
+{
+    m_client = nullptr;
+    m_loop.timers().cancel(&m_timer);
+}
+
+void BodyStream::handle_timeout(TimerNode*)
+{
+    if (m_client == nullptr)
+    {
+        return;
+    }
+
+    if (m_ended)
+    {
+        // Last, since the client may free this stream.
+        UpstreamClient* client = m_client;
+        m_client = nullptr;
+        client->upstream_complete(!m_chunked);
+        return;
+    }
+
+    if (!m_paused)
+    {
+        m_producer->produce(*this);
+    }
+}
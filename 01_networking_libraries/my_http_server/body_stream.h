@@ -0,0 +1,84 @@
+#ifndef BODY_STREAM_H
+#define BODY_STREAM_H
+
+#include "event_loop.h"
+#include "timer_wheel.h"
+#include "upstream_connection.h"
+
+#include <memory>
+#include <string>
+
+class BodyStream;
+
+// A piece of body serialized once, already framed as a chunk, that any
+// number of streams write without a copy.
+struct SharedChunk
+{
+    std::shared_ptr<const std::string> framed;
+    // Where the data lies in framed, for unframed streams
+    std::size_t data_offset;
+    std::size_t data_length;
+};
+
+// Generates a response body whose length is not known up front, handing
+// it over piece by piece as it becomes available, e.g. from a timer or
+// from another socket.
+class BodyProducer
+{
+public:
+    virtual ~BodyProducer() = default;
+    // The stream can take more data: called once after the head has been
+    // queued, and again each time the client has caught up after write()
+    // returned false. The producer may write right away, or keep the
+    // stream and write later from its own events.
+    virtual void produce(BodyStream& stream) = 0;
+};
+
+// Delivers a producer's body to a connection, each write() as one chunk
+// of a "Transfer-Encoding: chunked" response, or unframed until the
+// connection closes for an HTTP/1.0 client. It goes through the same path
+// as a proxied response, so the client's output queue applies the
+// backpressure. Calls into the producer and the completion of the response
+// are made from the event loop, never from inside the producer's own call
+// stack. The connection owns the stream, and the stream owns the producer.
+class BodyStream : public UpstreamSource, public TimerHandler
+{
+public:
+    BodyStream(EventLoop& loop, std::shared_ptr<BodyProducer> producer, bool chunked, UpstreamClient* client);
+    ~BodyStream();
+
+    // Lets the producer start; the head is already queued by the client.
+    void start();
+    // The data is always taken. Returns false when the producer should
+    // wait for the next produce() before writing more.
+    bool write(const std::string& data);
+    // Same for a chunk shared with other streams. Also returns false while
+    // the client holds too many queued pieces.
+    bool write(const SharedChunk& chunk);
+    // The body is complete.
+    void end();
+    // The body cannot be completed; the client connection is closed.
+    void fail();
+    // False once the body has ended or the client is gone.
+    bool is_open() const;
+    // For producers that schedule their own timers or watch their own fds.
+    EventLoop& get_loop() const;
+
+    // Frames data once for writing to many streams.
+    static SharedChunk share(const std::string& data);
+
+    void resume() override;
+    void detach() override;
+    void handle_timeout(TimerNode* timer) override;
+
+private:
+    EventLoop& m_loop;
+    std::shared_ptr<BodyProducer> m_producer;
+    bool m_chunked;
+    UpstreamClient* m_client;
+    TimerNode m_timer;
+    bool m_paused;
+    bool m_ended;
+};
+
+#endif // BODY_STREAM_H
@@ -0,0 +1,140 @@
+#ifndef CHASE_LEV_DEQUE_H
+#define CHASE_LEV_DEQUE_H
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <type_traits>
+#include <vector>
+
+// The lock-free work-stealing deque of Chase and Lev ("Dynamic Circular
+// Work-Stealing Deque", SPAA 2005), with the memory orderings of Lê et al.
+// ("Correct and Efficient Work-Stealing for Weak Memory Models", PPoPP
+// 2013). One thread, the owner, pushes at the bottom without any atomic
+// read-modify-write; any thread steals from the top with a single CAS.
+// The array grows when it is full. Arrays that have been replaced are kept
+// until the deque is destroyed, since a thief may still be reading one.
+// The owner never takes work back here, so the bottom-end pop is left out.
+template <typename T>
+class ChaseLevDeque
+{
+    static_assert(std::is_trivially_copyable<T>::value, "elements are copied through atomics");
+
+public:
+    explicit ChaseLevDeque(std::size_t capacity)
+        : m_top(0),
+          m_bottom(0)
+    {
+        std::size_t size = 1;
+        while (size < capacity)
+        {
+            size <<= 1;
+        }
+        m_arrays.emplace_back(new Array(size));
+        m_array.store(m_arrays.back().get(), std::memory_order_relaxed);
+    }
+
+    ChaseLevDeque(const ChaseLevDeque&) = delete;
+    ChaseLevDeque& operator=(const ChaseLevDeque&) = delete;
+
+    // Owner only.
+    void push(T item)
+    {
+        int64_t bottom = m_bottom.load(std::memory_order_relaxed);
+        int64_t top = m_top.load(std::memory_order_acquire);
+        Array* array = m_array.load(std::memory_order_relaxed);
+        if (bottom - top > static_cast<int64_t>(array->mask))
+        {
+            array = grow(array, top, bottom);
+        }
+        array->put(bottom, item);
+        // A release store rather than the paper's release fence: the same
+        // on x86, and visible to the thread sanitizer.
+        m_bottom.store(bottom + 1, std::memory_order_release);
+    }
+
+    // Any thread. Returns false once the deque is empty; a lost race with
+    // another thief is retried.
+    bool steal(T& item)
+    {
+        while (true)
+        {
+            int64_t top = m_top.load(std::memory_order_acquire);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            int64_t bottom = m_bottom.load(std::memory_order_acquire);
+            if (top >= bottom)
+            {
+                return false;
+            }
+
+            Array* array = m_array.load(std::memory_order_acquire);
+            item = array->get(top);
+            if (m_top.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+            {
+                return true;
+            }
+        }
+    }
+
+    // A snapshot, for deciding whether there is anything to steal.
+    bool is_empty() const
+    {
+        int64_t top = m_top.load(std::memory_order_acquire);
+        int64_t bottom = m_bottom.load(std::memory_order_acquire);
+        return top >= bottom;
+    }
+
+    std::size_t size() const
+    {
+        int64_t top = m_top.load(std::memory_order_acquire);
+        int64_t bottom = m_bottom.load(std::memory_order_acquire);
+        return (bottom > top) ? static_cast<std::size_t>(bottom - top) : 0;
+    }
+
+private:
+    struct Array
+    {
+        explicit Array(std::size_t size)
+            : mask(size - 1),
+              slots(new std::atomic<T>[size])
+        {
+
+        }
+
+        T get(int64_t index) const
+        {
+            return slots[index & mask].load(std::memory_order_relaxed);
+        }
+
+        void put(int64_t index, T item)
+        {
+            slots[index & mask].store(item, std::memory_order_relaxed);
+        }
+
+        std::size_t mask;
+        std::unique_ptr<std::atomic<T>[]> slots;
+    };
+
+    Array* grow(Array* array, int64_t top, int64_t bottom)
+    {
+        Array* grown = new Array((array->mask + 1) * 2);
+        for (int64_t i = top; i < bottom; i++)
+        {
+            grown->put(i, array->get(i));
+        }
+        m_arrays.emplace_back(grown);
+        m_array.store(grown, std::memory_order_release);
+        return grown;
+    }
+
+private:
+    // Apart, so thieves bumping the top do not keep taking the owner's
+    // cache line away.
+    alignas(64) std::atomic<int64_t> m_top;
+    alignas(64) std::atomic<int64_t> m_bottom;
+    std::atomic<Array*> m_array;
+    // Owner only
+    std::vector<std::unique_ptr<Array>> m_arrays;
+};
+
+#endif // CHASE_LEV_DEQUE_H
@@ -0,0 +1,136 @@
+#include "chunked_decoder.h"
+
+#include <algorithm>
+
+namespace
+{
+    int hex_value(char c)
+    {
+        if (c >= '0' && c <= '9') return c - '0';
+        if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+        if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+        return -1;
+    }
+
+    // Larger chunks than this are not supported, and it keeps the size
+    // from overflowing.
+    const int MAX_SIZE_DIGITS = 15;
+}
+
+ChunkedDecoder::ChunkedDecoder()
+{
+    reset();
+}
+
+void ChunkedDecoder::reset()
+{
+    m_state = CHUNK_SIZE;
+    m_chunk_remaining = 0;
+    m_size_digits = 0;
+}
+
+std::size_t ChunkedDecoder::feed(const char* data, std::size_t length, std::string* payload)
+{
+    std::size_t offset = 0;
+    while (offset < length && m_state != DONE && m_state != ERROR)
+    {
+        if (m_state == CHUNK_DATA)
+        {
+            std::size_t count = std::min<uint64_t>(m_chunk_remaining, length - offset);
+            if (payload != nullptr)
+            {
+                payload->append(data + offset, count);
+            }
+            offset += count;
+            m_chunk_remaining -= count;
+            if (m_chunk_remaining == 0)
+            {
+                m_state = CHUNK_DATA_CR;
+            }
+            continue;
+        }
+
+        char c = data[offset++];
+        switch (m_state)
+        {
+            case CHUNK_SIZE:
+            {
+                int value = hex_value(c);
+                if (value >= 0 && m_size_digits < MAX_SIZE_DIGITS)
+                {
+                    m_chunk_remaining = (m_chunk_remaining << 4) | value;
+                    m_size_digits++;
+                }
+                else if (m_size_digits > 0 && (c == ';' || c == ' ' || c == '\t'))
+                {
+                    m_state = CHUNK_EXTENSION;
+                }
+                else if (m_size_digits > 0 && c == '\r')
+                {
+                    m_state = CHUNK_SIZE_LF;
+                }
+                else
+                {
+                    m_state = ERROR;
+                }
+                break;
+            }
+
+            case CHUNK_EXTENSION:
+                if (c == '\r')
+                {
+                    m_state = CHUNK_SIZE_LF;
+                }
+                break;
+
+            case CHUNK_SIZE_LF:
+                if (c != '\n')
+                {
+                    m_state = ERROR;
+                }
+                else
+                {
+                    m_state = (m_chunk_remaining == 0) ? TRAILER_START : CHUNK_DATA;
+                    m_size_digits = 0;
+                }
+                break;
+
+            case CHUNK_DATA_CR:
+                m_state = (c == '\r') ? CHUNK_DATA_LF : ERROR;
+                break;
+
+            case CHUNK_DATA_LF:
+                m_state = (c == '\n') ? CHUNK_SIZE : ERROR;
+                break;
+
+            case TRAILER_START:
+                m_state = (c == '\r') ? TRAILER_END_LF : TRAILER_LINE;
+                break;
+
+            case TRAILER_LINE:
+                if (c == '\n')
+                {
+                    m_state = TRAILER_START;
+                }
+                break;
+
+            case TRAILER_END_LF:
+                m_state = (c == '\n') ? DONE : ERROR;
+                break;
+
+            default:
+                break;
+        }
+    }
+    return offset;
+}
+
+bool ChunkedDecoder::is_done() const
+{
+    return m_state == DONE;
+}
+
+bool ChunkedDecoder::has_error() const
+{
+    return m_state == ERROR;
+}
@@ -0,0 +1,46 @@
+#ifndef CHUNKED_DECODER_H
+#define CHUNKED_DECODER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// Incremental parser for the chunked transfer coding (RFC 9112 7.1).
+// Bytes can be fed in pieces of any size; chunk extensions and trailers are
+// skipped.
+class ChunkedDecoder
+{
+public:
+    ChunkedDecoder();
+
+    void reset();
+    // Consumes bytes up to the end of the message and appends the decoded
+    // payload to payload unless it is null. Returns how many bytes were
+    // consumed, which is less than length only once the message is complete
+    // or malformed.
+    std::size_t feed(const char* data, std::size_t length, std::string* payload);
+    bool is_done() const;
+    bool has_error() const;
+
+private:
+    enum State
+    {
+        CHUNK_SIZE,
+        CHUNK_EXTENSION,
+        CHUNK_SIZE_LF,
+        CHUNK_DATA,
+        CHUNK_DATA_CR,
+        CHUNK_DATA_LF,
+        TRAILER_START,
+        TRAILER_LINE,
+        TRAILER_END_LF,
+        DONE,
+        ERROR
+    };
+
+    State m_state;
+    uint64_t m_chunk_remaining;
+    int m_size_digits;
+};
+
+#endif // CHUNKED_DECODER_H
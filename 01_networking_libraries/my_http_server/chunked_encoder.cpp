@@ -0,0 +1,29 @@
+#include "chunked_encoder.h"
+
+void ChunkedEncoder::append_chunk(std::string& output, const char* data, std::size_t length)
+{
+    if (length == 0)
+    {
+        return;
+    }
+
+    static const char HEX_DIGITS[] = "0123456789abcdef";
+    char size[2 * sizeof(std::size_t)];
+    std::size_t digits = 0;
+    for (std::size_t value = length; value != 0; value >>= 4)
+    {
+        digits++;
+        size[sizeof(size) - digits] = HEX_DIGITS[value & 0xf];
+    }
+
+    output.reserve(output.length() + digits + length + 4);
+    output.append(size + sizeof(size) - digits, digits);
+    output.append("\r\n", 2);
+    output.append(data, length);
+    output.append("\r\n", 2);
+}
+
+void ChunkedEncoder::append_last_chunk(std::string& output)
+{
+    output.append("0\r\n\r\n", 5);
+}
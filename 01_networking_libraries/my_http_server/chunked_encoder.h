@@ -0,0 +1,19 @@
+#ifndef CHUNKED_ENCODER_H
+#define CHUNKED_ENCODER_H
+
+#include <cstddef>
+#include <string>
+
+// Framing for the chunked transfer coding (RFC 9112 7.1), the counterpart
+// of ChunkedDecoder. Each piece of a body of unknown length goes out as
+// one chunk as soon as it is available; the last chunk ends the message.
+class ChunkedEncoder
+{
+public:
+    // Appends data framed as one chunk. Nothing is appended for empty
+    // data, since a chunk of size zero would end the body.
+    static void append_chunk(std::string& output, const char* data, std::size_t length);
+    static void append_last_chunk(std::string& output);
+};
+
+#endif // CHUNKED_ENCODER_H
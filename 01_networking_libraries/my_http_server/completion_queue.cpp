@@ -0,0 +1,86 @@
+#include "completion_queue.h"
+#include "logging.h"
+
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+CompletionQueue::CompletionQueue(EventLoop& loop, CompletionClient* client)
+    : m_loop(loop),
+      m_client(client),
+      m_event_fd(-1),
+      m_finished(nullptr)
+{
+
+}
+
+CompletionQueue::~CompletionQueue()
+{
+    OffloadJob* job = m_finished.exchange(nullptr, std::memory_order_acquire);
+    while (job != nullptr)
+    {
+        OffloadJob* next = job->m_next;
+        delete job;
+        job = next;
+    }
+
+    if (m_event_fd >= 0)
+    {
+        m_loop.remove(m_event_fd);
+        close(m_event_fd);
+    }
+}
+
+bool CompletionQueue::start()
+{
+    m_event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (m_event_fd < 0 || !m_loop.add(m_event_fd, EPOLLIN, this))
+    {
+        LOGE("Completion queue eventfd is not ready");
+        return false;
+    }
+    return true;
+}
+
+void CompletionQueue::push(OffloadJob* job)
+{
+    OffloadJob* head = m_finished.load(std::memory_order_relaxed);
+    do
+    {
+        job->m_next = head;
+    }
+    while (!m_finished.compare_exchange_weak(head, job, std::memory_order_release, std::memory_order_relaxed));
+
+    // Only the first job on an empty stack wakes the loop up.
+    if (head == nullptr)
+    {
+        uint64_t one = 1;
+        ssize_t rc = write(m_event_fd, &one, sizeof(one));
+        (void)rc;
+    }
+}
+
+void CompletionQueue::handle_event(uint32_t)
+{
+    // The counter is reset before the stack is taken, so a job finishing
+    // in between is either taken now or signals again.
+    uint64_t count;
+    ssize_t rc = read(m_event_fd, &count, sizeof(count));
+    (void)rc;
+
+    OffloadJob* finished = m_finished.exchange(nullptr, std::memory_order_acquire);
+    OffloadJob* ordered = nullptr;
+    while (finished != nullptr)
+    {
+        OffloadJob* next = finished->m_next;
+        finished->m_next = ordered;
+        ordered = finished;
+        finished = next;
+    }
+
+    while (ordered != nullptr)
+    {
+        OffloadJob* job = ordered;
+        ordered = job->m_next;
+        m_client->job_finished(job);
+    }
+}
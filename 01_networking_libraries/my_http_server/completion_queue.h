@@ -0,0 +1,43 @@
+#ifndef COMPLETION_QUEUE_H
+#define COMPLETION_QUEUE_H
+
+#include "event_loop.h"
+#include "offload_job.h"
+
+#include <atomic>
+
+class CompletionClient
+{
+public:
+    virtual ~CompletionClient() = default;
+    // On the loop's thread, in the order the jobs finished. The client
+    // completes the job, unless it has been cancelled, and frees it.
+    virtual void job_finished(OffloadJob* job) = 0;
+};
+
+// Brings jobs finished on other threads back to the event loop's thread.
+// Finished jobs are pushed onto a lock-free stack, and the loop is woken
+// through an eventfd only when the stack was empty; the loop takes the
+// whole stack at once, so neither side ever waits for a lock.
+class CompletionQueue : public EventHandler
+{
+public:
+    CompletionQueue(EventLoop& loop, CompletionClient* client);
+    // Frees the jobs that were never taken.
+    ~CompletionQueue();
+
+    bool start();
+    // From any thread.
+    void push(OffloadJob* job);
+
+    void handle_event(uint32_t events) override;
+
+private:
+    EventLoop& m_loop;
+    CompletionClient* m_client;
+    int m_event_fd;
+    // Newest first
+    std::atomic<OffloadJob*> m_finished;
+};
+
+#endif // COMPLETION_QUEUE_H
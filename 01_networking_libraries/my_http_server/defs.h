@@ -6,8 +6,191 @@
 #define STR_LOCALHOST "localhost"
 #define STR_LOCALHOST_IP "127.0.0.1"
 #define STR_TCP_PROTOCOL "tcp"
+#define STR_METRICS_PATH "/metrics"
+#define STR_UPLOAD_PATH "/upload/"
+#define STR_DELAY_PATH "/delay/"
+#define STR_HASH_PATH "/hash/"
+#define STR_ECHO_PATH "/echo/"
+#define STR_EVENTS_PATH "/events/"
+#define STR_TLS_CERT_FILE "server.crt"
+#define STR_TLS_KEY_FILE "server.key"
 #define MAX_CONNECTION (2)
 #define MESSAGE_SIZE (1024)
+#define MAX_HEADER_SIZE (8192)
+#define MAX_BODY_SIZE (1024 * 1024)
+
+// Uploads are written to the upload directory through a pipe of
+// UPLOAD_PIPE_SIZE bytes, which bounds what one splice() call moves.
+#define MAX_UPLOAD_SIZE (16ULL * 1024 * 1024 * 1024)
+#define UPLOAD_PIPE_SIZE (1024 * 1024)
+#define UPLOAD_FILE_MODE (0644)
+
+// Listening sockets. A wakeup accepts at most ACCEPT_BUDGET connections, so
+// a burst of new clients cannot starve the ones already connected; the rest
+// stay in the backlog for the next loop iteration.
+#define LISTEN_BACKLOG (511)
+#define ACCEPT_BUDGET (64)
+#define TCP_DEFER_ACCEPT_SEC (5)
+#define TCP_FASTOPEN_QUEUE_LENGTH (256)
+
+// Reading from a pipelining client pauses while this much response data is
+// queued and resumes once the queue drains below the low watermark.
+#define OUTPUT_HIGH_WATERMARK (256 * 1024)
+#define OUTPUT_LOW_WATERMARK (64 * 1024)
+// Small shared pieces, such as broadcast events, are also held back once a
+// client has this many segments queued, whatever their size.
+#define OUTPUT_MAX_SHARED_SEGMENTS (64)
+
+// Busy-poll mode. The loop spins for an adaptive budget between
+// BUSY_POLL_MIN_US and the configured maximum before it sleeps; the kernel
+// polls the NIC for up to BUSY_POLL_NAPI_BUDGET packets per pass.
+#define BUSY_POLL_MIN_US (8)
+#define BUSY_POLL_NAPI_BUDGET (64)
+
+// Load shedding. New connections are shed while the queueing delay has
+// stayed above the target for a whole SHED_INTERVAL_MS, and told to come
+// back after SHED_RETRY_AFTER_SEC.
+#define SHED_INTERVAL_MS (100)
+#define SHED_RETRY_AFTER_SEC (1)
+
+// Per-client rate limits. Clients are tracked in a shared table of
+// RATE_LIMIT_TABLE_SIZE slots (a power of two); a client is looked up in at
+// most RATE_LIMIT_PROBES slots from its hash, and a new one evicts the least
+// recently seen of them when all are taken. Refused clients are told to come
+// back after RATE_LIMIT_RETRY_AFTER_SEC.
+#define RATE_LIMIT_TABLE_SIZE (65536)
+#define RATE_LIMIT_PROBES (8)
+#define RATE_LIMIT_MAX_RATE (1000000)
+#define RATE_LIMIT_MAX_BURST (65535)
+#define RATE_LIMIT_RETRY_AFTER_SEC (1)
+
+// Coroutine handlers. Frames of up to FRAME_POOL_MAX_SIZE bytes are
+// recycled in size classes FRAME_POOL_CLASS_SIZE bytes apart, keeping at
+// most FRAME_POOL_MAX_FREE of each. A handler that has not completed after
+// COROUTINE_HANDLER_TIMEOUT_MS is cancelled and answered with 504. File
+// reads yield to the loop after every FILE_READ_CHUNK bytes, and the
+// built-in STR_DELAY_PATH handler waits at most DELAY_MAX_MS.
+#define FRAME_POOL_CLASS_SIZE (64)
+#define FRAME_POOL_MAX_SIZE (4096)
+#define FRAME_POOL_MAX_FREE (1024)
+#define COROUTINE_HANDLER_TIMEOUT_MS (120000)
+#define FILE_READ_CHUNK (256 * 1024)
+#define DELAY_MAX_MS (60000)
+
+// Offload pool for blocking filesystem calls. At most OFFLOAD_QUEUE_SIZE
+// jobs wait for a thread; past that the loop does the work itself. A static
+// file of up to OFFLOAD_READ_MAX bytes is read whole on the pool, a larger
+// one is opened there and its first OFFLOAD_READAHEAD_SIZE bytes are read
+// ahead into the page cache. At most OFFLOAD_MAX_THREADS threads per loop.
+#define OFFLOAD_QUEUE_SIZE (1024)
+#define OFFLOAD_READ_MAX (64 * 1024)
+#define OFFLOAD_READAHEAD_SIZE (1024 * 1024)
+#define OFFLOAD_MAX_THREADS (64)
+
+// Work-stealing scheduler for CPU-heavy handler work. Each thread's deque
+// starts with room for SCHEDULER_DEQUE_SIZE jobs and grows; at most
+// SCHEDULER_QUEUE_SIZE jobs wait in all of them, past that the loop does
+// the work itself. At most SCHEDULER_MAX_THREADS threads per loop. The
+// built-in STR_HASH_PATH handler hashes at most HASH_MAX_ROUNDS times.
+#define SCHEDULER_DEQUE_SIZE (256)
+#define SCHEDULER_QUEUE_SIZE (4096)
+#define SCHEDULER_MAX_THREADS (64)
+#define HASH_MAX_ROUNDS (10000000)
+
+// Per-connection deadlines, in milliseconds
+#define HEADER_READ_TIMEOUT_MS (10000)
+#define BODY_READ_TIMEOUT_MS (30000)
+#define KEEP_ALIVE_IDLE_TIMEOUT_MS (15000)
+#define WRITE_STALL_TIMEOUT_MS (30000)
+
+// Egress scheduling. Output of up to EGRESS_PRIORITY_SIZE bytes is
+// written right away; bulk output goes out in deficit round-robin turns of
+// EGRESS_QUANTUM bytes. Rate caps allow bursts of EGRESS_BURST_MS worth of
+// their rate, and of at least one quantum; a turn waits until the caps
+// allow at least EGRESS_MIN_GRANT bytes, so that a capped connection does
+// not trickle out in tiny writes. A cap is at most EGRESS_MAX_RATE bytes per
+// second.
+#define EGRESS_PRIORITY_SIZE (16 * 1024)
+#define EGRESS_QUANTUM (64 * 1024)
+#define EGRESS_MIN_GRANT (4 * 1024)
+#define EGRESS_BURST_MS (10)
+#define EGRESS_MAX_RATE (100ULL * 1000 * 1000 * 1000)
+
+// WebSocket. A message may take up to WEBSOCKET_MAX_MESSAGE_SIZE bytes once
+// reassembled and inflated. A connection that stays quiet for
+// WEBSOCKET_PING_INTERVAL_MS is pinged, and closed if the next interval
+// passes without an answer; a close handshake started by the server gets
+// WEBSOCKET_CLOSE_TIMEOUT_MS. With permessage-deflate, messages of at least
+// WEBSOCKET_DEFLATE_MIN_SIZE bytes are compressed at WEBSOCKET_DEFLATE_LEVEL
+// with a window of 2^WEBSOCKET_DEFLATE_WINDOW_BITS bytes, which with
+// WEBSOCKET_DEFLATE_MEM_LEVEL keeps the deflate state near 32 KB.
+#define WEBSOCKET_MAX_MESSAGE_SIZE (MAX_BODY_SIZE)
+#define WEBSOCKET_PING_INTERVAL_MS (30000)
+#define WEBSOCKET_CLOSE_TIMEOUT_MS (5000)
+#define WEBSOCKET_DEFLATE_MIN_SIZE (128)
+#define WEBSOCKET_DEFLATE_LEVEL (1)
+#define WEBSOCKET_DEFLATE_WINDOW_BITS (12)
+#define WEBSOCKET_DEFLATE_MEM_LEVEL (5)
+
+// Binary access log. Each loop fills a ring of ACCESS_LOG_RING_RECORDS
+// 64-byte records, which its flusher thread writes out every
+// ACCESS_LOG_FLUSH_INTERVAL_MS, or as soon as the ring is half full; a
+// record that finds the ring full is dropped. The last
+// ACCESS_LOG_PATH_CACHE_SIZE paths seen are not written again.
+#define ACCESS_LOG_RING_RECORDS (16384)
+#define ACCESS_LOG_FLUSH_INTERVAL_MS (200)
+#define ACCESS_LOG_PATH_CACHE_SIZE (4096)
+
+// The time-stamp counter's rate is measured over TSC_CALIBRATION_US when a
+// TscClock starts, then refined over the time since.
+#define TSC_CALIBRATION_US (10000)
+
+// Compact idle connections. Between requests a keep-alive connection is
+// cut down to a record of at most IDLE_CONNECTION_MAX_SIZE bytes, in slabs
+// of SLAB_CHUNK_SLOTS records. --max-connections goes up to
+// MAX_CONNECTION_LIMIT; the descriptor limit is raised to it plus
+// FD_LIMIT_RESERVE for listeners, upstreams and files being served.
+#define IDLE_CONNECTION_MAX_SIZE (256)
+#define SLAB_CHUNK_SLOTS (4096)
+#define MAX_CONNECTION_LIMIT (16 * 1024 * 1024)
+#define FD_LIMIT_RESERVE (1024)
+
+// TLS session resumption
+#define TLS_SESSION_CACHE_SIZE (20480)
+#define TLS_SESSION_LIFETIME_SEC (3600)
+#define TLS_TICKET_KEY_ROTATION_SEC (3600)
+
+// HTTP/2 (h2c). A header block may take up to HTTP2_MAX_HEADER_LIST_SIZE
+// bytes, both as received and once decoded, like a request head over
+// HTTP/1.x.
+#define HTTP2_MAX_CONCURRENT_STREAMS (100)
+#define HTTP2_DEFAULT_WINDOW_SIZE (65535)
+#define HTTP2_MAX_FRAME_SIZE (16384)
+#define HTTP2_HEADER_TABLE_SIZE (4096)
+#define HTTP2_MAX_HEADER_LIST_SIZE (MAX_HEADER_SIZE)
+
+// Reverse proxy upstreams. Idle pooled connections are closed before the
+// backend's own keep-alive timeout would close them under us.
+#define UPSTREAM_CONNECT_TIMEOUT_MS (2000)
+#define UPSTREAM_RESPONSE_TIMEOUT_MS (30000)
+#define UPSTREAM_IDLE_TIMEOUT_MS (10000)
+#define UPSTREAM_MAX_IDLE_CONNECTIONS (16)
+#define UPSTREAM_MAX_FAILURES (3)
+#define UPSTREAM_EJECTION_TIME_MS (10000)
+#define UPSTREAM_READ_SIZE (16384)
+
+// Prefork mode: a worker that dies sooner than this after being spawned is
+// respawned only once this much time has passed.
+#define WORKER_RESPAWN_DELAY_MS (1000)
+
+// Hot upgrade and graceful drain. A draining server answers the requests
+// in progress with "Connection: close", closes connections that stay idle
+// for DRAIN_IDLE_TIMEOUT_MS, and exits after DRAIN_TIMEOUT_MS at the latest.
+// With incoming-CPU steering there are listeners per worker and port.
+#define UPGRADE_MAX_LISTENERS (128)
+#define UPGRADE_CONFIRM_TIMEOUT_MS (5000)
+#define DRAIN_IDLE_TIMEOUT_MS (1000)
+#define DRAIN_TIMEOUT_MS (30000)
 
 enum ClientActivity
 {
@@ -20,10 +203,17 @@ enum ClientActivity
 enum HttpStatus
 {
     HTTP_200 = 200,
+    HTTP_201 = 201,
     HTTP_400 = 400,
     HTTP_403 = 403,
     HTTP_404 = 404,
-    HTTP_500 = 500
+    HTTP_405 = 405,
+    HTTP_413 = 413,
+    HTTP_429 = 429,
+    HTTP_500 = 500,
+    HTTP_502 = 502,
+    HTTP_503 = 503,
+    HTTP_504 = 504
 };
 
 #endif // DEFS_H
\ No newline at end of file
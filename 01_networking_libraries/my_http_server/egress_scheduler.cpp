@@ -0,0 +1,214 @@
+#include "egress_scheduler.h"
+#include "defs.h"
+#include "metrics.h"
+#include "utils.h"
+
+#include <algorithm>
+
+EgressNode::EgressNode(EgressClient* client)
+    : m_client(client),
+      m_prev(nullptr),
+      m_next(nullptr),
+      m_scheduler(nullptr),
+      m_deficit(0),
+      m_bucket_set(false)
+{
+
+}
+
+EgressNode::~EgressNode()
+{
+    if (m_scheduler != nullptr)
+    {
+        m_scheduler->cancel(this);
+    }
+}
+
+bool EgressNode::is_queued() const
+{
+    return m_scheduler != nullptr;
+}
+
+EgressScheduler::EgressScheduler(EventLoop& loop, uint64_t rate, uint64_t connection_rate)
+    : m_loop(loop),
+      m_bucket(rate, std::max<uint64_t>(rate * EGRESS_BURST_MS / 1000, EGRESS_QUANTUM)),
+      m_connection_rate(connection_rate),
+      m_timer(this),
+      m_head(nullptr),
+      m_tail(nullptr),
+      m_count(0)
+{
+
+}
+
+EgressScheduler::~EgressScheduler()
+{
+    while (m_head != nullptr)
+    {
+        unlink(m_head);
+    }
+}
+
+bool EgressScheduler::is_priority(std::size_t pending_bytes) const
+{
+    return pending_bytes <= EGRESS_PRIORITY_SIZE;
+}
+
+void EgressScheduler::charge(std::size_t bytes)
+{
+    METRIC_ADD(METRIC_EGRESS_PRIORITY_BYTES, bytes);
+    if (m_bucket.is_limited())
+    {
+        m_bucket.refill(monotonic_us());
+        m_bucket.consume(bytes);
+    }
+}
+
+void EgressScheduler::enqueue(EgressNode* node)
+{
+    if (node->m_scheduler != nullptr)
+    {
+        return;
+    }
+    if (!node->m_bucket_set)
+    {
+        node->m_bucket = TokenBucket(m_connection_rate, std::max<uint64_t>(m_connection_rate * EGRESS_BURST_MS / 1000, EGRESS_QUANTUM));
+        node->m_bucket_set = true;
+    }
+
+    node->m_scheduler = this;
+    node->m_prev = m_tail;
+    node->m_next = nullptr;
+    if (m_tail != nullptr)
+    {
+        m_tail->m_next = node;
+    }
+    else
+    {
+        m_head = node;
+    }
+    m_tail = node;
+    m_count++;
+    METRIC_INC(METRIC_EGRESS_QUEUED);
+
+    if (!m_timer.is_armed())
+    {
+        m_loop.timers().schedule(&m_timer, 0);
+    }
+}
+
+void EgressScheduler::cancel(EgressNode* node)
+{
+    if (node->m_scheduler != this)
+    {
+        return;
+    }
+    unlink(node);
+    node->m_deficit = 0;
+    if (m_head == nullptr)
+    {
+        m_loop.timers().cancel(&m_timer);
+    }
+}
+
+void EgressScheduler::handle_timeout(TimerNode* timer)
+{
+    (void)timer;
+    uint64_t now_us = monotonic_us();
+    m_bucket.refill(now_us);
+
+    // Every node queued when the round starts gets one turn at most; those
+    // queued by a turn wait for the next round.
+    bool progress = false;
+    for (std::size_t turns = m_count; turns > 0 && m_head != nullptr; turns--)
+    {
+        if (m_bucket.available() < EGRESS_MIN_GRANT)
+        {
+            METRIC_INC(METRIC_EGRESS_THROTTLED);
+            break;
+        }
+
+        EgressNode* node = m_head;
+        unlink(node);
+        node->m_deficit += EGRESS_QUANTUM;
+        std::size_t budget = std::min<uint64_t>(node->m_deficit, m_bucket.available());
+        node->m_bucket.refill(now_us);
+        budget = std::min<uint64_t>(budget, node->m_bucket.available());
+        if (budget < EGRESS_MIN_GRANT)
+        {
+            // Over its own cap: it keeps its place in the rotation, and
+            // does not save up turns meanwhile.
+            node->m_deficit = 0;
+            enqueue(node);
+            continue;
+        }
+
+        // The client may close while it writes; its node lives on until
+        // the end of the loop iteration, like the connection.
+        std::size_t written = node->m_client->egress_write(budget);
+        m_bucket.consume(written);
+        node->m_bucket.consume(written);
+        METRIC_ADD(METRIC_EGRESS_BULK_BYTES, written);
+        progress = progress || written > 0;
+
+        // Deficit round-robin: what was not used, because the global bucket
+        // or the socket ran out, carries over to the next turn, unless the
+        // client has nothing more to send for now. A socket that stays full
+        // saves up at most one quantum.
+        if (node->m_client->egress_pending())
+        {
+            node->m_deficit = std::min<std::size_t>(node->m_deficit - std::min(written, node->m_deficit), EGRESS_QUANTUM);
+        }
+        else
+        {
+            node->m_deficit = 0;
+        }
+    }
+
+    schedule_round(progress);
+}
+
+void EgressScheduler::unlink(EgressNode* node)
+{
+    if (node->m_prev != nullptr)
+    {
+        node->m_prev->m_next = node->m_next;
+    }
+    else
+    {
+        m_head = node->m_next;
+    }
+    if (node->m_next != nullptr)
+    {
+        node->m_next->m_prev = node->m_prev;
+    }
+    else
+    {
+        m_tail = node->m_prev;
+    }
+
+    node->m_prev = nullptr;
+    node->m_next = nullptr;
+    node->m_scheduler = nullptr;
+    m_count--;
+    METRIC_DEC(METRIC_EGRESS_QUEUED);
+}
+
+void EgressScheduler::schedule_round(bool progress)
+{
+    if (m_head == nullptr)
+    {
+        m_loop.timers().cancel(&m_timer);
+        return;
+    }
+
+    // The next round runs on the next loop iteration, or, when this one
+    // was held back by the caps, once the buckets have had time to refill.
+    m_bucket.refill(monotonic_us());
+    uint64_t delay_ms = 0;
+    if (!progress || m_bucket.available() < EGRESS_MIN_GRANT)
+    {
+        delay_ms = std::max<uint64_t>((m_bucket.wait_us(EGRESS_MIN_GRANT) + 999) / 1000, 1);
+    }
+    m_loop.timers().schedule(&m_timer, delay_ms);
+}
@@ -0,0 +1,91 @@
+#ifndef EGRESS_SCHEDULER_H
+#define EGRESS_SCHEDULER_H
+
+#include "event_loop.h"
+#include "timer_wheel.h"
+#include "token_bucket.h"
+
+#include <cstddef>
+#include <cstdint>
+
+class EgressNode;
+class EgressScheduler;
+
+// A connection with bulk output to send.
+class EgressClient
+{
+public:
+    virtual ~EgressClient() = default;
+    // Its turn: write at most budget bytes and return how many were
+    // written. To send more in a later round, enqueue the node again.
+    virtual std::size_t egress_write(std::size_t budget) = 0;
+    // Whether output is still waiting to be sent, queued or not.
+    virtual bool egress_pending() const = 0;
+};
+
+// Intrusive entry of a client in the scheduler's round, embedded in the
+// connection like its TimerNode. Holds the client's deficit and, with a
+// per-connection cap, its own bucket.
+class EgressNode
+{
+public:
+    explicit EgressNode(EgressClient* client);
+    ~EgressNode();
+
+    bool is_queued() const;
+
+private:
+    friend class EgressScheduler;
+
+    EgressClient* m_client;
+    EgressNode* m_prev;
+    EgressNode* m_next;
+    EgressScheduler* m_scheduler;
+    std::size_t m_deficit;
+    TokenBucket m_bucket;
+    bool m_bucket_set;
+};
+
+// Shares one loop's egress between its connections. Output of up to
+// EGRESS_PRIORITY_SIZE bytes, like a page or a small response, takes the
+// priority lane: the connection writes it right away and only the global
+// bucket is charged. Bulk output waits for its turn in deficit round-robin
+// rounds, run once per loop iteration, in which every queued connection
+// may write EGRESS_QUANTUM more bytes, within what the global and its own
+// bucket allow. A round stops when the global bucket runs dry and the next
+// one starts where it stopped, so between two rounds the loop serves the
+// events that were waiting, small requests included.
+class EgressScheduler : public TimerHandler
+{
+public:
+    // Bytes per second for the loop and for each connection, unlimited
+    // while zero.
+    EgressScheduler(EventLoop& loop, uint64_t rate, uint64_t connection_rate);
+    ~EgressScheduler();
+
+    // Output of this many bytes may take the priority lane.
+    bool is_priority(std::size_t pending_bytes) const;
+    // Bytes written in the priority lane.
+    void charge(std::size_t bytes);
+    // Queues node for the next round, at the end of it; a queued node
+    // keeps its place.
+    void enqueue(EgressNode* node);
+    void cancel(EgressNode* node);
+
+    void handle_timeout(TimerNode* timer) override;
+
+private:
+    void unlink(EgressNode* node);
+    void schedule_round(bool progress);
+
+private:
+    EventLoop& m_loop;
+    TokenBucket m_bucket;
+    uint64_t m_connection_rate;
+    TimerNode m_timer;
+    EgressNode* m_head;
+    EgressNode* m_tail;
+    std::size_t m_count;
+};
+
+#endif // EGRESS_SCHEDULER_H
@@ -0,0 +1,220 @@
+#include "event_loop.h"
+#include "logging.h"
+#include "metrics.h"
+#include "utils.h"
+#include "defs.h"
+
+#include <algorithm>
+#include <unistd.h>
+#include <cerrno>
+#include <sys/ioctl.h>
+
+// Per-instance epoll busy poll parameters, Linux 6.9 and later.
+#ifndef EPIOCSPARAMS
+struct epoll_params
+{
+    uint32_t busy_poll_usecs;
+    uint16_t busy_poll_budget;
+    uint8_t prefer_busy_poll;
+    uint8_t __pad;
+};
+#define EPIOCSPARAMS _IOW(0x8A, 0x01, struct epoll_params)
+#endif
+
+EventLoop::EventLoop()
+    : m_epoll_fd(epoll_create1(EPOLL_CLOEXEC)),
+      m_busy_poll_max_us(0),
+      m_spin_us(0),
+      m_measure_ready(false),
+      m_now_ms(monotonic_ms()),
+      m_ready_us(m_now_ms * 1000),
+      m_last_poll_us(m_ready_us),
+      m_timers(m_now_ms)
+{
+    if (m_epoll_fd < 0)
+    {
+        LOGE("epoll_create1() failed");
+    }
+}
+
+EventLoop::~EventLoop()
+{
+    if (m_epoll_fd >= 0)
+    {
+        close(m_epoll_fd);
+    }
+}
+
+bool EventLoop::is_valid() const
+{
+    return m_epoll_fd >= 0;
+}
+
+bool EventLoop::reopen()
+{
+    if (m_epoll_fd >= 0)
+    {
+        close(m_epoll_fd);
+    }
+
+    m_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (m_epoll_fd < 0)
+    {
+        LOGE("epoll_create1() failed");
+        return false;
+    }
+    apply_busy_poll();
+    return true;
+}
+
+bool EventLoop::add(int fd, uint32_t events, EventHandler* handler)
+{
+    epoll_event ev;
+    ev.events = events;
+    ev.data.ptr = handler;
+    if (epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, fd, &ev) != 0)
+    {
+        LOGE("epoll_ctl(EPOLL_CTL_ADD) failed");
+        return false;
+    }
+    return true;
+}
+
+bool EventLoop::modify(int fd, uint32_t events, EventHandler* handler)
+{
+    epoll_event ev;
+    ev.events = events;
+    ev.data.ptr = handler;
+    if (epoll_ctl(m_epoll_fd, EPOLL_CTL_MOD, fd, &ev) != 0)
+    {
+        LOGE("epoll_ctl(EPOLL_CTL_MOD) failed");
+        return false;
+    }
+    return true;
+}
+
+void EventLoop::remove(int fd)
+{
+    epoll_ctl(m_epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+}
+
+void EventLoop::set_busy_poll(int max_us)
+{
+    m_busy_poll_max_us = std::max(max_us, 0);
+    m_spin_us = m_busy_poll_max_us;
+    apply_busy_poll();
+}
+
+void EventLoop::set_measure_ready(bool measure)
+{
+    m_measure_ready = measure;
+}
+
+void EventLoop::apply_busy_poll()
+{
+    if (m_epoll_fd < 0 || m_busy_poll_max_us == 0)
+    {
+        return;
+    }
+
+    epoll_params params = {};
+    params.busy_poll_usecs = m_busy_poll_max_us;
+    params.busy_poll_budget = BUSY_POLL_NAPI_BUDGET;
+    params.prefer_busy_poll = 1;
+    if (ioctl(m_epoll_fd, EPIOCSPARAMS, &params) != 0)
+    {
+        LOGI("Kernel epoll busy polling is not available, spinning in user space only");
+    }
+}
+
+int EventLoop::spin(epoll_event* events, int timeout_ms)
+{
+    uint64_t budget_us = m_spin_us;
+    if (timeout_ms >= 0)
+    {
+        budget_us = std::min<uint64_t>(budget_us, static_cast<uint64_t>(timeout_ms) * 1000);
+    }
+
+    // Called once a first look found nothing ready, so spinning only
+    // counts for events that arrive while it lasts.
+    uint64_t start_us = monotonic_us();
+    while (monotonic_us() - start_us < budget_us)
+    {
+        int rc_wait = epoll_wait(m_epoll_fd, events, MAX_EVENTS, 0);
+        if (rc_wait != 0)
+        {
+            METRIC_INC(METRIC_BUSY_POLL_HITS);
+            m_spin_us = std::min(m_spin_us * 2, m_busy_poll_max_us);
+            return rc_wait;
+        }
+    }
+
+    METRIC_INC(METRIC_BUSY_POLL_MISSES);
+    m_spin_us = std::max(m_spin_us / 2, std::min(BUSY_POLL_MIN_US, m_busy_poll_max_us));
+    return 0;
+}
+
+void EventLoop::run_once()
+{
+    epoll_event events[MAX_EVENTS];
+    int timeout = m_timers.next_timeout_ms(monotonic_ms());
+
+    // A first look without sleeping tells the events that were waiting
+    // already, and may have been ready ever since the loop last looked,
+    // from those that wake it up. A busy loop never gets further. Busy
+    // polling looks first anyway; otherwise it is one more system call
+    // per wakeup, made only while someone measures.
+    int rc_wait = 0;
+    bool looked = m_measure_ready || m_busy_poll_max_us > 0;
+    if (looked)
+    {
+        rc_wait = epoll_wait(m_epoll_fd, events, MAX_EVENTS, 0);
+    }
+    bool waiting = rc_wait > 0;
+    if (rc_wait == 0 && timeout != 0 && m_busy_poll_max_us > 0)
+    {
+        rc_wait = spin(events, timeout);
+        if (rc_wait == 0)
+        {
+            timeout = m_timers.next_timeout_ms(monotonic_ms());
+        }
+    }
+    if (rc_wait == 0 && (timeout != 0 || !looked))
+    {
+        rc_wait = epoll_wait(m_epoll_fd, events, MAX_EVENTS, timeout);
+    }
+    if (rc_wait < 0 && errno != EINTR)
+    {
+        LOGE("epoll_wait() failed");
+    }
+
+    uint64_t now_us = monotonic_us();
+    m_ready_us = waiting ? m_last_poll_us : now_us;
+    m_last_poll_us = now_us;
+
+    // Bring the wheel up to date before dispatching, so that deadlines
+    // armed by the handlers below are measured from the current time.
+    m_now_ms = now_us / 1000;
+    m_timers.advance(m_now_ms);
+
+    for (int i = 0; i < rc_wait; i++)
+    {
+        EventHandler* handler = static_cast<EventHandler*>(events[i].data.ptr);
+        handler->handle_event(events[i].events);
+    }
+}
+
+TimerWheel& EventLoop::timers()
+{
+    return m_timers;
+}
+
+uint64_t EventLoop::now_ms() const
+{
+    return m_now_ms;
+}
+
+uint64_t EventLoop::ready_us() const
+{
+    return m_ready_us;
+}
@@ -0,0 +1,76 @@
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include "timer_wheel.h"
+
+#include <cstdint>
+#include <sys/epoll.h>
+
+class EventHandler
+{
+public:
+    virtual ~EventHandler() = default;
+    virtual void handle_event(uint32_t events) = 0;
+};
+
+// Level-triggered epoll loop. The timer wheel decides how long epoll_wait()
+// may sleep, so deadlines fire on time without a periodic tick.
+//
+// In busy-poll mode the loop trades CPU for wakeup latency: before going
+// to sleep it keeps polling for a spin budget, so an event arriving within
+// it is picked up without a wakeup. The budget adapts to the load: it
+// doubles, up to the configured maximum, each time spinning catches an
+// event, and halves each time it runs out, so an idle loop soon stops
+// burning CPU. Where the kernel supports it, epoll_wait() itself also
+// busy-polls the NIC queues of the sockets it watches.
+class EventLoop
+{
+public:
+    EventLoop();
+    ~EventLoop();
+
+    bool is_valid() const;
+    // A forked worker must not share its parent's epoll instance; call
+    // this before registering anything in the child.
+    bool reopen();
+    bool add(int fd, uint32_t events, EventHandler* handler);
+    bool modify(int fd, uint32_t events, EventHandler* handler);
+    void remove(int fd);
+
+    // Enables busy polling with a spin budget of at most max_us, or
+    // disables it while zero.
+    void set_busy_poll(int max_us);
+    // Tells ready_us() apart from the wakeup time, at the cost of a look
+    // without sleeping before every wait; only for those who use it.
+    void set_measure_ready(bool measure);
+
+    // Waits for readiness, expires due timers and then dispatches events.
+    void run_once();
+
+    TimerWheel& timers();
+    uint64_t now_ms() const;
+    // When the events being dispatched became ready, in monotonic_us()
+    // time: when the loop woke up for them, or when it last looked if they
+    // were waiting already. A handler has been queued for the time since.
+    // Without set_measure_ready(), always the wakeup time.
+    uint64_t ready_us() const;
+
+private:
+    static const int MAX_EVENTS = 256;
+
+    // Polls without sleeping for at most the spin budget and at most
+    // timeout_ms; returns what epoll_wait() returned last.
+    int spin(epoll_event* events, int timeout_ms);
+    void apply_busy_poll();
+
+    int m_epoll_fd;
+    int m_busy_poll_max_us;
+    int m_spin_us;
+    bool m_measure_ready;
+    uint64_t m_now_ms;
+    uint64_t m_ready_us;
+    uint64_t m_last_poll_us;
+    TimerWheel m_timers;
+};
+
+#endif // EVENT_LOOP_H
@@ -0,0 +1,58 @@
+#include "frame_pool.h"
+#include "defs.h"
+
+#include <new>
+
+namespace
+{
+    const std::size_t CLASS_COUNT = FRAME_POOL_MAX_SIZE / FRAME_POOL_CLASS_SIZE;
+
+    struct FreeList
+    {
+        void* head = nullptr;
+        std::size_t length = 0;
+    };
+
+    FreeList free_lists[CLASS_COUNT];
+}
+
+void* FramePool::allocate(std::size_t size)
+{
+    std::size_t index = size_class(size);
+    if (index >= CLASS_COUNT)
+    {
+        return ::operator new(size);
+    }
+
+    FreeList& list = free_lists[index];
+    if (list.head == nullptr)
+    {
+        return ::operator new((index + 1) * FRAME_POOL_CLASS_SIZE);
+    }
+
+    FreeFrame* frame = static_cast<FreeFrame*>(list.head);
+    list.head = frame->next;
+    list.length--;
+    return frame;
+}
+
+void FramePool::release(void* frame, std::size_t size)
+{
+    std::size_t index = size_class(size);
+    if (index >= CLASS_COUNT || free_lists[index].length >= FRAME_POOL_MAX_FREE)
+    {
+        ::operator delete(frame);
+        return;
+    }
+
+    FreeList& list = free_lists[index];
+    FreeFrame* free_frame = static_cast<FreeFrame*>(frame);
+    free_frame->next = static_cast<FreeFrame*>(list.head);
+    list.head = free_frame;
+    list.length++;
+}
+
+std::size_t FramePool::size_class(std::size_t size)
+{
+    return (size + FRAME_POOL_CLASS_SIZE - 1) / FRAME_POOL_CLASS_SIZE - 1;
+}
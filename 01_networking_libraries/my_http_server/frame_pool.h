@@ -0,0 +1,26 @@
+#ifndef FRAME_POOL_H
+#define FRAME_POOL_H
+
+#include <cstddef>
+
+// Recycles coroutine frames. Frames are kept on free lists by size class,
+// FRAME_POOL_CLASS_SIZE bytes apart, so a handler that runs on every
+// request allocates its frames from the system only until the pool has
+// warmed up. Larger frames go straight to operator new. Every process runs
+// one event loop on one thread, so the lists need no locking.
+class FramePool
+{
+public:
+    static void* allocate(std::size_t size);
+    static void release(void* frame, std::size_t size);
+
+private:
+    struct FreeFrame
+    {
+        FreeFrame* next;
+    };
+
+    static std::size_t size_class(std::size_t size);
+};
+
+#endif // FRAME_POOL_H
@@ -0,0 +1,466 @@
+#include "handler_context.h"
+#include "chunked_decoder.h"
+#include "defs.h"
+#include "http_parser.h"
+#include "logging.h"
+#include "metrics.h"
+#include "offload_pool.h"
+#include "upstream_pool.h"
+#include "work_stealing_scheduler.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <fcntl.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <unordered_map>
+
+namespace
+{
+    // Closes the file also when the reading coroutine is cancelled.
+    struct FileCloser
+    {
+        int fd;
+
+        ~FileCloser()
+        {
+            if (fd >= 0)
+            {
+                close(fd);
+            }
+        }
+    };
+}
+
+HandlerContext::Sleep::Sleep(EventLoop& loop, int delay_ms)
+    : m_loop(loop),
+      m_delay_ms(delay_ms),
+      m_timer(this)
+{
+
+}
+
+HandlerContext::Sleep::~Sleep()
+{
+    m_loop.timers().cancel(&m_timer);
+}
+
+bool HandlerContext::Sleep::await_ready()
+{
+    return false;
+}
+
+void HandlerContext::Sleep::await_suspend(std::coroutine_handle<> waiter)
+{
+    m_waiter = waiter;
+    m_loop.timers().schedule(&m_timer, m_delay_ms > 0 ? m_delay_ms : 0);
+}
+
+void HandlerContext::Sleep::await_resume()
+{
+
+}
+
+void HandlerContext::Sleep::handle_timeout(TimerNode*)
+{
+    m_waiter.resume();
+}
+
+HandlerContext::Fetch::Fetch(EventLoop& loop, UpstreamPool* upstreams, const HTTPRequest& request)
+    : m_loop(loop),
+      m_upstreams(upstreams),
+      m_request(request),
+      m_source(nullptr),
+      m_too_large(false),
+      m_timer(this)
+{
+    // The whole response is wanted, so it must not come back unframed.
+    m_request.m_version = "HTTP/1.1";
+}
+
+HandlerContext::Fetch::~Fetch()
+{
+    if (m_source != nullptr)
+    {
+        m_source->detach();
+    }
+    m_loop.timers().cancel(&m_timer);
+}
+
+bool HandlerContext::Fetch::await_ready()
+{
+    return false;
+}
+
+bool HandlerContext::Fetch::await_suspend(std::coroutine_handle<> waiter)
+{
+    m_waiter = waiter;
+    UpstreamGroup* group = (m_upstreams != nullptr) ? m_upstreams->match(m_request.m_path) : nullptr;
+    if (group == nullptr)
+    {
+        LOGE("No proxy route for " + m_request.m_path);
+        fail(HTTP_502);
+        return false;
+    }
+
+    m_source = m_upstreams->forward(*group, m_request, true, this);
+    if (m_source == nullptr)
+    {
+        fail(HTTP_502);
+        return false;
+    }
+    return true;
+}
+
+HTTPResponse HandlerContext::Fetch::await_resume()
+{
+    return std::move(m_response);
+}
+
+bool HandlerContext::Fetch::upstream_data(const std::string& data)
+{
+    // The rest of a response that is too large is dropped rather than
+    // paused, so the upstream connection still completes cleanly.
+    if (m_received.length() + data.length() > MAX_HEADER_SIZE + MAX_BODY_SIZE)
+    {
+        m_too_large = true;
+        m_received.clear();
+    }
+    if (!m_too_large)
+    {
+        m_received.append(data);
+    }
+    return true;
+}
+
+void HandlerContext::Fetch::upstream_complete(bool)
+{
+    m_source = nullptr;
+    if (m_too_large)
+    {
+        LOGE("Upstream response is too large for a handler");
+        fail(HTTP_502);
+    }
+    else
+    {
+        parse();
+    }
+
+    // Resumed from the loop: the connection that called us must be done
+    // with the response before the handler can destroy this call.
+    m_loop.timers().schedule(&m_timer, 0);
+}
+
+void HandlerContext::Fetch::upstream_failed(int status)
+{
+    m_source = nullptr;
+    fail(status);
+    m_loop.timers().schedule(&m_timer, 0);
+}
+
+void HandlerContext::Fetch::handle_timeout(TimerNode*)
+{
+    m_waiter.resume();
+}
+
+void HandlerContext::Fetch::fail(int status)
+{
+    m_response = HTTPResponse(status, status == HTTP_504 ? "504 Gateway Timeout" : "502 Bad Gateway");
+}
+
+void HandlerContext::Fetch::parse()
+{
+    std::size_t header_length = HTTPParser::find_header_end(m_received);
+    std::size_t status_start = m_received.find(' ');
+    if (header_length == std::string::npos || status_start == std::string::npos)
+    {
+        LOGE("Upstream response is malformed");
+        fail(HTTP_502);
+        return;
+    }
+
+    std::string head = m_received.substr(0, header_length);
+    std::string body;
+    if (HTTPParser::is_chunked(head))
+    {
+        ChunkedDecoder decoder;
+        decoder.feed(m_received.data() + header_length, m_received.length() - header_length, &body);
+        if (!decoder.is_done())
+        {
+            LOGE("Upstream response is truncated");
+            fail(HTTP_502);
+            return;
+        }
+    }
+    else
+    {
+        body = m_received.substr(header_length);
+    }
+
+    m_response = HTTPResponse(std::atoi(m_received.c_str() + status_start + 1));
+    std::size_t line_start = head.find("\r\n") + 2;
+    while (line_start < header_length - 2)
+    {
+        std::size_t line_end = head.find("\r\n", line_start);
+        std::size_t colon = head.find(':', line_start);
+        if (colon != std::string::npos && colon < line_end)
+        {
+            std::string key = head.substr(line_start, colon - line_start);
+            std::size_t value_start = head.find_first_not_of(" \t", colon + 1);
+            std::string value = (value_start < line_end) ? head.substr(value_start, line_end - value_start) : std::string();
+            // The framing is the handler's own connection's business.
+            if (strcasecmp(key.c_str(), "Connection") != 0 &&
+                strcasecmp(key.c_str(), "Transfer-Encoding") != 0 &&
+                strcasecmp(key.c_str(), "Content-Length") != 0)
+            {
+                m_response.set_header(key, value);
+            }
+        }
+        line_start = line_end + 2;
+    }
+    m_response.set_body(body);
+}
+
+struct HandlerContext::SharedOffload::Job : OffloadJob
+{
+    Job(const std::string& key, Work work)
+        : key(key),
+          work(std::move(work))
+    {
+
+    }
+
+    ~Job()
+    {
+        // Freed without completing, with its executor
+        unregister();
+        for (SharedOffload* waiter : waiters)
+        {
+            waiter->m_job = nullptr;
+            if (waiter->m_joined)
+            {
+                METRIC_DEC(METRIC_OFFLOAD_COALESCED_WAITING);
+            }
+        }
+    }
+
+    // The jobs in flight on this thread's loop, by key
+    static std::unordered_map<std::string, Job*>& in_flight()
+    {
+        static thread_local std::unordered_map<std::string, Job*> jobs;
+        return jobs;
+    }
+
+    void unregister()
+    {
+        auto it = in_flight().find(key);
+        if (it != in_flight().end() && it->second == this)
+        {
+            in_flight().erase(it);
+        }
+    }
+
+    void run() override
+    {
+        try
+        {
+            result = work();
+        }
+        catch (...)
+        {
+            exception = std::current_exception();
+        }
+    }
+
+    void complete() override
+    {
+        unregister();
+        // A resumed handler may cancel another waiter, which then takes
+        // itself off the list.
+        while (!waiters.empty())
+        {
+            SharedOffload* waiter = waiters.front();
+            waiters.erase(waiters.begin());
+            waiter->m_job = nullptr;
+            if (waiter->m_joined)
+            {
+                METRIC_DEC(METRIC_OFFLOAD_COALESCED_WAITING);
+            }
+            waiter->m_response = result.duplicate();
+            waiter->m_exception = exception;
+            waiter->m_done = true;
+            waiter->m_waiter.resume();
+        }
+    }
+
+    std::string key;
+    Work work;
+    HTTPResponse result;
+    std::exception_ptr exception;
+    std::vector<SharedOffload*> waiters;
+};
+
+HandlerContext::SharedOffload::SharedOffload(JobExecutor* executor, const std::string& key, Work work)
+    : m_executor(executor),
+      m_key(key),
+      m_work(std::move(work)),
+      m_job(nullptr),
+      m_joined(false),
+      m_done(false)
+{
+
+}
+
+HandlerContext::SharedOffload::~SharedOffload()
+{
+    leave();
+}
+
+bool HandlerContext::SharedOffload::await_ready()
+{
+    return m_executor == nullptr;
+}
+
+bool HandlerContext::SharedOffload::await_suspend(std::coroutine_handle<> waiter)
+{
+    m_waiter = waiter;
+    auto it = Job::in_flight().find(m_key);
+    if (it != Job::in_flight().end())
+    {
+        m_job = it->second;
+        m_job->waiters.push_back(this);
+        m_joined = true;
+        METRIC_INC(METRIC_OFFLOAD_COALESCED);
+        METRIC_INC(METRIC_OFFLOAD_COALESCED_WAITING);
+        return true;
+    }
+
+    Job* job = new Job(m_key, std::move(m_work));
+    std::unique_ptr<OffloadJob> submitted(job);
+    if (!m_executor->submit(submitted))
+    {
+        // The executor is full: the work is done here.
+        job->run();
+        m_response = std::move(job->result);
+        m_exception = job->exception;
+        m_done = true;
+        return false;
+    }
+    job->waiters.push_back(this);
+    Job::in_flight()[m_key] = job;
+    m_job = job;
+    return true;
+}
+
+HTTPResponse HandlerContext::SharedOffload::await_resume()
+{
+    // Without an executor
+    if (!m_done)
+    {
+        m_response = m_work();
+    }
+    if (m_exception)
+    {
+        std::rethrow_exception(m_exception);
+    }
+    return std::move(m_response);
+}
+
+void HandlerContext::SharedOffload::leave()
+{
+    if (m_job == nullptr)
+    {
+        return;
+    }
+
+    Job* job = m_job;
+    m_job = nullptr;
+    job->waiters.erase(std::find(job->waiters.begin(), job->waiters.end(), this));
+    if (m_joined)
+    {
+        METRIC_DEC(METRIC_OFFLOAD_COALESCED_WAITING);
+    }
+    // Nobody wants the result any more.
+    if (job->waiters.empty())
+    {
+        job->unregister();
+        m_executor->cancel(job);
+    }
+}
+
+HandlerContext::HandlerContext(const HandlerServices& services, uint64_t affinity)
+    : m_services(services),
+      m_affinity(affinity)
+{
+
+}
+
+EventLoop& HandlerContext::get_loop() const
+{
+    return m_services.loop;
+}
+
+HandlerContext::Sleep HandlerContext::sleep(int delay_ms)
+{
+    return Sleep(m_services.loop, delay_ms);
+}
+
+HandlerContext::Sleep HandlerContext::yield()
+{
+    return Sleep(m_services.loop, 0);
+}
+
+HandlerContext::Fetch HandlerContext::fetch(const HTTPRequest& request)
+{
+    return Fetch(m_services.loop, m_services.upstreams, request);
+}
+
+HandlerContext::SharedOffload HandlerContext::offload_shared(const std::string& key, SharedOffload::Work work)
+{
+    return SharedOffload(offload_executor(), key, std::move(work));
+}
+
+JobExecutor* HandlerContext::offload_executor() const
+{
+    return m_services.offload;
+}
+
+JobExecutor* HandlerContext::compute_executor() const
+{
+    return m_services.scheduler;
+}
+
+Task<bool> HandlerContext::read_file(std::string path, std::string& contents)
+{
+    FileCloser file = {open(path.c_str(), O_RDONLY | O_CLOEXEC)};
+    struct stat file_stat;
+    if (file.fd < 0 || fstat(file.fd, &file_stat) != 0)
+    {
+        LOGE("Error reading the file");
+        co_return false;
+    }
+
+    contents.resize(file_stat.st_size);
+    std::size_t done = 0;
+    bool ok = true;
+    while (done < contents.length())
+    {
+        if (done > 0)
+        {
+            co_await yield();
+        }
+        std::size_t length = std::min<std::size_t>(contents.length() - done, FILE_READ_CHUNK);
+        ssize_t bytes = pread(file.fd, &contents[done], length, done);
+        if (bytes <= 0)
+        {
+            ok = (bytes == 0);
+            break;
+        }
+        done += bytes;
+    }
+
+    // A file that shrank while it was read is returned as it was found.
+    contents.resize(done);
+    co_return ok;
+}
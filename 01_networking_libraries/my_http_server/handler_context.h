@@ -0,0 +1,310 @@
+#ifndef HANDLER_CONTEXT_H
+#define HANDLER_CONTEXT_H
+
+#include "event_loop.h"
+#include "http_request.h"
+#include "http_response.h"
+#include "offload_job.h"
+#include "task.h"
+#include "timer_wheel.h"
+#include "upstream_connection.h"
+
+#include <coroutine>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+class HandlerContext;
+class OffloadPool;
+class UpstreamPool;
+class WorkStealingScheduler;
+
+// A request handler written as a coroutine. It may co_await the context's
+// timers, upstream calls and file reads, an AsyncSocket, or other tasks,
+// and co_returns the response.
+using CoroutineHandler = std::function<Task<HTTPResponse>(HandlerContext& context, const HTTPRequest& request)>;
+
+struct HandlerRoute
+{
+    std::string prefix;
+    CoroutineHandler handler;
+};
+
+// What the loop a handler runs on offers it. Any but the loop may be null.
+struct HandlerServices
+{
+    EventLoop& loop;
+    UpstreamPool* upstreams;
+    OffloadPool* offload;
+    WorkStealingScheduler* scheduler;
+};
+
+// What a coroutine handler awaits, besides its own sockets. Every awaiter
+// suspends the handler until the event loop resumes it, on the loop's own
+// thread, and undoes its registration when a cancelled handler destroys it.
+class HandlerContext
+{
+public:
+    // Resumes the handler after a delay; with no delay, on the next loop
+    // iteration, after the events that are already waiting.
+    class Sleep : public TimerHandler
+    {
+    public:
+        Sleep(EventLoop& loop, int delay_ms);
+        ~Sleep();
+
+        Sleep(const Sleep&) = delete;
+        Sleep& operator=(const Sleep&) = delete;
+
+        bool await_ready();
+        void await_suspend(std::coroutine_handle<> waiter);
+        void await_resume();
+
+        void handle_timeout(TimerNode* timer) override;
+
+    private:
+        EventLoop& m_loop;
+        int m_delay_ms;
+        TimerNode m_timer;
+        std::coroutine_handle<> m_waiter;
+    };
+
+    // Sends a request through the upstream pool, as a proxy route would,
+    // and resumes the handler with the whole response. A response that
+    // cannot be had, or is larger than MAX_HEADER_SIZE plus MAX_BODY_SIZE,
+    // is a 502 or 504 of its own.
+    class Fetch : public UpstreamClient, public TimerHandler
+    {
+    public:
+        Fetch(EventLoop& loop, UpstreamPool* upstreams, const HTTPRequest& request);
+        ~Fetch();
+
+        Fetch(const Fetch&) = delete;
+        Fetch& operator=(const Fetch&) = delete;
+
+        bool await_ready();
+        bool await_suspend(std::coroutine_handle<> waiter);
+        HTTPResponse await_resume();
+
+        bool upstream_data(const std::string& data) override;
+        void upstream_complete(bool close_client) override;
+        void upstream_failed(int status) override;
+        void handle_timeout(TimerNode* timer) override;
+
+    private:
+        void fail(int status);
+        void parse();
+
+    private:
+        EventLoop& m_loop;
+        UpstreamPool* m_upstreams;
+        HTTPRequest m_request;
+        UpstreamSource* m_source;
+        std::string m_received;
+        bool m_too_large;
+        HTTPResponse m_response;
+        TimerNode m_timer;
+        std::coroutine_handle<> m_waiter;
+    };
+
+    // Runs work, a callable returning the result, on an executor and
+    // resumes the handler with what it returned or threw. Without an
+    // executor, or while it is full, work runs right away instead. work must
+    // own everything it uses: a cancelled handler does not wait for it.
+    // Pass a named callable rather than a lambda written inside the
+    // co_await: GCC 12 destroys the captures of such a temporary twice.
+    template <typename Work>
+    class Offload
+    {
+    public:
+        using Result = std::invoke_result_t<Work&>;
+
+        Offload(JobExecutor* executor, uint64_t affinity, Work work)
+            : m_executor(executor),
+              m_job(new Job(std::move(work), this)),
+              m_submitted(nullptr)
+        {
+            m_job->set_affinity(affinity);
+        }
+
+        ~Offload()
+        {
+            if (m_submitted != nullptr)
+            {
+                m_executor->cancel(m_submitted);
+            }
+        }
+
+        Offload(const Offload&) = delete;
+        Offload& operator=(const Offload&) = delete;
+
+        bool await_ready()
+        {
+            return m_executor == nullptr;
+        }
+
+        bool await_suspend(std::coroutine_handle<> waiter)
+        {
+            m_waiter = waiter;
+            Job* job = m_job.get();
+            std::unique_ptr<OffloadJob> submitted(std::move(m_job));
+            if (m_executor->submit(submitted))
+            {
+                m_submitted = job;
+                return true;
+            }
+            m_job.reset(static_cast<Job*>(submitted.release()));
+            return false;
+        }
+
+        Result await_resume()
+        {
+            // Not submitted: the work is done here.
+            if (m_job != nullptr)
+            {
+                m_job->run();
+                m_job->deliver();
+            }
+            if (m_exception)
+            {
+                std::rethrow_exception(m_exception);
+            }
+            return std::move(*m_result);
+        }
+
+    private:
+        struct Job : OffloadJob
+        {
+            Job(Work work, Offload* owner)
+                : work(std::move(work)),
+                  owner(owner)
+            {
+
+            }
+
+            void run() override
+            {
+                try
+                {
+                    result.emplace(work());
+                }
+                catch (...)
+                {
+                    exception = std::current_exception();
+                }
+            }
+
+            void deliver()
+            {
+                owner->m_result = std::move(result);
+                owner->m_exception = exception;
+            }
+
+            void complete() override
+            {
+                // The executor frees the job once the handler has moved on.
+                Offload* awaiter = owner;
+                awaiter->m_submitted = nullptr;
+                deliver();
+                awaiter->m_waiter.resume();
+            }
+
+            Work work;
+            Offload* owner;
+            std::optional<Result> result;
+            std::exception_ptr exception;
+        };
+
+        JobExecutor* m_executor;
+        std::unique_ptr<Job> m_job;
+        OffloadJob* m_submitted;
+        std::coroutine_handle<> m_waiter;
+        std::optional<Result> m_result;
+        std::exception_ptr m_exception;
+    };
+
+    // Runs work on an executor as Offload does, for a response that several
+    // handlers may want at once: a handler whose key is being worked on
+    // already, by a job on the same loop, waits for that job instead of
+    // queuing its own, and every waiter gets a copy of the response. The
+    // job runs on as long as any of them waits.
+    class SharedOffload
+    {
+    public:
+        using Work = std::function<HTTPResponse()>;
+
+        SharedOffload(JobExecutor* executor, const std::string& key, Work work);
+        ~SharedOffload();
+
+        SharedOffload(const SharedOffload&) = delete;
+        SharedOffload& operator=(const SharedOffload&) = delete;
+
+        bool await_ready();
+        bool await_suspend(std::coroutine_handle<> waiter);
+        HTTPResponse await_resume();
+
+    private:
+        struct Job;
+
+        void leave();
+
+    private:
+        JobExecutor* m_executor;
+        std::string m_key;
+        Work m_work;
+        // The job waited for, until it completes
+        Job* m_job;
+        bool m_joined;
+        bool m_done;
+        std::coroutine_handle<> m_waiter;
+        HTTPResponse m_response;
+        std::exception_ptr m_exception;
+    };
+
+    // affinity keeps the compute() work of one client on one thread.
+    explicit HandlerContext(const HandlerServices& services, uint64_t affinity = 0);
+
+    EventLoop& get_loop() const;
+
+    Sleep sleep(int delay_ms);
+    // Lets the events that are waiting run before the handler continues.
+    Sleep yield();
+    // request.m_path selects the proxy route, as it would for a client.
+    Fetch fetch(const HTTPRequest& request);
+    // Reads a whole file into contents, yielding to the loop between
+    // chunks of FILE_READ_CHUNK bytes so a large file does not hold up the
+    // other connections. Returns false if it cannot be read.
+    Task<bool> read_file(std::string path, std::string& contents);
+
+    // Blocking calls go to the offload pool,
+    template <typename Work>
+    Offload<Work> offload(Work work)
+    {
+        return Offload<Work>(offload_executor(), m_affinity, std::move(work));
+    }
+
+    // and CPU-heavy work to the work-stealing scheduler.
+    template <typename Work>
+    Offload<Work> compute(Work work)
+    {
+        return Offload<Work>(compute_executor(), m_affinity, std::move(work));
+    }
+
+    // Blocking calls that other handlers may make at the same time, such as
+    // looking up the same file, are shared by key.
+    SharedOffload offload_shared(const std::string& key, SharedOffload::Work work);
+
+private:
+    JobExecutor* offload_executor() const;
+    JobExecutor* compute_executor() const;
+
+private:
+    HandlerServices m_services;
+    uint64_t m_affinity;
+};
+
+#endif // HANDLER_CONTEXT_H
@@ -0,0 +1,85 @@
+#include "handler_task.h"
+#include "defs.h"
+#include "logging.h"
+#include "metrics.h"
+
+#include <exception>
+
+HandlerTask::HandlerTask(const HandlerServices& services, uint64_t affinity, const HandlerRoute& route, const HTTPRequest& request, HandlerClient* client)
+    : m_loop(services.loop),
+      m_route(route),
+      m_request(request),
+      m_context(services, affinity),
+      m_client(client),
+      m_timer(this)
+{
+
+}
+
+HandlerTask::~HandlerTask()
+{
+    m_loop.timers().cancel(&m_timer);
+}
+
+void HandlerTask::start()
+{
+    METRIC_INC(METRIC_COROUTINE_HANDLERS);
+    m_task = m_route.handler(m_context, m_request);
+    m_loop.timers().schedule(&m_timer, COROUTINE_HANDLER_TIMEOUT_MS);
+    m_task.start(this);
+}
+
+void HandlerTask::resume()
+{
+    // The whole response is delivered at once; there is no flow to resume.
+}
+
+void HandlerTask::detach()
+{
+    m_client = nullptr;
+    m_loop.timers().cancel(&m_timer);
+    m_task = Task<HTTPResponse>();
+}
+
+void HandlerTask::task_done()
+{
+    // Called from the coroutine's final suspension, which may be deep in
+    // the handler's own resumption.
+    m_loop.timers().schedule(&m_timer, 0);
+}
+
+void HandlerTask::handle_timeout(TimerNode*)
+{
+    HTTPResponse response;
+    if (!m_task.is_done())
+    {
+        LOGE("Coroutine handler for " + m_route.prefix + " is taking too long");
+        m_task = Task<HTTPResponse>();
+        response = HTTPResponse(HTTP_504, "504 Gateway Timeout");
+    }
+    else
+    {
+        try
+        {
+            response = m_task.take_result();
+        }
+        catch (const std::exception& e)
+        {
+            LOGE(std::string("Coroutine handler failed: ") + e.what());
+            response = HTTPResponse(HTTP_500, "500 Internal Server Error");
+        }
+        catch (...)
+        {
+            LOGE("Coroutine handler failed");
+            response = HTTPResponse(HTTP_500, "500 Internal Server Error");
+        }
+    }
+
+    // Last: the client may destroy this task.
+    HandlerClient* client = m_client;
+    m_client = nullptr;
+    if (client != nullptr)
+    {
+        client->handler_complete(m_request, response);
+    }
+}
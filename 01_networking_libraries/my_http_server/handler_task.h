@@ -0,0 +1,53 @@
+#ifndef HANDLER_TASK_H
+#define HANDLER_TASK_H
+
+#include "event_loop.h"
+#include "handler_context.h"
+#include "http_request.h"
+#include "http_response.h"
+#include "task.h"
+#include "timer_wheel.h"
+#include "upstream_connection.h"
+
+class HandlerClient
+{
+public:
+    virtual ~HandlerClient() = default;
+    // The handler's response. The task is done with it and touches nothing
+    // after the call, so the client may destroy it from here.
+    virtual void handler_complete(const HTTPRequest& request, HTTPResponse& response) = 0;
+};
+
+// Runs a coroutine handler for one request. The handler runs right away up
+// to its first suspension, and from then on whenever the event loop resumes
+// it; its response is delivered to the client from the loop, never from
+// inside the handler's own call stack. A handler that throws is answered
+// with 500, and one still running after COROUTINE_HANDLER_TIMEOUT_MS is
+// cancelled and answered with 504. The client holds the task as the source
+// of its response, like a proxied one, so a client that goes away cancels
+// the handler by detaching it.
+class HandlerTask : public UpstreamSource, public TimerHandler, public TaskObserver
+{
+public:
+    HandlerTask(const HandlerServices& services, uint64_t affinity, const HandlerRoute& route, const HTTPRequest& request, HandlerClient* client);
+    ~HandlerTask();
+
+    void start();
+
+    void resume() override;
+    void detach() override;
+    void task_done() override;
+    void handle_timeout(TimerNode* timer) override;
+
+private:
+    EventLoop& m_loop;
+    const HandlerRoute& m_route;
+    HTTPRequest m_request;
+    HandlerContext m_context;
+    HandlerClient* m_client;
+    TimerNode m_timer;
+    // Last, so the coroutine is destroyed before what it refers to.
+    Task<HTTPResponse> m_task;
+};
+
+#endif // HANDLER_TASK_H
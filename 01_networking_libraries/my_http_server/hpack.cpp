@@ -0,0 +1,594 @@
+#include "hpack.h"
+
+#include <cstring>
+
+namespace
+{
+    const HeaderField STATIC_TABLE[] = {
+        {":authority", ""},
+        {":method", "GET"},
+        {":method", "POST"},
+        {":path", "/"},
+        {":path", "/index.html"},
+        {":scheme", "http"},
+        {":scheme", "https"},
+        {":status", "200"},
+        {":status", "204"},
+        {":status", "206"},
+        {":status", "304"},
+        {":status", "400"},
+        {":status", "404"},
+        {":status", "500"},
+        {"accept-charset", ""},
+        {"accept-encoding", "gzip, deflate"},
+        {"accept-language", ""},
+        {"accept-ranges", ""},
+        {"accept", ""},
+        {"access-control-allow-origin", ""},
+        {"age", ""},
+        {"allow", ""},
+        {"authorization", ""},
+        {"cache-control", ""},
+        {"content-disposition", ""},
+        {"content-encoding", ""},
+        {"content-language", ""},
+        {"content-length", ""},
+        {"content-location", ""},
+        {"content-range", ""},
+        {"content-type", ""},
+        {"cookie", ""},
+        {"date", ""},
+        {"etag", ""},
+        {"expect", ""},
+        {"expires", ""},
+        {"from", ""},
+        {"host", ""},
+        {"if-match", ""},
+        {"if-modified-since", ""},
+        {"if-none-match", ""},
+        {"if-range", ""},
+        {"if-unmodified-since", ""},
+        {"last-modified", ""},
+        {"link", ""},
+        {"location", ""},
+        {"max-forwards", ""},
+        {"proxy-authenticate", ""},
+        {"proxy-authorization", ""},
+        {"range", ""},
+        {"referer", ""},
+        {"refresh", ""},
+        {"retry-after", ""},
+        {"server", ""},
+        {"set-cookie", ""},
+        {"strict-transport-security", ""},
+        {"transfer-encoding", ""},
+        {"user-agent", ""},
+        {"vary", ""},
+        {"via", ""},
+        {"www-authenticate", ""},
+    };
+    const std::size_t STATIC_TABLE_SIZE = sizeof(STATIC_TABLE) / sizeof(STATIC_TABLE[0]);
+    const std::size_t ENTRY_OVERHEAD = 32;
+
+    struct HuffmanCode
+    {
+        uint32_t code;
+        uint8_t bits;
+    };
+
+    // RFC 7541 Appendix B, indexed by symbol; 256 is EOS.
+    const HuffmanCode HUFFMAN_CODES[257] = {
+        {0x1ff8, 13}, {0x7fffd8, 23}, {0xfffffe2, 28}, {0xfffffe3, 28},
+        {0xfffffe4, 28}, {0xfffffe5, 28}, {0xfffffe6, 28}, {0xfffffe7, 28},
+        {0xfffffe8, 28}, {0xffffea, 24}, {0x3ffffffc, 30}, {0xfffffe9, 28},
+        {0xfffffea, 28}, {0x3ffffffd, 30}, {0xfffffeb, 28}, {0xfffffec, 28},
+        {0xfffffed, 28}, {0xfffffee, 28}, {0xfffffef, 28}, {0xffffff0, 28},
+        {0xffffff1, 28}, {0xffffff2, 28}, {0x3ffffffe, 30}, {0xffffff3, 28},
+        {0xffffff4, 28}, {0xffffff5, 28}, {0xffffff6, 28}, {0xffffff7, 28},
+        {0xffffff8, 28}, {0xffffff9, 28}, {0xffffffa, 28}, {0xffffffb, 28},
+        {0x14, 6}, {0x3f8, 10}, {0x3f9, 10}, {0xffa, 12},
+        {0x1ff9, 13}, {0x15, 6}, {0xf8, 8}, {0x7fa, 11},
+        {0x3fa, 10}, {0x3fb, 10}, {0xf9, 8}, {0x7fb, 11},
+        {0xfa, 8}, {0x16, 6}, {0x17, 6}, {0x18, 6},
+        {0x0, 5}, {0x1, 5}, {0x2, 5}, {0x19, 6},
+        {0x1a, 6}, {0x1b, 6}, {0x1c, 6}, {0x1d, 6},
+        {0x1e, 6}, {0x1f, 6}, {0x5c, 7}, {0xfb, 8},
+        {0x7ffc, 15}, {0x20, 6}, {0xffb, 12}, {0x3fc, 10},
+        {0x1ffa, 13}, {0x21, 6}, {0x5d, 7}, {0x5e, 7},
+        {0x5f, 7}, {0x60, 7}, {0x61, 7}, {0x62, 7},
+        {0x63, 7}, {0x64, 7}, {0x65, 7}, {0x66, 7},
+        {0x67, 7}, {0x68, 7}, {0x69, 7}, {0x6a, 7},
+        {0x6b, 7}, {0x6c, 7}, {0x6d, 7}, {0x6e, 7},
+        {0x6f, 7}, {0x70, 7}, {0x71, 7}, {0x72, 7},
+        {0xfc, 8}, {0x73, 7}, {0xfd, 8}, {0x1ffb, 13},
+        {0x7fff0, 19}, {0x1ffc, 13}, {0x3ffc, 14}, {0x22, 6},
+        {0x7ffd, 15}, {0x3, 5}, {0x23, 6}, {0x4, 5},
+        {0x24, 6}, {0x5, 5}, {0x25, 6}, {0x26, 6},
+        {0x27, 6}, {0x6, 5}, {0x74, 7}, {0x75, 7},
+        {0x28, 6}, {0x29, 6}, {0x2a, 6}, {0x7, 5},
+        {0x2b, 6}, {0x76, 7}, {0x2c, 6}, {0x8, 5},
+        {0x9, 5}, {0x2d, 6}, {0x77, 7}, {0x78, 7},
+        {0x79, 7}, {0x7a, 7}, {0x7b, 7}, {0x7ffe, 15},
+        {0x7fc, 11}, {0x3ffd, 14}, {0x1ffd, 13}, {0xffffffc, 28},
+        {0xfffe6, 20}, {0x3fffd2, 22}, {0xfffe7, 20}, {0xfffe8, 20},
+        {0x3fffd3, 22}, {0x3fffd4, 22}, {0x3fffd5, 22}, {0x7fffd9, 23},
+        {0x3fffd6, 22}, {0x7fffda, 23}, {0x7fffdb, 23}, {0x7fffdc, 23},
+        {0x7fffdd, 23}, {0x7fffde, 23}, {0xffffeb, 24}, {0x7fffdf, 23},
+        {0xffffec, 24}, {0xffffed, 24}, {0x3fffd7, 22}, {0x7fffe0, 23},
+        {0xffffee, 24}, {0x7fffe1, 23}, {0x7fffe2, 23}, {0x7fffe3, 23},
+        {0x7fffe4, 23}, {0x1fffdc, 21}, {0x3fffd8, 22}, {0x7fffe5, 23},
+        {0x3fffd9, 22}, {0x7fffe6, 23}, {0x7fffe7, 23}, {0xffffef, 24},
+        {0x3fffda, 22}, {0x1fffdd, 21}, {0xfffe9, 20}, {0x3fffdb, 22},
+        {0x3fffdc, 22}, {0x7fffe8, 23}, {0x7fffe9, 23}, {0x1fffde, 21},
+        {0x7fffea, 23}, {0x3fffdd, 22}, {0x3fffde, 22}, {0xfffff0, 24},
+        {0x1fffdf, 21}, {0x3fffdf, 22}, {0x7fffeb, 23}, {0x7fffec, 23},
+        {0x1fffe0, 21}, {0x1fffe1, 21}, {0x3fffe0, 22}, {0x1fffe2, 21},
+        {0x7fffed, 23}, {0x3fffe1, 22}, {0x7fffee, 23}, {0x7fffef, 23},
+        {0xfffea, 20}, {0x3fffe2, 22}, {0x3fffe3, 22}, {0x3fffe4, 22},
+        {0x7ffff0, 23}, {0x3fffe5, 22}, {0x3fffe6, 22}, {0x7ffff1, 23},
+        {0x3ffffe0, 26}, {0x3ffffe1, 26}, {0xfffeb, 20}, {0x7fff1, 19},
+        {0x3fffe7, 22}, {0x7ffff2, 23}, {0x3fffe8, 22}, {0x1ffffec, 25},
+        {0x3ffffe2, 26}, {0x3ffffe3, 26}, {0x3ffffe4, 26}, {0x7ffffde, 27},
+        {0x7ffffdf, 27}, {0x3ffffe5, 26}, {0xfffff1, 24}, {0x1ffffed, 25},
+        {0x7fff2, 19}, {0x1fffe3, 21}, {0x3ffffe6, 26}, {0x7ffffe0, 27},
+        {0x7ffffe1, 27}, {0x3ffffe7, 26}, {0x7ffffe2, 27}, {0xfffff2, 24},
+        {0x1fffe4, 21}, {0x1fffe5, 21}, {0x3ffffe8, 26}, {0x3ffffe9, 26},
+        {0xffffffd, 28}, {0x7ffffe3, 27}, {0x7ffffe4, 27}, {0x7ffffe5, 27},
+        {0xfffec, 20}, {0xfffff3, 24}, {0xfffed, 20}, {0x1fffe6, 21},
+        {0x3fffe9, 22}, {0x1fffe7, 21}, {0x1fffe8, 21}, {0x7ffff3, 23},
+        {0x3fffea, 22}, {0x3fffeb, 22}, {0x1ffffee, 25}, {0x1ffffef, 25},
+        {0xfffff4, 24}, {0xfffff5, 24}, {0x3ffffea, 26}, {0x7ffff4, 23},
+        {0x3ffffeb, 26}, {0x7ffffe6, 27}, {0x3ffffec, 26}, {0x3ffffed, 26},
+        {0x7ffffe7, 27}, {0x7ffffe8, 27}, {0x7ffffe9, 27}, {0x7ffffea, 27},
+        {0x7ffffeb, 27}, {0xffffffe, 28}, {0x7ffffec, 27}, {0x7ffffed, 27},
+        {0x7ffffee, 27}, {0x7ffffef, 27}, {0x7fffff0, 27}, {0x3ffffee, 26},
+        {0x3fffffff, 30},
+    };
+
+    // The code is canonical, so decoding only needs, per code length, the
+    // first code of that length and where its symbols start.
+    struct HuffmanDecodeTable
+    {
+        uint32_t first_code[32];
+        uint16_t first_symbol[32];
+        uint16_t count[32];
+        uint16_t symbols[257];
+
+        HuffmanDecodeTable()
+        {
+            std::memset(this, 0, sizeof(*this));
+            std::size_t n = 0;
+            for (int bits = 1; bits < 32; bits++)
+            {
+                first_symbol[bits] = n;
+                for (int symbol = 0; symbol < 257; symbol++)
+                {
+                    if (HUFFMAN_CODES[symbol].bits == bits)
+                    {
+                        if (count[bits] == 0)
+                        {
+                            first_code[bits] = HUFFMAN_CODES[symbol].code;
+                        }
+                        count[bits]++;
+                        symbols[n++] = symbol;
+                    }
+                }
+            }
+        }
+    };
+
+    const HuffmanDecodeTable& huffman_decode_table()
+    {
+        static const HuffmanDecodeTable table;
+        return table;
+    }
+
+    // Responses carry values that change on every response; indexing them
+    // would only churn the peer's table.
+    bool should_index(const std::string& name)
+    {
+        return name != "content-length" && name != "date" && name != "etag" &&
+               name != "last-modified" && name != "set-cookie" && name != ":path";
+    }
+}
+
+HPACKTable::HPACKTable(std::size_t max_size)
+    : m_size(0),
+      m_max_size(max_size)
+{
+
+}
+
+const HeaderField* HPACKTable::get(std::size_t index) const
+{
+    if (index == 0)
+    {
+        return nullptr;
+    }
+    if (index <= STATIC_TABLE_SIZE)
+    {
+        return &STATIC_TABLE[index - 1];
+    }
+    index -= STATIC_TABLE_SIZE + 1;
+    if (index >= m_entries.size())
+    {
+        return nullptr;
+    }
+    return &m_entries[index];
+}
+
+std::size_t HPACKTable::find(const std::string& name, const std::string& value, std::size_t& name_index) const
+{
+    name_index = 0;
+    for (std::size_t i = 0; i < STATIC_TABLE_SIZE; i++)
+    {
+        if (STATIC_TABLE[i].first == name)
+        {
+            if (STATIC_TABLE[i].second == value)
+            {
+                return i + 1;
+            }
+            if (name_index == 0)
+            {
+                name_index = i + 1;
+            }
+        }
+    }
+    for (std::size_t i = 0; i < m_entries.size(); i++)
+    {
+        if (m_entries[i].first == name)
+        {
+            if (m_entries[i].second == value)
+            {
+                return STATIC_TABLE_SIZE + 1 + i;
+            }
+            if (name_index == 0)
+            {
+                name_index = STATIC_TABLE_SIZE + 1 + i;
+            }
+        }
+    }
+    return 0;
+}
+
+void HPACKTable::insert(const std::string& name, const std::string& value)
+{
+    std::size_t entry_size = name.length() + value.length() + ENTRY_OVERHEAD;
+    if (entry_size > m_max_size)
+    {
+        // Too large to ever fit: the table is emptied (RFC 7541 4.4).
+        m_entries.clear();
+        m_size = 0;
+        return;
+    }
+
+    evict(entry_size);
+    m_entries.emplace_front(name, value);
+    m_size += entry_size;
+}
+
+void HPACKTable::set_max_size(std::size_t max_size)
+{
+    m_max_size = max_size;
+    evict(0);
+}
+
+std::size_t HPACKTable::get_max_size() const
+{
+    return m_max_size;
+}
+
+void HPACKTable::evict(std::size_t needed)
+{
+    while (!m_entries.empty() && m_size + needed > m_max_size)
+    {
+        const HeaderField& oldest = m_entries.back();
+        m_size -= oldest.first.length() + oldest.second.length() + ENTRY_OVERHEAD;
+        m_entries.pop_back();
+    }
+}
+
+HPACKDecoder::HPACKDecoder(std::size_t max_table_size, std::size_t max_list_size)
+    : m_table(max_table_size),
+      m_settings_max_size(max_table_size),
+      m_max_list_size(max_list_size)
+{
+
+}
+
+bool HPACKDecoder::decode(const uint8_t* data, std::size_t length, std::vector<HeaderField>& headers)
+{
+    const uint8_t* end = data + length;
+    bool fields_seen = false;
+    // A short block can still reference large table entries many times.
+    std::size_t list_size = 0;
+    while (data < end)
+    {
+        uint8_t first = *data;
+        uint64_t index = 0;
+
+        if (first & 0x80)
+        {
+            // Indexed header field
+            if (!hpack::decode_integer(data, end, 7, index))
+            {
+                return false;
+            }
+            const HeaderField* field = m_table.get(index);
+            if (field == nullptr)
+            {
+                return false;
+            }
+            list_size += field->first.length() + field->second.length() + 32;
+            if (list_size > m_max_list_size)
+            {
+                return false;
+            }
+            headers.push_back(*field);
+            fields_seen = true;
+            continue;
+        }
+
+        if ((first & 0xe0) == 0x20)
+        {
+            // Dynamic table size update, only allowed before any field
+            if (fields_seen || !hpack::decode_integer(data, end, 5, index) || index > m_settings_max_size)
+            {
+                return false;
+            }
+            m_table.set_max_size(index);
+            continue;
+        }
+
+        bool incremental = (first & 0xc0) == 0x40;
+        if (!hpack::decode_integer(data, end, incremental ? 6 : 4, index))
+        {
+            return false;
+        }
+
+        HeaderField field;
+        if (index > 0)
+        {
+            const HeaderField* name = m_table.get(index);
+            if (name == nullptr)
+            {
+                return false;
+            }
+            field.first = name->first;
+        }
+
+        for (int part = (index > 0 ? 1 : 0); part < 2; part++)
+        {
+            if (data >= end)
+            {
+                return false;
+            }
+            bool huffman = (*data & 0x80) != 0;
+            uint64_t string_length = 0;
+            if (!hpack::decode_integer(data, end, 7, string_length) || string_length > static_cast<uint64_t>(end - data))
+            {
+                return false;
+            }
+
+            std::string& target = (part == 0) ? field.first : field.second;
+            if (huffman)
+            {
+                if (!hpack::huffman_decode(data, string_length, target))
+                {
+                    return false;
+                }
+            }
+            else
+            {
+                target.assign(reinterpret_cast<const char*>(data), string_length);
+            }
+            data += string_length;
+        }
+
+        list_size += field.first.length() + field.second.length() + 32;
+        if (list_size > m_max_list_size)
+        {
+            return false;
+        }
+        if (incremental)
+        {
+            m_table.insert(field.first, field.second);
+        }
+        headers.push_back(std::move(field));
+        fields_seen = true;
+    }
+    return true;
+}
+
+HPACKEncoder::HPACKEncoder()
+    : m_table(4096),
+      m_pending_max_size(4096),
+      m_size_update_pending(false)
+{
+
+}
+
+void HPACKEncoder::set_max_table_size(std::size_t max_size)
+{
+    // We never need more than the default, even if the peer allows it.
+    if (max_size > 4096)
+    {
+        max_size = 4096;
+    }
+    if (max_size != m_table.get_max_size())
+    {
+        m_pending_max_size = max_size;
+        m_size_update_pending = true;
+    }
+}
+
+void HPACKEncoder::encode(const std::vector<HeaderField>& headers, std::string& output)
+{
+    if (m_size_update_pending)
+    {
+        m_table.set_max_size(m_pending_max_size);
+        hpack::encode_integer(m_pending_max_size, 5, 0x20, output);
+        m_size_update_pending = false;
+    }
+
+    for (const HeaderField& field : headers)
+    {
+        std::size_t name_index = 0;
+        std::size_t index = m_table.find(field.first, field.second, name_index);
+        if (index > 0)
+        {
+            hpack::encode_integer(index, 7, 0x80, output);
+            continue;
+        }
+
+        bool indexed = should_index(field.first);
+        if (indexed)
+        {
+            hpack::encode_integer(name_index, 6, 0x40, output);
+        }
+        else
+        {
+            hpack::encode_integer(name_index, 4, 0x00, output);
+        }
+        if (name_index == 0)
+        {
+            hpack::encode_string(field.first, output);
+        }
+        hpack::encode_string(field.second, output);
+
+        if (indexed)
+        {
+            m_table.insert(field.first, field.second);
+        }
+    }
+}
+
+namespace hpack
+{
+    void encode_integer(uint64_t value, int prefix_bits, uint8_t first_byte, std::string& output)
+    {
+        uint64_t max_prefix = (1u << prefix_bits) - 1;
+        if (value < max_prefix)
+        {
+            output.push_back(static_cast<char>(first_byte | value));
+            return;
+        }
+
+        output.push_back(static_cast<char>(first_byte | max_prefix));
+        value -= max_prefix;
+        while (value >= 128)
+        {
+            output.push_back(static_cast<char>((value & 0x7f) | 0x80));
+            value >>= 7;
+        }
+        output.push_back(static_cast<char>(value));
+    }
+
+    bool decode_integer(const uint8_t*& data, const uint8_t* end, int prefix_bits, uint64_t& value)
+    {
+        if (data >= end)
+        {
+            return false;
+        }
+
+        uint64_t max_prefix = (1u << prefix_bits) - 1;
+        value = *data++ & max_prefix;
+        if (value < max_prefix)
+        {
+            return true;
+        }
+
+        for (int shift = 0; shift <= 56; shift += 7)
+        {
+            if (data >= end)
+            {
+                return false;
+            }
+            uint8_t byte = *data++;
+            value += static_cast<uint64_t>(byte & 0x7f) << shift;
+            if ((byte & 0x80) == 0)
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void encode_string(const std::string& value, std::string& output)
+    {
+        std::size_t encoded_length = huffman_length(value);
+        if (encoded_length < value.length())
+        {
+            encode_integer(encoded_length, 7, 0x80, output);
+            huffman_encode(value, output);
+        }
+        else
+        {
+            encode_integer(value.length(), 7, 0x00, output);
+            output.append(value);
+        }
+    }
+
+    bool huffman_decode(const uint8_t* data, std::size_t length, std::string& output)
+    {
+        const HuffmanDecodeTable& table = huffman_decode_table();
+        uint32_t code = 0;
+        int bits = 0;
+        for (std::size_t i = 0; i < length; i++)
+        {
+            for (int bit = 7; bit >= 0; bit--)
+            {
+                code = (code << 1) | ((data[i] >> bit) & 1);
+                bits++;
+                if (bits > 30)
+                {
+                    return false;
+                }
+                if (table.count[bits] != 0 && code >= table.first_code[bits] && code - table.first_code[bits] < table.count[bits])
+                {
+                    uint16_t symbol = table.symbols[table.first_symbol[bits] + code - table.first_code[bits]];
+                    if (symbol == 256)
+                    {
+                        return false;
+                    }
+                    output.push_back(static_cast<char>(symbol));
+                    code = 0;
+                    bits = 0;
+                }
+            }
+        }
+
+        // Padding must be shorter than a byte and made of EOS's leading ones.
+        return bits < 8 && code == (1u << bits) - 1;
+    }
+
+    void huffman_encode(const std::string& value, std::string& output)
+    {
+        uint64_t buffer = 0;
+        int bits = 0;
+        for (unsigned char c : value)
+        {
+            buffer = (buffer << HUFFMAN_CODES[c].bits) | HUFFMAN_CODES[c].code;
+            bits += HUFFMAN_CODES[c].bits;
+            while (bits >= 8)
+            {
+                bits -= 8;
+                output.push_back(static_cast<char>(buffer >> bits));
+            }
+        }
+        if (bits > 0)
+        {
+            output.push_back(static_cast<char>((buffer << (8 - bits)) | (0xff >> bits)));
+        }
+    }
+
+    std::size_t huffman_length(const std::string& value)
+    {
+        std::size_t bits = 0;
+        for (unsigned char c : value)
+        {
+            bits += HUFFMAN_CODES[c].bits;
+        }
+        return (bits + 7) / 8;
+    }
+}
@@ -0,0 +1,81 @@
+#ifndef HPACK_H
+#define HPACK_H
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <utility>
+#include <vector>
+
+typedef std::pair<std::string, std::string> HeaderField;
+
+// HPACK (RFC 7541) dynamic table, shared by the encoder and the decoder.
+class HPACKTable
+{
+public:
+    explicit HPACKTable(std::size_t max_size);
+
+    // 1-based HPACK index, covering the static table first.
+    const HeaderField* get(std::size_t index) const;
+    // Returns the index of an exact match, or of a name-only match through
+    // name_index, or 0 if neither exists.
+    std::size_t find(const std::string& name, const std::string& value, std::size_t& name_index) const;
+    void insert(const std::string& name, const std::string& value);
+    void set_max_size(std::size_t max_size);
+    std::size_t get_max_size() const;
+
+private:
+    void evict(std::size_t needed);
+
+private:
+    std::deque<HeaderField> m_entries;
+    std::size_t m_size;
+    std::size_t m_max_size;
+};
+
+class HPACKDecoder
+{
+public:
+    // max_list_size bounds a decoded header list, counted as in
+    // SETTINGS_MAX_HEADER_LIST_SIZE: name and value plus 32 per field.
+    explicit HPACKDecoder(std::size_t max_table_size, std::size_t max_list_size = SIZE_MAX);
+
+    // Decodes one complete header block. Returns false on a compression
+    // error, or once the list grows past its bound; both are fatal for the
+    // whole HTTP/2 connection.
+    bool decode(const uint8_t* data, std::size_t length, std::vector<HeaderField>& headers);
+
+private:
+    HPACKTable m_table;
+    std::size_t m_settings_max_size;
+    std::size_t m_max_list_size;
+};
+
+class HPACKEncoder
+{
+public:
+    HPACKEncoder();
+
+    // The peer's SETTINGS_HEADER_TABLE_SIZE. The change is announced at the
+    // start of the next header block.
+    void set_max_table_size(std::size_t max_size);
+    void encode(const std::vector<HeaderField>& headers, std::string& output);
+
+private:
+    HPACKTable m_table;
+    std::size_t m_pending_max_size;
+    bool m_size_update_pending;
+};
+
+namespace hpack
+{
+    void encode_integer(uint64_t value, int prefix_bits, uint8_t first_byte, std::string& output);
+    bool decode_integer(const uint8_t*& data, const uint8_t* end, int prefix_bits, uint64_t& value);
+    void encode_string(const std::string& value, std::string& output);
+    bool huffman_decode(const uint8_t* data, std::size_t length, std::string& output);
+    void huffman_encode(const std::string& value, std::string& output);
+    std::size_t huffman_length(const std::string& value);
+}
+
+#endif // HPACK_H
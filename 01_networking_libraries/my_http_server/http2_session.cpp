@@ -0,0 +1,860 @@
+#include "http2_session.h"
+#include "logging.h"
+#include "metrics.h"
+#include "defs.h"
+#include "utils.h"
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <sys/stat.h>
+
+namespace
+{
+    enum FrameType
+    {
+        FRAME_DATA = 0x0,
+        FRAME_HEADERS = 0x1,
+        FRAME_PRIORITY = 0x2,
+        FRAME_RST_STREAM = 0x3,
+        FRAME_SETTINGS = 0x4,
+        FRAME_PUSH_PROMISE = 0x5,
+        FRAME_PING = 0x6,
+        FRAME_GOAWAY = 0x7,
+        FRAME_WINDOW_UPDATE = 0x8,
+        FRAME_CONTINUATION = 0x9
+    };
+
+    enum FrameFlag
+    {
+        FLAG_END_STREAM = 0x1,
+        FLAG_ACK = 0x1,
+        FLAG_END_HEADERS = 0x4,
+        FLAG_PADDED = 0x8,
+        FLAG_PRIORITY = 0x20
+    };
+
+    enum Setting
+    {
+        SETTINGS_HEADER_TABLE_SIZE = 0x1,
+        SETTINGS_ENABLE_PUSH = 0x2,
+        SETTINGS_MAX_CONCURRENT_STREAMS = 0x3,
+        SETTINGS_INITIAL_WINDOW_SIZE = 0x4,
+        SETTINGS_MAX_FRAME_SIZE = 0x5,
+        SETTINGS_MAX_HEADER_LIST_SIZE = 0x6
+    };
+
+    enum ErrorCode
+    {
+        NO_ERROR = 0x0,
+        PROTOCOL_ERROR = 0x1,
+        INTERNAL_ERROR = 0x2,
+        FLOW_CONTROL_ERROR = 0x3,
+        STREAM_CLOSED = 0x5,
+        FRAME_SIZE_ERROR = 0x6,
+        REFUSED_STREAM = 0x7,
+        COMPRESSION_ERROR = 0x9,
+        ENHANCE_YOUR_CALM = 0xb
+    };
+
+    const std::size_t FRAME_HEADER_LENGTH = 9;
+    const int64_t MAX_WINDOW_SIZE = 0x7fffffff;
+
+    uint32_t read_u32(const uint8_t* p)
+    {
+        return (static_cast<uint32_t>(p[0]) << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+    }
+
+    void append_u32(std::string& output, uint32_t value)
+    {
+        output.push_back(static_cast<char>(value >> 24));
+        output.push_back(static_cast<char>(value >> 16));
+        output.push_back(static_cast<char>(value >> 8));
+        output.push_back(static_cast<char>(value));
+    }
+
+    void append_frame_header(std::string& output, std::size_t length, uint8_t type, uint8_t flags, uint32_t stream_id)
+    {
+        output.push_back(static_cast<char>(length >> 16));
+        output.push_back(static_cast<char>(length >> 8));
+        output.push_back(static_cast<char>(length));
+        output.push_back(static_cast<char>(type));
+        output.push_back(static_cast<char>(flags));
+        append_u32(output, stream_id & 0x7fffffff);
+    }
+
+    bool decode_base64url(const std::string& input, std::string& output)
+    {
+        unsigned int buffer = 0;
+        int bits = 0;
+        for (char c : input)
+        {
+            int value;
+            if (c >= 'A' && c <= 'Z') value = c - 'A';
+            else if (c >= 'a' && c <= 'z') value = c - 'a' + 26;
+            else if (c >= '0' && c <= '9') value = c - '0' + 52;
+            else if (c == '-' || c == '+') value = 62;
+            else if (c == '_' || c == '/') value = 63;
+            else if (c == '=') break;
+            else return false;
+
+            buffer = ((buffer << 6) | value) & 0xfff;
+            bits += 6;
+            if (bits >= 8)
+            {
+                bits -= 8;
+                output.push_back(static_cast<char>((buffer >> bits) & 0xff));
+            }
+        }
+        return true;
+    }
+
+    // Connection-specific fields are not allowed in HTTP/2 (RFC 7540 8.1.2.2).
+    bool is_connection_header(const std::string& name)
+    {
+        return name == "connection" || name == "keep-alive" || name == "proxy-connection" ||
+               name == "transfer-encoding" || name == "upgrade";
+    }
+}
+
+HTTP2Session::HTTP2Session(HTTPRouter& router, OutputQueue& output)
+    : m_router(router),
+      m_output(output),
+      m_limiter(nullptr),
+      m_client(0),
+      m_decoder(HTTP2_HEADER_TABLE_SIZE, HTTP2_MAX_HEADER_LIST_SIZE),
+      m_preface_received(false),
+      m_goaway(false),
+      m_last_stream_id(0),
+      m_send_window(HTTP2_DEFAULT_WINDOW_SIZE),
+      m_peer_initial_window(HTTP2_DEFAULT_WINDOW_SIZE),
+      m_peer_max_frame_size(HTTP2_MAX_FRAME_SIZE),
+      m_header_stream_id(0),
+      m_header_end_stream(false)
+{
+    METRIC_INC(METRIC_HTTP2_CONNECTIONS);
+}
+
+HTTP2Session::~HTTP2Session()
+{
+    for (auto& entry : m_streams)
+    {
+        if (entry.second.file_fd >= 0)
+        {
+            close(entry.second.file_fd);
+        }
+    }
+}
+
+void HTTP2Session::start()
+{
+    write_settings();
+}
+
+bool HTTP2Session::start_upgrade(const HTTPRequest& request)
+{
+    std::string settings;
+    if (!decode_base64url(request.get_header("HTTP2-Settings"), settings) || settings.length() % 6 != 0)
+    {
+        return false;
+    }
+
+    // The header stands in for the client's first SETTINGS frame.
+    const uint8_t* payload = reinterpret_cast<const uint8_t*>(settings.data());
+    for (std::size_t i = 0; i < settings.length(); i += 6)
+    {
+        if (!apply_setting((payload[i] << 8) | payload[i + 1], read_u32(payload + i + 2)))
+        {
+            return false;
+        }
+    }
+
+    write_settings();
+
+    Stream& stream = m_streams[1];
+    stream.id = 1;
+    stream.send_window = m_peer_initial_window;
+    stream.remote_closed = true;
+    stream.request = request;
+    m_last_stream_id = 1;
+    METRIC_INC(METRIC_HTTP2_STREAMS);
+    dispatch(stream);
+    return true;
+}
+
+void HTTP2Session::set_rate_limit(RateLimiter* limiter, uint64_t client)
+{
+    m_limiter = limiter;
+    m_client = client;
+}
+
+bool HTTP2Session::process_input(std::string& input)
+{
+    std::size_t offset = 0;
+    if (!m_preface_received)
+    {
+        std::size_t available = std::min<std::size_t>(input.length(), HTTP2_CONNECTION_PREFACE_LENGTH);
+        if (input.compare(0, available, HTTP2_CONNECTION_PREFACE, available) != 0)
+        {
+            LOGE("Invalid HTTP/2 connection preface");
+            return connection_error(PROTOCOL_ERROR);
+        }
+        if (available < HTTP2_CONNECTION_PREFACE_LENGTH)
+        {
+            return true;
+        }
+        m_preface_received = true;
+        offset = HTTP2_CONNECTION_PREFACE_LENGTH;
+    }
+
+    bool ok = true;
+    while (ok && input.length() - offset >= FRAME_HEADER_LENGTH)
+    {
+        const uint8_t* header = reinterpret_cast<const uint8_t*>(input.data() + offset);
+        std::size_t length = (header[0] << 16) | (header[1] << 8) | header[2];
+        if (length > HTTP2_MAX_FRAME_SIZE)
+        {
+            ok = connection_error(FRAME_SIZE_ERROR);
+            break;
+        }
+        if (input.length() - offset < FRAME_HEADER_LENGTH + length)
+        {
+            break;
+        }
+
+        uint32_t stream_id = read_u32(header + 5) & 0x7fffffff;
+        ok = handle_frame(header[3], header[4], stream_id, header + FRAME_HEADER_LENGTH, length);
+        offset += FRAME_HEADER_LENGTH + length;
+    }
+
+    input.erase(0, offset);
+    return ok;
+}
+
+bool HTTP2Session::produce_output()
+{
+    // After an h2c upgrade, the body of stream 1 waits for the client
+    // preface: some clients only buffer a little data behind the 101.
+    if (!m_preface_received)
+    {
+        return false;
+    }
+
+    while (!m_ready_streams.empty() && m_send_window > 0)
+    {
+        if (m_output.pending_bytes() >= OUTPUT_HIGH_WATERMARK)
+        {
+            return true;
+        }
+
+        uint32_t stream_id = m_ready_streams.front();
+        m_ready_streams.pop_front();
+
+        auto it = m_streams.find(stream_id);
+        if (it == m_streams.end())
+        {
+            continue;
+        }
+
+        Stream& stream = it->second;
+        stream.queued = false;
+        if (stream.send_window <= 0)
+        {
+            // Re-queued by the WINDOW_UPDATE that opens the window again.
+            continue;
+        }
+
+        std::size_t remaining = (stream.file_fd >= 0) ? stream.file_remaining : stream.body.length() - stream.body_offset;
+        std::size_t chunk = std::min<std::size_t>(remaining, m_peer_max_frame_size);
+        chunk = std::min<std::size_t>(chunk, stream.send_window);
+        chunk = std::min<std::size_t>(chunk, m_send_window);
+
+        bool end_stream = (chunk == remaining);
+        std::string frame;
+        frame.reserve(FRAME_HEADER_LENGTH + chunk);
+        append_frame_header(frame, chunk, FRAME_DATA, end_stream ? FLAG_END_STREAM : 0, stream_id);
+        if (stream.file_fd >= 0)
+        {
+            frame.resize(FRAME_HEADER_LENGTH + chunk);
+            ssize_t rc_read = pread(stream.file_fd, &frame[FRAME_HEADER_LENGTH], chunk, stream.file_offset);
+            if (rc_read != static_cast<ssize_t>(chunk))
+            {
+                LOGE("Error reading the file");
+                reset_stream(stream_id, INTERNAL_ERROR);
+                continue;
+            }
+            stream.file_offset += chunk;
+            stream.file_remaining -= chunk;
+        }
+        else
+        {
+            frame.append(stream.body, stream.body_offset, chunk);
+            stream.body_offset += chunk;
+        }
+
+        stream.send_window -= chunk;
+        m_send_window -= chunk;
+        m_output.append(std::move(frame));
+
+        if (end_stream)
+        {
+            close_stream(stream_id);
+        }
+        else
+        {
+            stream.queued = true;
+            m_ready_streams.push_back(stream_id);
+        }
+    }
+    return false;
+}
+
+bool HTTP2Session::has_active_streams() const
+{
+    return !m_streams.empty();
+}
+
+void HTTP2Session::shutdown()
+{
+    if (m_goaway)
+    {
+        return;
+    }
+
+    std::string payload;
+    append_u32(payload, m_last_stream_id);
+    append_u32(payload, NO_ERROR);
+    write_frame(FRAME_GOAWAY, 0, 0, payload);
+    m_goaway = true;
+}
+
+bool HTTP2Session::is_finished() const
+{
+    return m_goaway && m_streams.empty();
+}
+
+bool HTTP2Session::handle_frame(uint8_t type, uint8_t flags, uint32_t stream_id, const uint8_t* payload, std::size_t length)
+{
+    // A header block must not be interleaved with any other frame.
+    if (m_header_stream_id != 0 && (type != FRAME_CONTINUATION || stream_id != m_header_stream_id))
+    {
+        return connection_error(PROTOCOL_ERROR);
+    }
+
+    switch (type)
+    {
+        case FRAME_DATA:
+            return handle_data(flags, stream_id, payload, length);
+
+        case FRAME_HEADERS:
+            return handle_headers(flags, stream_id, payload, length);
+
+        case FRAME_CONTINUATION:
+            if (m_header_stream_id == 0)
+            {
+                return connection_error(PROTOCOL_ERROR);
+            }
+            // Without a bound, CONTINUATION frames could grow the block forever.
+            if (m_header_block.length() + length > HTTP2_MAX_HEADER_LIST_SIZE)
+            {
+                return connection_error(ENHANCE_YOUR_CALM);
+            }
+            m_header_block.append(reinterpret_cast<const char*>(payload), length);
+            if (flags & FLAG_END_HEADERS)
+            {
+                uint32_t header_stream_id = m_header_stream_id;
+                m_header_stream_id = 0;
+                return handle_header_block(header_stream_id, m_header_end_stream);
+            }
+            return true;
+
+        case FRAME_PRIORITY:
+            if (stream_id == 0 || length != 5)
+            {
+                return connection_error(stream_id == 0 ? PROTOCOL_ERROR : FRAME_SIZE_ERROR);
+            }
+            return true;
+
+        case FRAME_RST_STREAM:
+            if (stream_id == 0 || length != 4)
+            {
+                return connection_error(stream_id == 0 ? PROTOCOL_ERROR : FRAME_SIZE_ERROR);
+            }
+            close_stream(stream_id);
+            return true;
+
+        case FRAME_SETTINGS:
+            return handle_settings(flags, stream_id, payload, length);
+
+        case FRAME_PUSH_PROMISE:
+            // Clients cannot push.
+            return connection_error(PROTOCOL_ERROR);
+
+        case FRAME_PING:
+            if (stream_id != 0 || length != 8)
+            {
+                return connection_error(stream_id != 0 ? PROTOCOL_ERROR : FRAME_SIZE_ERROR);
+            }
+            if ((flags & FLAG_ACK) == 0)
+            {
+                write_frame(FRAME_PING, FLAG_ACK, 0, std::string(reinterpret_cast<const char*>(payload), length));
+            }
+            return true;
+
+        case FRAME_GOAWAY:
+            // Finish the streams we already have, accept no new ones.
+            m_goaway = true;
+            return true;
+
+        case FRAME_WINDOW_UPDATE:
+            return handle_window_update(stream_id, payload, length);
+
+        default:
+            // Unknown frame types must be ignored.
+            return true;
+    }
+}
+
+bool HTTP2Session::handle_headers(uint8_t flags, uint32_t stream_id, const uint8_t* payload, std::size_t length)
+{
+    if (stream_id == 0 || (stream_id % 2) == 0)
+    {
+        return connection_error(PROTOCOL_ERROR);
+    }
+
+    std::size_t padding = 0;
+    if (flags & FLAG_PADDED)
+    {
+        if (length < 1)
+        {
+            return connection_error(PROTOCOL_ERROR);
+        }
+        padding = payload[0];
+        payload++;
+        length--;
+    }
+    if (flags & FLAG_PRIORITY)
+    {
+        if (length < 5)
+        {
+            return connection_error(PROTOCOL_ERROR);
+        }
+        payload += 5;
+        length -= 5;
+    }
+    if (padding > length)
+    {
+        return connection_error(PROTOCOL_ERROR);
+    }
+    if (length - padding > HTTP2_MAX_HEADER_LIST_SIZE)
+    {
+        return connection_error(ENHANCE_YOUR_CALM);
+    }
+
+    m_header_block.assign(reinterpret_cast<const char*>(payload), length - padding);
+    m_header_end_stream = (flags & FLAG_END_STREAM) != 0;
+    if (flags & FLAG_END_HEADERS)
+    {
+        return handle_header_block(stream_id, m_header_end_stream);
+    }
+
+    m_header_stream_id = stream_id;
+    return true;
+}
+
+bool HTTP2Session::handle_header_block(uint32_t stream_id, bool end_stream)
+{
+    // The block must be decoded even for a stream we refuse, to keep the
+    // HPACK tables of both ends in sync.
+    std::vector<HeaderField> fields;
+    if (!m_decoder.decode(reinterpret_cast<const uint8_t*>(m_header_block.data()), m_header_block.length(), fields))
+    {
+        LOGE("HPACK decoding failed");
+        return connection_error(COMPRESSION_ERROR);
+    }
+    m_header_block.clear();
+
+    if (m_streams.count(stream_id) > 0)
+    {
+        // Trailers: nothing in them is used, but they can end the stream.
+        Stream& stream = m_streams[stream_id];
+        if (!end_stream || stream.remote_closed)
+        {
+            return connection_error(PROTOCOL_ERROR);
+        }
+        stream.remote_closed = true;
+        dispatch(stream);
+        return true;
+    }
+
+    if (stream_id <= m_last_stream_id)
+    {
+        return connection_error(PROTOCOL_ERROR);
+    }
+    m_last_stream_id = stream_id;
+
+    if (m_goaway || m_streams.size() >= HTTP2_MAX_CONCURRENT_STREAMS)
+    {
+        reset_stream(stream_id, REFUSED_STREAM);
+        return true;
+    }
+
+    Stream& stream = m_streams[stream_id];
+    stream.id = stream_id;
+    stream.send_window = m_peer_initial_window;
+    stream.remote_closed = end_stream;
+    stream.request.m_version = "HTTP/2";
+    METRIC_INC(METRIC_HTTP2_STREAMS);
+
+    for (HeaderField& field : fields)
+    {
+        if (field.first == ":method")
+        {
+            stream.request.m_method = field.second;
+        }
+        else if (field.first == ":path")
+        {
+            stream.request.m_path = field.second;
+        }
+        else if (field.first == ":authority")
+        {
+            stream.request.m_headers["host"] = field.second;
+        }
+        else if (!field.first.empty() && field.first[0] != ':')
+        {
+            stream.request.m_headers[field.first] = field.second;
+        }
+    }
+
+    if (stream.request.m_method.empty() || stream.request.m_path.empty())
+    {
+        reset_stream(stream_id, PROTOCOL_ERROR);
+        return true;
+    }
+
+    if (end_stream)
+    {
+        dispatch(stream);
+    }
+    return true;
+}
+
+bool HTTP2Session::handle_data(uint8_t flags, uint32_t stream_id, const uint8_t* payload, std::size_t length)
+{
+    if (stream_id == 0)
+    {
+        return connection_error(PROTOCOL_ERROR);
+    }
+
+    // Flow-controlled bytes are handed straight back to the peer: bodies
+    // are bounded by MAX_BODY_SIZE, not by the receive window.
+    if (length > 0)
+    {
+        std::string increment;
+        append_u32(increment, length);
+        write_frame(FRAME_WINDOW_UPDATE, 0, 0, increment);
+    }
+
+    auto it = m_streams.find(stream_id);
+    if (it == m_streams.end() || it->second.remote_closed)
+    {
+        if (stream_id > m_last_stream_id)
+        {
+            return connection_error(PROTOCOL_ERROR);
+        }
+        reset_stream(stream_id, STREAM_CLOSED);
+        return true;
+    }
+
+    Stream& stream = it->second;
+    std::size_t window_increment = length;
+    std::size_t padding = 0;
+    if (flags & FLAG_PADDED)
+    {
+        if (length < 1 || payload[0] >= length)
+        {
+            return connection_error(PROTOCOL_ERROR);
+        }
+        padding = payload[0];
+        payload++;
+        length--;
+    }
+
+    std::size_t data_length = length - padding;
+    if (stream.request.m_body.length() + data_length > MAX_BODY_SIZE)
+    {
+        LOGE("Client request body is too large");
+        reset_stream(stream_id, REFUSED_STREAM);
+        return true;
+    }
+    stream.request.m_body.append(reinterpret_cast<const char*>(payload), data_length);
+
+    if (flags & FLAG_END_STREAM)
+    {
+        stream.remote_closed = true;
+        dispatch(stream);
+    }
+    else if (window_increment > 0)
+    {
+        std::string increment;
+        append_u32(increment, window_increment);
+        write_frame(FRAME_WINDOW_UPDATE, 0, stream_id, increment);
+    }
+    return true;
+}
+
+bool HTTP2Session::handle_settings(uint8_t flags, uint32_t stream_id, const uint8_t* payload, std::size_t length)
+{
+    if (stream_id != 0)
+    {
+        return connection_error(PROTOCOL_ERROR);
+    }
+    if (flags & FLAG_ACK)
+    {
+        return length == 0 ? true : connection_error(FRAME_SIZE_ERROR);
+    }
+    if (length % 6 != 0)
+    {
+        return connection_error(FRAME_SIZE_ERROR);
+    }
+
+    for (std::size_t i = 0; i < length; i += 6)
+    {
+        if (!apply_setting((payload[i] << 8) | payload[i + 1], read_u32(payload + i + 2)))
+        {
+            return false;
+        }
+    }
+
+    write_frame(FRAME_SETTINGS, FLAG_ACK, 0, std::string());
+    return true;
+}
+
+bool HTTP2Session::handle_window_update(uint32_t stream_id, const uint8_t* payload, std::size_t length)
+{
+    if (length != 4)
+    {
+        return connection_error(FRAME_SIZE_ERROR);
+    }
+
+    uint32_t increment = read_u32(payload) & 0x7fffffff;
+    if (stream_id == 0)
+    {
+        if (increment == 0)
+        {
+            return connection_error(PROTOCOL_ERROR);
+        }
+        m_send_window += increment;
+        if (m_send_window > MAX_WINDOW_SIZE)
+        {
+            return connection_error(FLOW_CONTROL_ERROR);
+        }
+        return true;
+    }
+
+    auto it = m_streams.find(stream_id);
+    if (it == m_streams.end())
+    {
+        return true;
+    }
+
+    Stream& stream = it->second;
+    if (increment == 0)
+    {
+        reset_stream(stream_id, PROTOCOL_ERROR);
+        return true;
+    }
+    stream.send_window += increment;
+    if (stream.send_window > MAX_WINDOW_SIZE)
+    {
+        reset_stream(stream_id, FLOW_CONTROL_ERROR);
+        return true;
+    }
+
+    if (stream.responding && !stream.queued)
+    {
+        stream.queued = true;
+        m_ready_streams.push_back(stream_id);
+    }
+    return true;
+}
+
+bool HTTP2Session::apply_setting(uint16_t id, uint32_t value)
+{
+    switch (id)
+    {
+        case SETTINGS_HEADER_TABLE_SIZE:
+            m_encoder.set_max_table_size(value);
+            return true;
+
+        case SETTINGS_ENABLE_PUSH:
+            return value <= 1 ? true : connection_error(PROTOCOL_ERROR);
+
+        case SETTINGS_INITIAL_WINDOW_SIZE:
+        {
+            if (value > MAX_WINDOW_SIZE)
+            {
+                return connection_error(FLOW_CONTROL_ERROR);
+            }
+            // Applies retroactively to every open stream (RFC 7540 6.9.2).
+            int64_t delta = static_cast<int64_t>(value) - m_peer_initial_window;
+            m_peer_initial_window = value;
+            for (auto& entry : m_streams)
+            {
+                Stream& stream = entry.second;
+                stream.send_window += delta;
+                if (stream.responding && !stream.queued && stream.send_window > 0)
+                {
+                    stream.queued = true;
+                    m_ready_streams.push_back(stream.id);
+                }
+            }
+            return true;
+        }
+
+        case SETTINGS_MAX_FRAME_SIZE:
+            if (value < 16384 || value > 16777215)
+            {
+                return connection_error(PROTOCOL_ERROR);
+            }
+            m_peer_max_frame_size = value;
+            return true;
+
+        default:
+            // Includes SETTINGS_MAX_CONCURRENT_STREAMS: we never push.
+            return true;
+    }
+}
+
+void HTTP2Session::dispatch(Stream& stream)
+{
+    bool admitted = m_limiter == nullptr || m_limiter->allow(m_client, monotonic_ms());
+    HTTPResponse response = admitted ? m_router.route(stream.request) : HTTPResponse(HTTP_429, "429 Too Many Requests");
+    if (!admitted)
+    {
+        METRIC_INC(METRIC_RATE_LIMITED_REQUESTS);
+        response.set_header("Retry-After", std::to_string(RATE_LIMIT_RETRY_AFTER_SEC));
+    }
+    if (response.get_upstream() != nullptr || response.get_body_producer() != nullptr || response.get_handler() != nullptr)
+    {
+        // Proxied, generated and coroutine responses arrive asynchronously,
+        // which streams cannot wait for yet.
+        response = HTTPResponse(HTTP_502, "502 Bad Gateway");
+    }
+
+    std::vector<HeaderField> fields;
+    fields.emplace_back(":status", std::to_string(response.get_status()));
+    for (const auto& header : response.get_headers())
+    {
+        std::string name = header.first;
+        std::transform(name.begin(), name.end(), name.begin(), [](unsigned char c) { return std::tolower(c); });
+        if (!is_connection_header(name))
+        {
+            fields.emplace_back(name, header.second);
+        }
+    }
+
+    std::size_t body_length = response.get_body().length();
+    const std::string& body_file = response.get_body_file();
+    if (!body_file.empty())
+    {
+        stream.file_fd = open(body_file.c_str(), O_RDONLY | O_CLOEXEC);
+        struct stat file_stat;
+        if (stream.file_fd < 0 || fstat(stream.file_fd, &file_stat) != 0)
+        {
+            LOGE("Error reading the file");
+            reset_stream(stream.id, INTERNAL_ERROR);
+            return;
+        }
+        stream.file_remaining = file_stat.st_size;
+        body_length = stream.file_remaining;
+    }
+    else
+    {
+        stream.body = response.get_body();
+    }
+
+    std::string block;
+    m_encoder.encode(fields, block);
+
+    // Split the header block into HEADERS and CONTINUATION frames.
+    uint32_t stream_id = stream.id;
+    std::size_t offset = 0;
+    do
+    {
+        std::size_t chunk = std::min<std::size_t>(block.length() - offset, m_peer_max_frame_size);
+        bool first = (offset == 0);
+        bool last = (offset + chunk == block.length());
+        uint8_t flags = (last ? FLAG_END_HEADERS : 0) | (first && body_length == 0 ? FLAG_END_STREAM : 0);
+        write_frame(first ? FRAME_HEADERS : FRAME_CONTINUATION, flags, stream_id, block.substr(offset, chunk));
+        offset += chunk;
+    } while (offset < block.length());
+
+    if (body_length == 0)
+    {
+        close_stream(stream_id);
+        return;
+    }
+
+    stream.responding = true;
+    stream.queued = true;
+    m_ready_streams.push_back(stream_id);
+}
+
+void HTTP2Session::close_stream(uint32_t stream_id)
+{
+    auto it = m_streams.find(stream_id);
+    if (it == m_streams.end())
+    {
+        return;
+    }
+    if (it->second.file_fd >= 0)
+    {
+        close(it->second.file_fd);
+    }
+    m_streams.erase(it);
+}
+
+void HTTP2Session::reset_stream(uint32_t stream_id, uint32_t error_code)
+{
+    std::string payload;
+    append_u32(payload, error_code);
+    write_frame(FRAME_RST_STREAM, 0, stream_id, payload);
+    close_stream(stream_id);
+}
+
+bool HTTP2Session::connection_error(uint32_t error_code)
+{
+    std::string payload;
+    append_u32(payload, m_last_stream_id);
+    append_u32(payload, error_code);
+    write_frame(FRAME_GOAWAY, 0, 0, payload);
+    m_goaway = true;
+    return false;
+}
+
+void HTTP2Session::write_frame(uint8_t type, uint8_t flags, uint32_t stream_id, const std::string& payload)
+{
+    std::string frame;
+    frame.reserve(FRAME_HEADER_LENGTH + payload.length());
+    append_frame_header(frame, payload.length(), type, flags, stream_id);
+    frame.append(payload);
+    m_output.append(std::move(frame));
+}
+
+void HTTP2Session::write_settings()
+{
+    std::string payload;
+    payload.push_back(0);
+    payload.push_back(SETTINGS_MAX_CONCURRENT_STREAMS);
+    append_u32(payload, HTTP2_MAX_CONCURRENT_STREAMS);
+    payload.push_back(0);
+    payload.push_back(SETTINGS_MAX_HEADER_LIST_SIZE);
+    append_u32(payload, HTTP2_MAX_HEADER_LIST_SIZE);
+    payload.push_back(0);
+    payload.push_back(SETTINGS_ENABLE_PUSH);
+    append_u32(payload, 0);
+    write_frame(FRAME_SETTINGS, 0, 0, payload);
+}
@@ -0,0 +1,113 @@
+#ifndef HTTP2_SESSION_H
+#define HTTP2_SESSION_H
+
+#include "hpack.h"
+#include "http_request.h"
+#include "http_router.h"
+#include "output_queue.h"
+#include "rate_limiter.h"
+
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <string>
+#include <sys/types.h>
+
+#define HTTP2_CONNECTION_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define HTTP2_CONNECTION_PREFACE_LENGTH (24)
+
+// Server side of one HTTP/2 connection (RFC 7540), owned by the
+// HTTPConnectionHandler that detected it. Frames are parsed out of the
+// connection's input buffer and written into its output queue; each
+// complete request stream is answered through the same HTTPRouter that
+// serves HTTP/1.1. Response bodies are sent as DATA frames, round-robin
+// across streams, within the peer's flow-control windows and the
+// connection's output watermark. With a rate limiter every stream takes a
+// token from the client's bucket, and a refused one is answered with 429.
+class HTTP2Session
+{
+public:
+    HTTP2Session(HTTPRouter& router, OutputQueue& output);
+    ~HTTP2Session();
+
+    HTTP2Session(const HTTP2Session&) = delete;
+    HTTP2Session& operator=(const HTTP2Session&) = delete;
+
+    // Prior knowledge: the client starts with the connection preface.
+    void start();
+    // h2c upgrade: the HTTP/1.1 request that asked for it becomes stream 1,
+    // and the client sends its preface after our 101 response.
+    bool start_upgrade(const HTTPRequest& request);
+
+    // Limits the requests of client, unless limiter is null.
+    void set_rate_limit(RateLimiter* limiter, uint64_t client);
+
+    // Graceful GOAWAY: the streams already open are completed, new ones
+    // are refused.
+    void shutdown();
+
+    // Consumes every complete frame in input. Returns false when the
+    // connection must be closed once the output queue is flushed.
+    bool process_input(std::string& input);
+    // Queues DATA frames as far as flow control and the watermark allow.
+    // Returns true when it stopped at the watermark with data still ready.
+    bool produce_output();
+
+    bool has_active_streams() const;
+    bool is_finished() const;
+
+private:
+    struct Stream
+    {
+        uint32_t id = 0;
+        int64_t send_window = 0;
+        bool remote_closed = false;
+        bool responding = false;
+        bool queued = false;
+        HTTPRequest request;
+        std::string body;
+        std::size_t body_offset = 0;
+        int file_fd = -1;
+        off_t file_offset = 0;
+        std::size_t file_remaining = 0;
+    };
+
+    bool handle_frame(uint8_t type, uint8_t flags, uint32_t stream_id, const uint8_t* payload, std::size_t length);
+    bool handle_headers(uint8_t flags, uint32_t stream_id, const uint8_t* payload, std::size_t length);
+    bool handle_header_block(uint32_t stream_id, bool end_stream);
+    bool handle_data(uint8_t flags, uint32_t stream_id, const uint8_t* payload, std::size_t length);
+    bool handle_settings(uint8_t flags, uint32_t stream_id, const uint8_t* payload, std::size_t length);
+    bool handle_window_update(uint32_t stream_id, const uint8_t* payload, std::size_t length);
+    bool apply_setting(uint16_t id, uint32_t value);
+
+    void dispatch(Stream& stream);
+    void close_stream(uint32_t stream_id);
+    void reset_stream(uint32_t stream_id, uint32_t error_code);
+    bool connection_error(uint32_t error_code);
+    void write_frame(uint8_t type, uint8_t flags, uint32_t stream_id, const std::string& payload);
+    void write_settings();
+
+private:
+    HTTPRouter& m_router;
+    OutputQueue& m_output;
+    RateLimiter* m_limiter;
+    uint64_t m_client;
+    HPACKDecoder m_decoder;
+    HPACKEncoder m_encoder;
+    std::map<uint32_t, Stream> m_streams;
+    std::deque<uint32_t> m_ready_streams;
+
+    bool m_preface_received;
+    bool m_goaway;
+    uint32_t m_last_stream_id;
+    int64_t m_send_window;
+    uint32_t m_peer_initial_window;
+    uint32_t m_peer_max_frame_size;
+
+    // Header block spread over HEADERS and CONTINUATION frames
+    uint32_t m_header_stream_id;
+    bool m_header_end_stream;
+    std::string m_header_block;
+};
+
+#endif // HTTP2_SESSION_H
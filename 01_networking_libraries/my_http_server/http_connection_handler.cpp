@@ -1,42 +1,1257 @@
 #include "http_connection_handler.h"
-#include "logging.h"
+#include "http_server.h"
+#include "metrics.h"
 
 #include <unistd.h>
+#include <fcntl.h>
 #include <iostream>
 #include <string>
 #include <cstring>
+#include <cstdint>
+#include <cstdlib>
+#include <cerrno>
+#include <algorithm>
+#include <strings.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
 #include <netdb.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <openssl/err.h>
 
-HTTPConnectionHandler::HTTPConnectionHandler()
+template <typename Policies>
+BasicHTTPConnectionHandler<Policies>::BasicHTTPConnectionHandler(Server& server, Loop& loop, int sock_client, uint64_t client, SSL* ssl)
+    : m_server(server),
+      m_loop(loop),
+      m_sock(sock_client),
+      m_client(client),
+      m_request_prepaid(true),
+      m_ssl(ssl),
+      m_handshake_done(ssl == nullptr),
+      m_handshake_interest(EPOLLIN),
+      m_state(READING_HEADERS),
+      m_closing(false),
+      m_draining(false),
+      m_peer_closed(false),
+      m_reading_paused(false),
+      m_interest(EPOLLIN | EPOLLRDHUP),
+      m_timer(this),
+      m_egress(this),
+      m_router(server.get_upstreams(), server.get_config().upload_dir, server.get_offload_pool()),
+      m_upstream(nullptr),
+      m_upstream_responded(false),
+      m_body_streaming(false),
+      m_body_chunked(false),
+      m_body_remaining(0),
+      m_request_arrival_us(0)
 {
-    
+    arm_timer(HEADER_READ_TIMEOUT_MS);
 }
 
-ClientActivity HTTPConnectionHandler::handle_client(int sock_client)
+template <typename Policies>
+BasicHTTPConnectionHandler<Policies>::~BasicHTTPConnectionHandler()
 {
+    if (m_ssl != nullptr)
+    {
+        SSL_free(m_ssl);
+    }
+}
+
+template <typename Policies>
+int BasicHTTPConnectionHandler<Policies>::get_socket() const
+{
+    return m_sock;
+}
+
+template <typename Policies>
+void BasicHTTPConnectionHandler<Policies>::shutdown()
+{
+    EgressScheduler* egress = m_server.get_egress_scheduler();
+    if (egress != nullptr)
+    {
+        egress->cancel(&m_egress);
+    }
+
+    if (m_upstream != nullptr)
+    {
+        m_upstream->detach();
+        m_upstream = nullptr;
+    }
+    if (Policies::websocket && m_websocket != nullptr)
+    {
+        m_websocket->detach();
+    }
+
+    // A response still in progress never completes.
+    if (m_access.active)
+    {
+        m_access.flags |= ACCESS_FLAG_TRUNCATED | ACCESS_FLAG_CLOSE;
+        end_access(0);
+    }
+
+    // Best effort close_notify; the socket is about to be closed anyway.
+    if (m_ssl != nullptr && m_handshake_done)
+    {
+        SSL_shutdown(m_ssl);
+    }
+}
+
+template <typename Policies>
+void BasicHTTPConnectionHandler<Policies>::drain()
+{
+    m_draining = true;
+    if (Policies::http2 && m_http2 != nullptr)
+    {
+        // GOAWAY: the open streams are completed, no new ones are accepted.
+        m_http2->shutdown();
+        finish_activity(process_http2_input());
+        return;
+    }
+    if (Policies::websocket && m_websocket != nullptr)
+    {
+        // The close handshake gets WEBSOCKET_CLOSE_TIMEOUT_MS.
+        m_websocket->close(WEBSOCKET_CLOSE_GOING_AWAY);
+        finish_activity(flush_output());
+        return;
+    }
+
+    // Requests in progress are answered with "Connection: close". An idle
+    // connection is closed shortly; a request already on its way gets
+    // that long to arrive.
+    if (m_handshake_done && m_state == IDLE && m_input.empty() && m_output.empty() && m_upstream == nullptr)
+    {
+        arm_timer(DRAIN_IDLE_TIMEOUT_MS);
+    }
+}
+
+template <typename Policies>
+void BasicHTTPConnectionHandler<Policies>::resume(uint32_t events)
+{
+    // As after a response; the token for the next request is taken when
+    // it arrives.
+    m_request_prepaid = false;
+    m_state = IDLE;
+    arm_timer(KEEP_ALIVE_IDLE_TIMEOUT_MS);
+    handle_event(events);
+}
+
+template <typename Policies>
+void BasicHTTPConnectionHandler<Policies>::handle_event(uint32_t events)
+{
+    if (m_sock < 0)
+    {
+        return;
+    }
+
+    LoadShedder* shedder = m_server.get_load_shedder();
+    if (shedder != nullptr)
+    {
+        shedder->sample(m_loop.ready_us());
+    }
+
+    ClientActivity activity = ClientActivity::WAITING;
+    if (!m_handshake_done)
+    {
+        activity = handshake();
+        if (m_handshake_done)
+        {
+            // The client's first request may have arrived with the last
+            // handshake flight.
+            events |= EPOLLIN;
+        }
+    }
+
+    if ((events & (EPOLLOUT | EPOLLERR | EPOLLHUP)) && !m_output.empty())
+    {
+        activity = flush_output();
+        if (activity == ClientActivity::WAITING && !m_reading_paused)
+        {
+            // Pipelined requests left in the buffer while reading was paused.
+            activity = process_input();
+        }
+    }
+
+    if (activity == ClientActivity::WAITING && m_handshake_done && (events & (EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLHUP)) && !m_reading_paused && !m_closing && !m_peer_closed)
+    {
+        activity = handle_client();
+    }
+
+    finish_activity(activity);
+}
+
+template <typename Policies>
+void BasicHTTPConnectionHandler<Policies>::finish_activity(ClientActivity activity)
+{
+    if (m_sock < 0)
+    {
+        return;
+    }
+
+    if (activity == ClientActivity::WAITING && m_output.empty() && m_upstream == nullptr && (m_closing || m_peer_closed))
+    {
+        activity = ClientActivity::COMPLETED;
+    }
+
+    if (activity != ClientActivity::WAITING)
+    {
+        SERVER_LOGI("A client is disconnected");
+        m_server.close_connection(this);
+        m_sock = -1;
+        return;
+    }
+
+    // The server keeps the socket and its deadline, this object goes.
+    if (m_server.get_config().compact_idle && can_compact() && m_server.compact_connection(this, m_client))
+    {
+        m_loop.timers().cancel(&m_timer);
+        m_sock = -1;
+        return;
+    }
+
+    update_interest();
+}
+
+template <typename Policies>
+bool BasicHTTPConnectionHandler<Policies>::can_compact() const
+{
+    // TLS state cannot be carried over to a new connection.
+    return m_ssl == nullptr && m_state == IDLE && m_http2 == nullptr && m_websocket == nullptr && m_upstream == nullptr && !m_body_streaming &&
+           m_input.empty() && m_output.empty() && !m_closing && !m_draining && !m_peer_closed && !m_reading_paused;
+}
+
+template <typename Policies>
+void BasicHTTPConnectionHandler<Policies>::handle_timeout(TimerNode* timer)
+{
+    (void)timer;
+    // A quiet WebSocket client gets a ping, and the next deadline to
+    // answer it.
+    if (Policies::websocket && m_websocket != nullptr && m_output.empty() && m_websocket->ping())
+    {
+        finish_activity(flush_output());
+        return;
+    }
+
+    if (!m_handshake_done)
+    {
+        SERVER_LOGI("Client is too slow to complete the TLS handshake");
+    }
+    else if (!m_output.empty())
+    {
+        SERVER_LOGI("Client stopped reading the response");
+    }
+    else if (Policies::websocket && m_websocket != nullptr)
+    {
+        SERVER_LOGI(m_websocket->is_closing() ? "WebSocket client did not complete the close handshake" : "WebSocket client did not answer a ping");
+    }
+    else
+    {
+        switch (m_state)
+        {
+            case IDLE:            SERVER_LOGI("Keep-alive connection is idle for too long"); break;
+            case READING_HEADERS: SERVER_LOGI("Client is too slow to send request headers"); break;
+            case READING_BODY:    SERVER_LOGI("Client is too slow to send request body"); break;
+        }
+    }
+
+    m_server.close_connection(this);
+    m_sock = -1;
+}
+
+template <typename Policies>
+ClientActivity BasicHTTPConnectionHandler<Policies>::handshake()
+{
+    ERR_clear_error();
+    int rc_accept = SSL_accept(m_ssl);
+    if (rc_accept == 1)
+    {
+        m_handshake_done = true;
+        METRIC_INC(METRIC_TLS_HANDSHAKES);
+        if (SSL_session_reused(m_ssl))
+        {
+            METRIC_INC(METRIC_TLS_HANDSHAKES_RESUMED);
+        }
+        if (BIO_get_ktls_send(SSL_get_wbio(m_ssl)))
+        {
+            METRIC_INC(METRIC_TLS_KTLS_CONNECTIONS);
+        }
+        return ClientActivity::WAITING;
+    }
+
+    int error = SSL_get_error(m_ssl, rc_accept);
+    if (error == SSL_ERROR_WANT_READ)
+    {
+        m_handshake_interest = EPOLLIN;
+        return ClientActivity::WAITING;
+    }
+    if (error == SSL_ERROR_WANT_WRITE)
+    {
+        m_handshake_interest = EPOLLOUT;
+        return ClientActivity::WAITING;
+    }
+
+    SERVER_LOGE("TLS handshake failed");
+    METRIC_INC(METRIC_TLS_HANDSHAKE_FAILURES);
+    return ClientActivity::DISCONNECT;
+}
+
+template <typename Policies>
+int BasicHTTPConnectionHandler<Policies>::receive(char* buffer, std::size_t length)
+{
+    if (!Policies::tls || m_ssl == nullptr)
+    {
+        return recv(m_sock, buffer, length, 0);
+    }
+
+    ERR_clear_error();
+    int rc_read = SSL_read(m_ssl, buffer, length);
+    if (rc_read > 0)
+    {
+        return rc_read;
+    }
+
+    // Map the TLS result onto recv() semantics.
+    switch (SSL_get_error(m_ssl, rc_read))
+    {
+        case SSL_ERROR_WANT_READ:
+        case SSL_ERROR_WANT_WRITE:
+            errno = EAGAIN;
+            return -1;
+        case SSL_ERROR_ZERO_RETURN:
+            return 0;
+        case SSL_ERROR_SYSCALL:
+            if (rc_read == 0 || errno == 0)
+            {
+                return 0;
+            }
+            return -1;
+        default:
+            errno = EPROTO;
+            return -1;
+    }
+}
+
+template <typename Policies>
+ClientActivity BasicHTTPConnectionHandler<Policies>::handle_client()
+{
+    if (Policies::uploads && m_body_streaming && m_body_consumer != nullptr && m_body_consumer->can_splice() &&
+        !m_body_chunked && m_ssl == nullptr && m_input.empty())
+    {
+        return splice_body();
+    }
+
+    // Reading stops at the input limit until process_input() has taken
+    // the requests, or the part of a streamed body, out of the buffer.
     char buffer[MESSAGE_SIZE];
-    std::memset(buffer, 0, MESSAGE_SIZE);
-    int rc_recv = recv(sock_client, buffer, MESSAGE_SIZE, 0);
-    if (rc_recv <= 0)
+    while (m_input.length() <= MAX_HEADER_SIZE + MAX_BODY_SIZE)
+    {
+        int rc_recv = receive(buffer, MESSAGE_SIZE);
+        if (rc_recv > 0)
+        {
+            m_input.append(buffer, rc_recv);
+            continue;
+        }
+
+        if (rc_recv < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            break;
+        }
+        if (rc_recv < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (rc_recv < 0)
+        {
+            SERVER_LOGE("Server recv() failed");
+            return ClientActivity::DISCONNECT;
+        }
+
+        // The client may half-close after its last request, which must
+        // still be answered.
+        SERVER_LOGI("Receive zero data from client");
+        m_peer_closed = true;
+        break;
+    }
+
+    ClientActivity activity = process_input();
+    if (activity == ClientActivity::WAITING && m_input.length() > MAX_HEADER_SIZE + MAX_BODY_SIZE)
     {
-        LOGI("Receive zero data from client");
+        SERVER_LOGE("Client request is too large");
         return ClientActivity::DISCONNECT;
     }
+    return activity;
+}
+
+template <typename Policies>
+ClientActivity BasicHTTPConnectionHandler<Policies>::splice_body()
+{
+    bool moved_any = false;
+    while (m_body_remaining > 0)
+    {
+        ssize_t moved = m_body_consumer->consume_from(m_sock, m_body_remaining);
+        if (moved > 0)
+        {
+            m_body_remaining -= moved;
+            m_access.request_bytes += moved;
+            moved_any = true;
+            continue;
+        }
+        if (moved < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            break;
+        }
+        if (moved < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (moved == 0)
+        {
+            SERVER_LOGI("Client closed the connection during the request body");
+            return ClientActivity::DISCONNECT;
+        }
+
+        // Refused by the consumer, or the socket failed; either way the
+        // response says so if it can still be sent.
+        m_body_streaming = false;
+        m_state = IDLE;
+        finish_body(false);
+        return flush_output();
+    }
 
-    HTTPRequest client_request = m_parser.parse(buffer);
-    HTTPResponse server_response = m_router.route(client_request);
+    if (moved_any && m_output.empty())
+    {
+        arm_timer(BODY_READ_TIMEOUT_MS);
+    }
+    return process_input();
+}
 
-    std::string s_server_response = server_response.to_string();
-    int rc_send = send(sock_client, s_server_response.c_str(), s_server_response.length(), 0);
-    if (rc_send <= 0)
+template <typename Policies>
+ClientActivity BasicHTTPConnectionHandler<Policies>::process_input()
+{
+    if (m_http2 != nullptr)
+    {
+        return process_http2_input();
+    }
+    if (m_websocket != nullptr)
+    {
+        return process_websocket_input();
+    }
+
+    bool queued = false;
+    while (!m_closing && (!m_input.empty() || m_body_streaming) && m_upstream == nullptr)
+    {
+        if (m_output.pending_bytes() >= OUTPUT_HIGH_WATERMARK)
+        {
+            m_reading_paused = true;
+            break;
+        }
+
+        HTTPRequest client_request;
+        if (m_body_streaming)
+        {
+            BodyProgress progress = feed_body();
+            if (progress == BODY_INVALID)
+            {
+                return ClientActivity::DISCONNECT;
+            }
+            if (progress == BODY_PENDING)
+            {
+                break;
+            }
+
+            m_body_streaming = false;
+            m_state = IDLE;
+            if (m_body_consumer != nullptr)
+            {
+                finish_body(progress == BODY_COMPLETE);
+                queued = true;
+                continue;
+            }
+            client_request = std::move(m_body_request);
+            m_body_request = HTTPRequest();
+        }
+        else
+        {
+            // Prior knowledge h2c: the client opens with the HTTP/2 preface.
+            std::size_t preface_length = std::min<std::size_t>(m_input.length(), HTTP2_CONNECTION_PREFACE_LENGTH);
+            if (Policies::http2 && m_ssl == nullptr && m_input.compare(0, preface_length, HTTP2_CONNECTION_PREFACE, preface_length) == 0)
+            {
+                if (preface_length < HTTP2_CONNECTION_PREFACE_LENGTH)
+                {
+                    break;
+                }
+                start_http2(nullptr);
+                return process_http2_input();
+            }
+
+            std::size_t header_length = Parser::find_header_end(m_input);
+            if (header_length == std::string::npos)
+            {
+                if (m_input.length() > MAX_HEADER_SIZE)
+                {
+                    SERVER_LOGE("Client request headers are too large");
+                    return ClientActivity::DISCONNECT;
+                }
+
+                if (m_request_arrival_us == 0)
+                {
+                    m_request_arrival_us = m_loop.ready_us();
+                }
+
+                // The header deadline starts at the first byte and is not extended
+                // by later bytes, so a client trickling headers cannot hold the slot.
+                if (m_state == IDLE)
+                {
+                    m_state = READING_HEADERS;
+                    if (m_output.empty())
+                    {
+                        arm_timer(HEADER_READ_TIMEOUT_MS);
+                    }
+                }
+                break;
+            }
+
+            if (!admit_request())
+            {
+                METRIC_INC(METRIC_RATE_LIMITED_REQUESTS);
+                m_output.append(m_server.get_rate_limiter()->rejection());
+                m_input.clear();
+                m_state = IDLE;
+                m_closing = true;
+                queued = true;
+                break;
+            }
+
+            // A body whose end is only known by decoding it, or that has not
+            // fully arrived, is streamed.
+            std::string head = m_input.substr(0, header_length);
+            bool chunked = Parser::is_chunked(head);
+            uint64_t body_length = chunked ? 0 : Parser::content_length(head);
+            if (chunked || body_length > MAX_BODY_SIZE || m_input.length() < header_length + body_length)
+            {
+                if (!start_body(header_length, chunked, body_length))
+                {
+                    return ClientActivity::DISCONNECT;
+                }
+                // A client that waits for the go-ahead before sending the
+                // body gets it once nothing of the body has arrived.
+                if (m_input.empty() && strcasecmp(m_body_request.get_header("Expect").c_str(), "100-continue") == 0)
+                {
+                    m_output.append("HTTP/1.1 100 Continue\r\n\r\n");
+                    queued = true;
+                }
+                continue;
+            }
+
+            std::size_t request_length = header_length + body_length;
+            client_request = m_parser.parse(m_input.substr(0, request_length));
+            m_input.erase(0, request_length);
+            m_state = IDLE;
+            begin_access(client_request);
+            m_access.request_bytes = request_length;
+        }
+
+        if (Policies::http2 && m_ssl == nullptr && strcasecmp(client_request.get_header("Upgrade").c_str(), "h2c") == 0 &&
+            !client_request.get_header("HTTP2-Settings").empty())
+        {
+            m_output.append("HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: h2c\r\n\r\n");
+            end_access(101);
+            if (!start_http2(&client_request))
+            {
+                return flush_output();
+            }
+            return process_http2_input();
+        }
+        if (Policies::websocket && WebSocketSession::is_upgrade(client_request) && start_websocket(client_request))
+        {
+            end_access(m_websocket != nullptr ? 101 : HTTP_400);
+            return m_websocket != nullptr ? process_websocket_input() : flush_output();
+        }
+
+        HTTPResponse server_response = m_router.route(client_request, true);
+        if (!client_request.keep_alive() || m_draining)
+        {
+            m_closing = true;
+        }
+
+        if (Policies::handlers && server_response.get_handler() != nullptr)
+        {
+            // The previous task may still be on the call stack here,
+            // completing, but it touches nothing after that.
+            m_handler_task.reset(new HandlerTask(m_server.get_handler_services(), m_sock, *server_response.get_handler(), client_request, this));
+            m_upstream = m_handler_task.get();
+            m_upstream_responded = false;
+            m_handler_task->start();
+            queued = true;
+            continue;
+        }
+        if (Policies::proxy && server_response.get_upstream() != nullptr)
+        {
+            m_upstream = m_server.get_upstreams()->forward(*server_response.get_upstream(), client_request, !m_closing, this);
+            if (m_upstream != nullptr)
+            {
+                m_upstream_responded = false;
+                queued = true;
+                continue;
+            }
+            server_response = HTTPResponse(HTTP_503, "503 Service Unavailable");
+        }
+        if (server_response.get_body_producer() != nullptr)
+        {
+            start_body_stream(client_request, server_response);
+            queued = true;
+            continue;
+        }
+        server_response.set_header("Connection", m_closing ? "close" : "keep-alive");
+        queue_response(server_response);
+        end_access(server_response.get_status());
+        queued = true;
+    }
+
+    if (!queued)
+    {
+        return ClientActivity::WAITING;
+    }
+
+    // Responses to a pipelined batch go out together in one flush. If that
+    // drains the queue and lifts the pause, no event will come for the
+    // requests still buffered, so carry on with them here.
+    ClientActivity activity = flush_output();
+    if (activity == ClientActivity::WAITING && !m_reading_paused && !m_input.empty())
+    {
+        return process_input();
+    }
+    return activity;
+}
+
+template <typename Policies>
+bool BasicHTTPConnectionHandler<Policies>::admit_request()
+{
+    RateLimiter* limiter = m_server.get_rate_limiter();
+    if (limiter == nullptr || m_request_prepaid)
+    {
+        m_request_prepaid = false;
+        return true;
+    }
+    return limiter->allow(m_client, m_loop.now_ms());
+}
+
+template <typename Policies>
+bool BasicHTTPConnectionHandler<Policies>::start_body(std::size_t header_length, bool chunked, uint64_t body_length)
+{
+    m_body_request = m_parser.parse(m_input.substr(0, header_length));
+    m_input.erase(0, header_length);
+    begin_access(m_body_request);
+    m_access.request_bytes = header_length;
+    if (Policies::uploads)
+    {
+        m_body_consumer = m_router.accept_body(m_body_request);
+    }
+    if (m_body_consumer == nullptr && body_length > MAX_BODY_SIZE)
+    {
+        SERVER_LOGE("Client request body is too large");
+        return false;
+    }
+
+    m_body_streaming = true;
+    m_body_chunked = chunked;
+    m_body_remaining = body_length;
+    m_body_decoder.reset();
+    // The body deadline is a progress timeout, refreshed by each read.
+    m_state = READING_BODY;
+    if (m_output.empty())
+    {
+        arm_timer(BODY_READ_TIMEOUT_MS);
+    }
+    return true;
+}
+
+template <typename Policies>
+typename BasicHTTPConnectionHandler<Policies>::BodyProgress BasicHTTPConnectionHandler<Policies>::feed_body()
+{
+    std::size_t used = 0;
+    const char* payload = m_input.data();
+    std::size_t payload_length = 0;
+    std::string decoded;
+    if (m_body_chunked)
+    {
+        used = m_body_decoder.feed(m_input.data(), m_input.length(), &decoded);
+        if (m_body_decoder.has_error())
+        {
+            SERVER_LOGE("Client request body has an invalid chunked coding");
+            return BODY_INVALID;
+        }
+        payload = decoded.data();
+        payload_length = decoded.length();
+    }
+    else
+    {
+        used = payload_length = std::min<uint64_t>(m_input.length(), m_body_remaining);
+        m_body_remaining -= used;
+    }
+
+    bool accepted = true;
+    if (m_body_consumer != nullptr)
+    {
+        accepted = m_body_consumer->consume(payload, payload_length);
+    }
+    else if (m_body_request.m_body.length() + payload_length > MAX_BODY_SIZE)
+    {
+        SERVER_LOGE("Client request body is too large");
+        return BODY_INVALID;
+    }
+    else
+    {
+        m_body_request.m_body.append(payload, payload_length);
+    }
+
+    m_input.erase(0, used);
+    m_access.request_bytes += used;
+    if (used > 0 && m_output.empty())
+    {
+        arm_timer(BODY_READ_TIMEOUT_MS);
+    }
+
+    if (!accepted)
+    {
+        return BODY_REJECTED;
+    }
+    bool done = m_body_chunked ? m_body_decoder.is_done() : (m_body_remaining == 0);
+    return done ? BODY_COMPLETE : BODY_PENDING;
+}
+
+template <typename Policies>
+void BasicHTTPConnectionHandler<Policies>::finish_body(bool complete)
+{
+    HTTPResponse response = m_body_consumer->finish(complete);
+    m_body_consumer.reset();
+    // The rest of a refused body is never read, so nothing after it can be
+    // framed on this connection.
+    if (!complete || !m_body_request.keep_alive() || m_draining)
+    {
+        m_closing = true;
+    }
+    m_body_request = HTTPRequest();
+    response.set_header("Connection", m_closing ? "close" : "keep-alive");
+    queue_response(response);
+    end_access(response.get_status());
+}
+
+template <typename Policies>
+ClientActivity BasicHTTPConnectionHandler<Policies>::process_http2_input()
+{
+    if constexpr (Policies::http2)
+    {
+        if (!m_reading_paused && !m_input.empty() && !m_http2->process_input(m_input))
+        {
+            // The session has queued a GOAWAY, send it and close.
+            m_input.clear();
+            m_closing = true;
+        }
+
+        // Without more input or EPOLLOUT nothing would call back here, so
+        // keep producing for as long as the socket drains the whole queue.
+        ClientActivity activity = ClientActivity::WAITING;
+        bool more = false;
+        do
+        {
+            more = m_http2->produce_output();
+            if (more)
+            {
+                m_reading_paused = true;
+            }
+            activity = flush_output();
+        } while (more && activity == ClientActivity::WAITING && m_output.empty());
+
+        if (m_http2->is_finished())
+        {
+            m_closing = true;
+        }
+        return activity;
+    }
+    else
     {
-        LOGE("Server is failed to respond");
         return ClientActivity::DISCONNECT;
     }
+}
+
+template <typename Policies>
+bool BasicHTTPConnectionHandler<Policies>::start_http2(const HTTPRequest* upgrade_request)
+{
+    if constexpr (Policies::http2)
+    {
+        m_http2.reset(new HTTP2Session(m_router, m_output));
+        m_state = IDLE;
+        if (upgrade_request == nullptr)
+        {
+            m_http2->start();
+        }
+        else if (!m_http2->start_upgrade(*upgrade_request))
+        {
+            SERVER_LOGE("Invalid HTTP2-Settings in h2c upgrade");
+            m_closing = true;
+            return false;
+        }
+
+        // The upgrade request has been admitted as HTTP/1.1 already.
+        m_http2->set_rate_limit(m_server.get_rate_limiter(), m_client);
+        return true;
+    }
+    else
+    {
+        (void)upgrade_request;
+        return false;
+    }
+}
+
+template <typename Policies>
+ClientActivity BasicHTTPConnectionHandler<Policies>::process_websocket_input()
+{
+    if constexpr (Policies::websocket)
+    {
+        if (!m_reading_paused && !m_input.empty() && !m_websocket->process_input(m_input))
+        {
+            // The close handshake is over, or the client broke the protocol;
+            // the session has queued its close frame.
+            m_input.clear();
+            m_closing = true;
+        }
+
+        // Frames already read are handled even past the watermark; no more
+        // are read until the client has caught up.
+        ClientActivity activity = flush_output();
+        if (m_output.pending_bytes() >= OUTPUT_HIGH_WATERMARK)
+        {
+            m_reading_paused = true;
+        }
+        return activity;
+    }
+    else
+    {
+        return ClientActivity::DISCONNECT;
+    }
+}
+
+template <typename Policies>
+bool BasicHTTPConnectionHandler<Policies>::start_websocket(const HTTPRequest& request)
+{
+    if constexpr (Policies::websocket)
+    {
+        std::unique_ptr<WebSocketHandler> handler = m_router.accept_websocket(request);
+        if (handler == nullptr)
+        {
+            return false;
+        }
+
+        m_state = IDLE;
+        m_websocket.reset(new WebSocketSession(m_loop, m_output, this));
+        if (!m_websocket->start(request, std::move(handler), m_server.get_config().websocket_deflate))
+        {
+            m_websocket.reset();
+            HTTPResponse error_response(HTTP_400, "400 Bad Request");
+            error_response.set_header("Sec-WebSocket-Version", "13");
+            error_response.set_header("Connection", "close");
+            m_closing = true;
+            queue_response(error_response);
+        }
+        return true;
+    }
+    else
+    {
+        (void)request;
+        return false;
+    }
+}
+
+template <typename Policies>
+void BasicHTTPConnectionHandler<Policies>::websocket_output()
+{
+    if (m_sock < 0)
+    {
+        return;
+    }
+
+    ClientActivity activity = flush_output();
+    if (activity == ClientActivity::WAITING && !m_reading_paused)
+    {
+        // Frames left in the buffer while reading was paused.
+        activity = process_input();
+    }
+    finish_activity(activity);
+}
+
+template <typename Policies>
+ClientActivity BasicHTTPConnectionHandler<Policies>::flush_output()
+{
+    std::size_t written = 0;
+    EgressScheduler* egress = m_server.get_egress_scheduler();
+    if (egress == nullptr)
+    {
+        return write_output(SIZE_MAX, written);
+    }
+
+    // Bulk output waits for its turn, which the scheduler calls back for.
+    if (m_egress.is_queued() || !egress->is_priority(m_output.pending_bytes()))
+    {
+        egress->enqueue(&m_egress);
+        return ClientActivity::WAITING;
+    }
+    ClientActivity activity = write_output(SIZE_MAX, written);
+    egress->charge(written);
+    return activity;
+}
+
+template <typename Policies>
+std::size_t BasicHTTPConnectionHandler<Policies>::egress_write(std::size_t budget)
+{
+    if (m_sock < 0)
+    {
+        return 0;
+    }
+
+    // Having used up its budget, it may have more to send; having fallen
+    // short of it, the socket is full and EPOLLOUT brings it back.
+    std::size_t written = 0;
+    ClientActivity activity = write_output(budget, written);
+    if (activity == ClientActivity::WAITING && !m_output.empty() && written >= budget)
+    {
+        m_server.get_egress_scheduler()->enqueue(&m_egress);
+    }
+    if (activity == ClientActivity::WAITING && !m_reading_paused)
+    {
+        // Pipelined requests left in the buffer while reading was paused.
+        activity = process_input();
+    }
+    finish_activity(activity);
+    return written;
+}
+
+template <typename Policies>
+bool BasicHTTPConnectionHandler<Policies>::egress_pending() const
+{
+    return m_sock >= 0 && !m_output.empty();
+}
+
+template <typename Policies>
+ClientActivity BasicHTTPConnectionHandler<Policies>::write_output(std::size_t limit, std::size_t& written_total)
+{
+    ssize_t written = (Policies::tls && m_ssl != nullptr) ? m_output.write_to(m_ssl, limit) : m_output.write_to(m_sock, limit);
+    if (written < 0)
+    {
+        SERVER_LOGE("Server is failed to respond");
+        return ClientActivity::DISCONNECT;
+    }
+    written_total += written;
+
+    if (m_output.pending_bytes() <= OUTPUT_LOW_WATERMARK)
+    {
+        m_reading_paused = false;
+        if (m_upstream != nullptr)
+        {
+            m_upstream->resume();
+        }
+        if (Policies::websocket && m_websocket != nullptr)
+        {
+            m_websocket->output_drained();
+        }
+    }
+
+    if (!m_output.empty())
+    {
+        // The stall deadline restarts whenever the client makes progress.
+        if (written > 0)
+        {
+            arm_timer(WRITE_STALL_TIMEOUT_MS);
+        }
+        return ClientActivity::WAITING;
+    }
+
+    if (m_upstream != nullptr)
+    {
+        // The upstream connection has its own deadlines.
+        m_loop.timers().cancel(&m_timer);
+        return ClientActivity::WAITING;
+    }
+
+    if (Policies::http2 && m_http2 != nullptr)
+    {
+        // Streams still open are waiting on the client (request body or
+        // flow-control credit).
+        arm_timer(m_http2->has_active_streams() ? WRITE_STALL_TIMEOUT_MS : KEEP_ALIVE_IDLE_TIMEOUT_MS);
+        return ClientActivity::WAITING;
+    }
+
+    if (Policies::websocket && m_websocket != nullptr)
+    {
+        // Restarted by every frame either way; see handle_timeout().
+        arm_timer(m_websocket->is_closing() ? WEBSOCKET_CLOSE_TIMEOUT_MS : WEBSOCKET_PING_INTERVAL_MS);
+        return ClientActivity::WAITING;
+    }
+
+    switch (m_state)
+    {
+        case IDLE:            arm_timer(m_draining ? DRAIN_IDLE_TIMEOUT_MS : KEEP_ALIVE_IDLE_TIMEOUT_MS); break;
+        case READING_HEADERS: arm_timer(HEADER_READ_TIMEOUT_MS); break;
+        case READING_BODY:    arm_timer(BODY_READ_TIMEOUT_MS); break;
+    }
+    return ClientActivity::WAITING;
+}
+
+template <typename Policies>
+void BasicHTTPConnectionHandler<Policies>::queue_response(HTTPResponse& response)
+{
+    if (m_output.empty())
+    {
+        arm_timer(WRITE_STALL_TIMEOUT_MS);
+    }
+
+    const std::string& body_file = response.get_body_file();
+    if (body_file.empty())
+    {
+        std::string data = response.to_string();
+        m_access.bytes += data.length();
+        m_output.append(std::move(data));
+        return;
+    }
+
+    // Opened on the offload pool already, or opened here.
+    int file_fd = response.take_body_fd();
+    if (file_fd < 0)
+    {
+        file_fd = open(body_file.c_str(), O_RDONLY | O_CLOEXEC);
+    }
+    struct stat file_stat;
+    if (file_fd < 0 || fstat(file_fd, &file_stat) != 0)
+    {
+        SERVER_LOGE("Error reading the file");
+        if (file_fd >= 0)
+        {
+            close(file_fd);
+        }
+        HTTPResponse error_response(HTTP_500, "500 Internal Server Error");
+        error_response.set_header("Connection", m_closing ? "close" : "keep-alive");
+        response.set_status(HTTP_500);
+        queue_response(error_response);
+        return;
+    }
+
+    response.set_body_file(body_file, file_stat.st_size);
+    std::string head = response.header_string();
+    m_access.bytes += head.length() + file_stat.st_size;
+    m_output.append(std::move(head));
+    m_output.append_file(file_fd, 0, file_stat.st_size);
+}
+
+template <typename Policies>
+void BasicHTTPConnectionHandler<Policies>::begin_access(const HTTPRequest& request)
+{
+    AccessLog* log = m_server.get_access_log();
+    if (log != nullptr)
+    {
+        // A request whose head came in one wakeup arrived with it.
+        uint64_t ready_us = m_loop.ready_us();
+        log->begin(m_access, request, (m_request_arrival_us != 0) ? m_request_arrival_us : ready_us, ready_us, m_ssl != nullptr);
+    }
+    m_request_arrival_us = 0;
+}
+
+template <typename Policies>
+void BasicHTTPConnectionHandler<Policies>::end_access(int status)
+{
+    AccessLog* log = m_server.get_access_log();
+    if (log == nullptr || !m_access.active)
+    {
+        return;
+    }
+    if (status != 0)
+    {
+        m_access.status = static_cast<uint16_t>(status);
+    }
+    if (m_closing)
+    {
+        m_access.flags |= ACCESS_FLAG_CLOSE;
+    }
+    log->end(m_access, m_client);
+}
+
+template <typename Policies>
+void BasicHTTPConnectionHandler<Policies>::start_body_stream(const HTTPRequest& request, HTTPResponse& response)
+{
+    // HTTP/1.0 has no chunked coding; the end of the connection ends the
+    // body instead.
+    bool chunked = (request.m_version != "HTTP/1.0");
+    if (chunked)
+    {
+        response.set_header("Transfer-Encoding", "chunked");
+    }
+    else
+    {
+        m_closing = true;
+    }
+    response.set_header("Connection", m_closing ? "close" : "keep-alive");
+    queue_response(response);
+    METRIC_INC(METRIC_RESPONSES_STREAMED);
+    m_access.status = static_cast<uint16_t>(response.get_status());
+    if (request.m_method == "HEAD")
+    {
+        end_access(0);
+        return;
+    }
+
+    // The head goes out right away; the body follows as the producer
+    // generates it, through the same path as a proxied response. The
+    // previous stream may still be on the call stack here, completing, but
+    // it touches nothing after that.
+    m_stream.reset(new BodyStream(m_loop, response.get_body_producer(), chunked, this));
+    m_upstream = m_stream.get();
+    m_upstream_responded = true;
+    m_stream->start();
+}
+
+template <typename Policies>
+bool BasicHTTPConnectionHandler<Policies>::upstream_data(const std::string& data)
+{
+    // A proxied response is relayed as it is; its status is in the first
+    // bytes, "HTTP/1.1 200".
+    if (!m_upstream_responded && data.length() >= 12 && data.compare(0, 7, "HTTP/1.") == 0)
+    {
+        m_access.status = static_cast<uint16_t>(std::atoi(data.c_str() + 9));
+    }
+    m_upstream_responded = true;
+    if (m_output.empty())
+    {
+        arm_timer(WRITE_STALL_TIMEOUT_MS);
+    }
+    m_access.bytes += data.length();
+    m_output.append(data);
+    finish_activity(flush_output());
+    return m_sock >= 0 && m_output.pending_bytes() < OUTPUT_HIGH_WATERMARK;
+}
+
+template <typename Policies>
+bool BasicHTTPConnectionHandler<Policies>::upstream_shared(const std::shared_ptr<const std::string>& buffer, std::size_t offset, std::size_t length)
+{
+    m_upstream_responded = true;
+    if (m_output.empty())
+    {
+        arm_timer(WRITE_STALL_TIMEOUT_MS);
+    }
+    m_access.bytes += length;
+    m_output.append_shared(buffer, offset, length);
+    finish_activity(flush_output());
+    return m_sock >= 0 && m_output.pending_bytes() < OUTPUT_HIGH_WATERMARK && m_output.segment_count() < OUTPUT_MAX_SHARED_SEGMENTS;
+}
+
+template <typename Policies>
+void BasicHTTPConnectionHandler<Policies>::upstream_complete(bool close_client)
+{
+    m_upstream = nullptr;
+    if (close_client)
+    {
+        m_closing = true;
+    }
+    end_access(0);
+
+    // Resume the pipelined requests that waited for this response.
+    ClientActivity activity = flush_output();
+    if (activity == ClientActivity::WAITING && !m_reading_paused)
+    {
+        activity = process_input();
+    }
+    finish_activity(activity);
+}
+
+template <typename Policies>
+void BasicHTTPConnectionHandler<Policies>::upstream_failed(int status)
+{
+    m_upstream = nullptr;
+    if (m_upstream_responded)
+    {
+        // Part of the response is already out; only closing the connection
+        // tells the client that it is incomplete.
+        SERVER_LOGE("Upstream response is truncated");
+        finish_activity(ClientActivity::DISCONNECT);
+        return;
+    }
+
+    HTTPResponse error_response(status, status == HTTP_504 ? "504 Gateway Timeout" : "502 Bad Gateway");
+    error_response.set_header("Connection", m_closing ? "close" : "keep-alive");
+    queue_response(error_response);
+    end_access(status);
+
+    ClientActivity activity = flush_output();
+    if (activity == ClientActivity::WAITING && !m_reading_paused)
+    {
+        activity = process_input();
+    }
+    finish_activity(activity);
+}
+
+template <typename Policies>
+void BasicHTTPConnectionHandler<Policies>::handler_complete(const HTTPRequest& request, HTTPResponse& response)
+{
+    m_upstream = nullptr;
+    if (response.get_upstream() != nullptr || response.get_handler() != nullptr)
+    {
+        SERVER_LOGE("Coroutine handler returned a route instead of a response");
+        response = HTTPResponse(HTTP_502, "502 Bad Gateway");
+    }
+
+    // request belongs to the task, which the next request may replace.
+    if (response.get_body_producer() != nullptr)
+    {
+        start_body_stream(request, response);
+    }
+    else
+    {
+        response.set_header("Connection", m_closing ? "close" : "keep-alive");
+        queue_response(response);
+        end_access(response.get_status());
+    }
+
+    ClientActivity activity = flush_output();
+    if (activity == ClientActivity::WAITING && !m_reading_paused)
+    {
+        activity = process_input();
+    }
+    finish_activity(activity);
+}
+
+template <typename Policies>
+void BasicHTTPConnectionHandler<Policies>::update_interest()
+{
+    // Writability is only of interest while there is something to write.
+    uint32_t interest = 0;
+    if (!m_handshake_done)
+    {
+        interest = m_handshake_interest;
+    }
+    else if (!m_reading_paused && !m_closing && !m_peer_closed)
+    {
+        interest |= EPOLLIN | EPOLLRDHUP;
+    }
+    // Output waiting for its turn is written from the scheduler.
+    if (m_handshake_done && !m_output.empty() && !m_egress.is_queued())
+    {
+        interest |= EPOLLOUT;
+    }
+
+    if (interest != m_interest)
+    {
+        m_loop.modify(m_sock, interest, this);
+        m_interest = interest;
+    }
+}
+
+template <typename Policies>
+void BasicHTTPConnectionHandler<Policies>::arm_timer(int timeout_ms)
+{
+    m_loop.timers().schedule(&m_timer, timeout_ms);
+}
 
-    return ClientActivity::COMPLETED;
-}
\ No newline at end of file
+// Each binary instantiates its own policy set, see CMakeLists.txt
+#ifdef HTTP_SERVER_STATIC_FILES
+template class BasicHTTPConnectionHandler<StaticFileServerPolicies>;
+#else
+template class BasicHTTPConnectionHandler<DefaultServerPolicies>;
+#endif
@@ -2,18 +2,200 @@
 #define HTTP_CONNECTION_HANDLER_H
 
 #include "defs.h"
+#include "access_log.h"
+#include "event_loop.h"
+#include "timer_wheel.h"
+#include "output_queue.h"
 #include "http_parser.h"
 #include "http_router.h"
+#include "chunked_decoder.h"
+#include "body_consumer.h"
+#include "http2_session.h"
+#include "websocket_session.h"
+#include "upstream_connection.h"
+#include "body_stream.h"
+#include "egress_scheduler.h"
+#include "handler_task.h"
+#include "server_policies.h"
 
-class HTTPConnectionHandler
+#include <memory>
+#include <string>
+#include <type_traits>
+#include <openssl/ssl.h>
+
+template <typename Policies>
+class BasicHTTPServer;
+
+// One instance per accepted client. Requests are framed out of m_input and
+// their responses appended to m_output, which is flushed as the socket
+// accepts data. Pipelined requests are answered in order; reading pauses
+// while too much response data is queued, so a slow reader costs at most
+// OUTPUT_HIGH_WATERMARK bytes plus one response. Every state that waits on
+// the peer has a deadline on the loop's timer wheel, including the TLS
+// handshake of an HTTPS connection. Policies choose the parser, router and
+// logger, and which of the features below are compiled in, as for
+// BasicHTTPServer.
+//
+// A cleartext connection that starts with the HTTP/2 preface, or upgrades
+// with "Upgrade: h2c", is handed over to an HTTP2Session that shares the
+// same input buffer and output queue; one that upgrades to WebSocket on a
+// WebSocket route is handed over to a WebSocketSession the same way, and
+// is pinged when it stays quiet.
+//
+// A request on a proxy route is forwarded through the server's upstream
+// pool, and a response with a body producer is streamed chunk by chunk as
+// it is generated; a request on a coroutine route is held until its
+// handler has produced the response. Later pipelined requests wait until
+// the response has been relayed.
+//
+// A request body that is chunked or has not fully arrived is streamed: to
+// the router's BodyConsumer for the request if it has one, spliced from a
+// plaintext socket when the consumer can take it that way, and otherwise
+// into the request, up to MAX_BODY_SIZE, which is routed once it is whole.
+//
+// When clients are rate limited, every request past the first takes a token
+// from the client's bucket as soon as its head has arrived, before it is
+// parsed; the first was paid for when the connection was accepted. A
+// refused request is answered with 429 and the connection is closed.
+//
+// Idle compaction, egress scheduling and access logging are described at
+// can_compact(), flush_output() and begin_access().
+template <typename Policies>
+class BasicHTTPConnectionHandler : public EventHandler, public TimerHandler, public UpstreamClient, public HandlerClient,
+                                   public EgressClient, public WebSocketOwner
 {
 public:
-    HTTPConnectionHandler();
-    ClientActivity handle_client(int sock_client);
+    using Loop = typename Policies::Loop;
+    using Parser = typename Policies::Parser;
+    using Router = typename Policies::Router;
+    using Log = typename Policies::Log;
+    using Server = BasicHTTPServer<Policies>;
+
+    static_assert(!Policies::http2 || std::is_same<Router, HTTPRouter>::value, "HTTP2Session routes through an HTTPRouter");
+    static_assert(Policies::handlers || !std::is_same<Router, HTTPRouter>::value, "HTTPRouter has coroutine routes");
+    static_assert(!Policies::websocket || std::is_same<Router, HTTPRouter>::value, "WebSocket routes are in HTTPRouter");
+
+    // client is the RateLimiter key of the peer's address.
+    BasicHTTPConnectionHandler(Server& server, Loop& loop, int sock_client, uint64_t client, SSL* ssl = nullptr);
+    ~BasicHTTPConnectionHandler();
+
+    int get_socket() const;
+    // Called before the socket is closed.
+    void shutdown();
+    // The server is going away: finish what is in progress, then close.
+    void drain();
+    // Takes over a compacted connection whose socket has become ready.
+    void resume(uint32_t events);
+    void handle_event(uint32_t events) override;
+    void handle_timeout(TimerNode* timer) override;
+
+    bool upstream_data(const std::string& data) override;
+    bool upstream_shared(const std::shared_ptr<const std::string>& buffer, std::size_t offset, std::size_t length) override;
+    void upstream_complete(bool close_client) override;
+    void upstream_failed(int status) override;
+
+    void handler_complete(const HTTPRequest& request, HTTPResponse& response) override;
+
+    std::size_t egress_write(std::size_t budget) override;
+    bool egress_pending() const override;
+
+    void websocket_output() override;
 
 private:
-    HTTPParser m_parser;
-    HTTPRouter m_router;
+    enum ConnectionState
+    {
+        IDLE,
+        READING_HEADERS,
+        READING_BODY
+    };
+
+    enum BodyProgress
+    {
+        BODY_PENDING,
+        BODY_COMPLETE,
+        // The consumer refused the body
+        BODY_REJECTED,
+        // Malformed chunked coding, or too large to be buffered
+        BODY_INVALID
+    };
+
+    ClientActivity handshake();
+    ClientActivity handle_client();
+    int receive(char* buffer, std::size_t length);
+    ClientActivity splice_body();
+    ClientActivity process_input();
+    bool admit_request();
+    bool start_body(std::size_t header_length, bool chunked, uint64_t body_length);
+    BodyProgress feed_body();
+    void finish_body(bool complete);
+    ClientActivity process_http2_input();
+    bool start_http2(const HTTPRequest* upgrade_request);
+    ClientActivity process_websocket_input();
+    // Returns false if the request is not for a WebSocket route; otherwise
+    // the connection is upgraded, or the invalid handshake answered.
+    bool start_websocket(const HTTPRequest& request);
+    // With the server's EgressScheduler, output beyond the priority lane
+    // waits for the connection's turn in egress_write() instead of being
+    // written as soon as the socket takes it.
+    ClientActivity flush_output();
+    // Writes up to limit bytes of m_output, adding them to written.
+    ClientActivity write_output(std::size_t limit, std::size_t& written);
+    void queue_response(HTTPResponse& response);
+    // The server's access log, if any, follows the request from when it
+    // has been parsed to when its response is complete, or cut short; 0
+    // keeps the status found so far. Only HTTP/1.x requests are logged.
+    void begin_access(const HTTPRequest& request);
+    void end_access(int status);
+    void start_body_stream(const HTTPRequest& request, HTTPResponse& response);
+    void finish_activity(ClientActivity activity);
+    // Between requests, with nothing buffered or in progress. On a server
+    // that compacts idle connections, such a plaintext HTTP/1.1 connection
+    // is handed back to the server, and a new one resumes it when the
+    // client's next request arrives.
+    bool can_compact() const;
+    void update_interest();
+    void arm_timer(int timeout_ms);
+
+private:
+    Server& m_server;
+    Loop& m_loop;
+    int m_sock;
+    uint64_t m_client;
+    // The token taken when the connection was accepted is still unused
+    bool m_request_prepaid;
+    SSL* m_ssl;
+    bool m_handshake_done;
+    uint32_t m_handshake_interest;
+    ConnectionState m_state;
+    bool m_closing;
+    bool m_draining;
+    bool m_peer_closed;
+    bool m_reading_paused;
+    uint32_t m_interest;
+    TimerNode m_timer;
+    EgressNode m_egress;
+    std::string m_input;
+    OutputQueue m_output;
+    Parser m_parser;
+    Router m_router;
+    FeaturePtr<Policies::http2, HTTP2Session> m_http2;
+    FeaturePtr<Policies::websocket, WebSocketSession> m_websocket;
+    UpstreamSource* m_upstream;
+    std::unique_ptr<BodyStream> m_stream;
+    std::unique_ptr<HandlerTask> m_handler_task;
+    bool m_upstream_responded;
+    // The request whose body is being streamed
+    bool m_body_streaming;
+    HTTPRequest m_body_request;
+    std::unique_ptr<BodyConsumer> m_body_consumer;
+    bool m_body_chunked;
+    uint64_t m_body_remaining;
+    ChunkedDecoder m_body_decoder;
+    // When the first byte of the next request was read, 0 before that
+    uint64_t m_request_arrival_us;
+    AccessEntry m_access;
 };
 
-#endif // HTTP_CONNECTION_HANDLER_H
\ No newline at end of file
+using HTTPConnectionHandler = BasicHTTPConnectionHandler<DefaultServerPolicies>;
+
+#endif // HTTP_CONNECTION_HANDLER_H
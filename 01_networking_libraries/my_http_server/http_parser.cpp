@@ -2,7 +2,9 @@
 
 #include <string>
 #include <cstring>
+#include <cstdlib>
 #include <sstream>
+#include <strings.h>
 
 HTTPRequest HTTPParser::parse(const std::string& raw_request)
 {
@@ -15,7 +17,7 @@ HTTPRequest HTTPParser::parse(const std::string& raw_request)
     if (std::getline(iss, line) && line != "\r")
     {
         std::istringstream iss_first_line(line);
-        iss_first_line >> request.m_method >> request.m_path;
+        iss_first_line >> request.m_method >> request.m_path >> request.m_version;
     }
 
     while (std::getline(iss, line) && line != "\r")
@@ -39,12 +41,62 @@ HTTPRequest HTTPParser::parse(const std::string& raw_request)
         }
     }
 
-    if (request.m_headers.count("Content-Length") > 0)
+    // Only the part of the body that is there; the head of a request whose
+    // body is streamed is parsed on its own.
+    std::size_t header_end = find_header_end(raw_request);
+    std::size_t body_length = content_length(raw_request);
+    if (body_length > 0 && header_end != std::string::npos)
     {
-        std::size_t body_length = std::stoi(request.m_headers["Content-Length"]);
-        request.m_body.resize(body_length);
-        iss.read(&request.m_body[0], body_length);
+        request.m_body = raw_request.substr(header_end, body_length);
     }
 
     return request;
+}
+
+std::size_t HTTPParser::find_header_end(const std::string& buffer)
+{
+    std::size_t pos = buffer.find("\r\n\r\n");
+    if (pos == std::string::npos)
+    {
+        return std::string::npos;
+    }
+    return pos + 4;
+}
+
+std::size_t HTTPParser::content_length(const std::string& raw_headers)
+{
+    const char* value = find_field(raw_headers, "content-length:");
+    return (value != nullptr) ? std::strtoull(value, nullptr, 10) : 0;
+}
+
+bool HTTPParser::is_chunked(const std::string& raw_headers)
+{
+    const char* value = find_field(raw_headers, "transfer-encoding:");
+    if (value == nullptr)
+    {
+        return false;
+    }
+
+    const char* line_end = std::strstr(value, "\r\n");
+    const char* chunked = strcasestr(value, "chunked");
+    return chunked != nullptr && (line_end == nullptr || chunked < line_end);
+}
+
+const char* HTTPParser::find_field(const std::string& raw_headers, const char* name)
+{
+    const std::size_t name_length = std::strlen(name);
+    std::size_t header_end = raw_headers.find("\r\n\r\n");
+    if (header_end == std::string::npos)
+    {
+        header_end = raw_headers.length();
+    }
+
+    for (std::size_t pos = raw_headers.find("\r\n"); pos != std::string::npos && pos < header_end; pos = raw_headers.find("\r\n", pos + 2))
+    {
+        if (strncasecmp(raw_headers.c_str() + pos + 2, name, name_length) == 0)
+        {
+            return raw_headers.c_str() + pos + 2 + name_length;
+        }
+    }
+    return nullptr;
 }
\ No newline at end of file
@@ -8,6 +8,16 @@ class HTTPParser
 {
 public:
     HTTPRequest parse(const std::string& raw_request);
+
+    // Framing helpers for the connection's input buffer
+    static std::size_t find_header_end(const std::string& buffer);
+    static std::size_t content_length(const std::string& raw_headers);
+    // "Transfer-Encoding: chunked", which takes precedence over Content-Length.
+    static bool is_chunked(const std::string& raw_headers);
+
+private:
+    // Value of the field, or null; the field name includes the colon.
+    static const char* find_field(const std::string& raw_headers, const char* name);
 };
 
 #endif // HTTP_PARSER_H
\ No newline at end of file
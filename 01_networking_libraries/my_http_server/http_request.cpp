@@ -0,0 +1,31 @@
+#include "http_request.h"
+
+#include <strings.h>
+
+std::string HTTPRequest::get_header(const std::string& key) const
+{
+    auto it = m_headers.find(key);
+    if (it != m_headers.end())
+    {
+        return it->second;
+    }
+
+    for (const auto& header : m_headers)
+    {
+        if (strcasecmp(header.first.c_str(), key.c_str()) == 0)
+        {
+            return header.second;
+        }
+    }
+    return std::string();
+}
+
+bool HTTPRequest::keep_alive() const
+{
+    std::string connection = get_header("Connection");
+    if (m_version == "HTTP/1.0")
+    {
+        return strcasecmp(connection.c_str(), "keep-alive") == 0;
+    }
+    return strcasecmp(connection.c_str(), "close") != 0;
+}
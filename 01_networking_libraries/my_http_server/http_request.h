@@ -8,10 +8,13 @@ class HTTPRequest
 {
 public:
     HTTPRequest() = default;
+    std::string get_header(const std::string& key) const;
+    bool keep_alive() const;
 
 public:
     std::string m_method;
     std::string m_path;
+    std::string m_version;
     std::unordered_map<std::string, std::string> m_headers;
     std::string m_body;
 };
@@ -3,10 +3,15 @@
 #include <string>
 #include <sstream>
 #include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
 
 HTTPResponse::HTTPResponse(int code, const std::string& body)
+    : m_status(code),
+      m_upstream(nullptr),
+      m_handler(nullptr)
 {
-
+    set_body(body);
 }
 
 void HTTPResponse::set_status(int status)
@@ -17,6 +22,9 @@ void HTTPResponse::set_status(int status)
 void HTTPResponse::set_body(const std::string& body)
 {
     m_body = body;
+    m_body_file.clear();
+    m_body_fd.reset();
+    m_body_producer.reset();
     set_header("Content-Length", std::to_string(m_body.length()));
 }
 
@@ -25,27 +33,144 @@ void HTTPResponse::set_header(const std::string& key, const std::string& val)
     m_headers[key] = val;
 }
 
-std::string HTTPResponse::to_string()
+void HTTPResponse::set_body_file(const std::string& path, std::size_t size)
+{
+    m_body.clear();
+    m_body_file = path;
+    m_body_fd.reset();
+    m_body_producer.reset();
+    set_header("Content-Length", std::to_string(size));
+}
+
+void HTTPResponse::set_body_file(const std::string& path, std::size_t size, int fd)
+{
+    set_body_file(path, size);
+    own_body_fd(fd);
+}
+
+int HTTPResponse::take_body_fd()
+{
+    if (m_body_fd == nullptr)
+    {
+        return -1;
+    }
+    int fd = *m_body_fd;
+    *m_body_fd = -1;
+    return fd;
+}
+
+HTTPResponse HTTPResponse::duplicate() const
+{
+    HTTPResponse copy = *this;
+    if (m_body_fd != nullptr && *m_body_fd >= 0)
+    {
+        // Should dup() fail, the connection opens the file itself.
+        copy.own_body_fd(fcntl(*m_body_fd, F_DUPFD_CLOEXEC, 0));
+    }
+    return copy;
+}
+
+int HTTPResponse::get_status() const
+{
+    return m_status;
+}
+
+const std::unordered_map<std::string, std::string>& HTTPResponse::get_headers() const
+{
+    return m_headers;
+}
+
+const std::string& HTTPResponse::get_body() const
+{
+    return m_body;
+}
+
+const std::string& HTTPResponse::get_body_file() const
+{
+    return m_body_file;
+}
+
+void HTTPResponse::set_body_producer(std::shared_ptr<BodyProducer> producer)
+{
+    m_body.clear();
+    m_body_file.clear();
+    m_body_fd.reset();
+    m_body_producer = std::move(producer);
+    m_headers.erase("Content-Length");
+}
+
+const std::shared_ptr<BodyProducer>& HTTPResponse::get_body_producer() const
+{
+    return m_body_producer;
+}
+
+void HTTPResponse::set_upstream(UpstreamGroup* upstream)
+{
+    m_upstream = upstream;
+}
+
+UpstreamGroup* HTTPResponse::get_upstream() const
+{
+    return m_upstream;
+}
+
+void HTTPResponse::set_handler(const HandlerRoute* handler)
+{
+    m_handler = handler;
+}
+
+const HandlerRoute* HTTPResponse::get_handler() const
+{
+    return m_handler;
+}
+
+std::string HTTPResponse::header_string()
 {
     std::ostringstream oss;
     oss << "HTTP/1.1 " << m_status << " " << code_to_message(m_status) << "\r\n";
     for (const auto& header : m_headers)
     {
-        oss << header.first << ":" << header.second << "\r\n";
+        oss << header.first << ": " << header.second << "\r\n";
     }
-    oss << "Content-Length: " << m_body.length() << "\r\n";
     oss << "\r\n";
-    oss << m_body;
     return oss.str();
 }
 
+std::string HTTPResponse::to_string()
+{
+    return header_string() + m_body;
+}
+
+void HTTPResponse::own_body_fd(int fd)
+{
+    // Shared by the copies of the response; the last one closes it unless
+    // it has been taken.
+    m_body_fd.reset(new int(fd), [](int* owned)
+    {
+        if (*owned >= 0)
+        {
+            close(*owned);
+        }
+        delete owned;
+    });
+}
+
 std::string HTTPResponse::code_to_message(int code)
 {
     switch (code)
     {
         case 200: return "OK";
+        case 201: return "Created";
+        case 400: return "Bad Request";
+        case 403: return "Forbidden";
         case 404: return "Not Found";
+        case 405: return "Method Not Allowed";
+        case 413: return "Payload Too Large";
+        case 429: return "Too Many Requests";
         case 500: return "Internal Server Error";
+        case 502: return "Bad Gateway";
+        case 503: return "Service Unavailable";
+        case 504: return "Gateway Timeout";
         default:  return "Unknown";
     }
 }
\ No newline at end of file
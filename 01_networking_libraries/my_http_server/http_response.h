@@ -1,9 +1,14 @@
 #ifndef HTTP_RESPONSE_H
 #define HTTP_RESPONSE_H
 
+#include <memory>
 #include <string>
 #include <unordered_map>
 
+class UpstreamGroup;
+class BodyProducer;
+struct HandlerRoute;
+
 class HTTPResponse
 {
 public:
@@ -11,15 +16,46 @@ public:
     void set_status(int status);
     void set_body(const std::string& body);
     void set_header(const std::string& key, const std::string& val);
+    // The body is sent straight from the file instead of from m_body.
+    void set_body_file(const std::string& path, std::size_t size);
+    // The same, for a file that is already open; the response owns fd
+    // until take_body_fd() hands it over.
+    void set_body_file(const std::string& path, std::size_t size, int fd);
+    // The open body file, or -1 if there is none; the caller closes it.
+    int take_body_fd();
+    // A copy that owns a descriptor of its own for the open body file, for
+    // a response handed to several connections.
+    HTTPResponse duplicate() const;
+    int get_status() const;
+    const std::unordered_map<std::string, std::string>& get_headers() const;
+    const std::string& get_body() const;
+    const std::string& get_body_file() const;
+    // The body is generated while it is being sent, and its length is not
+    // known up front; the connection sends it chunked.
+    void set_body_producer(std::shared_ptr<BodyProducer> producer);
+    const std::shared_ptr<BodyProducer>& get_body_producer() const;
+    // A proxy route: the response is produced by one of these upstreams.
+    void set_upstream(UpstreamGroup* upstream);
+    UpstreamGroup* get_upstream() const;
+    // A coroutine route: the response is produced by this handler.
+    void set_handler(const HandlerRoute* handler);
+    const HandlerRoute* get_handler() const;
+    std::string header_string();
     std::string to_string();
 
 private:
+    void own_body_fd(int fd);
     std::string code_to_message(int code);
 
 private:
     int m_status;
     std::unordered_map<std::string, std::string> m_headers;
     std::string m_body;
+    std::string m_body_file;
+    std::shared_ptr<int> m_body_fd;
+    std::shared_ptr<BodyProducer> m_body_producer;
+    UpstreamGroup* m_upstream;
+    const HandlerRoute* m_handler;
 };
 
 #endif // HTTP_RESPONSE_H
\ No newline at end of file
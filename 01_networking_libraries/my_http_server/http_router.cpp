@@ -1,64 +1,269 @@
 #include "http_router.h"
 #include "logging.h"
 #include "defs.h"
+#include "metrics.h"
+#include "static_file_router.h"
+#include "topic_registry.h"
+#include "upload_file.h"
+#include "upstream_pool.h"
+#include "websocket_session.h"
 
+#include <algorithm>
 #include <string>
 #include <cstring>
+#include <cstdlib>
+#include <cstdio>
+#include <deque>
 #include <sstream>
-#include <fstream>
-
-#if __has_include(<filesystem>)
-    #include <filesystem>
-    namespace fs = std::filesystem;
-#elif __has_include(<experimental/filesystem>)
-    #include <experimental/filesystem>
-    namespace fs = std::experimental::filesystem;
-#else
-    #error "No filesystem support available!"
-#endif
-
-HTTPResponse HTTPRouter::route(const HTTPRequest& request)
+
+namespace
 {
-    HTTPResponse response;
+    // Answers after the number of milliseconds in the path, without holding
+    // up the loop meanwhile.
+    Task<HTTPResponse> delay_handler(HandlerContext& context, const HTTPRequest& request)
+    {
+        int delay_ms = std::atoi(request.m_path.c_str() + std::strlen(STR_DELAY_PATH));
+        delay_ms = std::max(0, std::min(delay_ms, DELAY_MAX_MS));
+        co_await context.sleep(delay_ms);
+        co_return HTTPResponse(HTTP_200, std::to_string(delay_ms) + " ms\n");
+    }
+
+    // Hashes the path over and over, as many times as the number in it says:
+    // CPU-bound work that keeps to the compute threads when there are any.
+    Task<HTTPResponse> hash_handler(HandlerContext& context, const HTTPRequest& request)
+    {
+        long rounds = std::atol(request.m_path.c_str() + std::strlen(STR_HASH_PATH));
+        rounds = std::max(0L, std::min(rounds, static_cast<long>(HASH_MAX_ROUNDS)));
+        std::string path = request.m_path;
+        auto work = [path, rounds]
+        {
+            // FNV-1a of the path, then mixed rounds times with SplitMix64
+            uint64_t hash = 14695981039346656037ULL;
+            for (unsigned char c : path)
+            {
+                hash = (hash ^ c) * 1099511628211ULL;
+            }
+            for (long i = 0; i < rounds; i++)
+            {
+                hash += 0x9e3779b97f4a7c15ULL;
+                hash = (hash ^ (hash >> 30)) * 0xbf58476d1ce4e5b9ULL;
+                hash = (hash ^ (hash >> 27)) * 0x94d049bb133111ebULL;
+                hash ^= hash >> 31;
+            }
+            char hex[17];
+            snprintf(hex, sizeof(hex), "%016llx", static_cast<unsigned long long>(hash));
+            return std::string(hex);
+        };
+        std::string hash = co_await context.compute(std::move(work));
+        co_return HTTPResponse(HTTP_200, hash + "\n");
+    }
+
+    // Requests for the same file that arrive while it is being looked up
+    // wait for that lookup, so a burst of misses costs the disk one.
+    Task<HTTPResponse> offloaded_file_handler(HandlerContext& context, const HTTPRequest& request)
+    {
+        std::string path = request.m_path;
+        HandlerContext::SharedOffload::Work work = [path]
+        {
+            return StaticFileRouter::static_file(path, true);
+        };
+        HTTPResponse response = co_await context.offload_shared(StaticFileRouter::static_path(path), std::move(work));
+        co_return response;
+    }
+
+    const HandlerRoute& offloaded_file_route()
+    {
+        static const HandlerRoute route = {"/", offloaded_file_handler};
+        return route;
+    }
 
-    std::string path = fs::current_path().string() + "/" + std::string(STR_HTTP_ROOT_PATH) + request.m_path;
-    LOGI(path);
-    if (!fs::exists(path) || !fs::is_directory(path))
+    // A deque, so the routes handed out stay where they are.
+    std::deque<HandlerRoute>& handler_routes()
     {
-        LOGE("Path is not found");
-        path = fs::current_path().string() + "/" + std::string(STR_HTTP_ROOT_PATH) + std::string("/404");
-        response.set_status(HTTP_404);
+        static std::deque<HandlerRoute> routes = {{STR_DELAY_PATH, delay_handler}, {STR_HASH_PATH, hash_handler}};
+        return routes;
     }
-    else
+
+    // Sends every message back as it came.
+    class EchoHandler : public WebSocketHandler
+    {
+    public:
+        void on_message(WebSocketSession& session, const char* data, std::size_t length, bool binary) override
+        {
+            session.send(data, length, binary);
+        }
+    };
+
+    std::unique_ptr<WebSocketHandler> create_echo_handler(const HTTPRequest& request)
+    {
+        (void)request;
+        return std::unique_ptr<WebSocketHandler>(new EchoHandler());
+    }
+
+    std::deque<WebSocketRoute>& websocket_routes()
+    {
+        static std::deque<WebSocketRoute> routes = {{STR_ECHO_PATH, create_echo_handler}};
+        return routes;
+    }
+}
+
+HTTPRouter::HTTPRouter(UpstreamPool* upstreams, const std::string& upload_dir, OffloadPool* offload)
+    : m_upstreams(upstreams),
+      m_upload_dir(upload_dir),
+      m_offload(offload)
+{
+
+}
+
+HTTPResponse HTTPRouter::route(const HTTPRequest& request, bool can_wait)
+{
+    HTTPResponse response;
+    METRIC_INC(METRIC_REQUESTS);
+
+    if (request.m_path == STR_METRICS_PATH)
     {
         response.set_status(HTTP_200);
+        response.set_header("Content-Type", "text/plain");
+        response.set_body(Metrics::getInstance().to_string());
+        return response;
     }
 
+    if (request.m_path.length() > std::strlen(STR_EVENTS_PATH) &&
+        request.m_path.compare(0, std::strlen(STR_EVENTS_PATH), STR_EVENTS_PATH) == 0)
+    {
+        return event_stream(request);
+    }
 
-    std::string filename = path + "/" + STR_HTTP_MAIN_PAGE;
-    std::fstream file(filename, std::ios::in);
-    if (file.is_open())
+    const HandlerRoute* handler = match_handler(request.m_path);
+    if (handler != nullptr)
     {
-        file.seekg(0, std::ios::end);
-        std::streampos file_size = file.tellg();
-        file.seekg(0, std::ios::beg);
+        response.set_handler(handler);
+        return response;
+    }
 
-        std::string html_content;
-        html_content.resize(file_size);
+    // An upload small enough to have arrived whole
+    if (is_upload(request))
+    {
+        std::unique_ptr<BodyConsumer> upload = create_upload(request);
+        upload->consume(request.m_body.data(), request.m_body.length());
+        return upload->finish(true);
+    }
 
-        file.read(&html_content[0], file_size);
+    // Proxy route: the connection forwards the request and streams the
+    // upstream's response back.
+    UpstreamGroup* upstream = (m_upstreams != nullptr) ? m_upstreams->match(request.m_path) : nullptr;
+    if (upstream != nullptr)
+    {
+        response.set_upstream(upstream);
+        return response;
+    }
 
-        if (file)
-        {
-            response.set_body(html_content);
-        }
-        else
+    LOGI("Static file " + request.m_path);
+
+    // With an offload pool the file is looked up there, by a coroutine
+    // that waits for it, so a slow disk does not stall the loop.
+    if (m_offload != nullptr && can_wait)
+    {
+        response.set_handler(&offloaded_file_route());
+        return response;
+    }
+    return StaticFileRouter::static_file(request.m_path, false);
+}
+
+std::unique_ptr<BodyConsumer> HTTPRouter::accept_body(const HTTPRequest& request)
+{
+    if (!is_upload(request))
+    {
+        return nullptr;
+    }
+
+    METRIC_INC(METRIC_REQUESTS);
+    return create_upload(request);
+}
+
+std::unique_ptr<WebSocketHandler> HTTPRouter::accept_websocket(const HTTPRequest& request)
+{
+    const WebSocketRoute* match = nullptr;
+    for (const WebSocketRoute& route : websocket_routes())
+    {
+        if (request.m_path.compare(0, route.prefix.length(), route.prefix) == 0 &&
+            (match == nullptr || route.prefix.length() > match->prefix.length()))
         {
-           LOGE("Error reading the file");
+            match = &route;
         }
+    }
+    if (match == nullptr)
+    {
+        return nullptr;
+    }
+
+    METRIC_INC(METRIC_REQUESTS);
+    return match->factory(request);
+}
+
+void HTTPRouter::add_handler(const std::string& prefix, CoroutineHandler handler)
+{
+    handler_routes().push_back({prefix, std::move(handler)});
+}
 
-        file.close();
+void HTTPRouter::add_websocket(const std::string& prefix, WebSocketFactory factory)
+{
+    websocket_routes().push_back({prefix, std::move(factory)});
+}
+
+HTTPResponse HTTPRouter::event_stream(const HTTPRequest& request)
+{
+    TopicRegistry& registry = TopicRegistry::getInstance();
+    std::string topic = request.m_path.substr(std::strlen(STR_EVENTS_PATH));
+
+    // A POST publishes its body to the topic's subscribers.
+    if (request.m_method == "POST")
+    {
+        EventDelivery delivery = registry.publish(topic, request.m_body);
+        HTTPResponse response(HTTP_200, "id " + std::to_string(delivery.id) + "\n" +
+                                        "delivered " + std::to_string(delivery.delivered) + "\n" +
+                                        "dropped " + std::to_string(delivery.dropped) + "\n");
+        response.set_header("Content-Type", "text/plain");
+        return response;
+    }
+    if (request.m_method != "GET" && request.m_method != "HEAD")
+    {
+        HTTPResponse response(HTTP_405, "405 Method Not Allowed");
+        response.set_header("Allow", "GET, HEAD, POST");
+        return response;
     }
 
+    HTTPResponse response(HTTP_200, "");
+    response.set_header("Content-Type", "text/event-stream");
+    response.set_header("Cache-Control", "no-cache");
+    response.set_body_producer(registry.subscribe(topic));
     return response;
 }
+
+const HandlerRoute* HTTPRouter::match_handler(const std::string& path)
+{
+    const HandlerRoute* match = nullptr;
+    for (const HandlerRoute& route : handler_routes())
+    {
+        if (path.compare(0, route.prefix.length(), route.prefix) == 0 &&
+            (match == nullptr || route.prefix.length() > match->prefix.length()))
+        {
+            match = &route;
+        }
+    }
+    return match;
+}
+
+bool HTTPRouter::is_upload(const HTTPRequest& request) const
+{
+    return !m_upload_dir.empty() &&
+           (request.m_method == "PUT" || request.m_method == "POST") &&
+           request.m_path.compare(0, std::strlen(STR_UPLOAD_PATH), STR_UPLOAD_PATH) == 0;
+}
+
+std::unique_ptr<BodyConsumer> HTTPRouter::create_upload(const HTTPRequest& request) const
+{
+    std::unique_ptr<UploadFile> upload(new UploadFile());
+    upload->open(m_upload_dir, request.m_path.substr(std::strlen(STR_UPLOAD_PATH)));
+    return upload;
+}
@@ -1,14 +1,57 @@
 #ifndef HTTP_ROUTER_H
 #define HTTP_ROUTER_H
 
+#include "body_consumer.h"
+#include "handler_context.h"
 #include "http_request.h"
 #include "http_response.h"
+#include "websocket_handler.h"
+
+#include <memory>
+#include <string>
+
+class OffloadPool;
+class UpstreamPool;
 
 class HTTPRouter
 {
 public:
-    HTTPRouter() = default;
-    HTTPResponse route(const HTTPRequest& request);
+    // Proxy routes are looked up in upstreams when it is not null, and
+    // uploads are stored in upload_dir when it is not empty. Static files
+    // are looked up on offload when it is not null.
+    explicit HTTPRouter(UpstreamPool* upstreams = nullptr, const std::string& upload_dir = std::string(), OffloadPool* offload = nullptr);
+    // can_wait: the caller can run a coroutine handler for the response,
+    // so static files can be looked up on the offload pool.
+    HTTPResponse route(const HTTPRequest& request, bool can_wait = false);
+    // Called with the head of a request whose body has not arrived yet.
+    // Returns the consumer the body is streamed to, or null if the body is
+    // to be buffered and the request routed once it is complete.
+    std::unique_ptr<BodyConsumer> accept_body(const HTTPRequest& request);
+    // Called with a request asking to upgrade to WebSocket. Returns the
+    // handler of the WebSocket route for its path, or null if there is
+    // none and the request is to be routed as any other.
+    std::unique_ptr<WebSocketHandler> accept_websocket(const HTTPRequest& request);
+
+    // Routes the requests whose path starts with prefix to a coroutine
+    // handler, ahead of the static files. Handlers are registered before
+    // the server starts and apply to every router.
+    static void add_handler(const std::string& prefix, CoroutineHandler handler);
+    // Serves WebSocket connections upgraded on paths that start with
+    // prefix with handlers made by factory, registered the same way.
+    static void add_websocket(const std::string& prefix, WebSocketFactory factory);
+
+private:
+    static const HandlerRoute* match_handler(const std::string& path);
+    // STR_EVENTS_PATH<topic>: GET subscribes to the topic's Server-Sent
+    // Events, POST publishes the request body to it.
+    static HTTPResponse event_stream(const HTTPRequest& request);
+    bool is_upload(const HTTPRequest& request) const;
+    std::unique_ptr<BodyConsumer> create_upload(const HTTPRequest& request) const;
+
+private:
+    UpstreamPool* m_upstreams;
+    std::string m_upload_dir;
+    OffloadPool* m_offload;
 };
 
 #endif // HTTP_ROUTER_H
\ No newline at end of file
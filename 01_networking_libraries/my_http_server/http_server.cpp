@@ -1,7 +1,9 @@
 #include "http_server.h"
-#include "logging.h"
 #include "defs.h"
 #include "utils.h"
+#include "metrics.h"
+#include "topic_registry.h"
+#include "worker_supervisor.h"
 
 #include <unistd.h>
 #include <iostream>
@@ -9,94 +11,881 @@
 #include <cstring>
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <netdb.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/signalfd.h>
 
-#include <poll.h>
+#include <csignal>
+#include <cerrno>
 
-HTTPServer::HTTPServer(int port)
-    : sock_server(-1)
+template <typename Policies>
+BasicHTTPListener<Policies>::BasicHTTPListener(BasicHTTPServer<Policies>& server, int sock, TLSContext* tls)
+    : m_server(server),
+      m_sock(sock),
+      m_tls(tls)
 {
-    if (this->setup_socket(port) == false)
+
+}
+
+template <typename Policies>
+BasicHTTPListener<Policies>::~BasicHTTPListener()
+{
+    close(m_sock);
+}
+
+template <typename Policies>
+int BasicHTTPListener<Policies>::get_socket() const
+{
+    return m_sock;
+}
+
+template <typename Policies>
+TLSContext* BasicHTTPListener<Policies>::get_tls() const
+{
+    return m_tls;
+}
+
+template <typename Policies>
+void BasicHTTPListener<Policies>::handle_event(uint32_t events)
+{
+    if (events & EPOLLIN)
+    {
+        m_server.accept_clients(*this);
+    }
+}
+
+template <typename Policies>
+BasicHTTPServerControl<Policies>::BasicHTTPServerControl(BasicHTTPServer<Policies>& server, void (BasicHTTPServer<Policies>::*action)())
+    : m_server(server),
+      m_action(action)
+{
+
+}
+
+template <typename Policies>
+void BasicHTTPServerControl<Policies>::handle_event(uint32_t events)
+{
+    if (events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+    {
+        (m_server.*m_action)();
+    }
+}
+
+template <typename Policies>
+void BasicHTTPServerControl<Policies>::handle_timeout(TimerNode* timer)
+{
+    (void)timer;
+    (m_server.*m_action)();
+}
+
+template <typename Policies>
+BasicHTTPServer<Policies>::BasicHTTPServer(const ServerConfig& config)
+    : m_config(config),
+      m_accepting(false),
+      m_upstreams(m_loop),
+      m_quit_signal_fd(-1),
+      m_draining(false),
+      m_drain_deadline_ms(0)
+{
+    if (!check_features())
+    {
+        return;
+    }
+    m_loop.set_busy_poll(config.busy_poll_us);
+
+    // Every connection holds a descriptor, idle or not.
+    std::size_t descriptors = static_cast<std::size_t>(config.max_connections) + FD_LIMIT_RESERVE;
+    if (raise_fd_limit(descriptors) < descriptors)
+    {
+        SERVER_LOGE("Server descriptor limit is too low for " + std::to_string(config.max_connections) + " connections");
+    }
+    if (config.compact_idle)
+    {
+        m_idle.reset(new IdleConnectionSet(m_loop, this));
+    }
+    if (config.fair_egress)
+    {
+        m_egress.reset(new EgressScheduler(m_loop, config.egress_rate, config.connection_rate));
+    }
+
+    if (config.shed_target_ms > 0)
+    {
+        m_load_shedder.reset(new LoadShedder(config.shed_target_ms, config.shed_interval_ms));
+        m_loop.set_measure_ready(true);
+    }
+
+    // Mapped before the workers are forked, so all of them share it.
+    if (config.rate_limit > 0)
+    {
+        m_rate_limiter.reset(new RateLimiter(config.rate_limit, config.rate_limit_burst));
+        if (!m_rate_limiter->init())
+        {
+            SERVER_LOGE("Server rate limit table cannot be mapped");
+            m_rate_limiter.reset();
+        }
+    }
+
+    if constexpr (Policies::proxy)
+    {
+        for (const ProxyRoute& route : config.proxy_routes)
+        {
+            if (!m_upstreams.add_route(route.prefix, route.upstreams))
+            {
+                SERVER_LOGE("Server proxy route " + route.prefix + " is not valid");
+                return;
+            }
+        }
+    }
+
+    // On a hot upgrade the listening sockets come from the running server,
+    // with whatever connections are waiting in their backlog.
+    std::vector<int> inherited;
+    if (!config.upgrade_socket.empty())
+    {
+        m_upgrade.reset(new UpgradeSocket());
+        if (config.upgrade && !m_upgrade->take_over(config.upgrade_socket, inherited))
+        {
+            SERVER_LOGE("Server cannot take over from the running server");
+            return;
+        }
+    }
+
+    // With incoming-CPU steering every worker gets a listener of its own
+    // per port, all in one SO_REUSEPORT group.
+    std::size_t group_size = (config.incoming_cpu && config.workers > 0) ? config.workers : 1;
+    std::vector<int> socks_server = take_listeners(inherited, config.port, group_size);
+    std::vector<int> socks_tls;
+    if (config.https_port >= 0)
+    {
+        socks_tls = take_listeners(inherited, config.https_port, group_size);
+    }
+    for (int sock : inherited)
+    {
+        close(sock);
+    }
+
+    if (m_upgrade != nullptr && !m_upgrade->listen(config.upgrade_socket))
+    {
+        SERVER_LOGE("Server upgrade socket is not ready");
+    }
+
+    if (socks_server.empty())
+    {
+        SERVER_LOGE("Server HTTP service is not ready");
+        for (int sock : socks_tls)
+        {
+            close(sock);
+        }
+        return;
+    }
+    for (int sock : socks_server)
+    {
+        m_listeners.emplace_back(new Listener(*this, sock, nullptr));
+    }
+
+    if (!Policies::tls || config.https_port < 0)
+    {
+        return;
+    }
+
+    m_tls.reset(new TLSContext());
+    if (socks_tls.empty() || !m_tls->init(config.cert_file, config.key_file, config.enable_ktls))
+    {
+        SERVER_LOGE("Server HTTPS service is not ready");
+        for (int sock : socks_tls)
+        {
+            close(sock);
+        }
+        return;
+    }
+    for (int sock : socks_tls)
+    {
+        m_listeners.emplace_back(new Listener(*this, sock, m_tls.get()));
+    }
+}
+
+template <typename Policies>
+BasicHTTPServer<Policies>::~BasicHTTPServer()
+{
+    if (m_quit_signal_fd >= 0)
+    {
+        close(m_quit_signal_fd);
+    }
+}
+
+template <typename Policies>
+void BasicHTTPServer<Policies>::start()
+{
+    if (m_listeners.empty() || !m_loop.is_valid())
+    {
+        return;
+    }
+
+    // A single process logs as worker 0.
+    int worker = 0;
+    if (m_config.workers > 0)
+    {
+        std::vector<int> sockets;
+        for (auto& listener : m_listeners)
+        {
+            sockets.push_back(listener->get_socket());
+        }
+
+        // The workers are forked right away and pick up whatever the old
+        // server leaves in the backlog.
+        if (m_upgrade != nullptr)
+        {
+            m_upgrade->confirm();
+        }
+
+        // Only the listening sockets are inherited; each worker has its own
+        // loop, connections and upstream pool. The master alone answers
+        // upgrade requests.
+        WorkerSupervisor supervisor(m_config.workers, m_config.pin_workers, m_config.worker_cpus, m_config.numa_local);
+        worker = supervisor.run(m_upgrade.get(), sockets);
+        if (worker < 0 || !m_loop.reopen())
+        {
+            return;
+        }
+        keep_worker_listeners(worker, supervisor.get_cpu(worker));
+        if (m_upgrade != nullptr)
+        {
+            m_upgrade->abandon();
+            m_upgrade.reset();
+        }
+    }
+
+    if (!m_config.access_log.empty())
+    {
+        m_access_log.reset(new AccessLog(m_config.access_log, worker));
+        if (!m_access_log->start())
+        {
+            m_access_log.reset();
+        }
+        else
+        {
+            m_loop.set_measure_ready(true);
+        }
+    }
+    if (Policies::handlers && m_config.offload_threads > 0)
+    {
+        m_offload.reset(new OffloadPool(m_loop, m_config.offload_threads));
+        if (!m_offload->start())
+        {
+            m_offload.reset();
+        }
+    }
+    if (Policies::handlers && m_config.compute_threads > 0)
+    {
+        m_scheduler.reset(new WorkStealingScheduler(m_loop, m_config.compute_threads, m_config.compute_stealing));
+        if (!m_scheduler->start())
+        {
+            m_scheduler.reset();
+        }
+    }
+
+    for (auto& listener : m_listeners)
+    {
+        if (!m_loop.add(listener->get_socket(), listener_events(), listener.get()))
+        {
+            return;
+        }
+    }
+    m_accepting = true;
+
+    if (!watch_controls())
+    {
+        return;
+    }
+    if (m_upgrade != nullptr)
+    {
+        m_upgrade->confirm();
+    }
+
+    // Server Loop, until a drain has closed the last connection
+    while (!m_draining || (!m_connections.empty() && m_loop.now_ms() < m_drain_deadline_ms))
+    {
+        m_loop.run_once();
+
+        // Connections closed during this iteration may still have had events
+        // queued behind the one that closed them, so free them only now.
+        m_closed_connections.clear();
+        if (m_idle != nullptr)
+        {
+            m_idle->collect();
+        }
+        if constexpr (Policies::proxy)
+        {
+            m_upstreams.reap();
+        }
+    }
+
+    if (!m_connections.empty())
+    {
+        SERVER_LOGE("Server drain timed out with " + std::to_string(m_connections.size()) + " connections open");
+    }
+    SERVER_LOGI("Server is stopped");
+}
+
+template <typename Policies>
+bool BasicHTTPServer<Policies>::check_features()
+{
+    bool supported = true;
+    if (!Policies::proxy && !m_config.proxy_routes.empty())
+    {
+        SERVER_LOGE("Server is built without proxy routes");
+        supported = false;
+    }
+    if (!Policies::uploads && !m_config.upload_dir.empty())
+    {
+        SERVER_LOGE("Server is built without uploads");
+        supported = false;
+    }
+    if (!Policies::handlers && (m_config.offload_threads > 0 || m_config.compute_threads > 0))
+    {
+        SERVER_LOGE("Server is built without coroutine handlers");
+        supported = false;
+    }
+    if (!Policies::tls && m_config.https_port >= 0)
+    {
+        SERVER_LOGE("Server is built without HTTPS");
+        supported = false;
+    }
+    if (!Policies::websocket && m_config.websocket_deflate)
+    {
+        SERVER_LOGE("Server is built without WebSocket");
+        supported = false;
+    }
+    return supported;
+}
+
+template <typename Policies>
+void BasicHTTPServer<Policies>::close_connection(Connection* connection)
+{
+    auto it = m_connections.find(connection->get_socket());
+    if (it == m_connections.end())
+    {
+        return;
+    }
+
+    connection->shutdown();
+    m_loop.remove(it->first);
+    close(it->first);
+    m_closed_connections.push_back(std::move(it->second));
+    m_connections.erase(it);
+    METRIC_DEC(METRIC_CONNECTIONS_OPEN);
+
+    set_accepting(true);
+}
+
+template <typename Policies>
+bool BasicHTTPServer<Policies>::compact_connection(Connection* connection, uint64_t client)
+{
+    if (m_idle == nullptr || m_draining)
+    {
+        return false;
+    }
+    auto it = m_connections.find(connection->get_socket());
+    if (it == m_connections.end() || m_idle->add(it->first, client) == nullptr)
+    {
+        return false;
+    }
+
+    // Still open: only the connection object goes.
+    m_closed_connections.push_back(std::move(it->second));
+    m_connections.erase(it);
+    return true;
+}
+
+template <typename Policies>
+void BasicHTTPServer<Policies>::wake_connection(IdleConnection* idle, uint32_t events)
+{
+    int sock = idle->get_socket();
+    ConnectionPtr connection(Allocator::template create<Connection>(*this, m_loop, sock, idle->get_client(), nullptr));
+    if (!m_loop.modify(sock, EPOLLIN | EPOLLRDHUP, connection.get()))
+    {
+        close_idle_connection(idle);
+        return;
+    }
+    m_idle->remove(idle);
+
+    Connection* resumed = connection.get();
+    m_connections[sock] = std::move(connection);
+    resumed->resume(events);
+}
+
+template <typename Policies>
+void BasicHTTPServer<Policies>::expire_connection(IdleConnection* idle)
+{
+    SERVER_LOGI("Keep-alive connection is idle for too long");
+    close_idle_connection(idle);
+}
+
+template <typename Policies>
+void BasicHTTPServer<Policies>::close_idle_connection(IdleConnection* idle)
+{
+    int sock = idle->get_socket();
+    m_idle->remove(idle);
+    m_loop.remove(sock);
+    close(sock);
+    METRIC_DEC(METRIC_CONNECTIONS_OPEN);
+
+    set_accepting(true);
+}
+
+template <typename Policies>
+UpstreamPool* BasicHTTPServer<Policies>::get_upstreams()
+{
+    if constexpr (Policies::proxy)
+    {
+        return &m_upstreams;
+    }
+    else
+    {
+        return nullptr;
+    }
+}
+
+template <typename Policies>
+const ServerConfig& BasicHTTPServer<Policies>::get_config() const
+{
+    return m_config;
+}
+
+template <typename Policies>
+RateLimiter* BasicHTTPServer<Policies>::get_rate_limiter() const
+{
+    return m_rate_limiter.get();
+}
+
+template <typename Policies>
+LoadShedder* BasicHTTPServer<Policies>::get_load_shedder() const
+{
+    return m_load_shedder.get();
+}
+
+template <typename Policies>
+OffloadPool* BasicHTTPServer<Policies>::get_offload_pool() const
+{
+    return m_offload.get();
+}
+
+template <typename Policies>
+WorkStealingScheduler* BasicHTTPServer<Policies>::get_scheduler() const
+{
+    return m_scheduler.get();
+}
+
+template <typename Policies>
+EgressScheduler* BasicHTTPServer<Policies>::get_egress_scheduler() const
+{
+    return m_egress.get();
+}
+
+template <typename Policies>
+AccessLog* BasicHTTPServer<Policies>::get_access_log() const
+{
+    return m_access_log.get();
+}
+
+template <typename Policies>
+HandlerServices BasicHTTPServer<Policies>::get_handler_services()
+{
+    return {m_loop, get_upstreams(), m_offload.get(), m_scheduler.get()};
+}
+
+template <typename Policies>
+void BasicHTTPServer<Policies>::hand_over()
+{
+    std::vector<int> sockets;
+    for (auto& listener : m_listeners)
     {
-        LOGE("Server HTTP service is not ready");
+        sockets.push_back(listener->get_socket());
+    }
+
+    if (!m_upgrade->offer(sockets))
+    {
+        return;
+    }
+
+    // The answer is awaited on the loop, which keeps serving meanwhile; the
+    // upgrade socket is left alone until it has come.
+    m_loop.modify(m_upgrade->get_socket(), 0, m_upgrade_control.get());
+    if (!m_loop.add(m_upgrade->get_channel(), EPOLLIN, m_hand_over_control.get()))
+    {
+        m_upgrade->cancel_hand_over();
+        m_loop.modify(m_upgrade->get_socket(), EPOLLIN, m_upgrade_control.get());
+        return;
     }
+    m_loop.timers().schedule(&m_hand_over_timer, UPGRADE_CONFIRM_TIMEOUT_MS);
 }
 
-void HTTPServer::start()
+template <typename Policies>
+void BasicHTTPServer<Policies>::finish_hand_over()
 {
-    if (this->sock_server < 0)
+    m_loop.timers().cancel(&m_hand_over_timer);
+    m_loop.remove(m_upgrade->get_channel());
+    if (m_upgrade->finish_hand_over())
     {
+        drain();
         return;
     }
+    m_loop.modify(m_upgrade->get_socket(), EPOLLIN, m_upgrade_control.get());
+}
+
+template <typename Policies>
+void BasicHTTPServer<Policies>::handle_quit_signal()
+{
+    signalfd_siginfo info;
+    while (read(m_quit_signal_fd, &info, sizeof(info)) == sizeof(info))
+    {
+    }
+
+    if (!m_draining)
+    {
+        SERVER_LOGI("Server received SIGQUIT");
+        drain();
+    }
+}
+
+template <typename Policies>
+bool BasicHTTPServer<Policies>::watch_controls()
+{
+    // SIGQUIT is read from a signalfd, so it is handled between events like
+    // any other input. Prefork workers are spawned with it already blocked.
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGQUIT);
+    sigprocmask(SIG_BLOCK, &signals, nullptr);
+    m_quit_signal_fd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (m_quit_signal_fd < 0)
+    {
+        SERVER_LOGE("Server signalfd() failed");
+        return false;
+    }
+
+    m_quit_control.reset(new Control(*this, &BasicHTTPServer::handle_quit_signal));
+    if (!m_loop.add(m_quit_signal_fd, EPOLLIN, m_quit_control.get()))
+    {
+        return false;
+    }
+
+    if (m_upgrade != nullptr && m_upgrade->get_socket() >= 0)
+    {
+        m_upgrade_control.reset(new Control(*this, &BasicHTTPServer::hand_over));
+        m_hand_over_control.reset(new Control(*this, &BasicHTTPServer::finish_hand_over));
+        m_hand_over_timer.set_handler(m_hand_over_control.get());
+        return m_loop.add(m_upgrade->get_socket(), EPOLLIN, m_upgrade_control.get());
+    }
+    return true;
+}
+
+template <typename Policies>
+void BasicHTTPServer<Policies>::drain()
+{
+    SERVER_LOGI("Server is draining");
+    m_draining = true;
+    m_drain_deadline_ms = m_loop.now_ms() + DRAIN_TIMEOUT_MS;
+
+    if (m_upgrade != nullptr && m_upgrade->get_channel() >= 0)
+    {
+        m_loop.timers().cancel(&m_hand_over_timer);
+        m_loop.remove(m_upgrade->get_channel());
+        m_upgrade->cancel_hand_over();
+    }
+    if (m_upgrade != nullptr && m_upgrade->get_socket() >= 0)
+    {
+        m_loop.remove(m_upgrade->get_socket());
+        m_upgrade->close();
+    }
+
+    // After a hand-over the listening sockets live on in the new server, so
+    // closing them here would not unregister them from this loop.
+    for (auto& listener : m_listeners)
+    {
+        m_loop.remove(listener->get_socket());
+    }
+    m_listeners.clear();
+    m_accepting = false;
+
+    // Event streams never end on their own; their clients reconnect, to
+    // the new server after an upgrade. Only HTTPRouter has them.
+    if constexpr (std::is_same<typename Policies::Router, HTTPRouter>::value)
+    {
+        TopicRegistry::getInstance().end_all();
+    }
+
+    // A connection with nothing in progress may close right away, which
+    // removes it from m_connections.
+    std::vector<Connection*> connections;
+    for (auto& connection : m_connections)
+    {
+        connections.push_back(connection.second.get());
+    }
+    for (Connection* connection : connections)
+    {
+        connection->drain();
+    }
 
-    pollfd fds[MAX_CONNECTION];
-    int nfds = 1;
-    fds[0].fd = this->sock_server;
-    fds[0].events = POLLIN;
+    // Idle ones have nothing to finish.
+    while (m_idle != nullptr && m_idle->front() != nullptr)
+    {
+        close_idle_connection(m_idle->front());
+    }
+}
 
-    // Server Loop
-    while (true)
+template <typename Policies>
+void BasicHTTPServer<Policies>::accept_clients(Listener& listener)
+{
+    if (m_load_shedder != nullptr)
+    {
+        m_load_shedder->sample(m_loop.ready_us());
+    }
+
+    // The listener is level-triggered: whatever is left over once the budget
+    // is spent wakes the loop again after the other ready handlers have run.
+    for (int accepted = 0; accepted < ACCEPT_BUDGET && m_accepting; accepted++)
     {
-        LOGI("Server starts new poll()");
-        int rc_poll = poll(fds, nfds, -1);
-        if (rc_poll < 0)
+        if (!accept_client(listener))
         {
-            LOGE("Server poll() failed");
             break;
         }
+    }
+}
 
-        for (int i = 0; i < nfds; i++)
+template <typename Policies>
+bool BasicHTTPServer<Policies>::accept_client(Listener& listener)
+{
+    sockaddr_storage addr_client;
+    socklen_t addr_client_len = sizeof(addr_client);
+    int sock_client = accept4(listener.get_socket(), reinterpret_cast<sockaddr*>(&addr_client), &addr_client_len,
+                              SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (sock_client < 0)
+    {
+        // The client gave up while it was waiting in the backlog.
+        if (errno == ECONNABORTED || errno == EINTR)
+        {
+            return true;
+        }
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
         {
-            if (fds[i].revents & POLLIN)
+            SERVER_LOGE("Server accept4() failed");
+        }
+        return false;
+    }
+
+    // Refused before any work is spent on it.
+    if (m_load_shedder != nullptr && m_load_shedder->is_overloaded())
+    {
+        METRIC_INC(METRIC_SHED_CONNECTIONS);
+        refuse_client(listener, sock_client, m_load_shedder->rejection());
+        return true;
+    }
+    uint64_t client = RateLimiter::client_key(reinterpret_cast<sockaddr*>(&addr_client));
+    if (m_rate_limiter != nullptr && !m_rate_limiter->allow(client, m_loop.now_ms()))
+    {
+        METRIC_INC(METRIC_RATE_LIMITED_CONNECTIONS);
+        refuse_client(listener, sock_client, m_rate_limiter->rejection());
+        return true;
+    }
+
+    if constexpr (Log::inform_enabled)
+    {
+        SERVER_LOGI("A client is connected");
+        print_sockaddr_info(reinterpret_cast<sockaddr*>(&addr_client));
+    }
+
+    // Streamed responses end with a small write, the last chunk, which
+    // Nagle's algorithm would hold back until the client's delayed ACK.
+    int one = 1;
+    setsockopt(sock_client, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    // Lets reads poll the NIC queue of the connection instead of waiting
+    // for its interrupt, and the loop's epoll_wait() busy-poll that queue.
+    if (m_config.busy_poll_us > 0)
+    {
+        int budget = BUSY_POLL_NAPI_BUDGET;
+        if (setsockopt(sock_client, SOL_SOCKET, SO_BUSY_POLL, &m_config.busy_poll_us, sizeof(m_config.busy_poll_us)) != 0 ||
+            setsockopt(sock_client, SOL_SOCKET, SO_PREFER_BUSY_POLL, &one, sizeof(one)) != 0 ||
+            setsockopt(sock_client, SOL_SOCKET, SO_BUSY_POLL_BUDGET, &budget, sizeof(budget)) != 0)
+        {
+            SERVER_LOGE("Server cannot enable busy polling on a client socket");
+        }
+    }
+
+    SSL* ssl = nullptr;
+    if (listener.get_tls() != nullptr)
+    {
+        ssl = listener.get_tls()->create_ssl(sock_client);
+        if (ssl == nullptr)
+        {
+            close(sock_client);
+            return true;
+        }
+    }
+
+    ConnectionPtr connection(Allocator::template create<Connection>(*this, m_loop, sock_client, client, ssl));
+    if (!m_loop.add(sock_client, EPOLLIN | EPOLLRDHUP, connection.get()))
+    {
+        close(sock_client);
+        return true;
+    }
+    m_connections[sock_client] = std::move(connection);
+    METRIC_INC(METRIC_CONNECTIONS_ACCEPTED);
+    METRIC_INC(METRIC_CONNECTIONS_OPEN);
+
+    // Leave further clients in the listen backlog until a slot frees up,
+    // which the connection deadlines now guarantee will happen.
+    std::size_t idle = (m_idle != nullptr) ? m_idle->size() : 0;
+    if (m_connections.size() + idle >= static_cast<std::size_t>(m_config.max_connections))
+    {
+        set_accepting(false);
+    }
+    return true;
+}
+
+template <typename Policies>
+void BasicHTTPServer<Policies>::refuse_client(Listener& listener, int sock_client, const std::string& response)
+{
+    // A plaintext client is told why. What it already sent is dropped, so
+    // that closing ends with a FIN after the response rather than a reset.
+    if (listener.get_tls() == nullptr)
+    {
+        recv(sock_client, nullptr, MAX_HEADER_SIZE + MAX_BODY_SIZE, MSG_DONTWAIT | MSG_TRUNC);
+        send(sock_client, response.data(), response.length(), MSG_DONTWAIT | MSG_NOSIGNAL);
+    }
+    close(sock_client);
+}
+
+template <typename Policies>
+void BasicHTTPServer<Policies>::set_accepting(bool accepting)
+{
+    if (m_accepting == accepting || m_draining)
+    {
+        return;
+    }
+
+    m_accepting = accepting;
+    for (auto& listener : m_listeners)
+    {
+        if (m_config.workers == 0)
+        {
+            m_loop.modify(listener->get_socket(), accepting ? static_cast<uint32_t>(EPOLLIN) : 0u, listener.get());
+        }
+        // An EPOLLEXCLUSIVE registration cannot be modified, only removed.
+        else if (accepting)
+        {
+            m_loop.add(listener->get_socket(), listener_events(), listener.get());
+        }
+        else
+        {
+            m_loop.remove(listener->get_socket());
+        }
+    }
+}
+
+template <typename Policies>
+uint32_t BasicHTTPServer<Policies>::listener_events() const
+{
+    // All workers wait on the same listening sockets; EPOLLEXCLUSIVE wakes
+    // one of them per new connection instead of all of them.
+    return (m_config.workers > 0) ? (EPOLLIN | EPOLLEXCLUSIVE) : EPOLLIN;
+}
+
+template <typename Policies>
+std::vector<int> BasicHTTPServer<Policies>::take_listeners(std::vector<int>& inherited, int port, std::size_t count)
+{
+    // Every inherited listener is kept, even beyond count, since closing
+    // one would reset the connections waiting in its backlog.
+    std::vector<int> socks;
+    for (auto it = inherited.begin(); it != inherited.end();)
+    {
+        sockaddr_in address;
+        socklen_t length = sizeof(address);
+        if (getsockname(*it, reinterpret_cast<sockaddr*>(&address), &length) == 0 &&
+            address.sin_family == AF_INET && ntohs(address.sin_port) == port)
+        {
+            socks.push_back(*it);
+            it = inherited.erase(it);
+            SERVER_LOGI("Server took over a listener on port " + std::to_string(port));
+        }
+        else
+        {
+            ++it;
+        }
+    }
+
+    // Binding next to inherited listeners only works if they are in a
+    // SO_REUSEPORT group too; otherwise the workers share the ones there are.
+    while (socks.size() < count)
+    {
+        int sock = setup_socket(port, count > 1);
+        if (sock < 0)
+        {
+            break;
+        }
+        socks.push_back(sock);
+    }
+    return socks;
+}
+
+template <typename Policies>
+void BasicHTTPServer<Policies>::keep_worker_listeners(int worker, int cpu)
+{
+    // Listeners of a port are dealt out to the workers: each worker owns
+    // its own while there are enough of them, and shares one otherwise.
+    std::vector<TLSContext*> kinds = { nullptr };
+    if (m_tls != nullptr)
+    {
+        kinds.push_back(m_tls.get());
+    }
+
+    std::vector<std::unique_ptr<Listener>> kept;
+    for (TLSContext* tls : kinds)
+    {
+        std::vector<std::unique_ptr<Listener>*> group;
+        for (auto& listener : m_listeners)
+        {
+            if (listener != nullptr && listener->get_tls() == tls)
+            {
+                group.push_back(&listener);
+            }
+        }
+
+        std::size_t workers = m_config.workers;
+        bool owned = group.size() >= workers;
+        for (std::size_t i = 0; i < group.size(); i++)
+        {
+            if (owned ? (i % workers != static_cast<std::size_t>(worker)) : (i != worker % group.size()))
             {
-                if (fds[i].fd == this->sock_server)
-                {
-                    sockaddr addr_client;
-                    socklen_t addr_client_len = sizeof(sockaddr);
-                    int sock_client = accept(this->sock_server, &addr_client, &addr_client_len);
-                    if (sock_client < 0)
-                    {
-                        LOGE("Server accept() failed");
-                    }
-                    else
-                    {
-                        LOGI("A client is connected");
-                        print_sockaddr_info(&addr_client);
-
-                        if (nfds < MAX_CONNECTION)
-                        {
-                            fds[nfds].fd = sock_client;
-                            fds[nfds].events = POLLIN;
-                            nfds++;
-                        }
-                    }
-                }
+                continue;
             }
-            else
+
+            // The kernel prefers the listener of the CPU that took the
+            // connection's packets, so the NIC's queue, the socket and the
+            // worker all share one CPU's caches and NUMA node.
+            if (owned && cpu >= 0 && m_config.incoming_cpu &&
+                setsockopt((*group[i])->get_socket(), SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof(cpu)) != 0)
             {
-                HTTPConnectionHandler handler;
-                ClientActivity activity = handler.handle_client(fds[i].fd);
-                if (activity != ClientActivity::WAITING)
-                {
-                    LOGI("A client is disconnected");
-                    close(fds[i].fd);
-                    fds[i].fd = fds[nfds - 1].fd;
-                    fds[i].events = fds[nfds - 1].events;
-                    nfds--;
-                }
+                SERVER_LOGE("Server setsockopt(SO_INCOMING_CPU) failed");
             }
+            kept.push_back(std::move(*group[i]));
         }
     }
+
+    // The others stay open in the master for the workers they belong to.
+    m_listeners = std::move(kept);
 }
 
-bool HTTPServer::setup_socket(int port)
+template <typename Policies>
+int BasicHTTPServer<Policies>::setup_socket(int port, bool reuseport)
 {
     protoent* tcp_proto = getprotobyname(STR_TCP_PROTOCOL);
     if (tcp_proto == nullptr)
     {
-        return false;
+        return -1;
     }
 
     std::string s_port = std::to_string(port);
@@ -110,26 +899,32 @@ bool HTTPServer::setup_socket(int port)
     addrinfo* addr_server;
     if (getaddrinfo(STR_LOCALHOST, s_port.c_str(), &hints, &addr_server) != 0)
     {
-        LOGE("Server getaddrinfo() failed");
-        return false;
+        SERVER_LOGE("Server getaddrinfo() failed");
+        return -1;
     }
 
-    this->sock_server = socket(addr_server->ai_family, addr_server->ai_socktype, addr_server->ai_protocol);
-    if (this->sock_server < 0)
+    int sock_server = socket(addr_server->ai_family, addr_server->ai_socktype, addr_server->ai_protocol);
+    if (sock_server < 0)
     {
-        LOGE("Server socket() failed");
+        SERVER_LOGE("Server socket() failed");
         freeaddrinfo(addr_server);
-        this->sock_server = -1;
-        return false;
+        return -1;
     }
 
-    set_socket_nonblocking(this->sock_server);
+    set_socket_nonblocking(sock_server);
+
+    // Only sockets that all have it set before bind() can share a port.
+    int enable = 1;
+    if (reuseport && setsockopt(sock_server, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable)) != 0)
+    {
+        SERVER_LOGE("Server setsockopt(SO_REUSEPORT) failed");
+    }
 
     int rc_bind = 0;
     for (addrinfo* p = addr_server; p != nullptr; p = p->ai_next)
     {
         print_sockaddr_info(p->ai_addr);
-        rc_bind = bind(this->sock_server, p->ai_addr, p->ai_addrlen);
+        rc_bind = bind(sock_server, p->ai_addr, p->ai_addrlen);
         if (rc_bind == 0)
         {
             break;
@@ -138,22 +933,66 @@ bool HTTPServer::setup_socket(int port)
     
     if (rc_bind != 0)
     {
-        LOGE("Server bind() failed");
+        SERVER_LOGE("Server bind() failed");
         freeaddrinfo(addr_server);
-        close(this->sock_server);
-        this->sock_server = -1;
-        return false;
+        close(sock_server);
+        return -1;
     }
 
-    if (listen(this->sock_server, MAX_CONNECTION) != 0)
+    tune_listener(sock_server);
+    if (listen(sock_server, m_config.backlog) != 0)
     {
-        LOGE("Server listen() failed");
+        SERVER_LOGE("Server listen() failed");
         freeaddrinfo(addr_server);
-        close(this->sock_server);
-        this->sock_server = -1;
-        return false;
+        close(sock_server);
+        return -1;
     }
 
     freeaddrinfo(addr_server);
-    return true;
+    return sock_server;
+}
+
+template <typename Policies>
+void BasicHTTPServer<Policies>::tune_listener(int sock) const
+{
+    // Lets a restarted server bind while connections of the previous one
+    // are still in TIME_WAIT.
+    int enable = 1;
+    if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable)) != 0)
+    {
+        SERVER_LOGE("Server setsockopt(SO_REUSEADDR) failed");
+    }
+
+    // Every protocol served here starts with the client talking, so the
+    // kernel may hold a connection back until its request or ClientHello
+    // is there to be read.
+    if (m_config.defer_accept)
+    {
+        int seconds = TCP_DEFER_ACCEPT_SEC;
+        if (setsockopt(sock, IPPROTO_TCP, TCP_DEFER_ACCEPT, &seconds, sizeof(seconds)) != 0)
+        {
+            SERVER_LOGE("Server setsockopt(TCP_DEFER_ACCEPT) failed");
+        }
+    }
+
+    // Only takes effect where net.ipv4.tcp_fastopen has the server bit (2).
+    if (m_config.fast_open)
+    {
+        int queue_length = TCP_FASTOPEN_QUEUE_LENGTH;
+        if (setsockopt(sock, IPPROTO_TCP, TCP_FASTOPEN, &queue_length, sizeof(queue_length)) != 0)
+        {
+            SERVER_LOGE("Server setsockopt(TCP_FASTOPEN) failed");
+        }
+    }
 }
+
+// Each binary instantiates its own policy set, see CMakeLists.txt
+#ifdef HTTP_SERVER_STATIC_FILES
+template class BasicHTTPListener<StaticFileServerPolicies>;
+template class BasicHTTPServerControl<StaticFileServerPolicies>;
+template class BasicHTTPServer<StaticFileServerPolicies>;
+#else
+template class BasicHTTPListener<DefaultServerPolicies>;
+template class BasicHTTPServerControl<DefaultServerPolicies>;
+template class BasicHTTPServer<DefaultServerPolicies>;
+#endif
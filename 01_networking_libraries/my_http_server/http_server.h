@@ -1,19 +1,180 @@
 #ifndef HTTP_SERVER_H
 #define HTTP_SERVER_H
 
+#include "access_log.h"
+#include "egress_scheduler.h"
+#include "event_loop.h"
 #include "http_connection_handler.h"
+#include "idle_connection.h"
+#include "load_shedder.h"
+#include "offload_pool.h"
+#include "rate_limiter.h"
+#include "server_policies.h"
+#include "server_config.h"
+#include "tls_context.h"
+#include "upstream_pool.h"
+#include "upgrade_socket.h"
+#include "work_stealing_scheduler.h"
 
-class HTTPServer
+#include <memory>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+
+template <typename Policies>
+class BasicHTTPServer;
+
+// A listening socket. Connections accepted on it speak TLS when it has a
+// TLS context.
+template <typename Policies>
+class BasicHTTPListener : public EventHandler
+{
+public:
+    BasicHTTPListener(BasicHTTPServer<Policies>& server, int sock, TLSContext* tls);
+    ~BasicHTTPListener();
+
+    int get_socket() const;
+    TLSContext* get_tls() const;
+    void handle_event(uint32_t events) override;
+
+private:
+    BasicHTTPServer<Policies>& m_server;
+    int m_sock;
+    TLSContext* m_tls;
+};
+
+// One of the server's own control descriptors on its loop: the hot-upgrade
+// socket, the channel of a hand-over or the SIGQUIT signalfd. Readiness,
+// or the deadline of a timer it handles, calls action on the server.
+template <typename Policies>
+class BasicHTTPServerControl : public EventHandler, public TimerHandler
 {
 public:
-    HTTPServer(int port);
+    BasicHTTPServerControl(BasicHTTPServer<Policies>& server, void (BasicHTTPServer<Policies>::*action)());
+    void handle_event(uint32_t events) override;
+    void handle_timeout(TimerNode* timer) override;
+
+private:
+    BasicHTTPServer<Policies>& m_server;
+    void (BasicHTTPServer<Policies>::*m_action)();
+};
+
+// The server, configured at compile time by Policies (see
+// server_policies.h): its event loop, parser, router, logger and the
+// allocator of its connections, and which of proxy routes, coroutine
+// handlers, uploads, HTTP/2 and HTTPS it supports. Options in the
+// ServerConfig for a feature it was built without are refused. HTTPServer
+// is the instantiation with all of them; the member definitions are
+// instantiated in http_server.cpp for the policies in server_policies.h.
+// With compact_idle, a keep-alive connection is handed back between
+// requests and kept as an IdleConnection until its client sends the next
+// one; then it gets a new Connection from the Allocator.
+template <typename Policies>
+class BasicHTTPServer : public IdleConnectionOwner
+{
+public:
+    using Loop = typename Policies::Loop;
+    using Log = typename Policies::Log;
+    using Allocator = typename Policies::Allocator;
+    using Listener = BasicHTTPListener<Policies>;
+    using Control = BasicHTTPServerControl<Policies>;
+    using Connection = BasicHTTPConnectionHandler<Policies>;
+
+    static_assert(std::is_base_of<EventLoop, Loop>::value, "the server's components run on an EventLoop");
+
+    BasicHTTPServer(const ServerConfig& config);
+    ~BasicHTTPServer();
     void start();
 
+    // Accepts the connections waiting on the listener, at most
+    // ACCEPT_BUDGET of them per wakeup.
+    void accept_clients(Listener& listener);
+    void close_connection(Connection* connection);
+    // Swaps connection, idle between requests, for an IdleConnection.
+    // False if it has to stay as it is.
+    bool compact_connection(Connection* connection, uint64_t client);
+    void wake_connection(IdleConnection* connection, uint32_t events) override;
+    void expire_connection(IdleConnection* connection) override;
+    // Null when the policies leave proxy routes out.
+    UpstreamPool* get_upstreams();
+    const ServerConfig& get_config() const;
+    // Null while clients are not rate limited.
+    RateLimiter* get_rate_limiter() const;
+    // Null while new connections are never shed.
+    LoadShedder* get_load_shedder() const;
+    // Null while the loop does its filesystem calls itself.
+    OffloadPool* get_offload_pool() const;
+    // Null while handlers compute on the loop.
+    WorkStealingScheduler* get_scheduler() const;
+    // Null while connections write whenever their socket is ready.
+    EgressScheduler* get_egress_scheduler() const;
+    // Null while requests are not logged.
+    AccessLog* get_access_log() const;
+    // What coroutine handlers on this server's loop may use.
+    HandlerServices get_handler_services();
+
+    // A new server process asked for the listeners on the upgrade socket.
+    void hand_over();
+    // It answered, hung up or let UPGRADE_CONFIRM_TIMEOUT_MS pass.
+    void finish_hand_over();
+    // SIGQUIT: stop accepting, finish the requests in progress and exit.
+    void handle_quit_signal();
+
 private:
-    bool setup_socket(int port);
+    // Returns false once the listener has nothing more to accept.
+    bool accept_client(Listener& listener);
+    // Answers with response, if the client can be told, and closes.
+    void refuse_client(Listener& listener, int sock_client, const std::string& response);
+    int setup_socket(int port, bool reuseport);
+    void tune_listener(int sock) const;
+    // The listeners for port: the inherited ones, completed up to count
+    // with new ones in a SO_REUSEPORT group.
+    std::vector<int> take_listeners(std::vector<int>& inherited, int port, std::size_t count);
+    // In a worker: closes the listeners that belong to the other workers.
+    void keep_worker_listeners(int worker, int cpu);
+    bool watch_controls();
+    void drain();
+    void close_idle_connection(IdleConnection* connection);
+    void set_accepting(bool accepting);
+    uint32_t listener_events() const;
 
 private:
-    int sock_server;
+    using ConnectionPtr = std::unique_ptr<Connection, AllocatorDelete<Allocator>>;
+
+    // False if the configuration asks for a feature the policies leave out.
+    bool check_features();
+
+private:
+    ServerConfig m_config;
+    bool m_accepting;
+    Loop m_loop;
+    [[no_unique_address]] FeatureMember<Policies::proxy, UpstreamPool> m_upstreams;
+    // Outlives the connections, whose nodes it may hold
+    std::unique_ptr<EgressScheduler> m_egress;
+    // Started after the fork: threads do not survive it.
+    std::unique_ptr<OffloadPool> m_offload;
+    std::unique_ptr<WorkStealingScheduler> m_scheduler;
+    std::unique_ptr<AccessLog> m_access_log;
+    std::unique_ptr<RateLimiter> m_rate_limiter;
+    std::unique_ptr<LoadShedder> m_load_shedder;
+    std::unique_ptr<TLSContext> m_tls;
+    std::unique_ptr<UpgradeSocket> m_upgrade;
+    int m_quit_signal_fd;
+    std::unique_ptr<Control> m_upgrade_control;
+    std::unique_ptr<Control> m_hand_over_control;
+    TimerNode m_hand_over_timer;
+    std::unique_ptr<Control> m_quit_control;
+    bool m_draining;
+    uint64_t m_drain_deadline_ms;
+    std::vector<std::unique_ptr<Listener>> m_listeners;
+    std::unordered_map<int, ConnectionPtr> m_connections;
+    std::vector<ConnectionPtr> m_closed_connections;
+    // Null unless compact_idle
+    std::unique_ptr<IdleConnectionSet> m_idle;
 };
 
-#endif // HTTP_SERVER_H
\ No newline at end of file
+using HTTPListener = BasicHTTPListener<DefaultServerPolicies>;
+using HTTPServerControl = BasicHTTPServerControl<DefaultServerPolicies>;
+using HTTPServer = BasicHTTPServer<DefaultServerPolicies>;
+
+#endif // HTTP_SERVER_H
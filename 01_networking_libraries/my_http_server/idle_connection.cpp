@@ -0,0 +1,139 @@
+#include "idle_connection.h"
+#include "defs.h"
+#include "metrics.h"
+
+#include <new>
+
+static_assert(sizeof(IdleConnection) <= IDLE_CONNECTION_MAX_SIZE, "an idle connection outgrew its budget");
+
+IdleConnection::IdleConnection(IdleConnectionOwner* owner, int sock, uint64_t client)
+    : m_owner(owner),
+      m_sock(sock),
+      m_client(client),
+      m_timer(this),
+      m_prev(nullptr),
+      m_next(nullptr)
+{
+
+}
+
+int IdleConnection::get_socket() const
+{
+    return m_sock;
+}
+
+uint64_t IdleConnection::get_client() const
+{
+    return m_client;
+}
+
+void IdleConnection::handle_event(uint32_t events)
+{
+    if (m_sock < 0)
+    {
+        return;
+    }
+    m_owner->wake_connection(this, events);
+}
+
+void IdleConnection::handle_timeout(TimerNode* timer)
+{
+    (void)timer;
+    m_owner->expire_connection(this);
+}
+
+IdleConnectionSet::IdleConnectionSet(EventLoop& loop, IdleConnectionOwner* owner)
+    : m_loop(loop),
+      m_owner(owner),
+      m_slab(sizeof(IdleConnection)),
+      m_live(nullptr),
+      m_removed(nullptr),
+      m_count(0)
+{
+
+}
+
+IdleConnectionSet::~IdleConnectionSet()
+{
+    while (m_live != nullptr)
+    {
+        remove(m_live);
+    }
+    collect();
+    METRIC_ADD(METRIC_IDLE_CONNECTION_BYTES, -static_cast<int64_t>(m_slab.bytes_reserved()));
+}
+
+IdleConnection* IdleConnectionSet::add(int sock, uint64_t client)
+{
+    std::size_t reserved = m_slab.bytes_reserved();
+    IdleConnection* connection = new (m_slab.allocate()) IdleConnection(m_owner, sock, client);
+    METRIC_ADD(METRIC_IDLE_CONNECTION_BYTES, m_slab.bytes_reserved() - reserved);
+
+    if (!m_loop.modify(sock, EPOLLIN | EPOLLRDHUP, connection))
+    {
+        release(connection);
+        return nullptr;
+    }
+    m_loop.timers().schedule(&connection->m_timer, KEEP_ALIVE_IDLE_TIMEOUT_MS);
+
+    connection->m_next = m_live;
+    if (m_live != nullptr)
+    {
+        m_live->m_prev = connection;
+    }
+    m_live = connection;
+    m_count++;
+    METRIC_INC(METRIC_CONNECTIONS_IDLE);
+    return connection;
+}
+
+void IdleConnectionSet::remove(IdleConnection* connection)
+{
+    m_loop.timers().cancel(&connection->m_timer);
+    connection->m_sock = -1;
+
+    if (connection->m_prev != nullptr)
+    {
+        connection->m_prev->m_next = connection->m_next;
+    }
+    else
+    {
+        m_live = connection->m_next;
+    }
+    if (connection->m_next != nullptr)
+    {
+        connection->m_next->m_prev = connection->m_prev;
+    }
+
+    connection->m_prev = nullptr;
+    connection->m_next = m_removed;
+    m_removed = connection;
+    m_count--;
+    METRIC_DEC(METRIC_CONNECTIONS_IDLE);
+}
+
+void IdleConnectionSet::collect()
+{
+    while (m_removed != nullptr)
+    {
+        IdleConnection* connection = m_removed;
+        m_removed = connection->m_next;
+        release(connection);
+    }
+}
+
+IdleConnection* IdleConnectionSet::front() const
+{
+    return m_live;
+}
+
+std::size_t IdleConnectionSet::size() const
+{
+    return m_count;
+}
+
+void IdleConnectionSet::release(IdleConnection* connection)
+{
+    connection->~IdleConnection();
+    m_slab.release(connection);
+}
@@ -0,0 +1,83 @@
+#ifndef IDLE_CONNECTION_H
+#define IDLE_CONNECTION_H
+
+#include "event_loop.h"
+#include "slab_allocator.h"
+#include "timer_wheel.h"
+
+#include <cstddef>
+#include <cstdint>
+
+class IdleConnection;
+
+// Takes an idle connection back when its client sends something, and
+// closes it when its keep-alive deadline passes.
+class IdleConnectionOwner
+{
+public:
+    virtual ~IdleConnectionOwner() = default;
+    virtual void wake_connection(IdleConnection* connection, uint32_t events) = 0;
+    virtual void expire_connection(IdleConnection* connection) = 0;
+};
+
+// What is left of a keep-alive connection between two requests: its
+// socket, its client's RateLimiter key and its deadline, and no buffers,
+// parser or router. It stays registered on the loop in their place until
+// the client sends its next request.
+class IdleConnection : public EventHandler, public TimerHandler
+{
+public:
+    IdleConnection(IdleConnectionOwner* owner, int sock, uint64_t client);
+
+    int get_socket() const;
+    uint64_t get_client() const;
+    void handle_event(uint32_t events) override;
+    void handle_timeout(TimerNode* timer) override;
+
+private:
+    friend class IdleConnectionSet;
+
+    IdleConnectionOwner* m_owner;
+    // Negative once the set has let go of it
+    int m_sock;
+    uint64_t m_client;
+    TimerNode m_timer;
+    // Links of the set's list, live or removed
+    IdleConnection* m_prev;
+    IdleConnection* m_next;
+};
+
+// The idle connections of one loop, in slots of a SlabAllocator. A removed
+// connection may still have an event queued in the loop's current
+// iteration, so its slot is only reused after collect().
+class IdleConnectionSet
+{
+public:
+    IdleConnectionSet(EventLoop& loop, IdleConnectionOwner* owner);
+    ~IdleConnectionSet();
+
+    // Hands sock's events over to a new idle connection, with the
+    // keep-alive deadline armed. Null if the loop refused the socket.
+    IdleConnection* add(int sock, uint64_t client);
+    // Forgets connection; the socket is left to the caller.
+    void remove(IdleConnection* connection);
+    // Frees the connections removed since the last call.
+    void collect();
+
+    // Any live connection, null if there is none.
+    IdleConnection* front() const;
+    std::size_t size() const;
+
+private:
+    void release(IdleConnection* connection);
+
+private:
+    EventLoop& m_loop;
+    IdleConnectionOwner* m_owner;
+    SlabAllocator m_slab;
+    IdleConnection* m_live;
+    IdleConnection* m_removed;
+    std::size_t m_count;
+};
+
+#endif // IDLE_CONNECTION_H
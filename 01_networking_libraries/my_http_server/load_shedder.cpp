@@ -0,0 +1,61 @@
+#include "load_shedder.h"
+#include "defs.h"
+#include "http_response.h"
+#include "logging.h"
+#include "metrics.h"
+#include "utils.h"
+
+#include <algorithm>
+
+LoadShedder::LoadShedder(int target_ms, int interval_ms)
+    : m_target_us(static_cast<uint64_t>(target_ms) * 1000),
+      m_interval_us(static_cast<uint64_t>(interval_ms) * 1000),
+      m_interval_end_us(monotonic_us() + m_interval_us),
+      m_min_delay_us(UINT64_MAX),
+      m_overloaded(false)
+{
+    HTTPResponse response(HTTP_503, "503 Service Unavailable");
+    response.set_header("Retry-After", std::to_string(SHED_RETRY_AFTER_SEC));
+    response.set_header("Connection", "close");
+    m_rejection = response.to_string();
+}
+
+void LoadShedder::sample(uint64_t ready_us)
+{
+    uint64_t now_us = monotonic_us();
+    uint64_t delay_us = (now_us > ready_us) ? now_us - ready_us : 0;
+
+    if (now_us >= m_interval_end_us)
+    {
+        // An interval without any samples was an idle one.
+        bool overloaded = now_us < m_interval_end_us + m_interval_us && m_min_delay_us != UINT64_MAX &&
+                          m_min_delay_us > m_target_us;
+        if (overloaded && !m_overloaded)
+        {
+            LOGE("Server is overloaded, shedding new connections");
+        }
+        m_overloaded = overloaded;
+        METRIC_SET(METRIC_OVERLOADED, m_overloaded ? 1 : 0);
+        METRIC_SET(METRIC_QUEUE_DELAY_US, (m_min_delay_us != UINT64_MAX) ? m_min_delay_us : 0);
+        m_min_delay_us = UINT64_MAX;
+        m_interval_end_us = now_us + m_interval_us;
+    }
+
+    m_min_delay_us = std::min(m_min_delay_us, delay_us);
+    if (m_overloaded && delay_us <= m_target_us)
+    {
+        LOGI("Server is no longer overloaded");
+        m_overloaded = false;
+        METRIC_SET(METRIC_OVERLOADED, 0);
+    }
+}
+
+bool LoadShedder::is_overloaded() const
+{
+    return m_overloaded;
+}
+
+const std::string& LoadShedder::rejection() const
+{
+    return m_rejection;
+}
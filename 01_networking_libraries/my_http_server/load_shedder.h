@@ -0,0 +1,37 @@
+#ifndef LOAD_SHEDDER_H
+#define LOAD_SHEDDER_H
+
+#include <cstdint>
+#include <string>
+
+// Admission control after CoDel: the loop is overloaded once the queueing
+// delay, from readiness to dispatch, has not dropped below the target for
+// a whole interval. A short burst leaves some handler dispatched on time
+// within the interval and sheds nothing; a standing queue keeps even the
+// shortest delay above the target. Overload ends as soon as a handler is
+// dispatched within the target again.
+//
+// Each process has its own, since each has its own loop to measure.
+class LoadShedder
+{
+public:
+    LoadShedder(int target_ms, int interval_ms);
+
+    // A handler was dispatched for events that became ready at ready_us.
+    void sample(uint64_t ready_us);
+    bool is_overloaded() const;
+
+    // The complete 503 response for shed clients, built once.
+    const std::string& rejection() const;
+
+private:
+    uint64_t m_target_us;
+    uint64_t m_interval_us;
+    uint64_t m_interval_end_us;
+    // The shortest delay seen in the current interval
+    uint64_t m_min_delay_us;
+    bool m_overloaded;
+    std::string m_rejection;
+};
+
+#endif // LOAD_SHEDDER_H
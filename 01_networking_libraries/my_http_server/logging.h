@@ -1,3 +1,6 @@
+#ifndef LOGGING_H
+#define LOGGING_H
+
 #include <iostream>
 #include <string>
 #include <mutex>
@@ -62,3 +65,5 @@ private:
 #define LOGI(message) Logger::getInstance().inform(message)
 #define LOGD(message) Logger::getInstance().debug(message)
 #define LOGE(message) Logger::getInstance().error(message)
+
+#endif // LOGGING_H
@@ -1,26 +1,297 @@
 #include "http_server.h"
+#include "server_config.h"
 #include "logging.h"
+#include <algorithm>
 #include <iostream>
 #include <stdlib.h>
+#include <signal.h>
+#include <getopt.h>
+#include <sched.h>
 #include <string>
 
+// The static-files-only build, see CMakeLists.txt
+#ifdef HTTP_SERVER_STATIC_FILES
+using Server = BasicHTTPServer<StaticFileServerPolicies>;
+#else
+using Server = HTTPServer;
+#endif
+
 void print_usage(const char *program_name)
 {
-    fprintf(stderr, "Usage: %s <port>\n", program_name);
+    fprintf(stderr, "Usage: %s [options] <port>\n", program_name);
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "  --backlog <n>         Listen backlog (default: %d)\n", LISTEN_BACKLOG);
+    fprintf(stderr, "  --no-defer-accept     Accept connections before their first data arrives\n");
+    fprintf(stderr, "  --no-fastopen         Disable TCP Fast Open on the listeners\n");
+    fprintf(stderr, "  --max-connections <n> Serve up to n connections at once (default: %d)\n", MAX_CONNECTION);
+    fprintf(stderr, "  --compact-idle        Keep idle keep-alive connections as small records without buffers\n");
+    fprintf(stderr, "  --busy-poll <usecs>   Spin for up to usecs before sleeping (default: off)\n");
+    fprintf(stderr, "  --shed-target <ms>    Shed new connections while requests wait longer than ms (default: off)\n");
+    fprintf(stderr, "  --shed-interval <ms>  How long the wait must last before shedding (default: %d)\n", SHED_INTERVAL_MS);
+    fprintf(stderr, "  --rate-limit <n>      Allow each client address n requests per second (default: off)\n");
+    fprintf(stderr, "  --rate-burst <n>      Let each client address make up to n requests in a row (default: rate)\n");
+    fprintf(stderr, "  --https-port <port>   Also serve HTTPS on this port\n");
+    fprintf(stderr, "  --cert <file>         TLS certificate chain (default: %s)\n", STR_TLS_CERT_FILE);
+    fprintf(stderr, "  --key <file>          TLS private key (default: %s)\n", STR_TLS_KEY_FILE);
+    fprintf(stderr, "  --no-ktls             Keep TLS record encryption in user space\n");
+    fprintf(stderr, "  --fair-egress         Send bulk output round-robin, small responses first\n");
+    fprintf(stderr, "  --egress-rate <n>     Send at most n bytes per second per loop (default: off)\n");
+    fprintf(stderr, "  --connection-rate <n> Send bulk output at most n bytes per second per connection (default: off)\n");
+    fprintf(stderr, "  --websocket-deflate   Compress WebSocket messages for clients offering permessage-deflate\n");
+    fprintf(stderr, "  --access-log <file>   Append a binary record of every request to file\n");
+    fprintf(stderr, "  --proxy <prefix>=<host:port>[,<host:port>...]\n");
+    fprintf(stderr, "                        Forward requests under prefix to these upstreams\n");
+    fprintf(stderr, "  --upload-dir <dir>    Store PUT and POST bodies to %s<name> in this directory\n", STR_UPLOAD_PATH);
+    fprintf(stderr, "  --offload-threads <n> Look static files up and read them on n threads per loop (default: off)\n");
+    fprintf(stderr, "  --compute-threads <n> Run CPU-heavy handler work on n threads per loop (default: off)\n");
+    fprintf(stderr, "  --no-steal            Keep each compute thread to the work queued for it\n");
+    fprintf(stderr, "  --workers <n>         Prefork n worker processes\n");
+    fprintf(stderr, "  --no-pin              Do not pin workers to CPUs\n");
+    fprintf(stderr, "  --cpus <list>         Pin workers to these CPUs, e.g. 0-3,8-11 (default: all allowed)\n");
+    fprintf(stderr, "  --no-numa             Do not keep pinned workers' memory on their NUMA node\n");
+    fprintf(stderr, "  --incoming-cpu        Give each pinned worker its own listeners, fed by its CPU\n");
+    fprintf(stderr, "  --upgrade-socket <path>\n");
+    fprintf(stderr, "                        Hand the listeners over to a new server on this Unix socket\n");
+    fprintf(stderr, "  --upgrade             Take the listeners over from the server on --upgrade-socket\n");
 }
 
-int main(int argc, char** argv)
+bool parse_proxy_route(const std::string& argument, ServerConfig& config)
 {
-    if (argc != 2)
+    std::size_t equals = argument.find('=');
+    if (equals == std::string::npos || equals == 0)
     {
-        print_usage(argv[0]);
-        return -1;
+        return false;
+    }
+
+    ProxyRoute route;
+    route.prefix = argument.substr(0, equals);
+    std::size_t begin = equals + 1;
+    while (begin <= argument.length())
+    {
+        std::size_t end = argument.find(',', begin);
+        if (end == std::string::npos)
+        {
+            end = argument.length();
+        }
+        if (end > begin)
+        {
+            route.upstreams.push_back(argument.substr(begin, end - begin));
+        }
+        begin = end + 1;
+    }
+
+    if (route.upstreams.empty())
+    {
+        return false;
+    }
+    config.proxy_routes.push_back(route);
+    return true;
+}
+
+bool parse_cpu_list(const std::string& argument, ServerConfig& config)
+{
+    std::size_t begin = 0;
+    while (begin < argument.length())
+    {
+        std::size_t end = argument.find(',', begin);
+        if (end == std::string::npos)
+        {
+            end = argument.length();
+        }
+
+        std::string range = argument.substr(begin, end - begin);
+        std::size_t dash = range.find('-');
+        char* rest = nullptr;
+        long first = std::strtol(range.c_str(), &rest, 10);
+        long last = (dash != std::string::npos) ? std::strtol(range.c_str() + dash + 1, &rest, 10) : first;
+        if (range.empty() || *rest != '\0' || first < 0 || last < first || last >= CPU_SETSIZE)
+        {
+            return false;
+        }
+        for (long cpu = first; cpu <= last; cpu++)
+        {
+            config.worker_cpus.push_back(static_cast<int>(cpu));
+        }
+        begin = end + 1;
+    }
+    return !config.worker_cpus.empty();
+}
+
+bool parse_arguments(int argc, char** argv, ServerConfig& config)
+{
+    enum
+    {
+        OPT_BACKLOG = 256,
+        OPT_NO_DEFER_ACCEPT,
+        OPT_NO_FASTOPEN,
+        OPT_MAX_CONNECTIONS,
+        OPT_COMPACT_IDLE,
+        OPT_BUSY_POLL,
+        OPT_SHED_TARGET,
+        OPT_SHED_INTERVAL,
+        OPT_RATE_LIMIT,
+        OPT_RATE_BURST,
+        OPT_HTTPS_PORT,
+        OPT_CERT,
+        OPT_KEY,
+        OPT_NO_KTLS,
+        OPT_FAIR_EGRESS,
+        OPT_EGRESS_RATE,
+        OPT_CONNECTION_RATE,
+        OPT_WEBSOCKET_DEFLATE,
+        OPT_ACCESS_LOG,
+        OPT_PROXY,
+        OPT_UPLOAD_DIR,
+        OPT_OFFLOAD_THREADS,
+        OPT_COMPUTE_THREADS,
+        OPT_NO_STEAL,
+        OPT_WORKERS,
+        OPT_NO_PIN,
+        OPT_CPUS,
+        OPT_NO_NUMA,
+        OPT_INCOMING_CPU,
+        OPT_UPGRADE_SOCKET,
+        OPT_UPGRADE,
+    };
+
+    static const option long_options[] = {
+        {"backlog", required_argument, nullptr, OPT_BACKLOG},
+        {"no-defer-accept", no_argument, nullptr, OPT_NO_DEFER_ACCEPT},
+        {"no-fastopen", no_argument, nullptr, OPT_NO_FASTOPEN},
+        {"max-connections", required_argument, nullptr, OPT_MAX_CONNECTIONS},
+        {"compact-idle", no_argument, nullptr, OPT_COMPACT_IDLE},
+        {"busy-poll", required_argument, nullptr, OPT_BUSY_POLL},
+        {"shed-target", required_argument, nullptr, OPT_SHED_TARGET},
+        {"shed-interval", required_argument, nullptr, OPT_SHED_INTERVAL},
+        {"rate-limit", required_argument, nullptr, OPT_RATE_LIMIT},
+        {"rate-burst", required_argument, nullptr, OPT_RATE_BURST},
+        {"https-port", required_argument, nullptr, OPT_HTTPS_PORT},
+        {"cert", required_argument, nullptr, OPT_CERT},
+        {"key", required_argument, nullptr, OPT_KEY},
+        {"no-ktls", no_argument, nullptr, OPT_NO_KTLS},
+        {"fair-egress", no_argument, nullptr, OPT_FAIR_EGRESS},
+        {"egress-rate", required_argument, nullptr, OPT_EGRESS_RATE},
+        {"connection-rate", required_argument, nullptr, OPT_CONNECTION_RATE},
+        {"websocket-deflate", no_argument, nullptr, OPT_WEBSOCKET_DEFLATE},
+        {"access-log", required_argument, nullptr, OPT_ACCESS_LOG},
+        {"proxy", required_argument, nullptr, OPT_PROXY},
+        {"upload-dir", required_argument, nullptr, OPT_UPLOAD_DIR},
+        {"offload-threads", required_argument, nullptr, OPT_OFFLOAD_THREADS},
+        {"compute-threads", required_argument, nullptr, OPT_COMPUTE_THREADS},
+        {"no-steal", no_argument, nullptr, OPT_NO_STEAL},
+        {"workers", required_argument, nullptr, OPT_WORKERS},
+        {"no-pin", no_argument, nullptr, OPT_NO_PIN},
+        {"cpus", required_argument, nullptr, OPT_CPUS},
+        {"no-numa", no_argument, nullptr, OPT_NO_NUMA},
+        {"incoming-cpu", no_argument, nullptr, OPT_INCOMING_CPU},
+        {"upgrade-socket", required_argument, nullptr, OPT_UPGRADE_SOCKET},
+        {"upgrade", no_argument, nullptr, OPT_UPGRADE},
+        {nullptr, 0, nullptr, 0}
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", long_options, nullptr)) != -1)
+    {
+        switch (opt)
+        {
+            case OPT_BACKLOG:    config.backlog = std::stoi(optarg); break;
+            case OPT_NO_DEFER_ACCEPT: config.defer_accept = false; break;
+            case OPT_NO_FASTOPEN: config.fast_open = false; break;
+            case OPT_MAX_CONNECTIONS: config.max_connections = std::stoi(optarg); break;
+            case OPT_COMPACT_IDLE: config.compact_idle = true; break;
+            case OPT_BUSY_POLL:  config.busy_poll_us = std::stoi(optarg); break;
+            case OPT_SHED_TARGET: config.shed_target_ms = std::stoi(optarg); break;
+            case OPT_SHED_INTERVAL: config.shed_interval_ms = std::stoi(optarg); break;
+            case OPT_RATE_LIMIT: config.rate_limit = std::stoi(optarg); break;
+            case OPT_RATE_BURST: config.rate_limit_burst = std::stoi(optarg); break;
+            case OPT_HTTPS_PORT: config.https_port = std::stoi(optarg); break;
+            case OPT_CERT:       config.cert_file = optarg; break;
+            case OPT_KEY:        config.key_file = optarg; break;
+            case OPT_NO_KTLS:    config.enable_ktls = false; break;
+            case OPT_FAIR_EGRESS: config.fair_egress = true; break;
+            case OPT_EGRESS_RATE: config.egress_rate = std::stoull(optarg); break;
+            case OPT_CONNECTION_RATE: config.connection_rate = std::stoull(optarg); break;
+            case OPT_WEBSOCKET_DEFLATE: config.websocket_deflate = true; break;
+            case OPT_ACCESS_LOG: config.access_log = optarg; break;
+            case OPT_PROXY:
+                if (!parse_proxy_route(optarg, config))
+                {
+                    return false;
+                }
+                break;
+            case OPT_UPLOAD_DIR: config.upload_dir = optarg; break;
+            case OPT_OFFLOAD_THREADS: config.offload_threads = std::stoi(optarg); break;
+            case OPT_COMPUTE_THREADS: config.compute_threads = std::stoi(optarg); break;
+            case OPT_NO_STEAL:   config.compute_stealing = false; break;
+            case OPT_WORKERS:    config.workers = std::stoi(optarg); break;
+            case OPT_NO_PIN:     config.pin_workers = false; break;
+            case OPT_CPUS:
+                if (!parse_cpu_list(optarg, config))
+                {
+                    return false;
+                }
+                break;
+            case OPT_NO_NUMA:    config.numa_local = false; break;
+            case OPT_INCOMING_CPU: config.incoming_cpu = true; break;
+            case OPT_UPGRADE_SOCKET: config.upgrade_socket = optarg; break;
+            case OPT_UPGRADE:    config.upgrade = true; break;
+            default:             return false;
+        }
     }
 
+    if (optind != argc - 1 || config.workers < 0 || config.backlog <= 0 || config.busy_poll_us < 0 || (config.upgrade && config.upgrade_socket.empty()))
+    {
+        return false;
+    }
+    if (config.max_connections <= 0 || config.max_connections > MAX_CONNECTION_LIMIT)
+    {
+        return false;
+    }
+    if (config.shed_target_ms < 0 || config.shed_interval_ms <= 0)
+    {
+        return false;
+    }
+    if (config.rate_limit < 0 || config.rate_limit > RATE_LIMIT_MAX_RATE ||
+        config.rate_limit_burst < 0 || config.rate_limit_burst > RATE_LIMIT_MAX_BURST)
+    {
+        return false;
+    }
+    if (config.egress_rate > EGRESS_MAX_RATE || config.connection_rate > EGRESS_MAX_RATE)
+    {
+        return false;
+    }
+    if (config.offload_threads < 0 || config.offload_threads > OFFLOAD_MAX_THREADS ||
+        config.compute_threads < 0 || config.compute_threads > SCHEDULER_MAX_THREADS)
+    {
+        return false;
+    }
+    if (config.egress_rate > 0 || config.connection_rate > 0)
+    {
+        config.fair_egress = true;
+    }
+    if (config.rate_limit_burst == 0)
+    {
+        config.rate_limit_burst = std::min(config.rate_limit, RATE_LIMIT_MAX_BURST);
+    }
+    config.port = std::stoi(argv[optind]);
+    return true;
+}
+
+int main(int argc, char** argv)
+{
+    // Writes to a client that went away must fail with EPIPE, not kill us.
+    signal(SIGPIPE, SIG_IGN);
+
     try
     {
-        int port = std::stoi(argv[1]);
-        HTTPServer server(port);
+        ServerConfig config;
+        if (!parse_arguments(argc, argv, config))
+        {
+            print_usage(argv[0]);
+            return -1;
+        }
+
+        Server server(config);
         server.start();
     }
     catch(const std::exception& e)
@@ -30,4 +301,4 @@ int main(int argc, char** argv)
     }   
 
     return 0;
-}
\ No newline at end of file
+}
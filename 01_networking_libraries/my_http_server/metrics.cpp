@@ -0,0 +1,186 @@
+#include "metrics.h"
+#include "numa_node.h"
+
+#include <new>
+#include <sstream>
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace
+{
+    const char* const METRIC_NAMES[METRIC_COUNT] = {
+        "connections_accepted",
+        "connections_open",
+        "connections_idle",
+        "idle_connection_bytes",
+        "requests",
+        "responses_streamed",
+        "coroutine_handlers",
+        "offload_jobs",
+        "offload_inline",
+        "offload_queue_depth",
+        "offload_wait_us",
+        "offload_run_us",
+        "offload_coalesced",
+        "offload_coalesced_waiting",
+        "compute_jobs",
+        "compute_inline",
+        "compute_steals",
+        "compute_queue_depth",
+        "compute_wait_us",
+        "compute_run_us",
+        "egress_priority_bytes",
+        "egress_bulk_bytes",
+        "egress_queued",
+        "egress_throttled",
+        "uploads",
+        "upload_bytes",
+        "shed_connections",
+        "overloaded",
+        "queue_delay_us",
+        "rate_limited_connections",
+        "rate_limited_requests",
+        "rate_limit_evictions",
+        "busy_poll_hits",
+        "busy_poll_misses",
+        "tls_handshakes",
+        "tls_handshakes_resumed",
+        "tls_handshake_failures",
+        "tls_ktls_connections",
+        "tls_sendfile_bytes",
+        "http2_connections",
+        "http2_streams",
+        "websocket_connections",
+        "websocket_messages_in",
+        "websocket_messages_out",
+        "websocket_protocol_errors",
+        "event_subscribers",
+        "events_published",
+        "events_delivered",
+        "events_dropped",
+        "event_fanout_us",
+        "access_log_records",
+        "access_log_dropped",
+        "upstream_requests",
+        "upstream_connections_opened",
+        "upstream_connections_reused",
+        "upstream_failures",
+        "upstream_ejections",
+        "upstream_coalesced",
+        "upstream_coalesced_waiting",
+    };
+
+    // Values that describe the present rather than count events.
+    bool is_gauge(int id)
+    {
+        return id == METRIC_CONNECTIONS_OPEN || id == METRIC_CONNECTIONS_IDLE || id == METRIC_IDLE_CONNECTION_BYTES ||
+               id == METRIC_OVERLOADED || id == METRIC_QUEUE_DELAY_US ||
+               id == METRIC_OFFLOAD_QUEUE_DEPTH || id == METRIC_COMPUTE_QUEUE_DEPTH ||
+               id == METRIC_EGRESS_QUEUED || id == METRIC_EVENT_SUBSCRIBERS ||
+               id == METRIC_OFFLOAD_COALESCED_WAITING || id == METRIC_UPSTREAM_COALESCED_WAITING;
+    }
+}
+
+Metrics::Metrics()
+    : m_values(m_local),
+      m_shared(nullptr),
+      m_workers(0),
+      m_row_size(METRIC_COUNT)
+{
+    for (int i = 0; i < METRIC_COUNT; i++)
+    {
+        m_local[i].store(0, std::memory_order_relaxed);
+    }
+}
+
+int64_t Metrics::get(MetricId id) const
+{
+    if (m_shared == nullptr)
+    {
+        return m_values[id].load(std::memory_order_relaxed);
+    }
+
+    int64_t total = 0;
+    for (int worker = 0; worker < m_workers; worker++)
+    {
+        total += m_shared[worker * m_row_size + id].load(std::memory_order_relaxed);
+    }
+    return total;
+}
+
+bool Metrics::share(int workers)
+{
+    static_assert(std::atomic<int64_t>::is_always_lock_free, "metrics are shared between processes");
+
+    // Each worker's row fills whole pages, so no cache line is written by
+    // two workers and a row can be moved to its worker's NUMA node.
+    std::size_t page_size = sysconf(_SC_PAGESIZE);
+    std::size_t row_bytes = (sizeof(std::atomic<int64_t>) * METRIC_COUNT + page_size - 1) / page_size * page_size;
+    std::size_t size = row_bytes * workers;
+    void* memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED)
+    {
+        return false;
+    }
+
+    m_shared = static_cast<std::atomic<int64_t>*>(memory);
+    m_row_size = row_bytes / sizeof(std::atomic<int64_t>);
+    for (std::size_t i = 0; i < m_row_size * workers; i++)
+    {
+        new (&m_shared[i]) std::atomic<int64_t>(0);
+    }
+    m_workers = workers;
+    return true;
+}
+
+void Metrics::use_worker_slot(int worker, int numa_node)
+{
+    if (m_shared == nullptr || worker < 0 || worker >= m_workers)
+    {
+        return;
+    }
+
+    m_values = m_shared + worker * m_row_size;
+    if (numa_node >= 0)
+    {
+        NumaNode::move(m_values, m_row_size * sizeof(std::atomic<int64_t>), numa_node);
+    }
+    for (int i = 0; i < METRIC_COUNT; i++)
+    {
+        if (is_gauge(i))
+        {
+            m_values[i].store(0, std::memory_order_relaxed);
+        }
+    }
+}
+
+std::string Metrics::to_string() const
+{
+    std::ostringstream oss;
+    for (int i = 0; i < METRIC_COUNT; i++)
+    {
+        oss << METRIC_NAMES[i] << " " << get(static_cast<MetricId>(i)) << "\n";
+    }
+
+    int64_t handshakes = get(METRIC_TLS_HANDSHAKES);
+    if (handshakes > 0)
+    {
+        oss << "tls_resumption_ratio " << static_cast<double>(get(METRIC_TLS_HANDSHAKES_RESUMED)) / handshakes << "\n";
+    }
+
+    // What an idle connection costs in user space, its slab's free slots
+    // included.
+    int64_t idle = get(METRIC_CONNECTIONS_IDLE);
+    if (idle > 0)
+    {
+        oss << "idle_connection_bytes_per_connection " << get(METRIC_IDLE_CONNECTION_BYTES) / idle << "\n";
+    }
+
+    // Shows how evenly the kernel spreads new connections over the workers.
+    for (int worker = 0; worker < m_workers; worker++)
+    {
+        oss << "worker_" << worker << "_connections_accepted "
+            << m_shared[worker * m_row_size + METRIC_CONNECTIONS_ACCEPTED].load(std::memory_order_relaxed) << "\n";
+    }
+    return oss.str();
+}
@@ -0,0 +1,126 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+enum MetricId
+{
+    METRIC_CONNECTIONS_ACCEPTED,
+    METRIC_CONNECTIONS_OPEN,
+    METRIC_CONNECTIONS_IDLE,
+    METRIC_IDLE_CONNECTION_BYTES,
+    METRIC_REQUESTS,
+    METRIC_RESPONSES_STREAMED,
+    METRIC_COROUTINE_HANDLERS,
+    METRIC_OFFLOAD_JOBS,
+    METRIC_OFFLOAD_INLINE,
+    METRIC_OFFLOAD_QUEUE_DEPTH,
+    METRIC_OFFLOAD_WAIT_US,
+    METRIC_OFFLOAD_RUN_US,
+    METRIC_OFFLOAD_COALESCED,
+    METRIC_OFFLOAD_COALESCED_WAITING,
+    METRIC_COMPUTE_JOBS,
+    METRIC_COMPUTE_INLINE,
+    METRIC_COMPUTE_STEALS,
+    METRIC_COMPUTE_QUEUE_DEPTH,
+    METRIC_COMPUTE_WAIT_US,
+    METRIC_COMPUTE_RUN_US,
+    METRIC_EGRESS_PRIORITY_BYTES,
+    METRIC_EGRESS_BULK_BYTES,
+    METRIC_EGRESS_QUEUED,
+    METRIC_EGRESS_THROTTLED,
+    METRIC_UPLOADS,
+    METRIC_UPLOAD_BYTES,
+    METRIC_SHED_CONNECTIONS,
+    METRIC_OVERLOADED,
+    METRIC_QUEUE_DELAY_US,
+    METRIC_RATE_LIMITED_CONNECTIONS,
+    METRIC_RATE_LIMITED_REQUESTS,
+    METRIC_RATE_LIMIT_EVICTIONS,
+    METRIC_BUSY_POLL_HITS,
+    METRIC_BUSY_POLL_MISSES,
+    METRIC_TLS_HANDSHAKES,
+    METRIC_TLS_HANDSHAKES_RESUMED,
+    METRIC_TLS_HANDSHAKE_FAILURES,
+    METRIC_TLS_KTLS_CONNECTIONS,
+    METRIC_TLS_SENDFILE_BYTES,
+    METRIC_HTTP2_CONNECTIONS,
+    METRIC_HTTP2_STREAMS,
+    METRIC_WEBSOCKET_CONNECTIONS,
+    METRIC_WEBSOCKET_MESSAGES_IN,
+    METRIC_WEBSOCKET_MESSAGES_OUT,
+    METRIC_WEBSOCKET_PROTOCOL_ERRORS,
+    METRIC_EVENT_SUBSCRIBERS,
+    METRIC_EVENTS_PUBLISHED,
+    METRIC_EVENTS_DELIVERED,
+    METRIC_EVENTS_DROPPED,
+    METRIC_EVENT_FANOUT_US,
+    METRIC_ACCESS_LOG_RECORDS,
+    METRIC_ACCESS_LOG_DROPPED,
+    METRIC_UPSTREAM_REQUESTS,
+    METRIC_UPSTREAM_CONNECTIONS_OPENED,
+    METRIC_UPSTREAM_CONNECTIONS_REUSED,
+    METRIC_UPSTREAM_FAILURES,
+    METRIC_UPSTREAM_EJECTIONS,
+    METRIC_UPSTREAM_COALESCED,
+    METRIC_UPSTREAM_COALESCED_WAITING,
+    METRIC_COUNT
+};
+
+// Process-wide counters and gauges, cheap enough to update on every request.
+// They are served as plain text by the router on STR_METRICS_PATH.
+//
+// In prefork mode the values live in shared memory, one row per worker, so
+// any worker can report the totals of all of them.
+class Metrics
+{
+public:
+    static Metrics& getInstance()
+    {
+        static Metrics instance;
+        return instance;
+    }
+
+    void add(MetricId id, int64_t value)
+    {
+        m_values[id].fetch_add(value, std::memory_order_relaxed);
+    }
+
+    void set(MetricId id, int64_t value)
+    {
+        m_values[id].store(value, std::memory_order_relaxed);
+    }
+
+    // The total over all workers.
+    int64_t get(MetricId id) const;
+
+    // Called before forking workers; the values so far are dropped.
+    bool share(int workers);
+    // Called in a worker after the fork. Gauges left over from a previous
+    // worker in the same slot are cleared, counters keep adding up. The
+    // slot's memory is moved to numa_node unless it is negative.
+    void use_worker_slot(int worker, int numa_node = -1);
+
+    std::string to_string() const;
+
+private:
+    std::atomic<int64_t> m_local[METRIC_COUNT];
+    std::atomic<int64_t>* m_values;
+    std::atomic<int64_t>* m_shared;
+    int m_workers;
+    // Values per worker row, padded to whole pages
+    std::size_t m_row_size;
+
+    Metrics();
+    Metrics(const Metrics&) = delete;
+    Metrics& operator=(const Metrics&) = delete;
+};
+
+#define METRIC_ADD(id, value) Metrics::getInstance().add(id, value)
+#define METRIC_INC(id) Metrics::getInstance().add(id, 1)
+#define METRIC_DEC(id) Metrics::getInstance().add(id, -1)
+#define METRIC_SET(id, value) Metrics::getInstance().set(id, value)
+
+#endif // METRICS_H
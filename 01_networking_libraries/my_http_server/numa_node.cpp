@@ -0,0 +1,44 @@
+#include "numa_node.h"
+
+#include <climits>
+#include <linux/mempolicy.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace
+{
+    const unsigned long NODE_MASK_BITS = sizeof(unsigned long) * CHAR_BIT;
+}
+
+int NumaNode::current()
+{
+    unsigned cpu = 0;
+    unsigned node = 0;
+    if (syscall(SYS_getcpu, &cpu, &node, nullptr) != 0)
+    {
+        return -1;
+    }
+    return static_cast<int>(node);
+}
+
+bool NumaNode::prefer(int node)
+{
+    if (node < 0 || static_cast<unsigned long>(node) >= NODE_MASK_BITS)
+    {
+        return false;
+    }
+
+    unsigned long mask = 1UL << node;
+    return syscall(SYS_set_mempolicy, MPOL_PREFERRED, &mask, NODE_MASK_BITS + 1) == 0;
+}
+
+bool NumaNode::move(void* address, std::size_t length, int node)
+{
+    if (node < 0 || static_cast<unsigned long>(node) >= NODE_MASK_BITS)
+    {
+        return false;
+    }
+
+    unsigned long mask = 1UL << node;
+    return syscall(SYS_mbind, address, length, MPOL_PREFERRED, &mask, NODE_MASK_BITS + 1, MPOL_MF_MOVE) == 0;
+}
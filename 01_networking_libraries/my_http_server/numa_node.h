@@ -0,0 +1,22 @@
+#ifndef NUMA_NODE_H
+#define NUMA_NODE_H
+
+#include <cstddef>
+
+// Memory placement on NUMA machines, through the kernel's memory policy
+// system calls so no NUMA library is needed. On a machine with a single
+// node every call succeeds and changes nothing.
+class NumaNode
+{
+public:
+    // The node of the CPU the caller is running on, -1 if unknown.
+    static int current();
+    // Pages the process allocates from now on come from node while it has
+    // free memory, wherever the process happens to run.
+    static bool prefer(int node);
+    // Moves the pages of a page-aligned range that are already there to
+    // node, and keeps future ones there.
+    static bool move(void* address, std::size_t length, int node);
+};
+
+#endif // NUMA_NODE_H
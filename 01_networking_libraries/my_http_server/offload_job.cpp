@@ -0,0 +1,27 @@
+#include "offload_job.h"
+
+OffloadJob::OffloadJob()
+    : m_next(nullptr),
+      m_affinity(0),
+      m_submitted_us(0),
+      m_started_us(0),
+      m_finished_us(0),
+      m_cancelled(false)
+{
+
+}
+
+void OffloadJob::set_affinity(uint64_t affinity)
+{
+    m_affinity = affinity;
+}
+
+uint64_t OffloadJob::get_affinity() const
+{
+    return m_affinity;
+}
+
+bool OffloadJob::is_cancelled() const
+{
+    return m_cancelled.load(std::memory_order_relaxed);
+}
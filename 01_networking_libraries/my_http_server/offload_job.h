@@ -0,0 +1,55 @@
+#ifndef OFFLOAD_JOB_H
+#define OFFLOAD_JOB_H
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+
+// Work that runs on another thread than the event loop's: blocking calls
+// on an OffloadPool, CPU-heavy ones on a WorkStealingScheduler.
+class OffloadJob
+{
+public:
+    OffloadJob();
+    virtual ~OffloadJob() = default;
+
+    // Runs on a pool thread; may block.
+    virtual void run() = 0;
+    // Runs on the loop's thread once run() has returned, unless the job
+    // has been cancelled.
+    virtual void complete() = 0;
+
+    // Jobs with the same affinity prefer the same thread.
+    void set_affinity(uint64_t affinity);
+    uint64_t get_affinity() const;
+    bool is_cancelled() const;
+
+private:
+    friend class CompletionQueue;
+    friend class OffloadPool;
+    friend class WorkStealingScheduler;
+
+    OffloadJob* m_next;
+    uint64_t m_affinity;
+    uint64_t m_submitted_us;
+    uint64_t m_started_us;
+    uint64_t m_finished_us;
+    // Set on the loop's thread, read by the threads that would run it
+    std::atomic<bool> m_cancelled;
+};
+
+// Where the loop hands jobs to.
+class JobExecutor
+{
+public:
+    virtual ~JobExecutor() = default;
+    // Takes job over, unless the executor cannot queue it: then it returns
+    // false and leaves job with the caller, who does the work itself.
+    virtual bool submit(std::unique_ptr<OffloadJob>& job) = 0;
+    // A submitted job whose result is no longer wanted. It still runs if
+    // it has started, since a thread cannot be interrupted, but it is not
+    // completed; the executor frees it.
+    virtual void cancel(OffloadJob* job) = 0;
+};
+
+#endif // OFFLOAD_JOB_H
@@ -0,0 +1,119 @@
+#include "offload_pool.h"
+#include "defs.h"
+#include "metrics.h"
+#include "utils.h"
+
+#include <algorithm>
+
+OffloadPool::OffloadPool(EventLoop& loop, int threads)
+    : m_thread_count(threads),
+      m_completions(loop, this),
+      m_stopping(false)
+{
+
+}
+
+OffloadPool::~OffloadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stopping = true;
+    }
+    m_ready.notify_all();
+    for (std::thread& thread : m_threads)
+    {
+        thread.join();
+    }
+
+    for (OffloadJob* job : m_queue)
+    {
+        delete job;
+    }
+}
+
+bool OffloadPool::start()
+{
+    if (!m_completions.start())
+    {
+        return false;
+    }
+
+    for (int i = 0; i < m_thread_count; i++)
+    {
+        m_threads.emplace_back(&OffloadPool::run_thread, this);
+    }
+    return true;
+}
+
+bool OffloadPool::submit(std::unique_ptr<OffloadJob>& job)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_queue.size() >= OFFLOAD_QUEUE_SIZE)
+        {
+            METRIC_INC(METRIC_OFFLOAD_INLINE);
+            return false;
+        }
+        job->m_submitted_us = monotonic_us();
+        m_queue.push_back(job.release());
+    }
+    m_ready.notify_one();
+    METRIC_INC(METRIC_OFFLOAD_QUEUE_DEPTH);
+    return true;
+}
+
+void OffloadPool::cancel(OffloadJob* job)
+{
+    // A job that is still queued is dropped right away.
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto it = std::find(m_queue.begin(), m_queue.end(), job);
+        if (it == m_queue.end())
+        {
+            job->m_cancelled.store(true, std::memory_order_relaxed);
+            return;
+        }
+        m_queue.erase(it);
+    }
+    METRIC_DEC(METRIC_OFFLOAD_QUEUE_DEPTH);
+    delete job;
+}
+
+void OffloadPool::job_finished(OffloadJob* job)
+{
+    METRIC_DEC(METRIC_OFFLOAD_QUEUE_DEPTH);
+    METRIC_INC(METRIC_OFFLOAD_JOBS);
+    METRIC_ADD(METRIC_OFFLOAD_WAIT_US, job->m_started_us - job->m_submitted_us);
+    METRIC_ADD(METRIC_OFFLOAD_RUN_US, job->m_finished_us - job->m_started_us);
+
+    // A completion may cancel jobs finished after this one; those are
+    // only flagged, not freed.
+    if (!job->is_cancelled())
+    {
+        job->complete();
+    }
+    delete job;
+}
+
+void OffloadPool::run_thread()
+{
+    while (true)
+    {
+        OffloadJob* job;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_ready.wait(lock, [this] { return m_stopping || !m_queue.empty(); });
+            if (m_stopping)
+            {
+                return;
+            }
+            job = m_queue.front();
+            m_queue.pop_front();
+        }
+
+        job->m_started_us = monotonic_us();
+        job->run();
+        job->m_finished_us = monotonic_us();
+        m_completions.push(job);
+    }
+}
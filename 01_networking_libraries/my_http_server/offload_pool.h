@@ -0,0 +1,47 @@
+#ifndef OFFLOAD_POOL_H
+#define OFFLOAD_POOL_H
+
+#include "completion_queue.h"
+#include "event_loop.h"
+#include "offload_job.h"
+
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Runs blocking filesystem calls off the event loop, on a fixed number of
+// threads, so a slow disk holds up the requests that need it rather than
+// every connection on the loop. At most OFFLOAD_QUEUE_SIZE jobs wait for a
+// thread. Finished jobs come back to the loop through a CompletionQueue.
+// One pool belongs to one loop and is started after the workers are forked.
+class OffloadPool : public JobExecutor, public CompletionClient
+{
+public:
+    OffloadPool(EventLoop& loop, int threads);
+    ~OffloadPool();
+
+    bool start();
+
+    bool submit(std::unique_ptr<OffloadJob>& job) override;
+    void cancel(OffloadJob* job) override;
+    void job_finished(OffloadJob* job) override;
+
+private:
+    void run_thread();
+
+private:
+    int m_thread_count;
+    CompletionQueue m_completions;
+    std::vector<std::thread> m_threads;
+
+    // Submitted jobs, taken by the threads
+    std::mutex m_mutex;
+    std::condition_variable m_ready;
+    std::deque<OffloadJob*> m_queue;
+    bool m_stopping;
+};
+
+#endif // OFFLOAD_POOL_H
@@ -0,0 +1,347 @@
+#include "output_queue.h"
+#include "logging.h"
+#include "metrics.h"
+
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+
+#define SENDFILE_CHUNK_SIZE (1024 * 1024)
+#define TLS_FILE_CHUNK_SIZE (16 * 1024)
+
+OutputQueue::OutputQueue()
+    : m_pending_bytes(0),
+      m_buffered_bytes(0),
+      m_tls_retry_length(0)
+{
+
+}
+
+OutputQueue::~OutputQueue()
+{
+    clear();
+}
+
+void OutputQueue::append(std::string data)
+{
+    if (data.empty())
+    {
+        return;
+    }
+
+    m_pending_bytes += data.length();
+    m_buffered_bytes += data.length();
+
+    Segment segment;
+    segment.data = std::move(data);
+    segment.shared_offset = 0;
+    segment.shared_length = 0;
+    segment.offset = 0;
+    segment.file_fd = -1;
+    segment.file_offset = 0;
+    segment.file_remaining = 0;
+    m_segments.push_back(std::move(segment));
+}
+
+void OutputQueue::append_shared(std::shared_ptr<const std::string> buffer, std::size_t offset, std::size_t length)
+{
+    if (length == 0)
+    {
+        return;
+    }
+
+    m_pending_bytes += length;
+    m_buffered_bytes += length;
+
+    Segment segment;
+    segment.shared = std::move(buffer);
+    segment.shared_offset = offset;
+    segment.shared_length = length;
+    segment.offset = 0;
+    segment.file_fd = -1;
+    segment.file_offset = 0;
+    segment.file_remaining = 0;
+    m_segments.push_back(std::move(segment));
+}
+
+void OutputQueue::append_file(int file_fd, off_t offset, std::size_t length)
+{
+    if (length == 0)
+    {
+        close(file_fd);
+        return;
+    }
+
+    m_pending_bytes += length;
+
+    Segment segment;
+    segment.shared_offset = 0;
+    segment.shared_length = 0;
+    segment.offset = 0;
+    segment.file_fd = file_fd;
+    segment.file_offset = offset;
+    segment.file_remaining = length;
+    m_segments.push_back(std::move(segment));
+}
+
+void OutputQueue::clear()
+{
+    while (!m_segments.empty())
+    {
+        pop_front();
+    }
+    m_pending_bytes = 0;
+    m_buffered_bytes = 0;
+    m_tls_retry_length = 0;
+}
+
+bool OutputQueue::empty() const
+{
+    return m_segments.empty();
+}
+
+std::size_t OutputQueue::pending_bytes() const
+{
+    return m_pending_bytes;
+}
+
+std::size_t OutputQueue::buffered_bytes() const
+{
+    return m_buffered_bytes;
+}
+
+std::size_t OutputQueue::segment_count() const
+{
+    return m_segments.size();
+}
+
+ssize_t OutputQueue::write_to(int sock, std::size_t limit)
+{
+    ssize_t total = 0;
+    while (!m_segments.empty() && static_cast<std::size_t>(total) < limit)
+    {
+        Segment& front = m_segments.front();
+        std::size_t left = limit - total;
+        ssize_t rc_write = (front.file_fd >= 0) ? write_file(sock, front, left) : write_buffers(sock, left);
+        if (rc_write < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                break;
+            }
+            return -1;
+        }
+        total += rc_write;
+    }
+    return total;
+}
+
+ssize_t OutputQueue::write_to(SSL* ssl, std::size_t limit)
+{
+    ssize_t total = 0;
+    bool ktls_send = BIO_get_ktls_send(SSL_get_wbio(ssl));
+    while (!m_segments.empty() && static_cast<std::size_t>(total) < limit)
+    {
+        Segment& front = m_segments.front();
+        std::size_t left = limit - total;
+        ssize_t rc_write = (ktls_send && front.file_fd >= 0) ? write_ktls_file(ssl, front, left) : write_tls(ssl, front, left);
+        if (rc_write < 0)
+        {
+            if (errno == EAGAIN)
+            {
+                break;
+            }
+            return -1;
+        }
+        total += rc_write;
+    }
+    return total;
+}
+
+ssize_t OutputQueue::write_buffers(int sock, std::size_t limit)
+{
+    iovec iov[MAX_IOVECS];
+    int iov_count = 0;
+    bool file_follows = false;
+    for (const Segment& segment : m_segments)
+    {
+        if (segment.file_fd >= 0)
+        {
+            file_follows = true;
+            break;
+        }
+        if (iov_count == MAX_IOVECS || limit == 0)
+        {
+            break;
+        }
+        iov[iov_count].iov_base = const_cast<char*>(segment.bytes() + segment.offset);
+        iov[iov_count].iov_len = std::min(segment.length() - segment.offset, limit);
+        limit -= iov[iov_count].iov_len;
+        iov_count++;
+    }
+
+    msghdr msg = {};
+    msg.msg_iov = iov;
+    msg.msg_iovlen = iov_count;
+
+    // Let headers share a segment with the start of the file body.
+    ssize_t rc_send = sendmsg(sock, &msg, MSG_NOSIGNAL | (file_follows ? MSG_MORE : 0));
+    if (rc_send <= 0)
+    {
+        if (rc_send == 0)
+        {
+            errno = EPIPE;
+        }
+        return -1;
+    }
+
+    std::size_t remaining = rc_send;
+    m_pending_bytes -= remaining;
+    m_buffered_bytes -= remaining;
+    while (remaining > 0)
+    {
+        Segment& front = m_segments.front();
+        std::size_t available = front.length() - front.offset;
+        if (remaining < available)
+        {
+            front.offset += remaining;
+            break;
+        }
+        remaining -= available;
+        pop_front();
+    }
+    return rc_send;
+}
+
+ssize_t OutputQueue::write_file(int sock, Segment& segment, std::size_t limit)
+{
+    std::size_t chunk = std::min<std::size_t>({segment.file_remaining, SENDFILE_CHUNK_SIZE, limit});
+    ssize_t rc_send = sendfile(sock, segment.file_fd, &segment.file_offset, chunk);
+    if (rc_send <= 0)
+    {
+        if (rc_send == 0)
+        {
+            // The file shrank after its length went out in the headers.
+            LOGE("sendfile() reached an unexpected end of file");
+            errno = EIO;
+        }
+        return -1;
+    }
+
+    segment.file_remaining -= rc_send;
+    m_pending_bytes -= rc_send;
+    if (segment.file_remaining == 0)
+    {
+        pop_front();
+    }
+    return rc_send;
+}
+
+ssize_t OutputQueue::write_tls(SSL* ssl, Segment& segment, std::size_t limit)
+{
+    limit = std::max(limit, m_tls_retry_length);
+
+    // A chunk that SSL_write() could not take is read again on the retry;
+    // SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER allows it to live at a new address.
+    char chunk[TLS_FILE_CHUNK_SIZE];
+    const char* data;
+    std::size_t length;
+    if (segment.file_fd >= 0)
+    {
+        length = std::min<std::size_t>({segment.file_remaining, sizeof(chunk), limit});
+        ssize_t rc_read = pread(segment.file_fd, chunk, length, segment.file_offset);
+        if (rc_read <= 0)
+        {
+            LOGE("pread() failed on a queued file");
+            errno = EIO;
+            return -1;
+        }
+        data = chunk;
+        length = rc_read;
+    }
+    else
+    {
+        data = segment.bytes() + segment.offset;
+        length = std::min(segment.length() - segment.offset, limit);
+    }
+
+    int rc_write = SSL_write(ssl, data, length);
+    if (rc_write <= 0)
+    {
+        int error = SSL_get_error(ssl, rc_write);
+        errno = (error == SSL_ERROR_WANT_WRITE || error == SSL_ERROR_WANT_READ) ? EAGAIN : EPIPE;
+        m_tls_retry_length = (errno == EAGAIN) ? length : 0;
+        return -1;
+    }
+    m_tls_retry_length = 0;
+
+    m_pending_bytes -= rc_write;
+    if (segment.file_fd >= 0)
+    {
+        segment.file_offset += rc_write;
+        segment.file_remaining -= rc_write;
+        if (segment.file_remaining == 0)
+        {
+            pop_front();
+        }
+    }
+    else
+    {
+        m_buffered_bytes -= rc_write;
+        segment.offset += rc_write;
+        if (segment.offset == segment.length())
+        {
+            pop_front();
+        }
+    }
+    return rc_write;
+}
+
+ssize_t OutputQueue::write_ktls_file(SSL* ssl, Segment& segment, std::size_t limit)
+{
+    std::size_t chunk = std::min<std::size_t>({segment.file_remaining, SENDFILE_CHUNK_SIZE, limit});
+    ossl_ssize_t rc_send = SSL_sendfile(ssl, segment.file_fd, segment.file_offset, chunk, 0);
+    if (rc_send <= 0)
+    {
+        int error = SSL_get_error(ssl, rc_send);
+        errno = (error == SSL_ERROR_WANT_WRITE || error == SSL_ERROR_WANT_READ) ? EAGAIN : EPIPE;
+        return -1;
+    }
+
+    METRIC_ADD(METRIC_TLS_SENDFILE_BYTES, rc_send);
+    segment.file_offset += rc_send;
+    segment.file_remaining -= rc_send;
+    m_pending_bytes -= rc_send;
+    if (segment.file_remaining == 0)
+    {
+        pop_front();
+    }
+    return rc_send;
+}
+
+const char* OutputQueue::Segment::bytes() const
+{
+    return (shared != nullptr) ? shared->data() + shared_offset : data.data();
+}
+
+std::size_t OutputQueue::Segment::length() const
+{
+    return (shared != nullptr) ? shared_length : data.length();
+}
+
+void OutputQueue::pop_front()
+{
+    Segment& front = m_segments.front();
+    if (front.file_fd >= 0)
+    {
+        close(front.file_fd);
+    }
+    m_segments.pop_front();
+}
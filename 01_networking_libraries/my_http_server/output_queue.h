@@ -0,0 +1,87 @@
+#ifndef OUTPUT_QUEUE_H
+#define OUTPUT_QUEUE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <string>
+#include <sys/types.h>
+#include <openssl/ssl.h>
+
+// Ordered list of pending response data for one connection. In-memory
+// segments are gathered into a single sendmsg(), file segments go out with
+// sendfile() and never occupy user-space memory. Shared segments reference
+// an immutable buffer that many queues hold at once, such as an event
+// broadcast to every subscriber of a topic.
+class OutputQueue
+{
+public:
+    OutputQueue();
+    ~OutputQueue();
+
+    OutputQueue(const OutputQueue&) = delete;
+    OutputQueue& operator=(const OutputQueue&) = delete;
+
+    void append(std::string data);
+    // Queues length bytes of buffer from offset, without a copy; the buffer
+    // is released once every queue holding it has sent its part.
+    void append_shared(std::shared_ptr<const std::string> buffer, std::size_t offset, std::size_t length);
+    // Takes ownership of file_fd, which is closed once the segment is sent.
+    void append_file(int file_fd, off_t offset, std::size_t length);
+    void clear();
+
+    bool empty() const;
+    // Bytes still to be sent, including file segments.
+    std::size_t pending_bytes() const;
+    // Bytes held in memory by in-memory segments.
+    std::size_t buffered_bytes() const;
+    // Segments still queued, each a separate write for the client to take.
+    std::size_t segment_count() const;
+
+    // Writes as much as the socket accepts, up to limit bytes. Returns the
+    // number of bytes written (0 if the socket is full) or -1 on a fatal
+    // socket error.
+    ssize_t write_to(int sock, std::size_t limit = SIZE_MAX);
+    // Same for a TLS connection. File segments go out with SSL_sendfile()
+    // when the kernel does the encryption, and are otherwise read in chunks
+    // and encrypted with SSL_write(). A write that has to be retried is
+    // retried whole, even past limit.
+    ssize_t write_to(SSL* ssl, std::size_t limit = SIZE_MAX);
+
+private:
+    struct Segment
+    {
+        std::string data;
+        // Set for a shared segment, which covers shared_length bytes of it
+        // from shared_offset instead of data
+        std::shared_ptr<const std::string> shared;
+        std::size_t shared_offset;
+        std::size_t shared_length;
+        std::size_t offset;
+        int file_fd;
+        off_t file_offset;
+        std::size_t file_remaining;
+
+        const char* bytes() const;
+        std::size_t length() const;
+    };
+
+    ssize_t write_buffers(int sock, std::size_t limit);
+    ssize_t write_file(int sock, Segment& segment, std::size_t limit);
+    ssize_t write_tls(SSL* ssl, Segment& segment, std::size_t limit);
+    ssize_t write_ktls_file(SSL* ssl, Segment& segment, std::size_t limit);
+    void pop_front();
+
+private:
+    static const int MAX_IOVECS = 64;
+
+    std::deque<Segment> m_segments;
+    std::size_t m_pending_bytes;
+    std::size_t m_buffered_bytes;
+    // Length of the SSL_write() that wants a retry, which must not be
+    // shorter; 0 if none does
+    std::size_t m_tls_retry_length;
+};
+
+#endif // OUTPUT_QUEUE_H
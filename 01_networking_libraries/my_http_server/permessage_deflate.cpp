@@ -0,0 +1,235 @@
+#include "permessage_deflate.h"
+#include "defs.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+namespace
+{
+    // The empty stored block a sync flush ends with, which is left out of
+    // every message on the wire (RFC 7692, section 7.2.1).
+    const char DEFLATE_TAIL[] = {'\x00', '\x00', '\xff', '\xff'};
+
+    std::string trim(const std::string& text)
+    {
+        std::size_t begin = text.find_first_not_of(" \t");
+        if (begin == std::string::npos)
+        {
+            return std::string();
+        }
+        std::size_t end = text.find_last_not_of(" \t");
+        return text.substr(begin, end - begin + 1);
+    }
+
+    std::vector<std::string> split(const std::string& text, char separator)
+    {
+        std::vector<std::string> parts;
+        std::size_t begin = 0;
+        while (begin <= text.length())
+        {
+            std::size_t end = text.find(separator, begin);
+            if (end == std::string::npos)
+            {
+                end = text.length();
+            }
+            parts.push_back(trim(text.substr(begin, end - begin)));
+            begin = end + 1;
+        }
+        return parts;
+    }
+
+    // A window size parameter: 8 to 15, possibly quoted. Returns -1 if it
+    // is not one.
+    int window_bits(std::string value)
+    {
+        if (value.length() >= 2 && value.front() == '"' && value.back() == '"')
+        {
+            value = value.substr(1, value.length() - 2);
+        }
+        if (value.empty() || value.length() > 2 || value.find_first_not_of("0123456789") != std::string::npos)
+        {
+            return -1;
+        }
+        int bits = std::atoi(value.c_str());
+        return (bits >= 8 && bits <= 15) ? bits : -1;
+    }
+}
+
+PerMessageDeflate::PerMessageDeflate()
+    : m_deflate_ready(false),
+      m_inflate_ready(false),
+      m_window_bits(WEBSOCKET_DEFLATE_WINDOW_BITS)
+{
+    std::memset(&m_deflate, 0, sizeof(m_deflate));
+    std::memset(&m_inflate, 0, sizeof(m_inflate));
+}
+
+PerMessageDeflate::~PerMessageDeflate()
+{
+    if (m_deflate_ready)
+    {
+        deflateEnd(&m_deflate);
+    }
+    if (m_inflate_ready)
+    {
+        inflateEnd(&m_inflate);
+    }
+}
+
+bool PerMessageDeflate::negotiate(const std::string& offers, std::string& response)
+{
+    for (const std::string& offer : split(offers, ','))
+    {
+        std::vector<std::string> parameters = split(offer, ';');
+        if (parameters[0] != "permessage-deflate")
+        {
+            continue;
+        }
+
+        bool acceptable = true;
+        bool server_no_context_takeover = false;
+        bool client_no_context_takeover = false;
+        bool client_max_window_bits = false;
+        int server_max_window_bits = 0;
+        for (std::size_t i = 1; i < parameters.size() && acceptable; i++)
+        {
+            std::size_t equals = parameters[i].find('=');
+            std::string name = trim(parameters[i].substr(0, equals));
+            std::string value = (equals == std::string::npos) ? std::string() : trim(parameters[i].substr(equals + 1));
+            bool has_value = (equals != std::string::npos);
+
+            // Every parameter at most once, and only with the values it
+            // can have.
+            if (name == "server_no_context_takeover" && !server_no_context_takeover && !has_value)
+            {
+                server_no_context_takeover = true;
+            }
+            else if (name == "client_no_context_takeover" && !client_no_context_takeover && !has_value)
+            {
+                client_no_context_takeover = true;
+            }
+            else if (name == "client_max_window_bits" && !client_max_window_bits && (!has_value || window_bits(value) > 0))
+            {
+                // The client would let us cap its window; its messages are
+                // inflated with a full one anyway.
+                client_max_window_bits = true;
+            }
+            else if (name == "server_max_window_bits" && server_max_window_bits == 0 && window_bits(value) > 0)
+            {
+                server_max_window_bits = window_bits(value);
+            }
+            else
+            {
+                acceptable = false;
+            }
+        }
+        // zlib cannot compress with a 256 byte window.
+        if (!acceptable || server_max_window_bits == 8)
+        {
+            continue;
+        }
+
+        response = "permessage-deflate; server_no_context_takeover";
+        if (client_no_context_takeover)
+        {
+            response += "; client_no_context_takeover";
+        }
+        if (server_max_window_bits > 0)
+        {
+            m_window_bits = std::min(m_window_bits, server_max_window_bits);
+            response += "; server_max_window_bits=" + std::to_string(server_max_window_bits);
+        }
+        return true;
+    }
+    return false;
+}
+
+bool PerMessageDeflate::compress(const char* data, std::size_t length, std::string& output)
+{
+    if (!m_deflate_ready)
+    {
+        if (deflateInit2(&m_deflate, WEBSOCKET_DEFLATE_LEVEL, Z_DEFLATED, -m_window_bits, WEBSOCKET_DEFLATE_MEM_LEVEL,
+                         Z_DEFAULT_STRATEGY) != Z_OK)
+        {
+            return false;
+        }
+        m_deflate_ready = true;
+    }
+
+    // The bound holds for the whole message finished off, which is more
+    // than a sync flush adds; one call does it all.
+    std::size_t start = output.length();
+    std::size_t capacity = deflateBound(&m_deflate, length) + 16;
+    output.resize(start + capacity);
+    m_deflate.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+    m_deflate.avail_in = length;
+    m_deflate.next_out = reinterpret_cast<Bytef*>(&output[start]);
+    m_deflate.avail_out = capacity;
+    int rc_deflate = deflate(&m_deflate, Z_SYNC_FLUSH);
+    std::size_t produced = capacity - m_deflate.avail_out;
+    deflateReset(&m_deflate);
+
+    if (rc_deflate != Z_OK || m_deflate.avail_in != 0 || produced < sizeof(DEFLATE_TAIL) ||
+        std::memcmp(&output[start + produced - sizeof(DEFLATE_TAIL)], DEFLATE_TAIL, sizeof(DEFLATE_TAIL)) != 0)
+    {
+        output.resize(start);
+        return false;
+    }
+    output.resize(start + produced - sizeof(DEFLATE_TAIL));
+    return true;
+}
+
+bool PerMessageDeflate::decompress(std::string& message, std::size_t limit)
+{
+    if (!m_inflate_ready)
+    {
+        if (inflateInit2(&m_inflate, -15) != Z_OK)
+        {
+            return false;
+        }
+        m_inflate_ready = true;
+    }
+
+    message.append(DEFLATE_TAIL, sizeof(DEFLATE_TAIL));
+    m_inflate.next_in = reinterpret_cast<Bytef*>(&message[0]);
+    m_inflate.avail_in = message.length();
+
+    std::string output;
+    char buffer[16384];
+    do
+    {
+        m_inflate.next_out = reinterpret_cast<Bytef*>(buffer);
+        m_inflate.avail_out = sizeof(buffer);
+        int rc_inflate = inflate(&m_inflate, Z_SYNC_FLUSH);
+        if (rc_inflate != Z_OK && rc_inflate != Z_STREAM_END && rc_inflate != Z_BUF_ERROR)
+        {
+            return false;
+        }
+        output.append(buffer, sizeof(buffer) - m_inflate.avail_out);
+        if (output.length() > limit)
+        {
+            return false;
+        }
+        // A message may end in a final block, after which the client
+        // starts a new stream.
+        if (rc_inflate == Z_STREAM_END)
+        {
+            inflateReset(&m_inflate);
+            break;
+        }
+        // No progress: the input ran out right after the output did.
+        if (rc_inflate == Z_BUF_ERROR && m_inflate.avail_out != 0)
+        {
+            if (m_inflate.avail_in > 0)
+            {
+                return false;
+            }
+            break;
+        }
+    } while (m_inflate.avail_in > 0 || m_inflate.avail_out == 0);
+
+    message.swap(output);
+    return true;
+}
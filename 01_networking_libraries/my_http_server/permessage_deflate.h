@@ -0,0 +1,44 @@
+#ifndef PERMESSAGE_DEFLATE_H
+#define PERMESSAGE_DEFLATE_H
+
+#include <cstddef>
+#include <string>
+#include <zlib.h>
+
+// The permessage-deflate WebSocket extension (RFC 7692) of one connection.
+// The server never takes its compression context over from one message to
+// the next, so between messages its deflate state is only reset, and it
+// compresses with a window of at most WEBSOCKET_DEFLATE_WINDOW_BITS. The
+// client may keep its context, so messages are inflated with one stream
+// and a full window for the whole connection. Both zlib streams are set up
+// when first used.
+class PerMessageDeflate
+{
+public:
+    PerMessageDeflate();
+    ~PerMessageDeflate();
+
+    PerMessageDeflate(const PerMessageDeflate&) = delete;
+    PerMessageDeflate& operator=(const PerMessageDeflate&) = delete;
+
+    // Picks the first offer in a Sec-WebSocket-Extensions request header
+    // that can be accepted. Returns false if none can; otherwise sets
+    // response to the extension's value for the response header.
+    bool negotiate(const std::string& offers, std::string& response);
+
+    // Appends the compressed message to output, without the empty block
+    // that ends it.
+    bool compress(const char* data, std::size_t length, std::string& output);
+    // Replaces the compressed payload of a message with the message.
+    // Returns false if it is corrupt or inflates beyond limit bytes.
+    bool decompress(std::string& message, std::size_t limit);
+
+private:
+    bool m_deflate_ready;
+    bool m_inflate_ready;
+    int m_window_bits;
+    z_stream m_deflate;
+    z_stream m_inflate;
+};
+
+#endif // PERMESSAGE_DEFLATE_H
@@ -0,0 +1,193 @@
+#include "rate_limiter.h"
+#include "http_response.h"
+#include "metrics.h"
+#include "utils.h"
+
+#include <algorithm>
+#include <cstring>
+#include <netinet/in.h>
+#include <new>
+#include <sys/mman.h>
+
+namespace
+{
+    const int TOKEN_BITS = 24;
+    const uint64_t TOKEN_MASK = (1ULL << TOKEN_BITS) - 1;
+    // Tokens are counted in 1/256ths, so slow refill rates still add up
+    const uint64_t TOKEN_SCALE = 256;
+    // Any bucket is full again after this long, which also keeps the
+    // refill arithmetic from overflowing
+    const uint64_t MAX_REFILL_MS = (RATE_LIMIT_MAX_BURST + 1) * 1000ULL;
+    const int TABLE_BITS = __builtin_ctz(RATE_LIMIT_TABLE_SIZE);
+
+    static_assert((RATE_LIMIT_TABLE_SIZE & (RATE_LIMIT_TABLE_SIZE - 1)) == 0, "the table size is a power of two");
+    static_assert(RATE_LIMIT_MAX_BURST * TOKEN_SCALE <= TOKEN_MASK, "a full bucket fits its bits");
+
+    std::size_t slot_index(uint64_t client)
+    {
+        // Fibonacci hashing: the high bits of the product mix every bit of
+        // the address.
+        return static_cast<std::size_t>((client * 0x9E3779B97F4A7C15ULL) >> (64 - TABLE_BITS));
+    }
+}
+
+RateLimiter::RateLimiter(int rate, int burst)
+    : m_slots(nullptr),
+      m_rate(rate),
+      m_burst(std::min(burst, RATE_LIMIT_MAX_BURST)),
+      m_epoch_ms(monotonic_ms())
+{
+    HTTPResponse response(HTTP_429, "429 Too Many Requests");
+    response.set_header("Retry-After", std::to_string(RATE_LIMIT_RETRY_AFTER_SEC));
+    response.set_header("Connection", "close");
+    m_rejection = response.to_string();
+}
+
+RateLimiter::~RateLimiter()
+{
+    if (m_slots != nullptr)
+    {
+        munmap(m_slots, RATE_LIMIT_TABLE_SIZE * sizeof(Slot));
+    }
+}
+
+bool RateLimiter::init()
+{
+    static_assert(std::atomic<uint64_t>::is_always_lock_free, "buckets are shared between processes");
+
+    void* memory = mmap(nullptr, RATE_LIMIT_TABLE_SIZE * sizeof(Slot), PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED)
+    {
+        return false;
+    }
+
+    m_slots = static_cast<Slot*>(memory);
+    for (std::size_t i = 0; i < RATE_LIMIT_TABLE_SIZE; i++)
+    {
+        new (&m_slots[i].client) std::atomic<uint64_t>(0);
+        new (&m_slots[i].bucket) std::atomic<uint64_t>(0);
+    }
+    return true;
+}
+
+bool RateLimiter::allow(uint64_t client, uint64_t now_ms)
+{
+    // The loop's clock of another process may lag the epoch by a little.
+    uint64_t now = (now_ms > m_epoch_ms) ? now_ms - m_epoch_ms : 0;
+    Slot* slot = find(client, now);
+    if (slot == nullptr)
+    {
+        return true;
+    }
+
+    uint64_t bucket = slot->bucket.load(std::memory_order_relaxed);
+    while (true)
+    {
+        uint64_t refilled = bucket >> TOKEN_BITS;
+        uint64_t tokens = bucket & TOKEN_MASK;
+        if (now > refilled)
+        {
+            uint64_t added = std::min(now - refilled, MAX_REFILL_MS) * m_rate * TOKEN_SCALE / 1000;
+            // Less than a 1/256th so far: the time keeps counting from
+            // the last refill instead of being lost.
+            if (added > 0)
+            {
+                tokens = std::min(tokens + added, m_burst * TOKEN_SCALE);
+                refilled = now;
+            }
+        }
+
+        if (tokens < TOKEN_SCALE)
+        {
+            return false;
+        }
+
+        uint64_t taken = (refilled << TOKEN_BITS) | (tokens - TOKEN_SCALE);
+        if (slot->bucket.compare_exchange_weak(bucket, taken, std::memory_order_relaxed))
+        {
+            return true;
+        }
+    }
+}
+
+const std::string& RateLimiter::rejection() const
+{
+    return m_rejection;
+}
+
+uint64_t RateLimiter::client_key(const sockaddr* address)
+{
+    uint64_t key = 0;
+    if (address->sa_family == AF_INET)
+    {
+        const sockaddr_in* sin = reinterpret_cast<const sockaddr_in*>(address);
+        key = (1ULL << 32) | ntohl(sin->sin_addr.s_addr);
+    }
+    else if (address->sa_family == AF_INET6)
+    {
+        const sockaddr_in6* sin6 = reinterpret_cast<const sockaddr_in6*>(address);
+        std::memcpy(&key, sin6->sin6_addr.s6_addr, sizeof(key));
+        // An IPv4-mapped address is the IPv4 client itself.
+        if (IN6_IS_ADDR_V4MAPPED(&sin6->sin6_addr))
+        {
+            uint32_t ipv4;
+            std::memcpy(&ipv4, sin6->sin6_addr.s6_addr + 12, sizeof(ipv4));
+            key = (1ULL << 32) | ntohl(ipv4);
+        }
+    }
+    // Zero marks an empty slot.
+    return (key != 0) ? key : 1;
+}
+
+RateLimiter::Slot* RateLimiter::find(uint64_t client, uint64_t now)
+{
+    // Slots are never emptied, only taken over, so a client is always
+    // found before the first empty slot of its probe window.
+    std::size_t index = slot_index(client);
+    Slot* oldest = nullptr;
+    uint64_t oldest_client = 0;
+    uint64_t oldest_refill = UINT64_MAX;
+    for (int probe = 0; probe < RATE_LIMIT_PROBES; probe++)
+    {
+        Slot& slot = m_slots[(index + probe) & (RATE_LIMIT_TABLE_SIZE - 1)];
+        uint64_t owner = slot.client.load(std::memory_order_acquire);
+        if (owner == 0)
+        {
+            if (slot.client.compare_exchange_strong(owner, client, std::memory_order_acq_rel))
+            {
+                slot.bucket.store(full_bucket(now), std::memory_order_relaxed);
+                return &slot;
+            }
+            // Another worker took it first, perhaps for the same client.
+        }
+        if (owner == client)
+        {
+            return &slot;
+        }
+
+        uint64_t refilled = slot.bucket.load(std::memory_order_relaxed) >> TOKEN_BITS;
+        if (refilled < oldest_refill)
+        {
+            oldest = &slot;
+            oldest_client = owner;
+            oldest_refill = refilled;
+        }
+    }
+
+    // A full window: the least recently refilled client makes room. If
+    // another worker changed that slot meanwhile, the client goes
+    // unlimited this once rather than probing again.
+    if (oldest == nullptr || !oldest->client.compare_exchange_strong(oldest_client, client, std::memory_order_acq_rel))
+    {
+        return nullptr;
+    }
+    oldest->bucket.store(full_bucket(now), std::memory_order_relaxed);
+    METRIC_INC(METRIC_RATE_LIMIT_EVICTIONS);
+    return oldest;
+}
+
+uint64_t RateLimiter::full_bucket(uint64_t now) const
+{
+    return (now << TOKEN_BITS) | (m_burst * TOKEN_SCALE);
+}
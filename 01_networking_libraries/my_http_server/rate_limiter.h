@@ -0,0 +1,65 @@
+#ifndef RATE_LIMITER_H
+#define RATE_LIMITER_H
+
+#include "defs.h"
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <sys/socket.h>
+
+// Token buckets per client address: a client may make `rate` requests per
+// second on average and up to `burst` in a row. A new connection takes a
+// token, and so does each request.
+//
+// The buckets live in a fixed open-addressing table in shared memory,
+// mapped before the workers are forked, so a client has one budget across
+// all of them. Every slot is updated with compare-and-swap only: a lookup
+// probes at most RATE_LIMIT_PROBES slots, takes the client's own or an
+// empty one, and otherwise evicts the one whose bucket was refilled least
+// recently. Two workers racing on the same slot may each let a request
+// through that the other then pays for, which keeps the limit approximate
+// under contention and never blocks.
+class RateLimiter
+{
+public:
+    RateLimiter(int rate, int burst);
+    ~RateLimiter();
+
+    RateLimiter(const RateLimiter&) = delete;
+    RateLimiter& operator=(const RateLimiter&) = delete;
+
+    // Maps the table. Returns false if it cannot be mapped.
+    bool init();
+
+    // Takes a token from client's bucket; false when it is empty.
+    bool allow(uint64_t client, uint64_t now_ms);
+
+    // The complete 429 response for refused clients, built once.
+    const std::string& rejection() const;
+
+    // The key of a peer address: the whole IPv4 address, or the /64
+    // prefix of an IPv6 one, since a single host usually owns all of it.
+    static uint64_t client_key(const sockaddr* address);
+
+private:
+    struct Slot
+    {
+        std::atomic<uint64_t> client;
+        // The last refill in ms since m_epoch_ms in the high bits, the
+        // tokens left in 1/256ths in the low 24 bits
+        std::atomic<uint64_t> bucket;
+    };
+
+    Slot* find(uint64_t client, uint64_t now);
+    uint64_t full_bucket(uint64_t now) const;
+
+private:
+    Slot* m_slots;
+    uint64_t m_rate;
+    uint64_t m_burst;
+    uint64_t m_epoch_ms;
+    std::string m_rejection;
+};
+
+#endif // RATE_LIMITER_H
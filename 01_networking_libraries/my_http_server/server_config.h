@@ -0,0 +1,103 @@
+#ifndef SERVER_CONFIG_H
+#define SERVER_CONFIG_H
+
+#include "defs.h"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Requests whose path starts with prefix are forwarded to one of the
+// upstream "host:port" addresses.
+struct ProxyRoute
+{
+    std::string prefix;
+    std::vector<std::string> upstreams;
+};
+
+struct ServerConfig
+{
+    int port = -1;
+
+    // Listen backlog, capped by the kernel at net.core.somaxconn
+    int backlog = LISTEN_BACKLOG;
+    // Wake up for a new connection only once its first data has arrived
+    bool defer_accept = true;
+    // Accept data in the SYN from clients holding a Fast Open cookie
+    bool fast_open = true;
+
+    // Connections open at once, counting the idle ones; new clients wait
+    // in the backlog beyond that
+    int max_connections = MAX_CONNECTION;
+    // Keep-alive connections between requests are cut down to an
+    // IdleConnection, without buffers, parser or router
+    bool compact_idle = false;
+
+    // Busy-poll for up to this many microseconds before sleeping, disabled
+    // while zero
+    int busy_poll_us = 0;
+
+    // Shed new connections with 503 while the queueing delay from readiness
+    // to dispatch stays above shed_target_ms, disabled while zero
+    int shed_target_ms = 0;
+    int shed_interval_ms = SHED_INTERVAL_MS;
+
+    // Requests per second allowed to each client address, unlimited while
+    // zero, in bursts of up to rate_limit_burst (default: rate_limit)
+    int rate_limit = 0;
+    int rate_limit_burst = 0;
+
+    // HTTPS listener, disabled while https_port is negative
+    int https_port = -1;
+    std::string cert_file = STR_TLS_CERT_FILE;
+    std::string key_file = STR_TLS_KEY_FILE;
+    // Hand record encryption to the kernel after the handshake when possible
+    bool enable_ktls = true;
+
+    // Share the loop's egress fairly between connections, with a priority
+    // lane for small responses; implied by either rate cap
+    bool fair_egress = false;
+    // Bytes per second the loop sends in all, and each connection, for
+    // bulk output, unlimited while zero
+    uint64_t egress_rate = 0;
+    uint64_t connection_rate = 0;
+
+    // Compress WebSocket messages for clients that offer permessage-deflate
+    bool websocket_deflate = false;
+
+    // Binary access log appended to by every worker, disabled while empty
+    std::string access_log;
+
+    std::vector<ProxyRoute> proxy_routes;
+
+    // Threads per event loop that look static files up and read them, so a
+    // slow disk does not stall the loop; the loop does it itself while zero
+    int offload_threads = 0;
+    // Threads per event loop that run CPU-heavy handler work, each with a
+    // deque of its own; handlers compute on the loop while zero
+    int compute_threads = 0;
+    // Idle compute threads take work queued for busy ones
+    bool compute_stealing = true;
+
+    // PUT and POST to STR_UPLOAD_PATH store files here, disabled while empty
+    std::string upload_dir;
+
+    // Prefork worker processes, single process while zero
+    int workers = 0;
+    // Pin each worker to its own CPU, taken round-robin from worker_cpus,
+    // or from the CPUs the server may run on while that is empty
+    bool pin_workers = true;
+    std::vector<int> worker_cpus;
+    // Pinned workers allocate their memory on the NUMA node of their CPU
+    bool numa_local = true;
+    // Each pinned worker gets its own SO_REUSEPORT listeners, which the
+    // kernel hands the connections arriving on the worker's CPU
+    bool incoming_cpu = false;
+
+    // Unix socket for hot upgrades, disabled while empty
+    std::string upgrade_socket;
+    // Take the listeners over from the server on upgrade_socket
+    bool upgrade = false;
+};
+
+#endif // SERVER_CONFIG_H
@@ -0,0 +1,227 @@
+#ifndef SERVER_POLICIES_H
+#define SERVER_POLICIES_H
+
+#include "event_loop.h"
+#include "frame_pool.h"
+#include "http_parser.h"
+#include "http_router.h"
+#include "logging.h"
+#include "static_file_router.h"
+
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <string>
+#include <type_traits>
+#include <utility>
+
+// Policies of BasicHTTPServer and BasicHTTPConnectionHandler. A server is
+// configured by a struct of them, chosen at compile time, so the calls it
+// makes on every request are resolved statically and the features it goes
+// without are not compiled into its hot paths:
+//
+//   Loop       the event backend; the other components take an EventLoop&,
+//              so it is EventLoop or derives from it
+//   Parser     frames and parses requests, like HTTPParser
+//   Router     answers requests, like HTTPRouter or StaticFileRouter
+//   Log        where the server's own messages go, like ConsoleLog
+//   Allocator  allocates the connections, like HeapAllocator
+//
+// and the features, each a constexpr bool: proxy (proxy routes), handlers
+// (coroutine handlers, the offload pool and the compute threads), uploads
+// (request bodies streamed to the router), http2 (h2c, which needs
+// HTTPRouter), websocket (WebSocket routes, which need HTTPRouter) and tls
+// (HTTPS listeners).
+
+// Every message goes to the Logger.
+struct ConsoleLog
+{
+    static constexpr bool enabled = true;
+    static constexpr bool inform_enabled = true;
+
+    static void inform(const std::string& message)
+    {
+        Logger::getInstance().inform(message);
+    }
+
+    static void error(const std::string& message)
+    {
+        Logger::getInstance().error(message);
+    }
+};
+
+// Only errors go to the Logger; the per-connection messages compile out.
+struct ErrorLog
+{
+    static constexpr bool enabled = true;
+    static constexpr bool inform_enabled = false;
+
+    static void inform(const std::string&)
+    {
+
+    }
+
+    static void error(const std::string& message)
+    {
+        Logger::getInstance().error(message);
+    }
+};
+
+// Nothing is logged.
+struct NullLog
+{
+    static constexpr bool enabled = false;
+    static constexpr bool inform_enabled = false;
+
+    static void inform(const std::string&)
+    {
+
+    }
+
+    static void error(const std::string&)
+    {
+
+    }
+};
+
+// For member functions of a class template with a Log policy: a message
+// its policy drops is not even built.
+#define SERVER_LOGI(message) do { if constexpr (Log::inform_enabled) { Log::inform(message); } } while (0)
+#define SERVER_LOGE(message) do { if constexpr (Log::enabled) { Log::error(message); } } while (0)
+
+// Plain operator new and delete.
+struct HeapAllocator
+{
+    template <typename T, typename... Args>
+    static T* create(Args&&... args)
+    {
+        return new T(std::forward<Args>(args)...);
+    }
+
+    template <typename T>
+    static void destroy(T* object)
+    {
+        delete object;
+    }
+};
+
+// Recycles the memory through the FramePool's free lists, so a server that
+// has warmed up accepts connections without malloc(). Like the pool, it is
+// only used from the loop's thread.
+struct PooledAllocator
+{
+    template <typename T, typename... Args>
+    static T* create(Args&&... args)
+    {
+        void* memory = FramePool::allocate(sizeof(T));
+        try
+        {
+            return new (memory) T(std::forward<Args>(args)...);
+        }
+        catch (...)
+        {
+            FramePool::release(memory, sizeof(T));
+            throw;
+        }
+    }
+
+    template <typename T>
+    static void destroy(T* object)
+    {
+        if (object != nullptr)
+        {
+            object->~T();
+            FramePool::release(object, sizeof(T));
+        }
+    }
+};
+
+// A std::unique_ptr deleter for objects made by an Allocator policy.
+template <typename Allocator>
+struct AllocatorDelete
+{
+    template <typename T>
+    void operator()(T* object) const
+    {
+        Allocator::destroy(object);
+    }
+};
+
+// Takes the place of a feature's member when the policies leave the feature
+// out, so that neither its state nor its code is in the server.
+struct AbsentFeature
+{
+    template <typename... Args>
+    explicit AbsentFeature(Args&&...)
+    {
+
+    }
+};
+
+// Likewise for a std::unique_ptr to a feature's object: always null. Only
+// code behind the feature's flag may dereference it.
+template <typename T>
+struct AbsentPtr
+{
+    T* get() const
+    {
+        return nullptr;
+    }
+
+    T* operator->() const
+    {
+        return nullptr;
+    }
+
+    void reset()
+    {
+
+    }
+
+    bool operator==(std::nullptr_t) const
+    {
+        return true;
+    }
+};
+
+template <bool Enabled, typename T>
+using FeatureMember = std::conditional_t<Enabled, T, AbsentFeature>;
+
+template <bool Enabled, typename T>
+using FeaturePtr = std::conditional_t<Enabled, std::unique_ptr<T>, AbsentPtr<T>>;
+
+// Everything this server does; HTTPServer.
+struct DefaultServerPolicies
+{
+    using Loop = EventLoop;
+    using Parser = HTTPParser;
+    using Router = HTTPRouter;
+    using Log = ConsoleLog;
+    using Allocator = HeapAllocator;
+
+    static constexpr bool proxy = true;
+    static constexpr bool handlers = true;
+    static constexpr bool uploads = true;
+    static constexpr bool http2 = true;
+    static constexpr bool websocket = true;
+    static constexpr bool tls = true;
+};
+
+// Static files over HTTP/1.1 and HTTPS, and /metrics, nothing else.
+struct StaticFileServerPolicies
+{
+    using Loop = EventLoop;
+    using Parser = HTTPParser;
+    using Router = StaticFileRouter;
+    using Log = ErrorLog;
+    using Allocator = PooledAllocator;
+
+    static constexpr bool proxy = false;
+    static constexpr bool handlers = false;
+    static constexpr bool uploads = false;
+    static constexpr bool http2 = false;
+    static constexpr bool websocket = false;
+    static constexpr bool tls = true;
+};
+
+#endif // SERVER_POLICIES_H
@@ -0,0 +1,76 @@
+#include "slab_allocator.h"
+#include "defs.h"
+
+#include <cstddef>
+#include <new>
+
+SlabAllocator::SlabAllocator(std::size_t slot_size)
+    : m_free(nullptr),
+      m_in_use(0)
+{
+    // Every slot is aligned like operator new's memory.
+    std::size_t alignment = alignof(std::max_align_t);
+    if (slot_size < sizeof(FreeSlot))
+    {
+        slot_size = sizeof(FreeSlot);
+    }
+    m_slot_size = (slot_size + alignment - 1) / alignment * alignment;
+}
+
+SlabAllocator::~SlabAllocator()
+{
+    for (char* chunk : m_chunks)
+    {
+        ::operator delete(chunk);
+    }
+}
+
+void* SlabAllocator::allocate()
+{
+    if (m_free == nullptr)
+    {
+        add_chunk();
+    }
+
+    FreeSlot* slot = m_free;
+    m_free = slot->next;
+    m_in_use++;
+    return slot;
+}
+
+void SlabAllocator::release(void* slot)
+{
+    FreeSlot* free_slot = static_cast<FreeSlot*>(slot);
+    free_slot->next = m_free;
+    m_free = free_slot;
+    m_in_use--;
+}
+
+std::size_t SlabAllocator::get_slot_size() const
+{
+    return m_slot_size;
+}
+
+std::size_t SlabAllocator::slots_in_use() const
+{
+    return m_in_use;
+}
+
+std::size_t SlabAllocator::bytes_reserved() const
+{
+    return m_chunks.size() * SLAB_CHUNK_SLOTS * m_slot_size;
+}
+
+void SlabAllocator::add_chunk()
+{
+    char* chunk = static_cast<char*>(::operator new(SLAB_CHUNK_SLOTS * m_slot_size));
+    m_chunks.push_back(chunk);
+
+    // Threaded back to front, so the slots are handed out in address order.
+    for (std::size_t i = SLAB_CHUNK_SLOTS; i > 0; i--)
+    {
+        FreeSlot* slot = reinterpret_cast<FreeSlot*>(chunk + (i - 1) * m_slot_size);
+        slot->next = m_free;
+        m_free = slot;
+    }
+}
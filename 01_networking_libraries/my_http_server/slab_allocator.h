@@ -0,0 +1,44 @@
+#ifndef SLAB_ALLOCATOR_H
+#define SLAB_ALLOCATOR_H
+
+#include <cstddef>
+#include <vector>
+
+// Fixed-size slots carved out of chunks of SLAB_CHUNK_SLOTS, with no
+// header per slot: a free slot holds the link of the free list. Slots are
+// recycled, but the chunks are only given back when the slab is
+// destroyed, so memory reserved by a burst stays reserved. Like the loop
+// it belongs to, it is used from one thread only.
+class SlabAllocator
+{
+public:
+    explicit SlabAllocator(std::size_t slot_size);
+    ~SlabAllocator();
+
+    void* allocate();
+    void release(void* slot);
+
+    std::size_t get_slot_size() const;
+    std::size_t slots_in_use() const;
+    // Bytes taken from the system for slots, in use or free
+    std::size_t bytes_reserved() const;
+
+private:
+    struct FreeSlot
+    {
+        FreeSlot* next;
+    };
+
+    void add_chunk();
+
+private:
+    std::size_t m_slot_size;
+    FreeSlot* m_free;
+    std::vector<char*> m_chunks;
+    std::size_t m_in_use;
+
+    SlabAllocator(const SlabAllocator&) = delete;
+    SlabAllocator& operator=(const SlabAllocator&) = delete;
+};
+
+#endif // SLAB_ALLOCATOR_H
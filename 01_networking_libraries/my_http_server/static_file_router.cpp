@@ -0,0 +1,129 @@
+#include "static_file_router.h"
+#include "defs.h"
+#include "logging.h"
+#include "metrics.h"
+
+#include <algorithm>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if __has_include(<filesystem>)
+    #include <filesystem>
+    namespace fs = std::filesystem;
+#elif __has_include(<experimental/filesystem>)
+    #include <experimental/filesystem>
+    namespace fs = std::experimental::filesystem;
+#else
+    #error "No filesystem support available!"
+#endif
+
+namespace
+{
+    // Opens the file and reads it whole if it is small, or reads its start
+    // ahead into the page cache; on a pool thread, so the loop does not
+    // wait for the disk when it sends the file.
+    void open_static_file(const std::string& filename, HTTPResponse& response)
+    {
+        int fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+        struct stat file_stat;
+        if (fd < 0 || fstat(fd, &file_stat) != 0)
+        {
+            LOGE("Error reading the file");
+            if (fd >= 0)
+            {
+                close(fd);
+            }
+            return;
+        }
+
+        std::size_t size = file_stat.st_size;
+        if (size > OFFLOAD_READ_MAX)
+        {
+            readahead(fd, 0, std::min<std::size_t>(size, OFFLOAD_READAHEAD_SIZE));
+            response.set_body_file(filename, size, fd);
+            return;
+        }
+
+        std::string body(size, '\0');
+        std::size_t done = 0;
+        while (done < size)
+        {
+            ssize_t bytes = pread(fd, &body[done], size - done, done);
+            if (bytes <= 0)
+            {
+                break;
+            }
+            done += bytes;
+        }
+        close(fd);
+        body.resize(done);
+        response.set_body(body);
+    }
+}
+
+StaticFileRouter::StaticFileRouter(UpstreamPool*, const std::string&, OffloadPool*)
+{
+
+}
+
+HTTPResponse StaticFileRouter::route(const HTTPRequest& request, bool)
+{
+    METRIC_INC(METRIC_REQUESTS);
+    if (request.m_path == STR_METRICS_PATH)
+    {
+        HTTPResponse response(HTTP_200, Metrics::getInstance().to_string());
+        response.set_header("Content-Type", "text/plain");
+        return response;
+    }
+    return static_file(request.m_path, false);
+}
+
+std::unique_ptr<BodyConsumer> StaticFileRouter::accept_body(const HTTPRequest&)
+{
+    return nullptr;
+}
+
+HTTPResponse StaticFileRouter::static_file(const std::string& request_path, bool open_file)
+{
+    HTTPResponse response;
+    std::string path = static_path(request_path);
+    if (!fs::exists(path) || !fs::is_directory(path))
+    {
+        LOGE("Path is not found");
+        path = fs::current_path().string() + "/" + std::string(STR_HTTP_ROOT_PATH) + std::string("/404");
+        response.set_status(HTTP_404);
+    }
+    else
+    {
+        response.set_status(HTTP_200);
+    }
+
+
+    // The body is streamed from the file by the connection, so a large
+    // file never has to be held in memory.
+    std::string filename = path + "/" + STR_HTTP_MAIN_PAGE;
+    if (open_file)
+    {
+        open_static_file(filename, response);
+        return response;
+    }
+
+    std::error_code ec;
+    std::uintmax_t file_size = fs::file_size(filename, ec);
+    if (!ec)
+    {
+        response.set_body_file(filename, file_size);
+    }
+    else
+    {
+        LOGE("Error reading the file");
+    }
+
+    return response;
+}
+
+std::string StaticFileRouter::static_path(const std::string& request_path)
+{
+    return fs::current_path().string() + "/" + std::string(STR_HTTP_ROOT_PATH) + request_path;
+}
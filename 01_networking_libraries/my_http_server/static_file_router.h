@@ -0,0 +1,37 @@
+#ifndef STATIC_FILE_ROUTER_H
+#define STATIC_FILE_ROUTER_H
+
+#include "body_consumer.h"
+#include "http_request.h"
+#include "http_response.h"
+
+#include <memory>
+#include <string>
+
+class OffloadPool;
+class UpstreamPool;
+
+// The router of a server that only serves static files: STR_METRICS_PATH
+// and the files under STR_HTTP_ROOT_PATH, looked up as HTTPRouter does.
+// Its responses never name an upstream, a handler or a body producer, and
+// it takes no request bodies.
+class StaticFileRouter
+{
+public:
+    // The same arguments as HTTPRouter, so either can be a server's Router
+    // policy; they are not used.
+    explicit StaticFileRouter(UpstreamPool* upstreams = nullptr, const std::string& upload_dir = std::string(), OffloadPool* offload = nullptr);
+
+    HTTPResponse route(const HTTPRequest& request, bool can_wait = false);
+    std::unique_ptr<BodyConsumer> accept_body(const HTTPRequest& request);
+
+    // The response for the static file at path. With open_file, the file is
+    // also opened, and read whole if it is small: all the disk access the
+    // response needs. Blocks on the disk; safe to call from any thread.
+    // HTTPRouter serves its static files with it too.
+    static HTTPResponse static_file(const std::string& path, bool open_file);
+    // Where static_file() looks path up, without touching the disk.
+    static std::string static_path(const std::string& path);
+};
+
+#endif // STATIC_FILE_ROUTER_H
@@ -0,0 +1,247 @@
+#ifndef TASK_H
+#define TASK_H
+
+#include "frame_pool.h"
+
+#include <coroutine>
+#include <exception>
+#include <optional>
+#include <utility>
+
+// Told when a task that nothing awaits has completed.
+class TaskObserver
+{
+public:
+    virtual ~TaskObserver() = default;
+    virtual void task_done() = 0;
+};
+
+template <typename T>
+class Task;
+
+namespace task_detail
+{
+    struct PromiseBase
+    {
+        // Resumed once the task has completed: the awaiting coroutine, or
+        // nothing for a task started by an observer.
+        std::coroutine_handle<> continuation;
+        TaskObserver* observer = nullptr;
+        std::exception_ptr exception;
+
+        static void* operator new(std::size_t size)
+        {
+            return FramePool::allocate(size);
+        }
+
+        static void operator delete(void* frame, std::size_t size)
+        {
+            FramePool::release(frame, size);
+        }
+
+        struct FinalAwaiter
+        {
+            bool await_ready() noexcept
+            {
+                return false;
+            }
+
+            // Symmetric transfer: the awaiting coroutine runs in place of
+            // this one, so a chain of tasks never grows the stack.
+            template <typename Promise>
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> handle) noexcept
+            {
+                PromiseBase& promise = handle.promise();
+                if (promise.continuation)
+                {
+                    return promise.continuation;
+                }
+                if (promise.observer != nullptr)
+                {
+                    promise.observer->task_done();
+                }
+                return std::noop_coroutine();
+            }
+
+            void await_resume() noexcept
+            {
+
+            }
+        };
+
+        // Tasks are lazy: nothing runs until the task is awaited or started.
+        std::suspend_always initial_suspend() noexcept
+        {
+            return {};
+        }
+
+        FinalAwaiter final_suspend() noexcept
+        {
+            return {};
+        }
+
+        void unhandled_exception()
+        {
+            exception = std::current_exception();
+        }
+    };
+
+    template <typename T>
+    struct Promise : PromiseBase
+    {
+        std::optional<T> value;
+
+        Task<T> get_return_object();
+
+        void return_value(T result)
+        {
+            value.emplace(std::move(result));
+        }
+
+        T take_result()
+        {
+            if (exception)
+            {
+                std::rethrow_exception(exception);
+            }
+            return std::move(*value);
+        }
+    };
+
+    template <>
+    struct Promise<void> : PromiseBase
+    {
+        Task<void> get_return_object();
+
+        void return_void()
+        {
+
+        }
+
+        void take_result()
+        {
+            if (exception)
+            {
+                std::rethrow_exception(exception);
+            }
+        }
+    };
+}
+
+// A coroutine that produces a T. Awaiting a task runs it until it
+// completes, which may take any number of trips through the event loop;
+// the awaiting coroutine is then resumed with the result, or with the
+// exception the task ended with. The task owns its coroutine frame, so
+// destroying a task that is suspended cancels it: the destructors of its
+// locals, and of whatever it is awaiting, undo their registrations.
+template <typename T = void>
+class Task
+{
+public:
+    using promise_type = task_detail::Promise<T>;
+
+    Task()
+        : m_handle(nullptr)
+    {
+
+    }
+
+    explicit Task(std::coroutine_handle<promise_type> handle)
+        : m_handle(handle)
+    {
+
+    }
+
+    Task(Task&& other) noexcept
+        : m_handle(std::exchange(other.m_handle, nullptr))
+    {
+
+    }
+
+    Task& operator=(Task&& other) noexcept
+    {
+        if (this != &other)
+        {
+            reset();
+            m_handle = std::exchange(other.m_handle, nullptr);
+        }
+        return *this;
+    }
+
+    Task(const Task&) = delete;
+    Task& operator=(const Task&) = delete;
+
+    ~Task()
+    {
+        reset();
+    }
+
+    bool is_valid() const
+    {
+        return static_cast<bool>(m_handle);
+    }
+
+    bool is_done() const
+    {
+        return m_handle && m_handle.done();
+    }
+
+    // Runs a task that nothing awaits up to its first suspension; observer
+    // is told when it has completed.
+    void start(TaskObserver* observer)
+    {
+        m_handle.promise().observer = observer;
+        m_handle.resume();
+    }
+
+    // The result of a completed task.
+    T take_result()
+    {
+        return m_handle.promise().take_result();
+    }
+
+    bool await_ready() const noexcept
+    {
+        return false;
+    }
+
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept
+    {
+        m_handle.promise().continuation = awaiting;
+        return m_handle;
+    }
+
+    T await_resume()
+    {
+        return m_handle.promise().take_result();
+    }
+
+private:
+    void reset()
+    {
+        if (m_handle)
+        {
+            m_handle.destroy();
+            m_handle = nullptr;
+        }
+    }
+
+private:
+    std::coroutine_handle<promise_type> m_handle;
+};
+
+namespace task_detail
+{
+    template <typename T>
+    Task<T> Promise<T>::get_return_object()
+    {
+        return Task<T>(std::coroutine_handle<Promise<T>>::from_promise(*this));
+    }
+
+    inline Task<void> Promise<void>::get_return_object()
+    {
+        return Task<void>(std::coroutine_handle<Promise<void>>::from_promise(*this));
+    }
+}
+
+#endif // TASK_H
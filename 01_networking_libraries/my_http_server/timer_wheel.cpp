@@ -0,0 +1,325 @@
+#include "timer_wheel.h"
+
+#include <climits>
+#include <cstring>
+
+namespace
+{
+    // Distance (1..64) from index to the next occupied slot, wrapping around.
+    int next_slot_distance(uint64_t occupied, int index)
+    {
+        int shift = (index + 1) & 63;
+        uint64_t rotated = (occupied >> shift) | (shift == 0 ? 0 : (occupied << (64 - shift)));
+        return __builtin_ctzll(rotated) + 1;
+    }
+}
+
+TimerNode::TimerNode(TimerHandler* handler)
+    : m_handler(handler),
+      m_prev(nullptr),
+      m_next(nullptr),
+      m_wheel(nullptr),
+      m_expires(0),
+      m_level(0),
+      m_slot(0)
+{
+
+}
+
+TimerNode::~TimerNode()
+{
+    if (m_wheel != nullptr)
+    {
+        m_wheel->cancel(this);
+    }
+}
+
+void TimerNode::set_handler(TimerHandler* handler)
+{
+    m_handler = handler;
+}
+
+bool TimerNode::is_armed() const
+{
+    return m_wheel != nullptr;
+}
+
+TimerWheel::TimerWheel(uint64_t now_ms)
+    : m_due(nullptr),
+      m_firing(nullptr),
+      m_current(now_ms),
+      m_count(0)
+{
+    std::memset(m_slots, 0, sizeof(m_slots));
+    std::memset(m_occupied, 0, sizeof(m_occupied));
+}
+
+TimerWheel::~TimerWheel()
+{
+    for (int level = 0; level < LEVELS; level++)
+    {
+        for (int slot = 0; slot < SLOTS; slot++)
+        {
+            while (m_slots[level][slot] != nullptr)
+            {
+                TimerNode* timer = m_slots[level][slot];
+                unlink(timer);
+                timer->m_wheel = nullptr;
+            }
+        }
+    }
+
+    while (m_due != nullptr)
+    {
+        TimerNode* timer = m_due;
+        unlink(timer);
+        timer->m_wheel = nullptr;
+    }
+}
+
+void TimerWheel::schedule(TimerNode* timer, uint64_t delay_ms)
+{
+    if (timer->m_wheel != nullptr)
+    {
+        timer->m_wheel->cancel(timer);
+    }
+
+    if (delay_ms == 0)
+    {
+        timer->m_expires = m_current;
+        timer->m_wheel = this;
+        timer->m_level = DUE;
+        timer->m_prev = nullptr;
+        timer->m_next = m_due;
+        if (m_due != nullptr)
+        {
+            m_due->m_prev = timer;
+        }
+        m_due = timer;
+        m_count++;
+        return;
+    }
+
+    // The current tick has already been processed, so the earliest
+    // deadline a new timer can get is the next one.
+    const uint64_t max_delay = (1ULL << (SLOT_BITS * LEVELS)) - 1;
+    if (delay_ms > max_delay)
+    {
+        delay_ms = max_delay;
+    }
+
+    timer->m_expires = m_current + delay_ms;
+    timer->m_wheel = this;
+    insert(timer);
+    m_count++;
+}
+
+void TimerWheel::cancel(TimerNode* timer)
+{
+    if (timer->m_wheel != this)
+    {
+        return;
+    }
+
+    unlink(timer);
+    timer->m_wheel = nullptr;
+    m_count--;
+}
+
+void TimerWheel::advance(uint64_t now_ms)
+{
+    fire_due();
+    if (m_count == 0)
+    {
+        if (now_ms > m_current)
+        {
+            m_current = now_ms;
+        }
+        return;
+    }
+
+    while (m_current < now_ms)
+    {
+        // Nothing can fire before the next level 1 cascade while the lowest
+        // level is empty, so skip the idle ticks in one step.
+        if (m_occupied[0] == 0)
+        {
+            uint64_t boundary = ((m_current >> SLOT_BITS) + 1) << SLOT_BITS;
+            m_current = (boundary - 1 < now_ms) ? boundary - 1 : now_ms;
+            if (m_current == now_ms)
+            {
+                break;
+            }
+        }
+
+        m_current++;
+
+        // Cascade top-down so that timers pulled out of a higher level can
+        // still land in a lower level slot that is cascaded on this tick.
+        int level = 1;
+        while (level < LEVELS && (m_current & ((1ULL << (SLOT_BITS * level)) - 1)) == 0)
+        {
+            level++;
+        }
+        for (int l = level - 1; l >= 1; l--)
+        {
+            cascade(l);
+        }
+
+        int slot = m_current & (SLOTS - 1);
+        while (m_slots[0][slot] != nullptr)
+        {
+            TimerNode* timer = m_slots[0][slot];
+            unlink(timer);
+            timer->m_wheel = nullptr;
+            m_count--;
+            if (timer->m_handler != nullptr)
+            {
+                timer->m_handler->handle_timeout(timer);
+            }
+        }
+
+        if (m_count == 0)
+        {
+            m_current = now_ms;
+        }
+    }
+}
+
+int TimerWheel::next_timeout_ms(uint64_t now_ms) const
+{
+    if (m_count == 0)
+    {
+        return -1;
+    }
+    if (m_due != nullptr)
+    {
+        return 0;
+    }
+
+    uint64_t ticks = UINT64_MAX;
+    for (int level = 0; level < LEVELS; level++)
+    {
+        if (m_occupied[level] == 0)
+        {
+            continue;
+        }
+
+        // A higher level slot cannot fire before it is cascaded, so waking
+        // up at its cascade boundary is always early enough.
+        int shift = SLOT_BITS * level;
+        int index = (m_current >> shift) & (SLOTS - 1);
+        uint64_t distance = next_slot_distance(m_occupied[level], index);
+        uint64_t boundary = (((m_current >> shift) + distance) << shift) - m_current;
+        if (boundary < ticks)
+        {
+            ticks = boundary;
+        }
+    }
+
+    uint64_t elapsed = now_ms > m_current ? now_ms - m_current : 0;
+    if (ticks <= elapsed)
+    {
+        return 0;
+    }
+    ticks -= elapsed;
+    return ticks > INT_MAX ? INT_MAX : static_cast<int>(ticks);
+}
+
+std::size_t TimerWheel::size() const
+{
+    return m_count;
+}
+
+void TimerWheel::fire_due()
+{
+    // Only the timers due so far fire; ones that their handlers schedule
+    // with no delay wait for the next advance(), so a handler that keeps
+    // rescheduling itself cannot hold up the loop.
+    m_firing = m_due;
+    m_due = nullptr;
+    for (TimerNode* timer = m_firing; timer != nullptr; timer = timer->m_next)
+    {
+        timer->m_level = FIRING;
+    }
+
+    while (m_firing != nullptr)
+    {
+        TimerNode* timer = m_firing;
+        unlink(timer);
+        timer->m_wheel = nullptr;
+        m_count--;
+        if (timer->m_handler != nullptr)
+        {
+            timer->m_handler->handle_timeout(timer);
+        }
+    }
+}
+
+void TimerWheel::insert(TimerNode* timer)
+{
+    uint64_t delta = timer->m_expires > m_current ? timer->m_expires - m_current : 0;
+
+    int level = 0;
+    while (level < LEVELS - 1 && delta >= (1ULL << (SLOT_BITS * (level + 1))))
+    {
+        level++;
+    }
+
+    int slot = (timer->m_expires >> (SLOT_BITS * level)) & (SLOTS - 1);
+    timer->m_level = level;
+    timer->m_slot = slot;
+    timer->m_prev = nullptr;
+    timer->m_next = m_slots[level][slot];
+    if (timer->m_next != nullptr)
+    {
+        timer->m_next->m_prev = timer;
+    }
+    m_slots[level][slot] = timer;
+    m_occupied[level] |= (1ULL << slot);
+}
+
+TimerNode*& TimerWheel::list_head(TimerNode* timer)
+{
+    switch (timer->m_level)
+    {
+        case DUE:    return m_due;
+        case FIRING: return m_firing;
+        default:     return m_slots[timer->m_level][timer->m_slot];
+    }
+}
+
+void TimerWheel::unlink(TimerNode* timer)
+{
+    if (timer->m_prev != nullptr)
+    {
+        timer->m_prev->m_next = timer->m_next;
+    }
+    else
+    {
+        list_head(timer) = timer->m_next;
+        if (timer->m_next == nullptr && timer->m_level < LEVELS)
+        {
+            m_occupied[timer->m_level] &= ~(1ULL << timer->m_slot);
+        }
+    }
+
+    if (timer->m_next != nullptr)
+    {
+        timer->m_next->m_prev = timer->m_prev;
+    }
+
+    timer->m_prev = nullptr;
+    timer->m_next = nullptr;
+}
+
+void TimerWheel::cascade(int level)
+{
+    int slot = (m_current >> (SLOT_BITS * level)) & (SLOTS - 1);
+    while (m_slots[level][slot] != nullptr)
+    {
+        TimerNode* timer = m_slots[level][slot];
+        unlink(timer);
+        insert(timer);
+    }
+}
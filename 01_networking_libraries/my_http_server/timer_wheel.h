@@ -0,0 +1,83 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <cstddef>
+#include <cstdint>
+
+class TimerNode;
+
+class TimerHandler
+{
+public:
+    virtual ~TimerHandler() = default;
+    virtual void handle_timeout(TimerNode* timer) = 0;
+};
+
+// Intrusive timer entry, embedded in the object that owns the deadline.
+// Arming and cancelling only relink the node, nothing is allocated.
+class TimerNode
+{
+public:
+    explicit TimerNode(TimerHandler* handler = nullptr);
+    ~TimerNode();
+
+    void set_handler(TimerHandler* handler);
+    bool is_armed() const;
+
+private:
+    friend class TimerWheel;
+
+    TimerHandler* m_handler;
+    TimerNode* m_prev;
+    TimerNode* m_next;
+    class TimerWheel* m_wheel;
+    uint64_t m_expires;
+    uint8_t m_level;
+    uint8_t m_slot;
+};
+
+// Hierarchical hashed timing wheel with millisecond ticks.
+// schedule()/cancel() are O(1). advance() costs O(1) per elapsed tick plus
+// O(1) per expired or cascaded timer, so idle timers cost nothing until
+// their slot comes around. A timer scheduled with no delay is due right
+// away and fires on the next advance(), without waiting for the next tick;
+// this is how work is deferred to the next loop iteration.
+class TimerWheel
+{
+public:
+    explicit TimerWheel(uint64_t now_ms);
+    ~TimerWheel();
+
+    void schedule(TimerNode* timer, uint64_t delay_ms);
+    void cancel(TimerNode* timer);
+    void advance(uint64_t now_ms);
+
+    // Milliseconds until the next slot holding a timer, -1 if none is armed.
+    int next_timeout_ms(uint64_t now_ms) const;
+    std::size_t size() const;
+
+private:
+    void insert(TimerNode* timer);
+    TimerNode*& list_head(TimerNode* timer);
+    void fire_due();
+    void unlink(TimerNode* timer);
+    void cascade(int level);
+
+private:
+    static const int SLOT_BITS = 6;
+    static const int SLOTS = 1 << SLOT_BITS;
+    static const int LEVELS = 6;
+    // Pseudo levels of the timers that are due now, and of the ones being
+    // fired by fire_due().
+    static const int DUE = LEVELS;
+    static const int FIRING = LEVELS + 1;
+
+    TimerNode* m_slots[LEVELS][SLOTS];
+    TimerNode* m_due;
+    TimerNode* m_firing;
+    uint64_t m_occupied[LEVELS];
+    uint64_t m_current;
+    std::size_t m_count;
+};
+
+#endif // TIMER_WHEEL_H
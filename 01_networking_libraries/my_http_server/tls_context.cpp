@@ -0,0 +1,183 @@
+#include "tls_context.h"
+#include "logging.h"
+#include "defs.h"
+
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+#include <openssl/core_names.h>
+
+#include <cstring>
+#include <ctime>
+
+namespace
+{
+    const unsigned char SESSION_ID_CONTEXT[] = "my_http_server";
+
+    void log_openssl_error(const std::string& message)
+    {
+        char error[256];
+        ERR_error_string_n(ERR_get_error(), error, sizeof(error));
+        LOGE(message + ": " + error);
+    }
+
+    uint64_t current_ticket_period()
+    {
+        return static_cast<uint64_t>(time(nullptr)) / TLS_TICKET_KEY_ROTATION_SEC;
+    }
+}
+
+TLSContext::TLSContext()
+    : m_ctx(nullptr)
+{
+    std::memset(m_master_secret, 0, sizeof(m_master_secret));
+}
+
+TLSContext::~TLSContext()
+{
+    if (m_ctx != nullptr)
+    {
+        SSL_CTX_free(m_ctx);
+    }
+}
+
+bool TLSContext::init(const std::string& cert_file, const std::string& key_file, bool enable_ktls)
+{
+    m_ctx = SSL_CTX_new(TLS_server_method());
+    if (m_ctx == nullptr)
+    {
+        log_openssl_error("SSL_CTX_new() failed");
+        return false;
+    }
+
+    SSL_CTX_set_min_proto_version(m_ctx, TLS1_2_VERSION);
+    SSL_CTX_set_mode(m_ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER | SSL_MODE_RELEASE_BUFFERS);
+
+#ifdef SSL_OP_ENABLE_KTLS
+    if (enable_ktls)
+    {
+        SSL_CTX_set_options(m_ctx, SSL_OP_ENABLE_KTLS);
+    }
+#else
+    if (enable_ktls)
+    {
+        LOGI("OpenSSL is built without kTLS support");
+    }
+#endif
+
+    if (SSL_CTX_use_certificate_chain_file(m_ctx, cert_file.c_str()) != 1)
+    {
+        log_openssl_error("Cannot load certificate " + cert_file);
+        return false;
+    }
+    if (SSL_CTX_use_PrivateKey_file(m_ctx, key_file.c_str(), SSL_FILETYPE_PEM) != 1)
+    {
+        log_openssl_error("Cannot load private key " + key_file);
+        return false;
+    }
+    if (SSL_CTX_check_private_key(m_ctx) != 1)
+    {
+        log_openssl_error("Private key does not match the certificate");
+        return false;
+    }
+
+    // Stateful resumption for clients that do not use tickets.
+    SSL_CTX_set_session_cache_mode(m_ctx, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_sess_set_cache_size(m_ctx, TLS_SESSION_CACHE_SIZE);
+    SSL_CTX_set_timeout(m_ctx, TLS_SESSION_LIFETIME_SEC);
+    SSL_CTX_set_session_id_context(m_ctx, SESSION_ID_CONTEXT, sizeof(SESSION_ID_CONTEXT) - 1);
+
+    // Stateless resumption with our own rotating ticket keys.
+    if (RAND_bytes(m_master_secret, sizeof(m_master_secret)) != 1)
+    {
+        log_openssl_error("RAND_bytes() failed");
+        return false;
+    }
+    SSL_CTX_set_app_data(m_ctx, this);
+    SSL_CTX_set_tlsext_ticket_key_evp_cb(m_ctx, &TLSContext::ticket_key_callback);
+
+    return true;
+}
+
+SSL* TLSContext::create_ssl(int sock)
+{
+    SSL* ssl = SSL_new(m_ctx);
+    if (ssl == nullptr)
+    {
+        log_openssl_error("SSL_new() failed");
+        return nullptr;
+    }
+
+    SSL_set_fd(ssl, sock);
+    SSL_set_accept_state(ssl);
+    return ssl;
+}
+
+void TLSContext::derive_ticket_key(uint64_t period, TicketKey& key) const
+{
+    unsigned char material[EVP_MAX_MD_SIZE * 3];
+    unsigned int length = 0;
+    for (unsigned char label = 0; label < 3; label++)
+    {
+        unsigned char input[sizeof(period) + 1];
+        std::memcpy(input, &period, sizeof(period));
+        input[sizeof(period)] = label;
+        HMAC(EVP_sha256(), m_master_secret, sizeof(m_master_secret), input, sizeof(input), material + label * 32, &length);
+    }
+
+    std::memcpy(key.name, material, sizeof(key.name));
+    std::memcpy(key.aes_key, material + 32, sizeof(key.aes_key));
+    std::memcpy(key.hmac_key, material + 64, sizeof(key.hmac_key));
+}
+
+int TLSContext::ticket_key_callback(SSL* ssl, unsigned char* key_name, unsigned char* iv, EVP_CIPHER_CTX* cipher_ctx, EVP_MAC_CTX* mac_ctx, int enc)
+{
+    TLSContext* self = static_cast<TLSContext*>(SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl)));
+    uint64_t period = current_ticket_period();
+
+    TicketKey key;
+    int result = 1;
+    if (enc)
+    {
+        self->derive_ticket_key(period, key);
+        std::memcpy(key_name, key.name, sizeof(key.name));
+        if (RAND_bytes(iv, EVP_CIPHER_iv_length(EVP_aes_256_cbc())) != 1)
+        {
+            return -1;
+        }
+        if (EVP_EncryptInit_ex(cipher_ctx, EVP_aes_256_cbc(), nullptr, key.aes_key, iv) != 1)
+        {
+            return -1;
+        }
+    }
+    else
+    {
+        self->derive_ticket_key(period, key);
+        if (std::memcmp(key_name, key.name, sizeof(key.name)) != 0)
+        {
+            self->derive_ticket_key(period - 1, key);
+            if (std::memcmp(key_name, key.name, sizeof(key.name)) != 0)
+            {
+                // Unknown or expired key: fall back to a full handshake.
+                return 0;
+            }
+            // Still valid, but ask the client to replace it.
+            result = 2;
+        }
+        if (EVP_DecryptInit_ex(cipher_ctx, EVP_aes_256_cbc(), nullptr, key.aes_key, iv) != 1)
+        {
+            return -1;
+        }
+    }
+
+    OSSL_PARAM params[3];
+    params[0] = OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY, key.hmac_key, sizeof(key.hmac_key));
+    params[1] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, const_cast<char*>("SHA256"), 0);
+    params[2] = OSSL_PARAM_construct_end();
+    if (EVP_MAC_CTX_set_params(mac_ctx, params) != 1)
+    {
+        return -1;
+    }
+    return result;
+}
@@ -0,0 +1,51 @@
+#ifndef TLS_CONTEXT_H
+#define TLS_CONTEXT_H
+
+#include <openssl/ssl.h>
+
+#include <cstdint>
+#include <string>
+
+// Server-side SSL_CTX shared by every HTTPS connection (and, after fork(),
+// by every worker process). Returning clients resume either from the
+// in-memory session cache or from a session ticket.
+//
+// Ticket keys rotate every TLS_TICKET_KEY_ROTATION_SEC seconds. The key of
+// each period is derived from a random master secret and the wall-clock
+// period number, so processes forked from one parent agree on the keys
+// without talking to each other. Tickets from the previous period are still
+// accepted and get renewed.
+//
+// With kTLS enabled, OpenSSL installs the negotiated keys into the kernel
+// after the handshake (when the "tls" module and the cipher allow it), and
+// static files can then be sent with SSL_sendfile(). Connections where that
+// did not happen keep using user-space encryption.
+class TLSContext
+{
+public:
+    TLSContext();
+    ~TLSContext();
+
+    TLSContext(const TLSContext&) = delete;
+    TLSContext& operator=(const TLSContext&) = delete;
+
+    bool init(const std::string& cert_file, const std::string& key_file, bool enable_ktls);
+    SSL* create_ssl(int sock);
+
+private:
+    struct TicketKey
+    {
+        unsigned char name[16];
+        unsigned char aes_key[32];
+        unsigned char hmac_key[32];
+    };
+
+    void derive_ticket_key(uint64_t period, TicketKey& key) const;
+    static int ticket_key_callback(SSL* ssl, unsigned char* key_name, unsigned char* iv, EVP_CIPHER_CTX* cipher_ctx, EVP_MAC_CTX* mac_ctx, int enc);
+
+private:
+    SSL_CTX* m_ctx;
+    unsigned char m_master_secret[32];
+};
+
+#endif // TLS_CONTEXT_H
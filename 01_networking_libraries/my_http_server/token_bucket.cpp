@@ -0,0 +1,74 @@
+#include "token_bucket.h"
+#include "utils.h"
+
+#include <cstdint>
+#include <limits>
+
+TokenBucket::TokenBucket(uint64_t rate, uint64_t burst)
+    : m_rate(rate),
+      m_burst(static_cast<int64_t>(burst)),
+      m_tokens(static_cast<int64_t>(burst)),
+      m_refilled_us(monotonic_us())
+{
+
+}
+
+bool TokenBucket::is_limited() const
+{
+    return m_rate > 0;
+}
+
+void TokenBucket::refill(uint64_t now_us)
+{
+    if (m_rate == 0 || now_us <= m_refilled_us)
+    {
+        return;
+    }
+
+    // Past the time it takes to fill up, a bucket earns nothing more; that
+    // also keeps the products below in range after any idle time.
+    uint64_t elapsed_us = now_us - m_refilled_us;
+    uint64_t missing = (m_tokens < m_burst) ? static_cast<uint64_t>(m_burst - m_tokens) : 0;
+    if (elapsed_us >= (missing * 1000000 + m_rate - 1) / m_rate)
+    {
+        m_tokens = m_burst;
+        m_refilled_us = now_us;
+        return;
+    }
+
+    // Whole bytes only; the remainder of the interval carries over.
+    uint64_t earned = elapsed_us * m_rate / 1000000;
+    if (earned == 0)
+    {
+        return;
+    }
+    m_refilled_us += earned * 1000000 / m_rate;
+    m_tokens += static_cast<int64_t>(earned);
+}
+
+uint64_t TokenBucket::available() const
+{
+    if (m_rate == 0)
+    {
+        return std::numeric_limits<uint64_t>::max();
+    }
+    return (m_tokens > 0) ? static_cast<uint64_t>(m_tokens) : 0;
+}
+
+void TokenBucket::consume(uint64_t bytes)
+{
+    if (m_rate > 0)
+    {
+        m_tokens -= static_cast<int64_t>(bytes);
+    }
+}
+
+uint64_t TokenBucket::wait_us(uint64_t bytes) const
+{
+    int64_t missing = static_cast<int64_t>(bytes) - m_tokens;
+    if (m_rate == 0 || missing <= 0)
+    {
+        return 0;
+    }
+    return (static_cast<uint64_t>(missing) * 1000000 + m_rate - 1) / m_rate;
+}
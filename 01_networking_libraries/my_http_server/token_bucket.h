@@ -0,0 +1,31 @@
+#ifndef TOKEN_BUCKET_H
+#define TOKEN_BUCKET_H
+
+#include <cstdint>
+
+// A byte budget refilled at `rate` bytes per second from the monotonic
+// clock, holding at most `burst`. Spending may overdraw it, which the
+// refills pay back before anything new is allowed. A bucket with a rate
+// of zero is unlimited.
+class TokenBucket
+{
+public:
+    TokenBucket(uint64_t rate = 0, uint64_t burst = 0);
+
+    bool is_limited() const;
+    // Brings the balance up to now_us.
+    void refill(uint64_t now_us);
+    // Bytes that may be sent now, 0 while overdrawn.
+    uint64_t available() const;
+    void consume(uint64_t bytes);
+    // Microseconds until `bytes` are available.
+    uint64_t wait_us(uint64_t bytes) const;
+
+private:
+    uint64_t m_rate;
+    int64_t m_burst;
+    int64_t m_tokens;
+    uint64_t m_refilled_us;
+};
+
+#endif // TOKEN_BUCKET_H
@@ -0,0 +1,319 @@
+// Access log decoder.
+//
+// Reads the binary access log written by the server's --access-log, from
+// the files given or from standard input, and prints one line per request:
+// as text by default, or as CSV with --csv. Paths come from the path
+// records of the log; a request whose path record is missing, because the
+// log was cut or the record dropped, shows the path's hash instead. The
+// records of each process are numbered, so the requests a full ring
+// dropped show up as gaps, which are counted in the summary printed to
+// standard error at the end.
+
+#include "../access_log.h"
+
+#include <arpa/inet.h>
+#include <getopt.h>
+#include <netinet/in.h>
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace
+{
+    struct Options
+    {
+        bool csv = false;
+        std::vector<std::string> files;
+    };
+
+    struct Totals
+    {
+        uint64_t requests = 0;
+        uint64_t processes = 0;
+        // Gaps in the request numbers of a process
+        uint64_t dropped = 0;
+        // Trailing bytes that do not make up a record
+        uint64_t partial_bytes = 0;
+        uint64_t invalid = 0;
+    };
+
+    class Decoder
+    {
+    public:
+        explicit Decoder(bool csv)
+            : m_csv(csv)
+        {
+
+        }
+
+        void print_header() const
+        {
+            if (m_csv)
+            {
+                printf("time,client,worker,pid,sequence,method,path,version,tls,status,request_bytes,bytes,read_us,handle_us,close,truncated\n");
+            }
+        }
+
+        void decode(const unsigned char* bytes)
+        {
+            switch (bytes[0])
+            {
+                case ACCESS_RECORD_HEADER: decode_header(bytes); break;
+                case ACCESS_RECORD_PATH:   decode_path(bytes); break;
+                case ACCESS_RECORD_REQUEST: decode_request(bytes); break;
+                default:                   m_totals.invalid++; break;
+            }
+        }
+
+        Totals& totals()
+        {
+            return m_totals;
+        }
+
+    private:
+        void decode_header(const unsigned char* bytes)
+        {
+            AccessLogHeader header;
+            std::memcpy(&header, bytes, sizeof(header));
+            if (header.magic != ACCESS_LOG_MAGIC || header.record_size != ACCESS_LOG_RECORD_SIZE)
+            {
+                m_totals.invalid++;
+                return;
+            }
+            // A process id may come back after a restart.
+            m_next_sequence[header.pid] = 0;
+            m_totals.processes++;
+        }
+
+        void decode_path(const unsigned char* bytes)
+        {
+            AccessPathRecord record;
+            std::memcpy(&record, bytes, sizeof(record));
+            std::string path(record.path, std::min<std::size_t>(record.length, ACCESS_LOG_PATH_LENGTH));
+            if (record.truncated)
+            {
+                path += "...";
+            }
+            m_paths[record.path_hash] = path;
+        }
+
+        void decode_request(const unsigned char* bytes)
+        {
+            AccessRecord record;
+            std::memcpy(&record, bytes, sizeof(record));
+            m_totals.requests++;
+
+            auto it = m_next_sequence.find(record.pid);
+            if (it != m_next_sequence.end() && record.sequence > it->second)
+            {
+                m_totals.dropped += record.sequence - it->second;
+            }
+            m_next_sequence[record.pid] = record.sequence + 1;
+
+            std::string time = format_time(record.time_ns);
+            std::string client = format_client(record.client);
+            std::string path = format_path(record.path_hash);
+            const char* version = (record.flags & ACCESS_FLAG_HTTP11) ? "HTTP/1.1" : "HTTP/1.0";
+            if (m_csv)
+            {
+                printf("%s,%s,%u,%u,%" PRIu64 ",%s,%s,%s,%d,%u,%u,%" PRIu64 ",%u,%u,%d,%d\n",
+                       time.c_str(), client.c_str(), record.worker, record.pid, record.sequence,
+                       method_name(record.method), csv_field(path).c_str(), version, (record.flags & ACCESS_FLAG_TLS) ? 1 : 0,
+                       record.status, record.request_bytes, record.bytes, record.read_us, record.handle_us,
+                       (record.flags & ACCESS_FLAG_CLOSE) ? 1 : 0, (record.flags & ACCESS_FLAG_TRUNCATED) ? 1 : 0);
+                return;
+            }
+
+            printf("%s %s %u/%u \"%s %s %s\" %u %" PRIu64 " in=%u read=%uus handle=%uus%s%s%s\n",
+                   time.c_str(), client.c_str(), record.worker, record.pid,
+                   method_name(record.method), path.c_str(), version, record.status, record.bytes,
+                   record.request_bytes, record.read_us, record.handle_us,
+                   (record.flags & ACCESS_FLAG_TLS) ? " tls" : "",
+                   (record.flags & ACCESS_FLAG_CLOSE) ? " close" : "",
+                   (record.flags & ACCESS_FLAG_TRUNCATED) ? " truncated" : "");
+        }
+
+        std::string format_path(uint64_t hash) const
+        {
+            auto it = m_paths.find(hash);
+            if (it != m_paths.end())
+            {
+                return it->second;
+            }
+            char text[32];
+            snprintf(text, sizeof(text), "#%016" PRIx64, hash);
+            return text;
+        }
+
+        static std::string format_time(uint64_t time_ns)
+        {
+            time_t seconds = static_cast<time_t>(time_ns / 1000000000);
+            tm utc;
+            gmtime_r(&seconds, &utc);
+            char text[64];
+            std::size_t length = strftime(text, sizeof(text), "%Y-%m-%dT%H:%M:%S", &utc);
+            snprintf(text + length, sizeof(text) - length, ".%06" PRIu64 "Z", (time_ns % 1000000000) / 1000);
+            return text;
+        }
+
+        // The inverse of RateLimiter::client_key(): an IPv4 address has bit
+        // 32 set, an IPv6 one keeps the first 8 bytes of its address.
+        static std::string format_client(uint64_t client)
+        {
+            char text[INET6_ADDRSTRLEN + 4];
+            if ((client >> 32) == 1)
+            {
+                in_addr address;
+                address.s_addr = htonl(static_cast<uint32_t>(client));
+                inet_ntop(AF_INET, &address, text, sizeof(text));
+                return text;
+            }
+            if (client <= 1)
+            {
+                return "-";
+            }
+            in6_addr address;
+            std::memset(&address, 0, sizeof(address));
+            std::memcpy(address.s6_addr, &client, sizeof(client));
+            inet_ntop(AF_INET6, &address, text, sizeof(text));
+            return std::string(text) + "/64";
+        }
+
+        static const char* method_name(uint8_t method)
+        {
+            static const char* const names[] = {"-", "GET", "HEAD", "POST", "PUT", "DELETE", "OPTIONS", "PATCH", "CONNECT", "TRACE"};
+            return (method < sizeof(names) / sizeof(names[0])) ? names[method] : "-";
+        }
+
+        static std::string csv_field(const std::string& value)
+        {
+            if (value.find_first_of(",\"\n") == std::string::npos)
+            {
+                return value;
+            }
+            std::string quoted = "\"";
+            for (char c : value)
+            {
+                quoted += c;
+                if (c == '"')
+                {
+                    quoted += '"';
+                }
+            }
+            return quoted + "\"";
+        }
+
+    private:
+        bool m_csv;
+        Totals m_totals;
+        std::unordered_map<uint64_t, std::string> m_paths;
+        // The next request number of each process
+        std::unordered_map<uint32_t, uint64_t> m_next_sequence;
+    };
+
+    bool decode_file(FILE* file, Decoder& decoder)
+    {
+        // Read in large blocks, a whole number of records at a time.
+        std::vector<unsigned char> buffer(4096 * ACCESS_LOG_RECORD_SIZE);
+        std::size_t filled = 0;
+        while (true)
+        {
+            std::size_t count = fread(buffer.data() + filled, 1, buffer.size() - filled, file);
+            filled += count;
+            std::size_t whole = filled - filled % ACCESS_LOG_RECORD_SIZE;
+            for (std::size_t offset = 0; offset < whole; offset += ACCESS_LOG_RECORD_SIZE)
+            {
+                decoder.decode(buffer.data() + offset);
+            }
+            std::memmove(buffer.data(), buffer.data() + whole, filled - whole);
+            filled -= whole;
+            if (count == 0)
+            {
+                break;
+            }
+        }
+        decoder.totals().partial_bytes += filled;
+        return !ferror(file);
+    }
+}
+
+void print_usage(const char* program_name)
+{
+    fprintf(stderr, "Usage: %s [options] [file...]\n", program_name);
+    fprintf(stderr, "Decodes binary access logs, or standard input without a file.\n");
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "  --csv                 Print CSV with a header line instead of text\n");
+}
+
+bool parse_arguments(int argc, char** argv, Options& options)
+{
+    enum
+    {
+        OPT_CSV = 256,
+    };
+
+    static const option long_options[] = {
+        {"csv", no_argument, nullptr, OPT_CSV},
+        {nullptr, 0, nullptr, 0}
+    };
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "", long_options, nullptr)) != -1)
+    {
+        switch (opt)
+        {
+            case OPT_CSV: options.csv = true; break;
+            default:      return false;
+        }
+    }
+    for (int i = optind; i < argc; i++)
+    {
+        options.files.push_back(argv[i]);
+    }
+    return true;
+}
+
+int main(int argc, char** argv)
+{
+    Options options;
+    if (!parse_arguments(argc, argv, options))
+    {
+        print_usage(argv[0]);
+        return -1;
+    }
+
+    Decoder decoder(options.csv);
+    decoder.print_header();
+    bool ok = true;
+    if (options.files.empty())
+    {
+        ok = decode_file(stdin, decoder);
+    }
+    for (const std::string& name : options.files)
+    {
+        FILE* file = fopen(name.c_str(), "rb");
+        if (file == nullptr)
+        {
+            fprintf(stderr, "Cannot open %s\n", name.c_str());
+            ok = false;
+            continue;
+        }
+        ok = decode_file(file, decoder) && ok;
+        fclose(file);
+    }
+
+    const Totals& totals = decoder.totals();
+    fprintf(stderr, "%" PRIu64 " requests from %" PRIu64 " processes, %" PRIu64 " dropped", totals.requests, totals.processes, totals.dropped);
+    if (totals.invalid > 0 || totals.partial_bytes > 0)
+    {
+        fprintf(stderr, ", %" PRIu64 " invalid records, %" PRIu64 " trailing bytes", totals.invalid, totals.partial_bytes);
+    }
+    fprintf(stderr, "\n");
+    return ok ? 0 : -1;
+}
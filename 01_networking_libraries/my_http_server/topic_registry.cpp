@@ -0,0 +1,175 @@
+#include "topic_registry.h"
+#include "metrics.h"
+#include "utils.h"
+
+EventSubscriber::EventSubscriber(TopicRegistry& registry, const std::string& topic)
+    : m_registry(registry),
+      m_topic(topic),
+      m_stream(nullptr),
+      m_joined(false),
+      m_index(0),
+      m_writable(false)
+{
+
+}
+
+EventSubscriber::~EventSubscriber()
+{
+    if (m_joined)
+    {
+        m_registry.leave(this);
+    }
+}
+
+void EventSubscriber::produce(BodyStream& stream)
+{
+    m_stream = &stream;
+    m_writable = true;
+    if (!m_joined && !m_registry.join(this))
+    {
+        stream.end();
+    }
+}
+
+TopicRegistry::TopicRegistry()
+    : m_ended(false)
+{
+
+}
+
+std::shared_ptr<BodyProducer> TopicRegistry::subscribe(const std::string& topic)
+{
+    return std::make_shared<EventSubscriber>(*this, topic);
+}
+
+EventDelivery TopicRegistry::publish(const std::string& topic, const std::string& data, const std::string& event)
+{
+    EventDelivery delivery = {0, 0, 0};
+    auto it = m_topics.find(topic);
+    if (it == m_topics.end())
+    {
+        return delivery;
+    }
+
+    uint64_t start_us = monotonic_us();
+    Topic& entry = it->second;
+    delivery.id = ++entry.last_id;
+    SharedChunk chunk = BodyStream::share(format_event(delivery.id, event, data));
+
+    // A write may close a subscriber's connection, but frees nothing before
+    // the next loop iteration, so the list stays as it is meanwhile.
+    for (EventSubscriber* subscriber : entry.subscribers)
+    {
+        if (!subscriber->m_stream->is_open())
+        {
+            continue;
+        }
+        if (!subscriber->m_writable)
+        {
+            delivery.dropped++;
+            continue;
+        }
+        subscriber->m_writable = subscriber->m_stream->write(chunk);
+        delivery.delivered++;
+    }
+
+    METRIC_INC(METRIC_EVENTS_PUBLISHED);
+    METRIC_ADD(METRIC_EVENTS_DELIVERED, delivery.delivered);
+    METRIC_ADD(METRIC_EVENTS_DROPPED, delivery.dropped);
+    METRIC_ADD(METRIC_EVENT_FANOUT_US, monotonic_us() - start_us);
+    return delivery;
+}
+
+void TopicRegistry::end_all()
+{
+    m_ended = true;
+    for (auto& [name, topic] : m_topics)
+    {
+        for (EventSubscriber* subscriber : topic.subscribers)
+        {
+            subscriber->m_joined = false;
+            subscriber->m_stream->end();
+        }
+        METRIC_ADD(METRIC_EVENT_SUBSCRIBERS, -static_cast<int64_t>(topic.subscribers.size()));
+    }
+    m_topics.clear();
+}
+
+bool TopicRegistry::join(EventSubscriber* subscriber)
+{
+    if (m_ended)
+    {
+        return false;
+    }
+
+    // A new topic starts its ids at 1.
+    Topic& topic = m_topics.try_emplace(subscriber->m_topic, Topic{{}, 0}).first->second;
+    subscriber->m_index = topic.subscribers.size();
+    subscriber->m_joined = true;
+    topic.subscribers.push_back(subscriber);
+    METRIC_INC(METRIC_EVENT_SUBSCRIBERS);
+    return true;
+}
+
+void TopicRegistry::leave(EventSubscriber* subscriber)
+{
+    auto it = m_topics.find(subscriber->m_topic);
+    if (it == m_topics.end())
+    {
+        return;
+    }
+
+    // Swap with the last one, so leaving takes constant time.
+    std::vector<EventSubscriber*>& subscribers = it->second.subscribers;
+    EventSubscriber* last = subscribers.back();
+    subscribers[subscriber->m_index] = last;
+    last->m_index = subscriber->m_index;
+    subscribers.pop_back();
+    subscriber->m_joined = false;
+    METRIC_DEC(METRIC_EVENT_SUBSCRIBERS);
+
+    if (subscribers.empty())
+    {
+        m_topics.erase(it);
+    }
+}
+
+std::string TopicRegistry::format_event(uint64_t id, const std::string& event, const std::string& data)
+{
+    std::string text;
+    text.reserve(data.length() + event.length() + 48);
+    text += "id: ";
+    text += std::to_string(id);
+    text += '\n';
+    if (!event.empty())
+    {
+        text += "event: ";
+        text += event;
+        text += '\n';
+    }
+
+    // Each line of the data is a "data:" field; the client joins them
+    // again with newlines. A client ends a line at CR, LF or CRLF alike, so
+    // all three are split here; otherwise a lone CR would let the data
+    // start fields of its own.
+    std::size_t start = 0;
+    while (true)
+    {
+        std::size_t end = data.find_first_of("\r\n", start);
+        std::size_t line_end = (end == std::string::npos) ? data.length() : end;
+        text += "data: ";
+        text.append(data, start, line_end - start);
+        text += '\n';
+        if (end == std::string::npos)
+        {
+            break;
+        }
+        start = end + 1;
+        if (data[end] == '\r' && start < data.length() && data[start] == '\n')
+        {
+            start++;
+        }
+    }
+    text += '\n';
+    return text;
+}
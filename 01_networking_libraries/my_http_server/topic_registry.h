@@ -0,0 +1,97 @@
+#ifndef TOPIC_REGISTRY_H
+#define TOPIC_REGISTRY_H
+
+#include "body_stream.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+class TopicRegistry;
+
+// The body of a Server-Sent Events response: one subscriber of a topic. It
+// joins the topic once the response head is queued, and leaves it when its
+// stream is freed with the connection. While the client is not keeping up,
+// the events published to the topic are dropped for it rather than queued.
+class EventSubscriber : public BodyProducer
+{
+public:
+    EventSubscriber(TopicRegistry& registry, const std::string& topic);
+    ~EventSubscriber();
+
+    EventSubscriber(const EventSubscriber&) = delete;
+    EventSubscriber& operator=(const EventSubscriber&) = delete;
+
+    void produce(BodyStream& stream) override;
+
+private:
+    friend class TopicRegistry;
+
+    TopicRegistry& m_registry;
+    std::string m_topic;
+    BodyStream* m_stream;
+    bool m_joined;
+    // Position in the topic's list of subscribers
+    std::size_t m_index;
+    // The last write was taken without pausing the stream
+    bool m_writable;
+};
+
+struct EventDelivery
+{
+    // Id of the event in its topic, 0 if the topic has no subscribers
+    uint64_t id;
+    std::size_t delivered;
+    std::size_t dropped;
+};
+
+// The topics of this process, each with its subscribers. A published event
+// is serialized once, with its chunk framing, into a buffer that every
+// subscriber's output queue references, so fanning it out costs a pointer
+// per subscriber rather than a copy. Topics exist while they have
+// subscribers. Every call is made from the event loop; with prefork
+// workers, each worker has topics of its own.
+class TopicRegistry
+{
+public:
+    static TopicRegistry& getInstance()
+    {
+        static TopicRegistry instance;
+        return instance;
+    }
+
+    // The body producer of a response that subscribes to topic.
+    std::shared_ptr<BodyProducer> subscribe(const std::string& topic);
+    // Sends an event to every subscriber of topic that is keeping up. The
+    // data may have several lines; event is the event type, if any, and
+    // must be a single line.
+    EventDelivery publish(const std::string& topic, const std::string& data, const std::string& event = std::string());
+    // Ends every event stream and refuses new ones, when the server drains.
+    // EventSource clients reconnect on their own, to the next server.
+    void end_all();
+
+private:
+    struct Topic
+    {
+        std::vector<EventSubscriber*> subscribers;
+        uint64_t last_id;
+    };
+
+    TopicRegistry();
+
+    // Returns false if the registry no longer takes subscribers.
+    bool join(EventSubscriber* subscriber);
+    void leave(EventSubscriber* subscriber);
+    static std::string format_event(uint64_t id, const std::string& event, const std::string& data);
+
+    friend class EventSubscriber;
+
+private:
+    std::unordered_map<std::string, Topic> m_topics;
+    bool m_ended;
+};
+
+#endif // TOPIC_REGISTRY_H
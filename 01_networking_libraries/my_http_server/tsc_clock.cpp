@@ -0,0 +1,85 @@
+#include "tsc_clock.h"
+#include "defs.h"
+
+#include <ctime>
+#include <fstream>
+#include <string>
+
+TscClock::TscClock()
+    : m_enabled(false),
+      m_base_ticks(0),
+      m_base_ns(0),
+      m_scale(0)
+{
+
+}
+
+bool TscClock::calibrate()
+{
+#ifdef TSC_CLOCK_X86
+    // The kernel falls back to another clocksource when it finds the
+    // counter unstable, e.g. stopping in deep sleep or drifting between
+    // sockets.
+    std::ifstream clocksource("/sys/devices/system/clocksource/clocksource0/current_clocksource");
+    std::string name;
+    if (!(clocksource >> name) || name != "tsc")
+    {
+        return false;
+    }
+
+    read_pair(m_base_ticks, m_base_ns);
+    uint64_t ticks = m_base_ticks;
+    uint64_t ns = m_base_ns;
+    while (ns - m_base_ns < TSC_CALIBRATION_US * 1000ULL)
+    {
+        read_pair(ticks, ns);
+    }
+    set_scale(ticks, ns);
+    m_enabled = (m_scale.load(std::memory_order_relaxed) != 0);
+    return m_enabled;
+#else
+    return false;
+#endif
+}
+
+void TscClock::recalibrate()
+{
+    if (!m_enabled)
+    {
+        return;
+    }
+    uint64_t ticks;
+    uint64_t ns;
+    read_pair(ticks, ns);
+    set_scale(ticks, ns);
+}
+
+uint64_t TscClock::monotonic_ns()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+void TscClock::read_pair(uint64_t& ticks, uint64_t& ns) const
+{
+#ifdef TSC_CLOCK_X86
+    uint64_t before = __rdtsc();
+    ns = monotonic_ns();
+    uint64_t after = __rdtsc();
+    ticks = before + (after - before) / 2;
+#else
+    ticks = 0;
+    ns = monotonic_ns();
+#endif
+}
+
+void TscClock::set_scale(uint64_t ticks, uint64_t ns)
+{
+    if (ticks <= m_base_ticks || ns <= m_base_ns)
+    {
+        return;
+    }
+    unsigned __int128 scaled = static_cast<unsigned __int128>(ns - m_base_ns) << SCALE_SHIFT;
+    m_scale.store(static_cast<uint64_t>(scaled / (ticks - m_base_ticks)), std::memory_order_relaxed);
+}
@@ -0,0 +1,59 @@
+#ifndef TSC_CLOCK_H
+#define TSC_CLOCK_H
+
+#include <atomic>
+#include <cstdint>
+
+#if defined(__x86_64__)
+    #include <x86intrin.h>
+    #define TSC_CLOCK_X86 1
+#endif
+
+// Nanoseconds on the scale of CLOCK_MONOTONIC, read from the CPU's
+// time-stamp counter when the kernel keeps its own time with it, which
+// means the counter ticks at a constant rate on every CPU; a read then
+// costs a fraction of a clock_gettime(). Otherwise, and until calibrate()
+// has measured the counter's rate, it is a clock_gettime(). One thread
+// may recalibrate() while others read the clock.
+class TscClock
+{
+public:
+    TscClock();
+
+    // Spins for TSC_CALIBRATION_US. Returns false if the counter is not
+    // used.
+    bool calibrate();
+    // Measures the rate again, over the whole time since calibrate().
+    void recalibrate();
+
+    uint64_t now_ns() const
+    {
+#ifdef TSC_CLOCK_X86
+        if (m_enabled)
+        {
+            uint64_t ticks = __rdtsc() - m_base_ticks;
+            unsigned __int128 scaled = static_cast<unsigned __int128>(ticks) * m_scale.load(std::memory_order_relaxed);
+            return m_base_ns + static_cast<uint64_t>(scaled >> SCALE_SHIFT);
+        }
+#endif
+        return monotonic_ns();
+    }
+
+    static uint64_t monotonic_ns();
+
+private:
+    static const int SCALE_SHIFT = 32;
+
+    // Reads the counter on both sides of the clock, for a matching pair.
+    void read_pair(uint64_t& ticks, uint64_t& ns) const;
+    void set_scale(uint64_t ticks, uint64_t ns);
+
+private:
+    bool m_enabled;
+    uint64_t m_base_ticks;
+    uint64_t m_base_ns;
+    // Nanoseconds per tick, times 2^SCALE_SHIFT
+    std::atomic<uint64_t> m_scale;
+};
+
+#endif // TSC_CLOCK_H
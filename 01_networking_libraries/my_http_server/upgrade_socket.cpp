@@ -0,0 +1,262 @@
+#include "upgrade_socket.h"
+#include "logging.h"
+#include "defs.h"
+
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+namespace
+{
+    const char UPGRADE_LISTENERS = 'L';
+    const char UPGRADE_READY = 'R';
+
+    bool make_address(const std::string& path, sockaddr_un& address)
+    {
+        if (path.empty() || path.length() >= sizeof(address.sun_path))
+        {
+            return false;
+        }
+
+        std::memset(&address, 0, sizeof(address));
+        address.sun_family = AF_UNIX;
+        std::memcpy(address.sun_path, path.c_str(), path.length());
+        return true;
+    }
+}
+
+UpgradeSocket::UpgradeSocket()
+    : m_sock(-1),
+      m_owns_path(false),
+      m_channel(-1)
+{
+
+}
+
+UpgradeSocket::~UpgradeSocket()
+{
+    close();
+    if (m_channel >= 0)
+    {
+        ::close(m_channel);
+    }
+}
+
+bool UpgradeSocket::listen(const std::string& path)
+{
+    sockaddr_un address;
+    if (!make_address(path, address))
+    {
+        LOGE("Upgrade socket path is not valid");
+        return false;
+    }
+
+    m_sock = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (m_sock < 0)
+    {
+        LOGE("Upgrade socket() failed");
+        return false;
+    }
+
+    // A previous server, or the one being replaced, may still have it bound;
+    // the new socket takes over the path either way.
+    unlink(path.c_str());
+    if (bind(m_sock, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 || ::listen(m_sock, 1) != 0)
+    {
+        LOGE("Upgrade socket bind() failed");
+        ::close(m_sock);
+        m_sock = -1;
+        return false;
+    }
+
+    m_path = path;
+    m_owns_path = true;
+    return true;
+}
+
+int UpgradeSocket::get_socket() const
+{
+    return m_sock;
+}
+
+bool UpgradeSocket::offer(const std::vector<int>& listeners)
+{
+    int channel = accept4(m_sock, nullptr, nullptr, SOCK_CLOEXEC);
+    if (channel < 0)
+    {
+        return false;
+    }
+
+    char control[CMSG_SPACE(sizeof(int) * UPGRADE_MAX_LISTENERS)];
+    std::memset(control, 0, sizeof(control));
+    std::size_t count = std::min<std::size_t>(listeners.size(), UPGRADE_MAX_LISTENERS);
+
+    char tag = UPGRADE_LISTENERS;
+    iovec data = { &tag, 1 };
+    msghdr message;
+    std::memset(&message, 0, sizeof(message));
+    message.msg_iov = &data;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = CMSG_SPACE(sizeof(int) * count);
+
+    cmsghdr* header = CMSG_FIRSTHDR(&message);
+    header->cmsg_level = SOL_SOCKET;
+    header->cmsg_type = SCM_RIGHTS;
+    header->cmsg_len = CMSG_LEN(sizeof(int) * count);
+    std::memcpy(CMSG_DATA(header), listeners.data(), sizeof(int) * count);
+
+    if (sendmsg(channel, &message, MSG_NOSIGNAL) != 1)
+    {
+        LOGE("Upgrade sendmsg() failed");
+        ::close(channel);
+        return false;
+    }
+
+    m_channel = channel;
+    return true;
+}
+
+int UpgradeSocket::get_channel() const
+{
+    return m_channel;
+}
+
+bool UpgradeSocket::finish_hand_over()
+{
+    // The new process answers once it has everything it needs to serve.
+    // Until then, or if it dies, this process keeps accepting.
+    char answer = 0;
+    bool confirmed = recv(m_channel, &answer, 1, MSG_DONTWAIT) == 1 && answer == UPGRADE_READY;
+    cancel_hand_over();
+    if (!confirmed)
+    {
+        LOGE("New server did not confirm the upgrade");
+        return false;
+    }
+
+    // The path belongs to the new process now.
+    m_owns_path = false;
+    LOGI("Listening sockets are handed over");
+    return true;
+}
+
+void UpgradeSocket::cancel_hand_over()
+{
+    if (m_channel >= 0)
+    {
+        ::close(m_channel);
+        m_channel = -1;
+    }
+}
+
+bool UpgradeSocket::hand_over(const std::vector<int>& listeners)
+{
+    if (!offer(listeners))
+    {
+        return false;
+    }
+
+    pollfd ready = { m_channel, POLLIN, 0 };
+    poll(&ready, 1, UPGRADE_CONFIRM_TIMEOUT_MS);
+    return finish_hand_over();
+}
+
+void UpgradeSocket::close()
+{
+    if (m_sock < 0)
+    {
+        return;
+    }
+
+    ::close(m_sock);
+    m_sock = -1;
+    if (m_owns_path)
+    {
+        unlink(m_path.c_str());
+        m_owns_path = false;
+    }
+}
+
+void UpgradeSocket::abandon()
+{
+    m_owns_path = false;
+    close();
+}
+
+bool UpgradeSocket::take_over(const std::string& path, std::vector<int>& listeners)
+{
+    sockaddr_un address;
+    if (!make_address(path, address))
+    {
+        LOGE("Upgrade socket path is not valid");
+        return false;
+    }
+
+    m_channel = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (m_channel < 0 || connect(m_channel, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0)
+    {
+        LOGE("Cannot connect to the running server on " + path);
+        return false;
+    }
+
+    char control[CMSG_SPACE(sizeof(int) * UPGRADE_MAX_LISTENERS)];
+    char tag = 0;
+    iovec data = { &tag, 1 };
+    msghdr message;
+    std::memset(&message, 0, sizeof(message));
+    message.msg_iov = &data;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+
+    ssize_t received;
+    do
+    {
+        received = recvmsg(m_channel, &message, MSG_CMSG_CLOEXEC);
+    } while (received < 0 && errno == EINTR);
+
+    if (received != 1 || tag != UPGRADE_LISTENERS)
+    {
+        LOGE("Running server did not hand over its listeners");
+        return false;
+    }
+
+    for (cmsghdr* header = CMSG_FIRSTHDR(&message); header != nullptr; header = CMSG_NXTHDR(&message, header))
+    {
+        if (header->cmsg_level != SOL_SOCKET || header->cmsg_type != SCM_RIGHTS)
+        {
+            continue;
+        }
+
+        std::size_t count = (header->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        const unsigned char* fds = CMSG_DATA(header);
+        for (std::size_t i = 0; i < count; i++)
+        {
+            int fd;
+            std::memcpy(&fd, fds + i * sizeof(int), sizeof(int));
+            listeners.push_back(fd);
+        }
+    }
+    return true;
+}
+
+void UpgradeSocket::confirm()
+{
+    if (m_channel < 0)
+    {
+        return;
+    }
+
+    char answer = UPGRADE_READY;
+    if (send(m_channel, &answer, 1, MSG_NOSIGNAL) != 1)
+    {
+        LOGE("Cannot confirm the upgrade to the running server");
+    }
+    ::close(m_channel);
+    m_channel = -1;
+}
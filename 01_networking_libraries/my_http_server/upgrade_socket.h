@@ -0,0 +1,54 @@
+#ifndef UPGRADE_SOCKET_H
+#define UPGRADE_SOCKET_H
+
+#include <string>
+#include <vector>
+
+// Hot upgrade channel. A running server listens on a Unix socket; a new
+// server process started with --upgrade connects to it and receives the
+// listening sockets with SCM_RIGHTS, so the listen backlog and the ports
+// survive the restart. The old server keeps accepting until the new one
+// confirms that it is about to serve, and then drains its connections.
+class UpgradeSocket
+{
+public:
+    UpgradeSocket();
+    ~UpgradeSocket();
+
+    UpgradeSocket(const UpgradeSocket&) = delete;
+    UpgradeSocket& operator=(const UpgradeSocket&) = delete;
+
+    // Old process side
+    bool listen(const std::string& path);
+    int get_socket() const;
+    // Passes listeners to the process that connected. Its answer is then
+    // awaited on get_channel(), by an event loop that keeps serving.
+    bool offer(const std::vector<int>& listeners);
+    // The channel to the other process during a hand-over, -1 otherwise.
+    int get_channel() const;
+    // Once the channel is readable, or the wait has timed out: returns
+    // false, with nothing changed, unless the new process confirmed.
+    bool finish_hand_over();
+    void cancel_hand_over();
+    // Offers the listeners and waits for the answer, for a caller without
+    // an event loop.
+    bool hand_over(const std::vector<int>& listeners);
+    // Stops listening; the path is removed unless another process owns it.
+    void close();
+    // In a forked child: closes the inherited socket, leaving the path to
+    // the parent.
+    void abandon();
+
+    // New process side
+    bool take_over(const std::string& path, std::vector<int>& listeners);
+    // Tells the old process to stop accepting.
+    void confirm();
+
+private:
+    std::string m_path;
+    int m_sock;
+    bool m_owns_path;
+    int m_channel;
+};
+
+#endif // UPGRADE_SOCKET_H
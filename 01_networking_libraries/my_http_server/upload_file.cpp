@@ -0,0 +1,209 @@
+#include "upload_file.h"
+#include "logging.h"
+#include "metrics.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace
+{
+    const char* error_body(HttpStatus status)
+    {
+        switch (status)
+        {
+            case HTTP_403: return "403 Forbidden";
+            case HTTP_413: return "413 Payload Too Large";
+            case HTTP_500: return "500 Internal Server Error";
+            default:       return "400 Bad Request";
+        }
+    }
+}
+
+UploadFile::UploadFile()
+    : m_fd(-1),
+      m_pipe{ -1, -1 },
+      m_size(0),
+      m_error(HTTP_200)
+{
+
+}
+
+UploadFile::~UploadFile()
+{
+    discard();
+    if (m_pipe[0] >= 0)
+    {
+        close(m_pipe[0]);
+        close(m_pipe[1]);
+    }
+}
+
+void UploadFile::open(const std::string& directory, const std::string& name)
+{
+    if (!is_valid_name(name))
+    {
+        LOGE("Invalid upload name: " + name);
+        fail(HTTP_403);
+        return;
+    }
+
+    m_path = directory + "/" + name;
+    m_temp_path = directory + "/." + name + ".XXXXXX";
+    m_fd = mkostemp(&m_temp_path[0], O_CLOEXEC);
+    if (m_fd < 0)
+    {
+        LOGE("Upload file cannot be created in " + directory);
+        fail(HTTP_500);
+        return;
+    }
+    // mkostemp() creates the file readable by the owner only.
+    fchmod(m_fd, UPLOAD_FILE_MODE);
+}
+
+bool UploadFile::consume(const char* data, std::size_t length)
+{
+    if (!reserve(length))
+    {
+        return false;
+    }
+
+    while (length > 0)
+    {
+        ssize_t written = write(m_fd, data, length);
+        if (written < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            LOGE("Upload write() failed");
+            fail(HTTP_500);
+            return false;
+        }
+        data += written;
+        length -= written;
+        m_size += written;
+    }
+    return true;
+}
+
+bool UploadFile::can_splice() const
+{
+    return m_fd >= 0;
+}
+
+ssize_t UploadFile::consume_from(int sock, std::size_t length)
+{
+    if (!reserve(length))
+    {
+        errno = EIO;
+        return -1;
+    }
+
+    if (m_pipe[0] < 0)
+    {
+        if (pipe2(m_pipe, O_NONBLOCK | O_CLOEXEC) != 0)
+        {
+            m_pipe[0] = m_pipe[1] = -1;
+            LOGE("Upload pipe cannot be created");
+            fail(HTTP_500);
+            errno = EIO;
+            return -1;
+        }
+        // A larger pipe moves more per call; the default size works too.
+        fcntl(m_pipe[1], F_SETPIPE_SZ, UPLOAD_PIPE_SIZE);
+    }
+
+    ssize_t moved = splice(sock, nullptr, m_pipe[1], nullptr, length, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (moved <= 0)
+    {
+        return moved;
+    }
+
+    // Emptied right away, so the pipe holds nothing between calls.
+    ssize_t left = moved;
+    while (left > 0)
+    {
+        ssize_t written = splice(m_pipe[0], nullptr, m_fd, nullptr, left, SPLICE_F_MOVE);
+        if (written < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (written <= 0)
+        {
+            LOGE("Upload splice() to the file failed");
+            fail(HTTP_500);
+            errno = EIO;
+            return -1;
+        }
+        left -= written;
+    }
+    m_size += moved;
+    return moved;
+}
+
+HTTPResponse UploadFile::finish(bool complete)
+{
+    if (complete && m_error == HTTP_200)
+    {
+        close(m_fd);
+        m_fd = -1;
+        if (rename(m_temp_path.c_str(), m_path.c_str()) == 0)
+        {
+            METRIC_INC(METRIC_UPLOADS);
+            METRIC_ADD(METRIC_UPLOAD_BYTES, m_size);
+            LOGI("Uploaded " + m_path + " (" + std::to_string(m_size) + " bytes)");
+            HTTPResponse response(HTTP_201, "201 Created");
+            response.set_header("Location", STR_UPLOAD_PATH + m_path.substr(m_path.rfind('/') + 1));
+            return response;
+        }
+        LOGE("Upload cannot be renamed to " + m_path);
+        unlink(m_temp_path.c_str());
+        m_error = HTTP_500;
+    }
+
+    discard();
+    // A body that ended early is a malformed request.
+    HttpStatus status = (m_error != HTTP_200) ? m_error : HTTP_400;
+    return HTTPResponse(status, error_body(status));
+}
+
+bool UploadFile::is_valid_name(const std::string& name)
+{
+    return !name.empty() && name[0] != '.' && name.find('/') == std::string::npos;
+}
+
+bool UploadFile::reserve(std::size_t length)
+{
+    if (m_error != HTTP_200)
+    {
+        return false;
+    }
+    if (m_size + length > MAX_UPLOAD_SIZE)
+    {
+        LOGE("Upload is too large");
+        fail(HTTP_413);
+        return false;
+    }
+    return true;
+}
+
+void UploadFile::fail(HttpStatus status)
+{
+    m_error = status;
+    discard();
+}
+
+void UploadFile::discard()
+{
+    if (m_fd >= 0)
+    {
+        close(m_fd);
+        m_fd = -1;
+        unlink(m_temp_path.c_str());
+    }
+}
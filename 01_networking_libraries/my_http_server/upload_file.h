@@ -0,0 +1,47 @@
+#ifndef UPLOAD_FILE_H
+#define UPLOAD_FILE_H
+
+#include "body_consumer.h"
+#include "defs.h"
+
+#include <cstdint>
+#include <string>
+
+// Stores an uploaded body as a file in the upload directory. The body is
+// written to a temporary file that is renamed into place once it is
+// complete, so readers never see half an upload and a failed one leaves
+// nothing behind. From a plaintext socket the body is moved with splice()
+// through a pipe and never enters user space.
+class UploadFile : public BodyConsumer
+{
+public:
+    UploadFile();
+    ~UploadFile();
+
+    // A file that cannot be created refuses the body, and finish() answers
+    // with the reason.
+    void open(const std::string& directory, const std::string& name);
+
+    bool consume(const char* data, std::size_t length) override;
+    bool can_splice() const override;
+    ssize_t consume_from(int sock, std::size_t length) override;
+    HTTPResponse finish(bool complete) override;
+
+    // A name is a single path segment that is not hidden.
+    static bool is_valid_name(const std::string& name);
+
+private:
+    bool reserve(std::size_t length);
+    void fail(HttpStatus status);
+    void discard();
+
+private:
+    std::string m_path;
+    std::string m_temp_path;
+    int m_fd;
+    int m_pipe[2];
+    uint64_t m_size;
+    HttpStatus m_error;
+};
+
+#endif // UPLOAD_FILE_H
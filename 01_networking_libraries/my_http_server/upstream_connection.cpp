@@ -0,0 +1,679 @@
+#include "upstream_connection.h"
+#include "upstream_pool.h"
+#include "http_parser.h"
+#include "chunked_encoder.h"
+#include "logging.h"
+#include "metrics.h"
+#include "defs.h"
+
+#include <unistd.h>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <strings.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+namespace
+{
+    // Hop-by-hop fields describe the upstream connection, not the response.
+    bool is_hop_by_hop(const std::string& name)
+    {
+        return strcasecmp(name.c_str(), "Connection") == 0 ||
+               strcasecmp(name.c_str(), "Keep-Alive") == 0 ||
+               strcasecmp(name.c_str(), "Proxy-Connection") == 0;
+    }
+
+    std::string trim(const std::string& value)
+    {
+        std::size_t begin = value.find_first_not_of(" \t");
+        if (begin == std::string::npos)
+        {
+            return std::string();
+        }
+        std::size_t end = value.find_last_not_of(" \t");
+        return value.substr(begin, end - begin + 1);
+    }
+}
+
+UpstreamConnection::UpstreamConnection(UpstreamPool& pool, EventLoop& loop, Upstream& upstream)
+    : m_pool(pool),
+      m_loop(loop),
+      m_upstream(upstream),
+      m_sock(-1),
+      m_state(CLOSED),
+      m_interest(0),
+      m_timer(this),
+      m_client(nullptr),
+      m_request_sent(0),
+      m_head_request(false),
+      m_client_keep_alive(true),
+      m_client_chunked(true),
+      m_reused(false),
+      m_retried(false),
+      m_received(false),
+      m_paused(false),
+      m_status(0),
+      m_keep_alive(false),
+      m_close_client(false),
+      m_dechunk(false),
+      m_rechunk(false),
+      m_framing(NO_BODY),
+      m_body_remaining(0)
+{
+
+}
+
+UpstreamConnection::~UpstreamConnection()
+{
+    if (m_sock >= 0)
+    {
+        if (m_interest != 0)
+        {
+            m_loop.remove(m_sock);
+        }
+        ::close(m_sock);
+    }
+}
+
+Upstream& UpstreamConnection::get_upstream() const
+{
+    return m_upstream;
+}
+
+bool UpstreamConnection::open()
+{
+    m_sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (m_sock < 0)
+    {
+        LOGE("Upstream socket() failed");
+        return false;
+    }
+
+    int one = 1;
+    setsockopt(m_sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    const sockaddr_in& address = m_upstream.get_address();
+    if (connect(m_sock, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) != 0 && errno != EINPROGRESS)
+    {
+        LOGE("Upstream connect() failed");
+        ::close(m_sock);
+        m_sock = -1;
+        return false;
+    }
+
+    METRIC_INC(METRIC_UPSTREAM_CONNECTIONS_OPENED);
+    m_state = CONNECTING;
+    m_reused = false;
+    return true;
+}
+
+void UpstreamConnection::start(const std::string& request, bool head_request, bool client_keep_alive, bool client_chunked, UpstreamClient* client)
+{
+    m_client = client;
+    m_request = request;
+    m_request_sent = 0;
+    m_head_request = head_request;
+    m_client_keep_alive = client_keep_alive;
+    m_client_chunked = client_chunked;
+    m_retried = false;
+    m_received = false;
+    m_paused = false;
+    m_input.clear();
+    m_client_head.clear();
+    m_status = 0;
+    m_keep_alive = false;
+    m_close_client = false;
+    m_rechunk = false;
+    m_dechunk = false;
+    m_framing = NO_BODY;
+    m_body_remaining = 0;
+    m_chunked.reset();
+    m_upstream.request_started();
+    METRIC_INC(METRIC_UPSTREAM_REQUESTS);
+
+    // The request is written from the event loop, never from inside the
+    // client's own call stack, so callbacks into the client cannot recurse.
+    if (m_state == IDLE)
+    {
+        m_reused = true;
+        m_state = SENDING;
+        m_loop.timers().schedule(&m_timer, UPSTREAM_RESPONSE_TIMEOUT_MS);
+    }
+    else
+    {
+        m_loop.timers().schedule(&m_timer, UPSTREAM_CONNECT_TIMEOUT_MS);
+    }
+    set_interest(EPOLLOUT);
+}
+
+void UpstreamConnection::resume()
+{
+    if (!m_paused || m_state == CLOSED)
+    {
+        return;
+    }
+
+    m_paused = false;
+    m_loop.timers().schedule(&m_timer, UPSTREAM_RESPONSE_TIMEOUT_MS);
+    set_interest(EPOLLIN | EPOLLRDHUP);
+}
+
+void UpstreamConnection::detach()
+{
+    if (m_client == nullptr)
+    {
+        return;
+    }
+
+    // The rest of the response would have to be drained before the
+    // connection could be reused, so it is simply closed.
+    m_client = nullptr;
+    m_upstream.request_abandoned();
+    close();
+}
+
+void UpstreamConnection::handle_event(uint32_t events)
+{
+    switch (m_state)
+    {
+        case CONNECTING:
+        {
+            int error = 0;
+            socklen_t length = sizeof(error);
+            if (getsockopt(m_sock, SOL_SOCKET, SO_ERROR, &error, &length) != 0 || error != 0)
+            {
+                LOGE("Upstream connection failed");
+                fail(HTTP_502, false);
+                return;
+            }
+            m_state = SENDING;
+            m_loop.timers().schedule(&m_timer, UPSTREAM_RESPONSE_TIMEOUT_MS);
+            send_request();
+            break;
+        }
+
+        case SENDING:
+            send_request();
+            break;
+
+        case READING_HEAD:
+        case READING_BODY:
+            read_response();
+            break;
+
+        case IDLE:
+            // Either the backend closed the connection or it sent something
+            // nobody asked for; it cannot be reused in both cases.
+            (void)events;
+            close();
+            break;
+
+        case CLOSED:
+            break;
+    }
+}
+
+void UpstreamConnection::handle_timeout(TimerNode* timer)
+{
+    (void)timer;
+    switch (m_state)
+    {
+        case CONNECTING:
+            LOGE("Upstream connection timed out");
+            fail(HTTP_504, false);
+            break;
+
+        case SENDING:
+        case READING_HEAD:
+        case READING_BODY:
+            LOGE("Upstream response timed out");
+            fail(HTTP_504, false);
+            break;
+
+        case IDLE:
+            close();
+            break;
+
+        case CLOSED:
+            break;
+    }
+}
+
+void UpstreamConnection::send_request()
+{
+    while (m_request_sent < m_request.length())
+    {
+        ssize_t rc_send = send(m_sock, m_request.data() + m_request_sent, m_request.length() - m_request_sent, MSG_NOSIGNAL);
+        if (rc_send < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                set_interest(EPOLLOUT);
+                return;
+            }
+            LOGE("Upstream send() failed");
+            fail(HTTP_502, true);
+            return;
+        }
+        m_request_sent += rc_send;
+    }
+
+    m_state = READING_HEAD;
+    set_interest(EPOLLIN | EPOLLRDHUP);
+}
+
+void UpstreamConnection::read_response()
+{
+    char buffer[UPSTREAM_READ_SIZE];
+    while (!m_paused && (m_state == READING_HEAD || m_state == READING_BODY))
+    {
+        ssize_t rc_recv = recv(m_sock, buffer, sizeof(buffer), 0);
+        if (rc_recv > 0)
+        {
+            m_received = true;
+            m_loop.timers().schedule(&m_timer, UPSTREAM_RESPONSE_TIMEOUT_MS);
+            process(buffer, rc_recv);
+            continue;
+        }
+
+        if (rc_recv < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            return;
+        }
+        if (rc_recv < 0 && errno == EINTR)
+        {
+            continue;
+        }
+
+        if (rc_recv == 0 && m_state == READING_BODY && m_framing == UNTIL_CLOSE)
+        {
+            m_keep_alive = false;
+            if (m_rechunk && m_client != nullptr)
+            {
+                std::string last_chunk;
+                last_chunk.swap(m_client_head);
+                ChunkedEncoder::append_last_chunk(last_chunk);
+                m_client->upstream_data(last_chunk);
+            }
+            // Delivering may have closed the client, and this connection.
+            if (m_state == READING_BODY)
+            {
+                finish();
+            }
+            return;
+        }
+
+        LOGE("Upstream closed the connection before the response was complete");
+        fail(HTTP_502, true);
+        return;
+    }
+}
+
+void UpstreamConnection::process(const char* data, std::size_t length)
+{
+    if (m_state == READING_BODY)
+    {
+        forward_body(data, length);
+        return;
+    }
+
+    m_input.append(data, length);
+    while (m_state == READING_HEAD)
+    {
+        std::size_t header_length = HTTPParser::find_header_end(m_input);
+        if (header_length == std::string::npos)
+        {
+            if (m_input.length() > MAX_HEADER_SIZE)
+            {
+                LOGE("Upstream response headers are too large");
+                fail(HTTP_502, false);
+            }
+            return;
+        }
+
+        std::string client_head;
+        if (!parse_head(header_length, client_head))
+        {
+            LOGE("Upstream response is malformed");
+            fail(HTTP_502, false);
+            return;
+        }
+
+        std::string body = m_input.substr(header_length);
+        m_input.clear();
+        if (client_head.empty())
+        {
+            // An interim 1xx response, the final one follows.
+            m_input = body;
+            continue;
+        }
+
+        // The head goes out with the first body bytes, in one write.
+        m_state = READING_BODY;
+        m_client_head.swap(client_head);
+        if (m_framing == NO_BODY || (m_framing == CONTENT_LENGTH && m_body_remaining == 0))
+        {
+            m_keep_alive = m_keep_alive && body.empty();
+            deliver(nullptr, 0);
+            if (m_state == READING_BODY)
+            {
+                finish();
+            }
+            return;
+        }
+        forward_body(body.data(), body.length());
+    }
+}
+
+bool UpstreamConnection::parse_head(std::size_t header_length, std::string& client_head)
+{
+    // Status line: HTTP/1.x SSS Reason
+    std::size_t line_end = m_input.find("\r\n");
+    if (m_input.compare(0, 7, "HTTP/1.") != 0 || line_end < 12 || m_input[8] != ' ')
+    {
+        return false;
+    }
+    m_status = atoi(m_input.c_str() + 9);
+    if (m_status < 100 || m_status > 999)
+    {
+        return false;
+    }
+    if (m_status < 200)
+    {
+        return true;
+    }
+
+    bool http10 = (m_input[7] == '0');
+    m_keep_alive = !http10;
+    bool chunked = false;
+    bool has_length = false;
+    uint64_t content_length = 0;
+
+    std::string head = "HTTP/1.1" + m_input.substr(8, line_end - 8) + "\r\n";
+    // Kept apart: chunks go only to a client that can take them, and a
+    // length never goes along with them.
+    std::string framing;
+    std::string length_header;
+    std::size_t offset = line_end + 2;
+    while (offset < header_length - 2)
+    {
+        std::size_t next = m_input.find("\r\n", offset);
+        std::size_t colon = m_input.find(':', offset);
+        if (colon == std::string::npos || colon > next)
+        {
+            return false;
+        }
+
+        std::string name = m_input.substr(offset, colon - offset);
+        std::string value = trim(m_input.substr(colon + 1, next - colon - 1));
+        if (strcasecmp(name.c_str(), "Connection") == 0)
+        {
+            if (strcasestr(value.c_str(), "close") != nullptr)
+            {
+                m_keep_alive = false;
+            }
+            else if (http10 && strcasestr(value.c_str(), "keep-alive") != nullptr)
+            {
+                m_keep_alive = true;
+            }
+        }
+        else if (strcasecmp(name.c_str(), "Transfer-Encoding") == 0)
+        {
+            chunked = strcasestr(value.c_str(), "chunked") != nullptr;
+        }
+        else if (strcasecmp(name.c_str(), "Content-Length") == 0)
+        {
+            has_length = true;
+            content_length = strtoull(value.c_str(), nullptr, 10);
+        }
+
+        if (strcasecmp(name.c_str(), "Transfer-Encoding") == 0)
+        {
+            framing.append(m_input, offset, next + 2 - offset);
+        }
+        else if (strcasecmp(name.c_str(), "Content-Length") == 0)
+        {
+            length_header.append(m_input, offset, next + 2 - offset);
+        }
+        else if (!is_hop_by_hop(name))
+        {
+            head.append(m_input, offset, next + 2 - offset);
+        }
+        offset = next + 2;
+    }
+
+    if (m_head_request || m_status == 204 || m_status == 304)
+    {
+        m_framing = NO_BODY;
+    }
+    else if (chunked)
+    {
+        // An HTTP/1.0 client cannot take chunks; it gets the decoded body,
+        // delimited by the end of the connection.
+        m_framing = CHUNKED;
+        m_dechunk = !m_client_chunked;
+        m_close_client = m_dechunk;
+    }
+    else if (has_length)
+    {
+        m_framing = CONTENT_LENGTH;
+        m_body_remaining = content_length;
+    }
+    else
+    {
+        // Only the end of the connection delimits the body. Towards the
+        // client it is sent chunked where possible, or delimited the same way.
+        m_framing = UNTIL_CLOSE;
+        m_keep_alive = false;
+        m_rechunk = m_client_keep_alive && m_client_chunked;
+        if (m_rechunk)
+        {
+            head += "Transfer-Encoding: chunked\r\n";
+        }
+        else
+        {
+            m_close_client = true;
+        }
+    }
+
+    // Transfer-Encoding must not reach an HTTP/1.0 client, even without a
+    // body, and Content-Length must not go along with it to anyone.
+    if (!chunked)
+    {
+        head += framing;
+        head += length_header;
+    }
+    else if (m_client_chunked)
+    {
+        head += framing;
+    }
+    bool client_keep_alive = m_client_keep_alive && !m_close_client;
+    head += client_keep_alive ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n";
+    client_head.swap(head);
+    return true;
+}
+
+void UpstreamConnection::forward_body(const char* data, std::size_t length)
+{
+    std::size_t count = length;
+    bool done = false;
+    std::string payload;
+    switch (m_framing)
+    {
+        case CONTENT_LENGTH:
+            count = std::min<uint64_t>(length, m_body_remaining);
+            m_body_remaining -= count;
+            done = (m_body_remaining == 0);
+            break;
+
+        case CHUNKED:
+            count = m_chunked.feed(data, length, m_dechunk ? &payload : nullptr);
+            if (m_chunked.has_error())
+            {
+                LOGE("Upstream response has a malformed chunked body");
+                fail(HTTP_502, false);
+                return;
+            }
+            done = m_chunked.is_done();
+            break;
+
+        case UNTIL_CLOSE:
+        case NO_BODY:
+            break;
+    }
+
+    // Bytes after the end of the response leave the connection out of sync.
+    if (count < length)
+    {
+        m_keep_alive = false;
+    }
+
+    if (m_dechunk)
+    {
+        deliver(payload.data(), payload.length());
+    }
+    else
+    {
+        deliver(data, count);
+    }
+    if (done && m_state == READING_BODY)
+    {
+        finish();
+    }
+}
+
+void UpstreamConnection::deliver(const char* data, std::size_t length)
+{
+    std::string chunk;
+    chunk.swap(m_client_head);
+    if (m_rechunk)
+    {
+        ChunkedEncoder::append_chunk(chunk, data, length);
+    }
+    else
+    {
+        chunk.append(data, length);
+    }
+    if (chunk.empty() || m_client == nullptr)
+    {
+        return;
+    }
+
+    if (!m_client->upstream_data(chunk) && m_state == READING_BODY)
+    {
+        // Backpressure: leave the rest in the socket until the client drains.
+        m_paused = true;
+        m_loop.timers().cancel(&m_timer);
+        set_interest(0);
+    }
+}
+
+void UpstreamConnection::finish()
+{
+    m_upstream.request_finished(m_status < 500, m_loop.now_ms());
+
+    UpstreamClient* client = m_client;
+    bool close_client = m_close_client;
+    m_client = nullptr;
+    m_request.clear();
+
+    if (m_keep_alive && m_upstream.put_idle(this))
+    {
+        m_state = IDLE;
+        m_paused = false;
+        m_loop.timers().schedule(&m_timer, UPSTREAM_IDLE_TIMEOUT_MS);
+        set_interest(EPOLLIN | EPOLLRDHUP);
+    }
+    else
+    {
+        close();
+    }
+
+    // Last, since the client may immediately send its next request through
+    // this very connection.
+    if (client != nullptr)
+    {
+        client->upstream_complete(close_client);
+    }
+}
+
+void UpstreamConnection::fail(int status, bool retryable)
+{
+    // A pooled connection may have been closed by the backend just as it
+    // was picked; that says nothing about the backend, so try once more on
+    // a fresh connection.
+    if (retryable && m_reused && !m_retried && !m_received && m_client != nullptr)
+    {
+        LOGI("Upstream connection went stale, retrying");
+        set_interest(0);
+        ::close(m_sock);
+        m_sock = -1;
+        if (open())
+        {
+            m_retried = true;
+            m_request_sent = 0;
+            m_loop.timers().schedule(&m_timer, UPSTREAM_CONNECT_TIMEOUT_MS);
+            set_interest(EPOLLOUT);
+            return;
+        }
+    }
+
+    METRIC_INC(METRIC_UPSTREAM_FAILURES);
+    m_upstream.request_finished(false, m_loop.now_ms());
+
+    UpstreamClient* client = m_client;
+    m_client = nullptr;
+    close();
+    if (client != nullptr)
+    {
+        client->upstream_failed(status);
+    }
+}
+
+void UpstreamConnection::close()
+{
+    if (m_state == CLOSED)
+    {
+        return;
+    }
+
+    m_state = CLOSED;
+    m_loop.timers().cancel(&m_timer);
+    set_interest(0);
+    if (m_sock >= 0)
+    {
+        ::close(m_sock);
+        m_sock = -1;
+    }
+    m_pool.destroy(this);
+}
+
+void UpstreamConnection::set_interest(uint32_t interest)
+{
+    // A paused connection is taken out of epoll altogether: a hang-up is
+    // reported regardless of the interest mask and would spin the loop.
+    if (interest == m_interest)
+    {
+        return;
+    }
+
+    if (interest == 0)
+    {
+        m_loop.remove(m_sock);
+    }
+    else if (m_interest == 0)
+    {
+        m_loop.add(m_sock, interest, this);
+    }
+    else
+    {
+        m_loop.modify(m_sock, interest, this);
+    }
+    m_interest = interest;
+}
@@ -0,0 +1,132 @@
+#ifndef UPSTREAM_CONNECTION_H
+#define UPSTREAM_CONNECTION_H
+
+#include "event_loop.h"
+#include "timer_wheel.h"
+#include "chunked_decoder.h"
+
+#include <cstdint>
+#include <memory>
+#include <string>
+
+class Upstream;
+class UpstreamPool;
+
+// Receives a proxied response, already framed for the downstream client.
+class UpstreamClient
+{
+public:
+    virtual ~UpstreamClient() = default;
+    // Returns false to stop the flow until the client calls resume().
+    virtual bool upstream_data(const std::string& data) = 0;
+    // The same for length bytes of a buffer shared with other clients.
+    // Clients that can queue it without a copy also return false while
+    // they hold too many pieces, so a slow one stops taking more.
+    virtual bool upstream_shared(const std::shared_ptr<const std::string>& buffer, std::size_t offset, std::size_t length)
+    {
+        return upstream_data(buffer->substr(offset, length));
+    }
+    virtual void upstream_complete(bool close_client) = 0;
+    // Nothing more will arrive. status is the error to answer with if no
+    // data has been delivered yet.
+    virtual void upstream_failed(int status) = 0;
+};
+
+// What a client holds while a proxied response is being delivered to it:
+// either the upstream connection itself, or its place in a shared fetch.
+class UpstreamSource
+{
+public:
+    virtual ~UpstreamSource() = default;
+    // The client has drained its output and can take more data.
+    virtual void resume() = 0;
+    // The client is gone; nothing more is delivered to it.
+    virtual void detach() = 0;
+};
+
+// A persistent, non-blocking HTTP/1.1 connection to one upstream, carrying
+// one request at a time. The response head is rewritten for the client,
+// and the body is passed through as it arrives, so a large response is
+// never buffered whole; the upstream socket is not read while the client
+// is not keeping up. A body delimited by the backend closing the connection
+// is re-framed as chunks, so the client's connection can stay open. A reused connection that turns out to have been
+// closed by the backend is reopened and the request resent once.
+class UpstreamConnection : public EventHandler, public TimerHandler, public UpstreamSource
+{
+public:
+    UpstreamConnection(UpstreamPool& pool, EventLoop& loop, Upstream& upstream);
+    ~UpstreamConnection();
+
+    Upstream& get_upstream() const;
+    bool open();
+    void start(const std::string& request, bool head_request, bool client_keep_alive, bool client_chunked, UpstreamClient* client);
+    void resume() override;
+    // The response cannot be completed, so the connection is closed.
+    void detach() override;
+
+    void handle_event(uint32_t events) override;
+    void handle_timeout(TimerNode* timer) override;
+
+private:
+    enum State
+    {
+        CONNECTING,
+        SENDING,
+        READING_HEAD,
+        READING_BODY,
+        IDLE,
+        CLOSED
+    };
+
+    enum BodyFraming
+    {
+        NO_BODY,
+        CONTENT_LENGTH,
+        CHUNKED,
+        UNTIL_CLOSE
+    };
+
+    void send_request();
+    void read_response();
+    void process(const char* data, std::size_t length);
+    bool parse_head(std::size_t header_length, std::string& client_head);
+    void forward_body(const char* data, std::size_t length);
+    void deliver(const char* data, std::size_t length);
+    void finish();
+    void fail(int status, bool retryable);
+    void close();
+    void set_interest(uint32_t interest);
+
+private:
+    UpstreamPool& m_pool;
+    EventLoop& m_loop;
+    Upstream& m_upstream;
+    int m_sock;
+    State m_state;
+    uint32_t m_interest;
+    TimerNode m_timer;
+
+    UpstreamClient* m_client;
+    std::string m_request;
+    std::size_t m_request_sent;
+    bool m_head_request;
+    bool m_client_keep_alive;
+    bool m_client_chunked;
+    bool m_reused;
+    bool m_retried;
+    bool m_received;
+    bool m_paused;
+
+    std::string m_input;
+    std::string m_client_head;
+    int m_status;
+    bool m_keep_alive;
+    bool m_close_client;
+    bool m_dechunk;
+    bool m_rechunk;
+    BodyFraming m_framing;
+    uint64_t m_body_remaining;
+    ChunkedDecoder m_chunked;
+};
+
+#endif // UPSTREAM_CONNECTION_H
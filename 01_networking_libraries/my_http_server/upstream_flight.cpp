@@ -0,0 +1,180 @@
+#include "upstream_flight.h"
+#include "upstream_pool.h"
+#include "metrics.h"
+
+UpstreamFlight::Waiter::Waiter(UpstreamFlight& flight, UpstreamClient* client, bool coalesced)
+    : m_flight(flight),
+      m_client(client),
+      m_coalesced(coalesced),
+      m_paused(false)
+{
+
+}
+
+void UpstreamFlight::Waiter::resume()
+{
+    if (!m_paused)
+    {
+        return;
+    }
+
+    m_paused = false;
+    m_flight.waiter_resumed();
+}
+
+void UpstreamFlight::Waiter::detach()
+{
+    m_flight.waiter_detached(this);
+}
+
+UpstreamFlight::UpstreamFlight(UpstreamPool& pool, const std::string& key, UpstreamConnection* connection)
+    : m_pool(pool),
+      m_key(key),
+      m_connection(connection),
+      m_sealed(false)
+{
+
+}
+
+const std::string& UpstreamFlight::get_key() const
+{
+    return m_key;
+}
+
+UpstreamSource* UpstreamFlight::join(UpstreamClient* client, bool coalesced)
+{
+    if (coalesced)
+    {
+        METRIC_INC(METRIC_UPSTREAM_COALESCED);
+        METRIC_INC(METRIC_UPSTREAM_COALESCED_WAITING);
+    }
+    m_waiters.emplace_back(new Waiter(*this, client, coalesced));
+    return m_waiters.back().get();
+}
+
+bool UpstreamFlight::upstream_data(const std::string& data)
+{
+    seal();
+
+    // Clients that leave or finish during the loop only clear their entry.
+    for (std::size_t i = 0; i < m_waiters.size(); i++)
+    {
+        Waiter* waiter = m_waiters[i].get();
+        if (waiter->m_client != nullptr && !waiter->m_client->upstream_data(data) && waiter->m_client != nullptr)
+        {
+            waiter->m_paused = true;
+        }
+    }
+    return !has_paused_waiters();
+}
+
+void UpstreamFlight::upstream_complete(bool close_client)
+{
+    m_connection = nullptr;
+    seal();
+    for (std::size_t i = 0; i < m_waiters.size(); i++)
+    {
+        UpstreamClient* client = m_waiters[i]->m_client;
+        m_waiters[i]->m_client = nullptr;
+        if (client != nullptr)
+        {
+            client->upstream_complete(close_client);
+        }
+    }
+    finish();
+}
+
+void UpstreamFlight::upstream_failed(int status)
+{
+    m_connection = nullptr;
+    seal();
+    for (std::size_t i = 0; i < m_waiters.size(); i++)
+    {
+        UpstreamClient* client = m_waiters[i]->m_client;
+        m_waiters[i]->m_client = nullptr;
+        if (client != nullptr)
+        {
+            client->upstream_failed(status);
+        }
+    }
+    finish();
+}
+
+void UpstreamFlight::seal()
+{
+    if (m_sealed)
+    {
+        return;
+    }
+
+    m_sealed = true;
+    m_pool.seal(this);
+    for (auto& waiter : m_waiters)
+    {
+        if (waiter->m_coalesced)
+        {
+            METRIC_DEC(METRIC_UPSTREAM_COALESCED_WAITING);
+        }
+    }
+}
+
+void UpstreamFlight::waiter_resumed()
+{
+    if (m_connection != nullptr && !has_paused_waiters())
+    {
+        m_connection->resume();
+    }
+}
+
+void UpstreamFlight::waiter_detached(Waiter* waiter)
+{
+    if (waiter->m_client == nullptr)
+    {
+        return;
+    }
+
+    waiter->m_client = nullptr;
+    waiter->m_paused = false;
+    if (!m_sealed && waiter->m_coalesced)
+    {
+        METRIC_DEC(METRIC_UPSTREAM_COALESCED_WAITING);
+        waiter->m_coalesced = false;
+    }
+
+    for (const auto& other : m_waiters)
+    {
+        if (other->m_client != nullptr)
+        {
+            // The others may have been held back only by this one.
+            waiter_resumed();
+            return;
+        }
+    }
+
+    // Nobody is left to deliver the response to.
+    if (m_connection != nullptr)
+    {
+        UpstreamConnection* connection = m_connection;
+        m_connection = nullptr;
+        connection->detach();
+    }
+    finish();
+}
+
+bool UpstreamFlight::has_paused_waiters() const
+{
+    for (const auto& waiter : m_waiters)
+    {
+        if (waiter->m_client != nullptr && waiter->m_paused)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+void UpstreamFlight::finish()
+{
+    seal();
+    m_pool.destroy(this);
+}
@@ -0,0 +1,65 @@
+#ifndef UPSTREAM_FLIGHT_H
+#define UPSTREAM_FLIGHT_H
+
+#include "upstream_connection.h"
+
+#include <memory>
+#include <string>
+#include <vector>
+
+class UpstreamPool;
+
+// One upstream fetch shared by identical requests (single-flight). The
+// first request starts the fetch; the ones that arrive before any of the
+// response has come back join it instead of going to the backend, and
+// every response chunk is fanned out to all of them. The fetch runs at the
+// pace of the slowest client still attached, and is abandoned when the
+// last one leaves.
+class UpstreamFlight : public UpstreamClient
+{
+public:
+    UpstreamFlight(UpstreamPool& pool, const std::string& key, UpstreamConnection* connection);
+
+    const std::string& get_key() const;
+    // coalesced is false for the request that started the fetch.
+    UpstreamSource* join(UpstreamClient* client, bool coalesced);
+
+    bool upstream_data(const std::string& data) override;
+    void upstream_complete(bool close_client) override;
+    void upstream_failed(int status) override;
+
+private:
+    class Waiter : public UpstreamSource
+    {
+    public:
+        Waiter(UpstreamFlight& flight, UpstreamClient* client, bool coalesced);
+
+        void resume() override;
+        void detach() override;
+
+    public:
+        UpstreamFlight& m_flight;
+        UpstreamClient* m_client;
+        bool m_coalesced;
+        bool m_paused;
+    };
+
+    // The response has started, or the fetch is over: a request joining
+    // now would miss part of it.
+    void seal();
+    void waiter_resumed();
+    void waiter_detached(Waiter* waiter);
+    bool has_paused_waiters() const;
+    void finish();
+
+private:
+    UpstreamPool& m_pool;
+    std::string m_key;
+    UpstreamConnection* m_connection;
+    bool m_sealed;
+    // Waiters stay allocated until the flight is freed, so a client that
+    // leaves while the response is being fanned out is simply skipped.
+    std::vector<std::unique_ptr<Waiter>> m_waiters;
+};
+
+#endif // UPSTREAM_FLIGHT_H
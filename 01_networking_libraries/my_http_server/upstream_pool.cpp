@@ -0,0 +1,399 @@
+#include "upstream_pool.h"
+#include "logging.h"
+#include "metrics.h"
+#include "defs.h"
+
+#include <algorithm>
+#include <cstring>
+#include <strings.h>
+#include <netdb.h>
+#include <sys/socket.h>
+
+namespace
+{
+    // Fields that only describe the client connection are not forwarded.
+    bool is_hop_by_hop(const std::string& name)
+    {
+        static const char* const HOP_BY_HOP[] = {
+            "Connection", "Keep-Alive", "Proxy-Connection", "TE", "Trailer",
+            "Transfer-Encoding", "Upgrade", "HTTP2-Settings", "Content-Length"
+        };
+        for (const char* field : HOP_BY_HOP)
+        {
+            if (strcasecmp(name.c_str(), field) == 0)
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Request fields a backend commonly varies its response on; requests
+    // that differ in any of them do not share a response.
+    const char* const FLIGHT_KEY_HEADERS[] = {
+        "Host", "Accept", "Accept-Encoding", "Accept-Language"
+    };
+
+    // Responses to these may be specific to the client, or partial.
+    const char* const PRIVATE_HEADERS[] = {
+        "Authorization", "Cookie", "Range", "If-Range"
+    };
+
+    bool resolve(const std::string& host_port, sockaddr_in& address)
+    {
+        std::size_t colon = host_port.rfind(':');
+        if (colon == std::string::npos)
+        {
+            return false;
+        }
+
+        addrinfo hints;
+        std::memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_INET;
+        hints.ai_socktype = SOCK_STREAM;
+        addrinfo* result;
+        if (getaddrinfo(host_port.substr(0, colon).c_str(), host_port.substr(colon + 1).c_str(), &hints, &result) != 0)
+        {
+            return false;
+        }
+        std::memcpy(&address, result->ai_addr, sizeof(address));
+        freeaddrinfo(result);
+        return true;
+    }
+}
+
+Upstream::Upstream(const std::string& name, const sockaddr_in& address)
+    : m_name(name),
+      m_address(address),
+      m_outstanding(0),
+      m_failures(0),
+      m_ejected_until(0)
+{
+
+}
+
+const std::string& Upstream::get_name() const
+{
+    return m_name;
+}
+
+const sockaddr_in& Upstream::get_address() const
+{
+    return m_address;
+}
+
+bool Upstream::is_available(uint64_t now_ms) const
+{
+    return now_ms >= m_ejected_until;
+}
+
+std::size_t Upstream::get_outstanding() const
+{
+    return m_outstanding;
+}
+
+void Upstream::request_started()
+{
+    m_outstanding++;
+}
+
+void Upstream::request_finished(bool success, uint64_t now_ms)
+{
+    m_outstanding--;
+    if (success)
+    {
+        m_failures = 0;
+        return;
+    }
+
+    if (++m_failures >= UPSTREAM_MAX_FAILURES && is_available(now_ms))
+    {
+        LOGE("Upstream " + m_name + " is ejected");
+        METRIC_INC(METRIC_UPSTREAM_EJECTIONS);
+        m_ejected_until = now_ms + UPSTREAM_EJECTION_TIME_MS;
+        // One more failure after the ejection ends ejects it again.
+        m_failures = UPSTREAM_MAX_FAILURES - 1;
+    }
+}
+
+void Upstream::request_abandoned()
+{
+    m_outstanding--;
+}
+
+UpstreamConnection* Upstream::take_idle()
+{
+    if (m_idle.empty())
+    {
+        return nullptr;
+    }
+
+    UpstreamConnection* connection = m_idle.back();
+    m_idle.pop_back();
+    return connection;
+}
+
+bool Upstream::put_idle(UpstreamConnection* connection)
+{
+    if (m_idle.size() >= UPSTREAM_MAX_IDLE_CONNECTIONS)
+    {
+        return false;
+    }
+
+    m_idle.push_back(connection);
+    return true;
+}
+
+void Upstream::remove_idle(UpstreamConnection* connection)
+{
+    auto it = std::find(m_idle.begin(), m_idle.end(), connection);
+    if (it != m_idle.end())
+    {
+        m_idle.erase(it);
+    }
+}
+
+UpstreamGroup::UpstreamGroup(const std::string& prefix)
+    : m_prefix(prefix),
+      m_next(0)
+{
+
+}
+
+const std::string& UpstreamGroup::get_prefix() const
+{
+    return m_prefix;
+}
+
+void UpstreamGroup::add(std::unique_ptr<Upstream> upstream)
+{
+    m_upstreams.push_back(std::move(upstream));
+}
+
+Upstream* UpstreamGroup::select(uint64_t now_ms)
+{
+    Upstream* selected = nullptr;
+    std::size_t count = m_upstreams.size();
+    for (std::size_t i = 0; i < count; i++)
+    {
+        Upstream* upstream = m_upstreams[(m_next + i) % count].get();
+        if (!upstream->is_available(now_ms))
+        {
+            continue;
+        }
+        if (selected == nullptr || upstream->get_outstanding() < selected->get_outstanding())
+        {
+            selected = upstream;
+        }
+    }
+
+    m_next = (count > 0) ? (m_next + 1) % count : 0;
+    return selected;
+}
+
+UpstreamPool::UpstreamPool(EventLoop& loop)
+    : m_loop(loop)
+{
+
+}
+
+UpstreamPool::~UpstreamPool()
+{
+    // Connections unregister from the loop and close their sockets.
+    m_connections.clear();
+    m_closed.clear();
+    m_waiting_flights.clear();
+    m_flights.clear();
+    m_finished_flights.clear();
+}
+
+bool UpstreamPool::add_route(const std::string& prefix, const std::vector<std::string>& upstreams)
+{
+    if (prefix.empty() || prefix[0] != '/' || upstreams.empty())
+    {
+        return false;
+    }
+
+    std::unique_ptr<UpstreamGroup> group(new UpstreamGroup(prefix));
+    for (const std::string& name : upstreams)
+    {
+        sockaddr_in address;
+        if (!resolve(name, address))
+        {
+            LOGE("Cannot resolve upstream " + name);
+            return false;
+        }
+        group->add(std::unique_ptr<Upstream>(new Upstream(name, address)));
+    }
+
+    m_groups.push_back(std::move(group));
+    // Longest prefix first, so the first match is the most specific one.
+    std::stable_sort(m_groups.begin(), m_groups.end(),
+        [](const std::unique_ptr<UpstreamGroup>& a, const std::unique_ptr<UpstreamGroup>& b)
+        {
+            return a->get_prefix().length() > b->get_prefix().length();
+        });
+    return true;
+}
+
+UpstreamGroup* UpstreamPool::match(const std::string& path)
+{
+    for (auto& group : m_groups)
+    {
+        const std::string& prefix = group->get_prefix();
+        if (path.compare(0, prefix.length(), prefix) != 0)
+        {
+            continue;
+        }
+
+        // "/api" matches "/api", "/api/..." and "/api?...", not "/apis".
+        if (prefix.back() == '/' || path.length() == prefix.length() ||
+            path[prefix.length()] == '/' || path[prefix.length()] == '?')
+        {
+            return group.get();
+        }
+    }
+    return nullptr;
+}
+
+UpstreamSource* UpstreamPool::forward(UpstreamGroup& group, const HTTPRequest& request, bool client_keep_alive, UpstreamClient* client)
+{
+    // A burst of identical requests, e.g. right after a popular resource
+    // expired, costs the backend a single fetch.
+    std::string key = flight_key(request, client_keep_alive);
+    if (!key.empty())
+    {
+        auto it = m_waiting_flights.find(key);
+        if (it != m_waiting_flights.end())
+        {
+            return it->second->join(client, true);
+        }
+    }
+
+    Upstream* upstream = group.select(m_loop.now_ms());
+    if (upstream == nullptr)
+    {
+        LOGE("No upstream is available for " + group.get_prefix());
+        return nullptr;
+    }
+
+    UpstreamConnection* connection = upstream->take_idle();
+    if (connection != nullptr)
+    {
+        METRIC_INC(METRIC_UPSTREAM_CONNECTIONS_REUSED);
+    }
+    else
+    {
+        std::unique_ptr<UpstreamConnection> created(new UpstreamConnection(*this, m_loop, *upstream));
+        if (!created->open())
+        {
+            METRIC_INC(METRIC_UPSTREAM_FAILURES);
+            upstream->request_started();
+            upstream->request_finished(false, m_loop.now_ms());
+            return nullptr;
+        }
+        connection = created.get();
+        m_connections[connection] = std::move(created);
+    }
+
+    // An HTTP/1.0 client cannot take a body re-framed as chunks.
+    bool client_chunked = (request.m_version != "HTTP/1.0");
+    if (key.empty())
+    {
+        connection->start(build_request(request), request.m_method == "HEAD", client_keep_alive, client_chunked, client);
+        return connection;
+    }
+
+    std::unique_ptr<UpstreamFlight> flight(new UpstreamFlight(*this, key, connection));
+    connection->start(build_request(request), request.m_method == "HEAD", client_keep_alive, client_chunked, flight.get());
+    UpstreamSource* source = flight->join(client, false);
+    m_waiting_flights[key] = flight.get();
+    m_flights[flight.get()] = std::move(flight);
+    return source;
+}
+
+void UpstreamPool::destroy(UpstreamConnection* connection)
+{
+    auto it = m_connections.find(connection);
+    if (it == m_connections.end())
+    {
+        return;
+    }
+
+    connection->get_upstream().remove_idle(connection);
+    m_closed.push_back(std::move(it->second));
+    m_connections.erase(it);
+}
+
+void UpstreamPool::seal(UpstreamFlight* flight)
+{
+    auto it = m_waiting_flights.find(flight->get_key());
+    if (it != m_waiting_flights.end() && it->second == flight)
+    {
+        m_waiting_flights.erase(it);
+    }
+}
+
+void UpstreamPool::destroy(UpstreamFlight* flight)
+{
+    auto it = m_flights.find(flight);
+    if (it == m_flights.end())
+    {
+        return;
+    }
+
+    m_finished_flights.push_back(std::move(it->second));
+    m_flights.erase(it);
+}
+
+void UpstreamPool::reap()
+{
+    m_closed.clear();
+    m_finished_flights.clear();
+}
+
+std::string UpstreamPool::build_request(const HTTPRequest& request)
+{
+    std::string output = request.m_method + " " + request.m_path + " HTTP/1.1\r\n";
+    for (const auto& header : request.m_headers)
+    {
+        if (!is_hop_by_hop(header.first))
+        {
+            output += header.first + ": " + header.second + "\r\n";
+        }
+    }
+
+    if (!request.m_body.empty() || request.m_method == "POST" || request.m_method == "PUT")
+    {
+        output += "Content-Length: " + std::to_string(request.m_body.length()) + "\r\n";
+    }
+    output += "Connection: keep-alive\r\n\r\n";
+    output += request.m_body;
+    return output;
+}
+
+std::string UpstreamPool::flight_key(const HTTPRequest& request, bool client_keep_alive)
+{
+    if ((request.m_method != "GET" && request.m_method != "HEAD") || !request.m_body.empty())
+    {
+        return std::string();
+    }
+
+    for (const char* field : PRIVATE_HEADERS)
+    {
+        if (!request.get_header(field).empty())
+        {
+            return std::string();
+        }
+    }
+
+    // The response head carries the client's own Connection field, and its
+    // framing may depend on the client's HTTP version.
+    std::string key = request.m_method + " " + request.m_path + " " + request.m_version +
+                      (client_keep_alive ? " keep-alive" : " close");
+    for (const char* field : FLIGHT_KEY_HEADERS)
+    {
+        key += "\n" + request.get_header(field);
+    }
+    return key;
+}
@@ -0,0 +1,112 @@
+#ifndef UPSTREAM_POOL_H
+#define UPSTREAM_POOL_H
+
+#include "event_loop.h"
+#include "http_request.h"
+#include "upstream_connection.h"
+#include "upstream_flight.h"
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <netinet/in.h>
+
+// One backend server. Tracks the requests in flight on it and its recent
+// failures: after UPSTREAM_MAX_FAILURES consecutive failures it is ejected
+// for UPSTREAM_EJECTION_TIME_MS, then gets a single trial request before
+// it can be ejected again.
+class Upstream
+{
+public:
+    Upstream(const std::string& name, const sockaddr_in& address);
+
+    const std::string& get_name() const;
+    const sockaddr_in& get_address() const;
+    bool is_available(uint64_t now_ms) const;
+    std::size_t get_outstanding() const;
+
+    void request_started();
+    void request_finished(bool success, uint64_t now_ms);
+    // The client went away, which says nothing about the backend's health.
+    void request_abandoned();
+
+    UpstreamConnection* take_idle();
+    bool put_idle(UpstreamConnection* connection);
+    void remove_idle(UpstreamConnection* connection);
+
+private:
+    std::string m_name;
+    sockaddr_in m_address;
+    std::size_t m_outstanding;
+    int m_failures;
+    uint64_t m_ejected_until;
+    // Most recently used last, so reuse picks the warmest connection.
+    std::vector<UpstreamConnection*> m_idle;
+};
+
+// The upstreams behind one proxy route.
+class UpstreamGroup
+{
+public:
+    explicit UpstreamGroup(const std::string& prefix);
+
+    const std::string& get_prefix() const;
+    void add(std::unique_ptr<Upstream> upstream);
+    // Least outstanding requests among the upstreams that are not ejected,
+    // ties broken round-robin. Returns nullptr when all are ejected.
+    Upstream* select(uint64_t now_ms);
+
+private:
+    std::string m_prefix;
+    std::vector<std::unique_ptr<Upstream>> m_upstreams;
+    std::size_t m_next;
+};
+
+// Proxy routes and the persistent connections to their upstreams. There
+// is one pool per event loop, so connections are never shared between
+// threads. Connections are only freed by reap(), after the loop iteration
+// that closed them.
+class UpstreamPool
+{
+public:
+    explicit UpstreamPool(EventLoop& loop);
+    ~UpstreamPool();
+
+    // upstreams are "host:port" strings, resolved once here.
+    bool add_route(const std::string& prefix, const std::vector<std::string>& upstreams);
+    // The route with the longest prefix matching path, or nullptr.
+    UpstreamGroup* match(const std::string& path);
+
+    // Sends request to an upstream of group, or joins an identical request
+    // already waiting for its response; the response is delivered to
+    // client. Returns nullptr, without calling client, when no upstream is
+    // available.
+    UpstreamSource* forward(UpstreamGroup& group, const HTTPRequest& request, bool client_keep_alive, UpstreamClient* client);
+
+    // Called by a connection that is closed for good.
+    void destroy(UpstreamConnection* connection);
+    // Called by a flight that no longer takes new requests.
+    void seal(UpstreamFlight* flight);
+    // Called by a flight that has nobody left to deliver to.
+    void destroy(UpstreamFlight* flight);
+    void reap();
+
+private:
+    static std::string build_request(const HTTPRequest& request);
+    // Empty when the request must not share another one's response.
+    static std::string flight_key(const HTTPRequest& request, bool client_keep_alive);
+
+private:
+    EventLoop& m_loop;
+    std::vector<std::unique_ptr<UpstreamGroup>> m_groups;
+    std::unordered_map<UpstreamConnection*, std::unique_ptr<UpstreamConnection>> m_connections;
+    std::vector<std::unique_ptr<UpstreamConnection>> m_closed;
+    std::unordered_map<UpstreamFlight*, std::unique_ptr<UpstreamFlight>> m_flights;
+    std::vector<std::unique_ptr<UpstreamFlight>> m_finished_flights;
+    // Flights still waiting for their response, by request key.
+    std::unordered_map<std::string, UpstreamFlight*> m_waiting_flights;
+};
+
+#endif // UPSTREAM_POOL_H
@@ -2,6 +2,8 @@
 #include "logging.h"
 #include <cstring>
 #include <fcntl.h>
+#include <sys/resource.h>
+#include <time.h>
 
 void print_sockaddr_info(sockaddr* sa)
 {
@@ -52,4 +54,40 @@ void set_socket_nonblocking(int sock)
     {
         LOGE("fcntl(F_SETFL, O_NONBLOCK) failed");
     }
-}
\ No newline at end of file
+}
+
+uint64_t monotonic_ms()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000 + ts.tv_nsec / 1000000;
+}
+
+uint64_t monotonic_us()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+std::size_t raise_fd_limit(std::size_t count)
+{
+    rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) != 0)
+    {
+        LOGE("getrlimit(RLIMIT_NOFILE) failed");
+        return 0;
+    }
+    if (limit.rlim_cur != RLIM_INFINITY && limit.rlim_cur < count)
+    {
+        rlim_t wanted = (limit.rlim_max == RLIM_INFINITY || limit.rlim_max > count) ? count : limit.rlim_max;
+        rlim_t current = limit.rlim_cur;
+        limit.rlim_cur = wanted;
+        if (setrlimit(RLIMIT_NOFILE, &limit) != 0)
+        {
+            LOGE("setrlimit(RLIMIT_NOFILE) failed");
+            limit.rlim_cur = current;
+        }
+    }
+    return limit.rlim_cur;
+}
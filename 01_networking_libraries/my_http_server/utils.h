@@ -5,8 +5,15 @@
 #include <netinet/in.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <cstddef>
+#include <cstdint>
 
 void print_sockaddr_info(sockaddr *sa);
 void set_socket_nonblocking(int sock);
+uint64_t monotonic_ms();
+uint64_t monotonic_us();
+// Raises the soft limit on open descriptors to at least count, as far as
+// the hard limit allows, and returns the limit in effect.
+std::size_t raise_fd_limit(std::size_t count);
 
 #endif // UTILS_H
\ No newline at end of file
@@ -0,0 +1,57 @@
+#ifndef WEBSOCKET_HANDLER_H
+#define WEBSOCKET_HANDLER_H
+
+#include "http_request.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+
+class WebSocketSession;
+
+// The application's side of one WebSocket connection. Every call is made
+// from the connection's event loop. The session owns the handler; the
+// handler may keep a pointer to the session until on_close().
+class WebSocketHandler
+{
+public:
+    virtual ~WebSocketHandler() = default;
+
+    // The 101 response is queued; messages may be sent right away.
+    virtual void on_open(WebSocketSession& session)
+    {
+        (void)session;
+    }
+
+    // A whole message, reassembled from its fragments and inflated. Text
+    // messages are valid UTF-8. data is only valid during the call.
+    virtual void on_message(WebSocketSession& session, const char* data, std::size_t length, bool binary) = 0;
+
+    // The client has caught up after send() returned false.
+    virtual void on_writable(WebSocketSession& session)
+    {
+        (void)session;
+    }
+
+    // The session is over, with the code from the close frame, or 1006 if
+    // the connection went away without one. Nothing more can be sent.
+    virtual void on_close(WebSocketSession& session, uint16_t code)
+    {
+        (void)session;
+        (void)code;
+    }
+};
+
+// Creates the handler for a request asking to upgrade on a WebSocket
+// route, or returns null to answer the request as any other.
+using WebSocketFactory = std::function<std::unique_ptr<WebSocketHandler>(const HTTPRequest& request)>;
+
+struct WebSocketRoute
+{
+    std::string prefix;
+    WebSocketFactory factory;
+};
+
+#endif // WEBSOCKET_HANDLER_H
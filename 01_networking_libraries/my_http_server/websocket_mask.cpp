@@ -0,0 +1,156 @@
+#include "websocket_mask.h"
+
+#include <cstring>
+
+#if defined(__x86_64__)
+    #include <immintrin.h>
+    #define WEBSOCKET_MASK_X86 1
+#endif
+
+namespace
+{
+    using MaskFunction = void (*)(uint8_t* data, std::size_t length, const uint8_t key[4]);
+
+    // The key repeated over a 64-bit word, in memory order.
+    uint64_t key_word(const uint8_t key[4])
+    {
+        uint32_t key32;
+        std::memcpy(&key32, key, sizeof(key32));
+        return (static_cast<uint64_t>(key32) << 32) | key32;
+    }
+
+    // From offset on; offset is a multiple of 4, so the key starts over.
+    void mask_tail(uint8_t* data, std::size_t offset, std::size_t length, const uint8_t key[4])
+    {
+        uint64_t key64 = key_word(key);
+        for (; offset + 8 <= length; offset += 8)
+        {
+            uint64_t word;
+            std::memcpy(&word, data + offset, sizeof(word));
+            word ^= key64;
+            std::memcpy(data + offset, &word, sizeof(word));
+        }
+        for (; offset < length; offset++)
+        {
+            data[offset] ^= key[offset & 3];
+        }
+    }
+
+#ifdef WEBSOCKET_MASK_X86
+    // SSE2 is part of x86-64, so this one needs no check.
+    void mask_sse2(uint8_t* data, std::size_t length, const uint8_t key[4])
+    {
+        int32_t key32;
+        std::memcpy(&key32, key, sizeof(key32));
+        const __m128i key128 = _mm_set1_epi32(key32);
+        std::size_t offset = 0;
+        for (; offset + 64 <= length; offset += 64)
+        {
+            __m128i* block = reinterpret_cast<__m128i*>(data + offset);
+            __m128i a = _mm_loadu_si128(block);
+            __m128i b = _mm_loadu_si128(block + 1);
+            __m128i c = _mm_loadu_si128(block + 2);
+            __m128i d = _mm_loadu_si128(block + 3);
+            _mm_storeu_si128(block, _mm_xor_si128(a, key128));
+            _mm_storeu_si128(block + 1, _mm_xor_si128(b, key128));
+            _mm_storeu_si128(block + 2, _mm_xor_si128(c, key128));
+            _mm_storeu_si128(block + 3, _mm_xor_si128(d, key128));
+        }
+        for (; offset + 16 <= length; offset += 16)
+        {
+            __m128i* block = reinterpret_cast<__m128i*>(data + offset);
+            _mm_storeu_si128(block, _mm_xor_si128(_mm_loadu_si128(block), key128));
+        }
+        mask_tail(data, offset, length, key);
+    }
+
+    __attribute__((target("avx2")))
+    void mask_avx2(uint8_t* data, std::size_t length, const uint8_t key[4])
+    {
+        int32_t key32;
+        std::memcpy(&key32, key, sizeof(key32));
+        const __m256i key256 = _mm256_set1_epi32(key32);
+        std::size_t offset = 0;
+        for (; offset + 128 <= length; offset += 128)
+        {
+            __m256i* block = reinterpret_cast<__m256i*>(data + offset);
+            __m256i a = _mm256_loadu_si256(block);
+            __m256i b = _mm256_loadu_si256(block + 1);
+            __m256i c = _mm256_loadu_si256(block + 2);
+            __m256i d = _mm256_loadu_si256(block + 3);
+            _mm256_storeu_si256(block, _mm256_xor_si256(a, key256));
+            _mm256_storeu_si256(block + 1, _mm256_xor_si256(b, key256));
+            _mm256_storeu_si256(block + 2, _mm256_xor_si256(c, key256));
+            _mm256_storeu_si256(block + 3, _mm256_xor_si256(d, key256));
+        }
+        for (; offset + 32 <= length; offset += 32)
+        {
+            __m256i* block = reinterpret_cast<__m256i*>(data + offset);
+            _mm256_storeu_si256(block, _mm256_xor_si256(_mm256_loadu_si256(block), key256));
+        }
+        mask_tail(data, offset, length, key);
+    }
+
+    bool has_avx2()
+    {
+        static const bool supported = __builtin_cpu_supports("avx2");
+        return supported;
+    }
+#endif
+
+    MaskFunction select_mask()
+    {
+#ifdef WEBSOCKET_MASK_X86
+        return has_avx2() ? mask_avx2 : mask_sse2;
+#else
+        return websocket_mask_scalar;
+#endif
+    }
+}
+
+void websocket_mask(uint8_t* data, std::size_t length, const uint8_t key[4])
+{
+    // Small control frames and chat-sized messages are not worth the call
+    // through the pointer.
+    if (length < 32)
+    {
+        mask_tail(data, 0, length, key);
+        return;
+    }
+
+    static const MaskFunction mask = select_mask();
+    mask(data, length, key);
+}
+
+void websocket_mask_scalar(uint8_t* data, std::size_t length, const uint8_t key[4])
+{
+    mask_tail(data, 0, length, key);
+}
+
+bool websocket_mask_sse2(uint8_t* data, std::size_t length, const uint8_t key[4])
+{
+#ifdef WEBSOCKET_MASK_X86
+    mask_sse2(data, length, key);
+    return true;
+#else
+    (void)data;
+    (void)length;
+    (void)key;
+    return false;
+#endif
+}
+
+bool websocket_mask_avx2(uint8_t* data, std::size_t length, const uint8_t key[4])
+{
+#ifdef WEBSOCKET_MASK_X86
+    if (has_avx2())
+    {
+        mask_avx2(data, length, key);
+        return true;
+    }
+#endif
+    (void)data;
+    (void)length;
+    (void)key;
+    return false;
+}
@@ -0,0 +1,20 @@
+#ifndef WEBSOCKET_MASK_H
+#define WEBSOCKET_MASK_H
+
+#include <cstddef>
+#include <cstdint>
+
+// XORs data with a WebSocket masking key (RFC 6455, section 5.3), which
+// masks and unmasks alike. Byte i of the payload is XORed with byte i % 4
+// of the key, so data must start at the beginning of a frame's payload.
+// Picks the widest implementation the CPU supports the first time it is
+// called: AVX2, SSE2, or 8 bytes at a time.
+void websocket_mask(uint8_t* data, std::size_t length, const uint8_t key[4]);
+
+// The implementations websocket_mask() chooses from, for benchmarks. The
+// SIMD ones return false, leaving data alone, where the CPU lacks them.
+void websocket_mask_scalar(uint8_t* data, std::size_t length, const uint8_t key[4]);
+bool websocket_mask_sse2(uint8_t* data, std::size_t length, const uint8_t key[4]);
+bool websocket_mask_avx2(uint8_t* data, std::size_t length, const uint8_t key[4]);
+
+#endif // WEBSOCKET_MASK_H
@@ -0,0 +1,631 @@
+#include "websocket_session.h"
+#include "websocket_mask.h"
+#include "logging.h"
+#include "metrics.h"
+#include "defs.h"
+
+#include <algorithm>
+#include <cstring>
+#include <strings.h>
+#include <openssl/evp.h>
+#include <openssl/sha.h>
+
+namespace
+{
+    enum Opcode
+    {
+        OPCODE_CONTINUATION = 0x0,
+        OPCODE_TEXT = 0x1,
+        OPCODE_BINARY = 0x2,
+        OPCODE_CLOSE = 0x8,
+        OPCODE_PING = 0x9,
+        OPCODE_PONG = 0xa
+    };
+
+    enum FrameBits
+    {
+        FRAME_FIN = 0x80,
+        FRAME_RSV1 = 0x40,
+        FRAME_RSV2 = 0x20,
+        FRAME_RSV3 = 0x10,
+        FRAME_OPCODE = 0x0f,
+        FRAME_MASKED = 0x80,
+        FRAME_LENGTH = 0x7f
+    };
+
+    const char WEBSOCKET_GUID[] = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+    const std::size_t CONTROL_PAYLOAD_MAX = 125;
+
+    // Whether a comma-separated header value has token in it.
+    bool has_token(const std::string& value, const char* token)
+    {
+        std::size_t begin = 0;
+        while (begin < value.length())
+        {
+            std::size_t end = value.find(',', begin);
+            if (end == std::string::npos)
+            {
+                end = value.length();
+            }
+            std::size_t first = value.find_first_not_of(" \t", begin);
+            std::size_t last = value.find_last_not_of(" \t", end - 1);
+            if (first < end && last != std::string::npos && last >= first &&
+                last - first + 1 == std::strlen(token) && strncasecmp(value.c_str() + first, token, last - first + 1) == 0)
+            {
+                return true;
+            }
+            begin = end + 1;
+        }
+        return false;
+    }
+
+    // A Sec-WebSocket-Key is 16 bytes in base64.
+    bool is_valid_key(const std::string& key)
+    {
+        unsigned char decoded[24];
+        return key.length() == 24 && key[22] == '=' && key[23] == '=' &&
+               EVP_DecodeBlock(decoded, reinterpret_cast<const unsigned char*>(key.data()), key.length()) == 18;
+    }
+
+    std::string accept_key(const std::string& key)
+    {
+        std::string input = key + WEBSOCKET_GUID;
+        unsigned char digest[SHA_DIGEST_LENGTH];
+        SHA1(reinterpret_cast<const unsigned char*>(input.data()), input.length(), digest);
+        unsigned char encoded[4 * ((SHA_DIGEST_LENGTH + 2) / 3) + 1];
+        int length = EVP_EncodeBlock(encoded, digest, SHA_DIGEST_LENGTH);
+        return std::string(reinterpret_cast<const char*>(encoded), length);
+    }
+
+    // Well-formed UTF-8 without overlong forms, surrogates or code points
+    // past U+10FFFF (RFC 3629). Runs of ASCII are skipped 8 bytes at a time.
+    bool is_valid_utf8(const char* text, std::size_t length)
+    {
+        const uint8_t* data = reinterpret_cast<const uint8_t*>(text);
+        std::size_t i = 0;
+        while (i < length)
+        {
+            if (i + 8 <= length)
+            {
+                uint64_t word;
+                std::memcpy(&word, data + i, sizeof(word));
+                if ((word & 0x8080808080808080ULL) == 0)
+                {
+                    i += 8;
+                    continue;
+                }
+            }
+
+            uint8_t byte = data[i];
+            if (byte < 0x80)
+            {
+                i++;
+                continue;
+            }
+
+            std::size_t continuation = 0;
+            uint8_t min_second = 0x80;
+            uint8_t max_second = 0xbf;
+            if (byte >= 0xc2 && byte <= 0xdf)
+            {
+                continuation = 1;
+            }
+            else if (byte >= 0xe0 && byte <= 0xef)
+            {
+                continuation = 2;
+                min_second = (byte == 0xe0) ? 0xa0 : 0x80;
+                max_second = (byte == 0xed) ? 0x9f : 0xbf;
+            }
+            else if (byte >= 0xf0 && byte <= 0xf4)
+            {
+                continuation = 3;
+                min_second = (byte == 0xf0) ? 0x90 : 0x80;
+                max_second = (byte == 0xf4) ? 0x8f : 0xbf;
+            }
+            else
+            {
+                return false;
+            }
+
+            if (i + continuation >= length)
+            {
+                return false;
+            }
+            if (data[i + 1] < min_second || data[i + 1] > max_second)
+            {
+                return false;
+            }
+            for (std::size_t j = 2; j <= continuation; j++)
+            {
+                if ((data[i + j] & 0xc0) != 0x80)
+                {
+                    return false;
+                }
+            }
+            i += continuation + 1;
+        }
+        return true;
+    }
+
+    // Close codes a peer may send (RFC 6455, section 7.4)
+    bool is_valid_close_code(uint16_t code)
+    {
+        return (code >= 1000 && code <= 1003) || (code >= 1007 && code <= 1011) || (code >= 3000 && code <= 4999);
+    }
+
+    void append_frame_header(std::string& frame, uint8_t first_byte, std::size_t length)
+    {
+        frame.push_back(static_cast<char>(first_byte));
+        if (length <= 125)
+        {
+            frame.push_back(static_cast<char>(length));
+        }
+        else if (length <= 0xffff)
+        {
+            frame.push_back(126);
+            frame.push_back(static_cast<char>(length >> 8));
+            frame.push_back(static_cast<char>(length));
+        }
+        else
+        {
+            frame.push_back(127);
+            for (int shift = 56; shift >= 0; shift -= 8)
+            {
+                frame.push_back(static_cast<char>(static_cast<uint64_t>(length) >> shift));
+            }
+        }
+    }
+}
+
+WebSocketSession::WebSocketSession(EventLoop& loop, OutputQueue& output, WebSocketOwner* owner)
+    : m_loop(loop),
+      m_output(output),
+      m_owner(owner),
+      m_timer(this),
+      m_message_opcode(0),
+      m_message_compressed(false),
+      m_dispatching(false),
+      m_blocked(false),
+      m_ping_outstanding(false),
+      m_close_sent(false),
+      m_close_received(false),
+      m_failed(false),
+      m_closed_notified(false)
+{
+
+}
+
+WebSocketSession::~WebSocketSession()
+{
+    m_loop.timers().cancel(&m_timer);
+    notify_closed(WEBSOCKET_CLOSE_ABNORMAL);
+}
+
+bool WebSocketSession::is_upgrade(const HTTPRequest& request)
+{
+    return has_token(request.get_header("Upgrade"), "websocket");
+}
+
+bool WebSocketSession::start(const HTTPRequest& request, std::unique_ptr<WebSocketHandler> handler, bool allow_deflate)
+{
+    std::string key = request.get_header("Sec-WebSocket-Key");
+    if (request.m_method != "GET" || request.m_version != "HTTP/1.1" || !has_token(request.get_header("Connection"), "upgrade") ||
+        request.get_header("Sec-WebSocket-Version") != "13" || !is_valid_key(key))
+    {
+        LOGE("Invalid WebSocket handshake");
+        return false;
+    }
+
+    std::string response = "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n";
+    response += "Sec-WebSocket-Accept: " + accept_key(key) + "\r\n";
+    if (allow_deflate)
+    {
+        std::string extension;
+        std::unique_ptr<PerMessageDeflate> deflate(new PerMessageDeflate());
+        if (deflate->negotiate(request.get_header("Sec-WebSocket-Extensions"), extension))
+        {
+            response += "Sec-WebSocket-Extensions: " + extension + "\r\n";
+            m_deflate = std::move(deflate);
+        }
+    }
+    response += "\r\n";
+    m_output.append(std::move(response));
+    METRIC_INC(METRIC_WEBSOCKET_CONNECTIONS);
+
+    // Whatever the handler sends now follows the 101 in the same flush.
+    m_handler = std::move(handler);
+    m_dispatching = true;
+    m_handler->on_open(*this);
+    m_dispatching = false;
+    return true;
+}
+
+bool WebSocketSession::process_input(std::string& input)
+{
+    // Frames are handled where they are and erased all at once at the end,
+    // so a burst of small ones does not shift the buffer for each.
+    std::size_t offset = 0;
+    m_dispatching = true;
+    while (!m_close_received && !m_failed)
+    {
+        std::size_t available = input.length() - offset;
+        if (available < 2)
+        {
+            break;
+        }
+
+        uint8_t* frame = reinterpret_cast<uint8_t*>(&input[offset]);
+        bool fin = (frame[0] & FRAME_FIN) != 0;
+        uint8_t flags = frame[0] & (FRAME_RSV1 | FRAME_RSV2 | FRAME_RSV3);
+        uint8_t opcode = frame[0] & FRAME_OPCODE;
+        uint64_t length = frame[1] & FRAME_LENGTH;
+        std::size_t header_length = 2;
+        if (length == 126)
+        {
+            header_length = 4;
+        }
+        else if (length == 127)
+        {
+            header_length = 10;
+        }
+        if (available < header_length)
+        {
+            break;
+        }
+        if (header_length > 2)
+        {
+            length = 0;
+            for (std::size_t i = 2; i < header_length; i++)
+            {
+                length = (length << 8) | frame[i];
+            }
+        }
+
+        // Client frames are always masked.
+        if ((frame[1] & FRAME_MASKED) == 0)
+        {
+            LOGE("Unmasked WebSocket frame from the client");
+            fail(WEBSOCKET_CLOSE_PROTOCOL_ERROR);
+            break;
+        }
+        header_length += 4;
+
+        // Checked before the payload arrives, so an oversized frame is
+        // refused without waiting for it.
+        if (!check_frame(fin, flags, opcode, length))
+        {
+            break;
+        }
+        if (available < header_length + length)
+        {
+            break;
+        }
+
+        char* payload = reinterpret_cast<char*>(frame + header_length);
+        websocket_mask(reinterpret_cast<uint8_t*>(payload), length, frame + header_length - 4);
+        offset += header_length + length;
+        if (!handle_frame(fin, flags, opcode, payload, length))
+        {
+            break;
+        }
+    }
+    input.erase(0, offset);
+    m_dispatching = false;
+    return !is_finished();
+}
+
+bool WebSocketSession::send(const char* data, std::size_t length, bool binary)
+{
+    if (m_close_sent || m_owner == nullptr)
+    {
+        return false;
+    }
+
+    uint8_t opcode = binary ? OPCODE_BINARY : OPCODE_TEXT;
+    std::string compressed;
+    if (m_deflate != nullptr && length >= WEBSOCKET_DEFLATE_MIN_SIZE && m_deflate->compress(data, length, compressed) &&
+        compressed.length() < length)
+    {
+        write_frame(opcode, true, compressed.data(), compressed.length());
+    }
+    else
+    {
+        write_frame(opcode, false, data, length);
+    }
+    METRIC_INC(METRIC_WEBSOCKET_MESSAGES_OUT);
+    schedule_flush();
+
+    if (m_output.pending_bytes() >= OUTPUT_HIGH_WATERMARK)
+    {
+        m_blocked = true;
+        return false;
+    }
+    return true;
+}
+
+bool WebSocketSession::send(const std::string& message, bool binary)
+{
+    return send(message.data(), message.length(), binary);
+}
+
+void WebSocketSession::close(uint16_t code, const std::string& reason)
+{
+    if (m_close_sent || m_owner == nullptr)
+    {
+        return;
+    }
+    write_close(code, reason.data(), std::min<std::size_t>(reason.length(), CONTROL_PAYLOAD_MAX - 2));
+    schedule_flush();
+}
+
+bool WebSocketSession::ping()
+{
+    if (m_close_sent || m_ping_outstanding || m_owner == nullptr)
+    {
+        return false;
+    }
+    write_frame(OPCODE_PING, false, nullptr, 0);
+    m_ping_outstanding = true;
+    return true;
+}
+
+void WebSocketSession::output_drained()
+{
+    if (m_blocked && !m_timer.is_armed())
+    {
+        m_loop.timers().schedule(&m_timer, 0);
+    }
+}
+
+void WebSocketSession::detach()
+{
+    m_owner = nullptr;
+    m_loop.timers().cancel(&m_timer);
+    notify_closed(WEBSOCKET_CLOSE_ABNORMAL);
+}
+
+bool WebSocketSession::is_closing() const
+{
+    return m_close_sent;
+}
+
+bool WebSocketSession::is_finished() const
+{
+    return m_failed || (m_close_sent && m_close_received);
+}
+
+EventLoop& WebSocketSession::get_loop() const
+{
+    return m_loop;
+}
+
+void WebSocketSession::handle_timeout(TimerNode* timer)
+{
+    (void)timer;
+    if (m_owner == nullptr)
+    {
+        return;
+    }
+
+    // What the handler sends from on_writable() goes out with the rest.
+    m_dispatching = true;
+    if (m_blocked && m_output.pending_bytes() <= OUTPUT_LOW_WATERMARK && !m_close_sent)
+    {
+        m_blocked = false;
+        m_handler->on_writable(*this);
+    }
+    m_dispatching = false;
+    m_owner->websocket_output();
+}
+
+bool WebSocketSession::check_frame(bool fin, uint8_t flags, uint8_t opcode, uint64_t length)
+{
+    // RSV1 marks the first frame of a compressed message; nothing else may
+    // be set without an extension that defines it.
+    bool compressed = (flags & FRAME_RSV1) != 0;
+    if ((flags & (FRAME_RSV2 | FRAME_RSV3)) != 0 || (compressed && (m_deflate == nullptr || opcode == OPCODE_CONTINUATION || opcode >= OPCODE_CLOSE)))
+    {
+        LOGE("WebSocket frame with reserved bits set");
+        return fail(WEBSOCKET_CLOSE_PROTOCOL_ERROR);
+    }
+
+    switch (opcode)
+    {
+        case OPCODE_CLOSE:
+        case OPCODE_PING:
+        case OPCODE_PONG:
+            if (!fin || length > CONTROL_PAYLOAD_MAX)
+            {
+                LOGE("Invalid WebSocket control frame");
+                return fail(WEBSOCKET_CLOSE_PROTOCOL_ERROR);
+            }
+            return true;
+        case OPCODE_CONTINUATION:
+            if (m_message_opcode == 0)
+            {
+                LOGE("WebSocket continuation frame without a message");
+                return fail(WEBSOCKET_CLOSE_PROTOCOL_ERROR);
+            }
+            break;
+        case OPCODE_TEXT:
+        case OPCODE_BINARY:
+            if (m_message_opcode != 0)
+            {
+                LOGE("WebSocket message started inside another");
+                return fail(WEBSOCKET_CLOSE_PROTOCOL_ERROR);
+            }
+            break;
+        default:
+            LOGE("Unknown WebSocket opcode");
+            return fail(WEBSOCKET_CLOSE_PROTOCOL_ERROR);
+    }
+
+    if (length > WEBSOCKET_MAX_MESSAGE_SIZE - m_message.length())
+    {
+        LOGE("WebSocket message is too large");
+        return fail(WEBSOCKET_CLOSE_TOO_BIG);
+    }
+    return true;
+}
+
+bool WebSocketSession::handle_frame(bool fin, uint8_t flags, uint8_t opcode, char* payload, std::size_t length)
+{
+    if (opcode >= OPCODE_CLOSE)
+    {
+        return handle_control(opcode, payload, length);
+    }
+
+    if (opcode != OPCODE_CONTINUATION)
+    {
+        m_message_opcode = opcode;
+        m_message_compressed = (flags & FRAME_RSV1) != 0;
+        // A whole message in one frame is delivered from the input buffer.
+        if (fin && !m_message_compressed)
+        {
+            m_message_opcode = 0;
+            return deliver(payload, length, opcode == OPCODE_BINARY);
+        }
+    }
+
+    m_message.append(payload, length);
+    if (!fin)
+    {
+        return true;
+    }
+
+    bool binary = (m_message_opcode == OPCODE_BINARY);
+    m_message_opcode = 0;
+    if (m_message_compressed && !m_deflate->decompress(m_message, WEBSOCKET_MAX_MESSAGE_SIZE))
+    {
+        LOGE("WebSocket message cannot be inflated");
+        return fail(WEBSOCKET_CLOSE_TOO_BIG);
+    }
+    bool delivered = deliver(m_message.data(), m_message.length(), binary);
+
+    // A large message does not keep its buffer for the next ones.
+    m_message.clear();
+    if (m_message.capacity() > MAX_HEADER_SIZE)
+    {
+        std::string().swap(m_message);
+    }
+    return delivered;
+}
+
+bool WebSocketSession::handle_control(uint8_t opcode, const char* payload, std::size_t length)
+{
+    if (opcode == OPCODE_PING)
+    {
+        if (!m_close_sent)
+        {
+            write_frame(OPCODE_PONG, false, payload, length);
+        }
+        return true;
+    }
+    if (opcode == OPCODE_PONG)
+    {
+        m_ping_outstanding = false;
+        return true;
+    }
+
+    // Close: answered with the same code, unless we have sent ours.
+    uint16_t code = WEBSOCKET_CLOSE_NO_STATUS;
+    if (length == 1)
+    {
+        return fail(WEBSOCKET_CLOSE_PROTOCOL_ERROR);
+    }
+    if (length >= 2)
+    {
+        code = (static_cast<uint8_t>(payload[0]) << 8) | static_cast<uint8_t>(payload[1]);
+        if (!is_valid_close_code(code))
+        {
+            return fail(WEBSOCKET_CLOSE_PROTOCOL_ERROR);
+        }
+        if (!is_valid_utf8(payload + 2, length - 2))
+        {
+            return fail(WEBSOCKET_CLOSE_INVALID_DATA);
+        }
+    }
+
+    m_close_received = true;
+    if (!m_close_sent)
+    {
+        write_close(code, nullptr, 0);
+    }
+    notify_closed(code);
+    return false;
+}
+
+bool WebSocketSession::deliver(const char* data, std::size_t length, bool binary)
+{
+    if (!binary && !is_valid_utf8(data, length))
+    {
+        LOGE("WebSocket text message is not valid UTF-8");
+        return fail(WEBSOCKET_CLOSE_INVALID_DATA);
+    }
+
+    METRIC_INC(METRIC_WEBSOCKET_MESSAGES_IN);
+    // Data that arrives after our close frame is dropped.
+    if (!m_close_sent)
+    {
+        m_handler->on_message(*this, data, length, binary);
+    }
+    return true;
+}
+
+bool WebSocketSession::fail(uint16_t code)
+{
+    METRIC_INC(METRIC_WEBSOCKET_PROTOCOL_ERRORS);
+    if (!m_close_sent)
+    {
+        write_close(code, nullptr, 0);
+    }
+    m_failed = true;
+    notify_closed(code);
+    return false;
+}
+
+void WebSocketSession::write_frame(uint8_t opcode, bool compressed, const char* payload, std::size_t length)
+{
+    // Server frames are not masked.
+    std::string frame;
+    frame.reserve(10 + length);
+    append_frame_header(frame, FRAME_FIN | (compressed ? FRAME_RSV1 : 0) | opcode, length);
+    if (length > 0)
+    {
+        frame.append(payload, length);
+    }
+    m_output.append(std::move(frame));
+}
+
+void WebSocketSession::write_close(uint16_t code, const char* reason, std::size_t length)
+{
+    // 1005 means there was no code, and is never sent.
+    std::string payload;
+    if (code != WEBSOCKET_CLOSE_NO_STATUS)
+    {
+        payload.push_back(static_cast<char>(code >> 8));
+        payload.push_back(static_cast<char>(code));
+        payload.append(reason, length);
+    }
+    write_frame(OPCODE_CLOSE, false, payload.data(), payload.length());
+    m_close_sent = true;
+}
+
+void WebSocketSession::notify_closed(uint16_t code)
+{
+    if (m_closed_notified || m_handler == nullptr)
+    {
+        return;
+    }
+    m_closed_notified = true;
+    m_handler->on_close(*this, code);
+}
+
+void WebSocketSession::schedule_flush()
+{
+    // From inside process_input() the connection flushes afterwards.
+    if (!m_dispatching && !m_timer.is_armed())
+    {
+        m_loop.timers().schedule(&m_timer, 0);
+    }
+}
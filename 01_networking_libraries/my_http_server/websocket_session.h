@@ -0,0 +1,129 @@
+#ifndef WEBSOCKET_SESSION_H
+#define WEBSOCKET_SESSION_H
+
+#include "event_loop.h"
+#include "http_request.h"
+#include "output_queue.h"
+#include "permessage_deflate.h"
+#include "timer_wheel.h"
+#include "websocket_handler.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+// Status codes of close frames (RFC 6455, section 7.4.1)
+enum WebSocketCloseCode
+{
+    WEBSOCKET_CLOSE_NORMAL = 1000,
+    WEBSOCKET_CLOSE_GOING_AWAY = 1001,
+    WEBSOCKET_CLOSE_PROTOCOL_ERROR = 1002,
+    WEBSOCKET_CLOSE_NO_STATUS = 1005,
+    WEBSOCKET_CLOSE_ABNORMAL = 1006,
+    WEBSOCKET_CLOSE_INVALID_DATA = 1007,
+    WEBSOCKET_CLOSE_TOO_BIG = 1009,
+    WEBSOCKET_CLOSE_INTERNAL_ERROR = 1011
+};
+
+// The connection a session writes to.
+class WebSocketOwner
+{
+public:
+    virtual ~WebSocketOwner() = default;
+    // Frames were queued from outside process_input(): flush them.
+    virtual void websocket_output() = 0;
+};
+
+// Server side of one WebSocket connection (RFC 6455), owned by the
+// HTTPConnectionHandler that upgraded it. Frames are parsed out of the
+// connection's input buffer, where they are unmasked in place; a message
+// that came in one uncompressed frame is handed to the handler right
+// there, without a copy, and only fragmented or compressed ones are
+// gathered. Pings are answered, fragments reassembled, and the close
+// handshake completed; a peer that breaks the protocol gets a close frame
+// with the reason and the connection is closed. Frames the handler sends
+// outside of process_input() are flushed on the next loop iteration, so a
+// burst of them goes out in one write.
+class WebSocketSession : public TimerHandler
+{
+public:
+    WebSocketSession(EventLoop& loop, OutputQueue& output, WebSocketOwner* owner);
+    ~WebSocketSession();
+
+    WebSocketSession(const WebSocketSession&) = delete;
+    WebSocketSession& operator=(const WebSocketSession&) = delete;
+
+    // The request asks to upgrade to WebSocket, validly or not.
+    static bool is_upgrade(const HTTPRequest& request);
+
+    // Checks the opening handshake and queues the 101 response, accepting
+    // permessage-deflate if allow_deflate and the client offers it, then
+    // opens the handler. Returns false, having queued nothing, if the
+    // handshake is invalid.
+    bool start(const HTTPRequest& request, std::unique_ptr<WebSocketHandler> handler, bool allow_deflate);
+
+    // Consumes every complete frame in input. Returns false when the
+    // connection must be closed once the output queue is flushed.
+    bool process_input(std::string& input);
+
+    // Queues a message. Returns false if it was not sent because the
+    // session is closing, or when the handler should wait for
+    // on_writable() before sending more.
+    bool send(const char* data, std::size_t length, bool binary);
+    bool send(const std::string& message, bool binary = false);
+    // Starts the close handshake; the connection is closed once the client
+    // answers, or after WEBSOCKET_CLOSE_TIMEOUT_MS.
+    void close(uint16_t code, const std::string& reason = std::string());
+    // Pings a quiet client. Returns false if the last ping has not been
+    // answered, or the session is closing.
+    bool ping();
+
+    // The connection's output queue has drained below the low watermark.
+    void output_drained();
+    // The connection is gone.
+    void detach();
+
+    bool is_closing() const;
+    bool is_finished() const;
+    // For handlers that schedule their own timers or watch their own fds.
+    EventLoop& get_loop() const;
+
+    void handle_timeout(TimerNode* timer) override;
+
+private:
+    bool check_frame(bool fin, uint8_t flags, uint8_t opcode, uint64_t length);
+    bool handle_frame(bool fin, uint8_t flags, uint8_t opcode, char* payload, std::size_t length);
+    bool handle_control(uint8_t opcode, const char* payload, std::size_t length);
+    bool deliver(const char* data, std::size_t length, bool binary);
+    bool fail(uint16_t code);
+    void write_frame(uint8_t opcode, bool compressed, const char* payload, std::size_t length);
+    void write_close(uint16_t code, const char* reason, std::size_t length);
+    void notify_closed(uint16_t code);
+    void schedule_flush();
+
+private:
+    EventLoop& m_loop;
+    OutputQueue& m_output;
+    WebSocketOwner* m_owner;
+    std::unique_ptr<WebSocketHandler> m_handler;
+    std::unique_ptr<PerMessageDeflate> m_deflate;
+    TimerNode m_timer;
+
+    // Message being reassembled from fragments, or inflated
+    std::string m_message;
+    uint8_t m_message_opcode;
+    bool m_message_compressed;
+
+    // In a handler call from process_input(), which flushes afterwards
+    bool m_dispatching;
+    // send() returned false
+    bool m_blocked;
+    bool m_ping_outstanding;
+    bool m_close_sent;
+    bool m_close_received;
+    bool m_failed;
+    bool m_closed_notified;
+};
+
+#endif // WEBSOCKET_SESSION_H
@@ -0,0 +1,206 @@
+#include "work_stealing_scheduler.h"
+#include "defs.h"
+#include "metrics.h"
+#include "utils.h"
+
+WorkStealingScheduler::Worker::Worker()
+    : jobs(SCHEDULER_DEQUE_SIZE),
+      parked(false)
+{
+
+}
+
+WorkStealingScheduler::WorkStealingScheduler(EventLoop& loop, int threads, bool stealing)
+    : m_thread_count(threads),
+      m_stealing(stealing),
+      m_completions(loop, this),
+      m_stopping(false),
+      m_pending(0)
+{
+    for (int i = 0; i < m_thread_count; i++)
+    {
+        m_workers.emplace_back(new Worker());
+    }
+}
+
+WorkStealingScheduler::~WorkStealingScheduler()
+{
+    m_stopping.store(true, std::memory_order_seq_cst);
+    for (std::unique_ptr<Worker>& worker : m_workers)
+    {
+        {
+            std::lock_guard<std::mutex> lock(worker->mutex);
+            worker->parked.store(false, std::memory_order_relaxed);
+        }
+        worker->ready.notify_one();
+    }
+    for (std::unique_ptr<Worker>& worker : m_workers)
+    {
+        if (worker->thread.joinable())
+        {
+            worker->thread.join();
+        }
+
+        OffloadJob* job;
+        while (worker->jobs.steal(job))
+        {
+            delete job;
+        }
+    }
+}
+
+bool WorkStealingScheduler::start()
+{
+    if (!m_completions.start())
+    {
+        return false;
+    }
+
+    for (int i = 0; i < m_thread_count; i++)
+    {
+        m_workers[i]->thread = std::thread(&WorkStealingScheduler::run_thread, this, i);
+    }
+    return true;
+}
+
+bool WorkStealingScheduler::submit(std::unique_ptr<OffloadJob>& job)
+{
+    if (m_pending >= SCHEDULER_QUEUE_SIZE)
+    {
+        METRIC_INC(METRIC_COMPUTE_INLINE);
+        return false;
+    }
+
+    Worker& home = *m_workers[job->m_affinity % m_workers.size()];
+    job->m_submitted_us = monotonic_us();
+    home.jobs.push(job.release());
+    m_pending++;
+    METRIC_INC(METRIC_COMPUTE_QUEUE_DEPTH);
+
+    // Pairs with the fence a worker puts between marking itself parked and
+    // looking for work one last time: either it sees the job or this sees
+    // it parked.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (home.parked.load(std::memory_order_relaxed) && wake(home))
+    {
+        return true;
+    }
+
+    // The home thread is busy; a sleeping one may take the job instead.
+    if (m_stealing)
+    {
+        for (std::unique_ptr<Worker>& worker : m_workers)
+        {
+            if (worker->parked.load(std::memory_order_relaxed) && wake(*worker))
+            {
+                break;
+            }
+        }
+    }
+    return true;
+}
+
+void WorkStealingScheduler::cancel(OffloadJob* job)
+{
+    // The job sits in a deque another thread may be taking it from; it is
+    // skipped there and freed once it comes back.
+    job->m_cancelled.store(true, std::memory_order_relaxed);
+}
+
+void WorkStealingScheduler::job_finished(OffloadJob* job)
+{
+    m_pending--;
+    METRIC_DEC(METRIC_COMPUTE_QUEUE_DEPTH);
+    if (!job->is_cancelled())
+    {
+        METRIC_INC(METRIC_COMPUTE_JOBS);
+        METRIC_ADD(METRIC_COMPUTE_WAIT_US, job->m_started_us - job->m_submitted_us);
+        METRIC_ADD(METRIC_COMPUTE_RUN_US, job->m_finished_us - job->m_started_us);
+        job->complete();
+    }
+    delete job;
+}
+
+void WorkStealingScheduler::run_thread(int index)
+{
+    Worker& self = *m_workers[index];
+    while (!m_stopping.load(std::memory_order_relaxed))
+    {
+        OffloadJob* job = take(index);
+        if (job != nullptr)
+        {
+            job->m_started_us = monotonic_us();
+            if (!job->is_cancelled())
+            {
+                job->run();
+            }
+            job->m_finished_us = monotonic_us();
+            m_completions.push(job);
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(self.mutex);
+        self.parked.store(true, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (has_work(index) || m_stopping.load(std::memory_order_relaxed))
+        {
+            self.parked.store(false, std::memory_order_relaxed);
+            continue;
+        }
+        self.ready.wait(lock, [&self] { return !self.parked.load(std::memory_order_relaxed); });
+    }
+}
+
+OffloadJob* WorkStealingScheduler::take(int index)
+{
+    OffloadJob* job;
+    if (m_workers[index]->jobs.steal(job))
+    {
+        return job;
+    }
+    if (!m_stealing)
+    {
+        return nullptr;
+    }
+
+    for (int i = 1; i < m_thread_count; i++)
+    {
+        if (m_workers[(index + i) % m_thread_count]->jobs.steal(job))
+        {
+            METRIC_INC(METRIC_COMPUTE_STEALS);
+            return job;
+        }
+    }
+    return nullptr;
+}
+
+bool WorkStealingScheduler::has_work(int index) const
+{
+    if (!m_stealing)
+    {
+        return !m_workers[index]->jobs.is_empty();
+    }
+
+    for (const std::unique_ptr<Worker>& worker : m_workers)
+    {
+        if (!worker->jobs.is_empty())
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool WorkStealingScheduler::wake(Worker& worker)
+{
+    {
+        std::lock_guard<std::mutex> lock(worker.mutex);
+        if (!worker.parked.load(std::memory_order_relaxed))
+        {
+            return false;
+        }
+        worker.parked.store(false, std::memory_order_relaxed);
+    }
+    worker.ready.notify_one();
+    return true;
+}
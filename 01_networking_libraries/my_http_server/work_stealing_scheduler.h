@@ -0,0 +1,66 @@
+#ifndef WORK_STEALING_SCHEDULER_H
+#define WORK_STEALING_SCHEDULER_H
+
+#include "chase_lev_deque.h"
+#include "completion_queue.h"
+#include "event_loop.h"
+#include "offload_job.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Runs CPU-heavy handler work off the event loop. Every thread has a
+// Chase-Lev deque of its own, and a job goes to the deque its affinity
+// picks, so the jobs of one connection keep to one thread and its cache.
+// A thread that runs out of work takes jobs from the others' deques, so a
+// burst that lands on one thread spreads over all of them; with stealing
+// off, every thread keeps to its own deque. Jobs are taken oldest first,
+// by their own thread as by a thief. The loop is the only thread that
+// submits, and finished jobs come back to it through a CompletionQueue.
+// At most SCHEDULER_QUEUE_SIZE jobs wait at a time. One scheduler belongs
+// to one loop and is started after the workers are forked.
+class WorkStealingScheduler : public JobExecutor, public CompletionClient
+{
+public:
+    WorkStealingScheduler(EventLoop& loop, int threads, bool stealing);
+    ~WorkStealingScheduler();
+
+    bool start();
+
+    bool submit(std::unique_ptr<OffloadJob>& job) override;
+    void cancel(OffloadJob* job) override;
+    void job_finished(OffloadJob* job) override;
+
+private:
+    struct Worker
+    {
+        Worker();
+
+        ChaseLevDeque<OffloadJob*> jobs;
+        std::mutex mutex;
+        std::condition_variable ready;
+        // Set by the worker before it sleeps, cleared by whoever wakes it
+        std::atomic<bool> parked;
+        std::thread thread;
+    };
+
+    void run_thread(int index);
+    OffloadJob* take(int index);
+    bool has_work(int index) const;
+    bool wake(Worker& worker);
+
+private:
+    int m_thread_count;
+    bool m_stealing;
+    CompletionQueue m_completions;
+    std::vector<std::unique_ptr<Worker>> m_workers;
+    std::atomic<bool> m_stopping;
+    // Submitted and not yet finished; the loop's thread only
+    std::size_t m_pending;
+};
+
+#endif // WORK_STEALING_SCHEDULER_H
@@ -0,0 +1,265 @@
+#include "worker_supervisor.h"
+#include "logging.h"
+#include "metrics.h"
+#include "numa_node.h"
+#include "utils.h"
+#include "defs.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <ctime>
+#include <string>
+#include <poll.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+
+namespace
+{
+    volatile sig_atomic_t s_stopping = 0;
+    volatile sig_atomic_t s_draining = 0;
+
+    void handle_stop_signal(int)
+    {
+        s_stopping = 1;
+    }
+
+    void handle_drain_signal(int)
+    {
+        s_draining = 1;
+    }
+
+    // Only there to interrupt ppoll(); the children are reaped afterwards.
+    void handle_child_signal(int)
+    {
+    }
+
+    void set_signal_handler(int signum, void (*handler)(int))
+    {
+        struct sigaction action;
+        action.sa_handler = handler;
+        sigemptyset(&action.sa_mask);
+        action.sa_flags = 0;
+        sigaction(signum, &action, nullptr);
+    }
+}
+
+WorkerSupervisor::WorkerSupervisor(int workers, bool pin_cpus, const std::vector<int>& cpus, bool numa_local)
+    : m_workers(workers),
+      m_pin_cpus(pin_cpus),
+      m_numa_local(numa_local),
+      m_pids(workers, -1),
+      m_started_ms(workers, 0),
+      m_cpus(cpus)
+{
+    if (!m_cpus.empty())
+    {
+        return;
+    }
+
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0)
+    {
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+        {
+            if (CPU_ISSET(cpu, &allowed))
+            {
+                m_cpus.push_back(cpu);
+            }
+        }
+    }
+}
+
+int WorkerSupervisor::run(UpgradeSocket* upgrade, const std::vector<int>& listeners)
+{
+    if (!Metrics::getInstance().share(m_workers))
+    {
+        LOGE("Metrics cannot be shared between workers");
+    }
+
+    // The signals are only let through inside ppoll(), so none can slip in
+    // between checking the flags and going to sleep.
+    sigset_t blocked;
+    sigemptyset(&blocked);
+    sigaddset(&blocked, SIGCHLD);
+    sigaddset(&blocked, SIGTERM);
+    sigaddset(&blocked, SIGINT);
+    sigaddset(&blocked, SIGQUIT);
+    sigprocmask(SIG_BLOCK, &blocked, &m_original_mask);
+    set_signal_handler(SIGCHLD, handle_child_signal);
+    set_signal_handler(SIGTERM, handle_stop_signal);
+    set_signal_handler(SIGINT, handle_stop_signal);
+    set_signal_handler(SIGQUIT, handle_drain_signal);
+
+    for (int worker = 0; worker < m_workers; worker++)
+    {
+        if (spawn(worker))
+        {
+            return worker;
+        }
+    }
+
+    bool stop_sent = false;
+    bool drain_sent = false;
+    while (has_workers())
+    {
+        if (s_stopping && !stop_sent)
+        {
+            signal_workers(SIGTERM);
+            stop_sent = true;
+        }
+        else if (s_draining && !drain_sent && !s_stopping)
+        {
+            LOGI("Draining workers");
+            signal_workers(SIGQUIT);
+            drain_sent = true;
+        }
+
+        pollfd request = { (upgrade != nullptr) ? upgrade->get_socket() : -1, POLLIN, 0 };
+        int ready = ppoll(&request, 1, nullptr, &m_original_mask);
+        if (ready > 0 && (request.revents & POLLIN) && !s_stopping && !s_draining &&
+            upgrade->hand_over(listeners))
+        {
+            upgrade->close();
+            s_draining = 1;
+        }
+
+        int status;
+        pid_t pid;
+        while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+        {
+            auto it = std::find(m_pids.begin(), m_pids.end(), pid);
+            if (it == m_pids.end())
+            {
+                continue;
+            }
+            int worker = static_cast<int>(it - m_pids.begin());
+            m_pids[worker] = -1;
+            if (s_stopping || s_draining)
+            {
+                continue;
+            }
+
+            LOGE("Worker " + std::to_string(worker) + " exited with status " + std::to_string(status) + ", respawning");
+            // A worker that dies right after starting would otherwise be
+            // respawned in a tight loop.
+            uint64_t alive_ms = monotonic_ms() - m_started_ms[worker];
+            if (alive_ms < WORKER_RESPAWN_DELAY_MS)
+            {
+                uint64_t delay_ms = WORKER_RESPAWN_DELAY_MS - alive_ms;
+                timespec delay = { static_cast<time_t>(delay_ms / 1000), static_cast<long>(delay_ms % 1000) * 1000000 };
+                nanosleep(&delay, nullptr);
+            }
+            if (spawn(worker))
+            {
+                return worker;
+            }
+        }
+    }
+
+    LOGI("All workers have exited");
+    return -1;
+}
+
+bool WorkerSupervisor::spawn(int worker)
+{
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        LOGE("Supervisor fork() failed");
+        return false;
+    }
+
+    if (pid == 0)
+    {
+        set_signal_handler(SIGCHLD, SIG_DFL);
+        set_signal_handler(SIGTERM, SIG_DFL);
+        set_signal_handler(SIGINT, SIG_DFL);
+        set_signal_handler(SIGQUIT, SIG_DFL);
+        // SIGQUIT stays blocked: the worker's loop reads it from a signalfd.
+        sigset_t mask = m_original_mask;
+        sigaddset(&mask, SIGQUIT);
+        sigprocmask(SIG_SETMASK, &mask, nullptr);
+        // Workers do not outlive the master.
+        prctl(PR_SET_PDEATHSIG, SIGTERM);
+        if (getppid() == 1)
+        {
+            _exit(0);
+        }
+
+        // A worker pinned to a CPU allocates from that CPU's node, including
+        // the copies of pages it shares with the master until it writes to
+        // them, and keeps its metrics row there.
+        int numa_node = -1;
+        if (m_pin_cpus && pin_to_cpu(worker) && m_numa_local)
+        {
+            numa_node = NumaNode::current();
+            if (!NumaNode::prefer(numa_node))
+            {
+                LOGE("Worker " + std::to_string(worker) + " cannot prefer NUMA node " + std::to_string(numa_node));
+                numa_node = -1;
+            }
+        }
+        Metrics::getInstance().use_worker_slot(worker, numa_node);
+        return true;
+    }
+
+    m_pids[worker] = pid;
+    m_started_ms[worker] = monotonic_ms();
+    LOGI("Worker " + std::to_string(worker) + " started as pid " + std::to_string(pid));
+    return false;
+}
+
+int WorkerSupervisor::get_cpu(int worker) const
+{
+    if (!m_pin_cpus || m_cpus.empty())
+    {
+        return -1;
+    }
+    return m_cpus[worker % m_cpus.size()];
+}
+
+bool WorkerSupervisor::pin_to_cpu(int worker) const
+{
+    int cpu = get_cpu(worker);
+    if (cpu < 0 || cpu >= CPU_SETSIZE)
+    {
+        return false;
+    }
+
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(cpu, &cpus);
+    if (sched_setaffinity(0, sizeof(cpus), &cpus) != 0)
+    {
+        LOGE("Worker " + std::to_string(worker) + " cannot be pinned to CPU " + std::to_string(cpu));
+        return false;
+    }
+    return true;
+}
+
+void WorkerSupervisor::signal_workers(int signum)
+{
+    for (pid_t pid : m_pids)
+    {
+        if (pid > 0)
+        {
+            kill(pid, signum);
+        }
+    }
+}
+
+bool WorkerSupervisor::has_workers() const
+{
+    for (pid_t pid : m_pids)
+    {
+        if (pid > 0)
+        {
+            return true;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,50 @@
+#ifndef WORKER_SUPERVISOR_H
+#define WORKER_SUPERVISOR_H
+
+#include "upgrade_socket.h"
+
+#include <cstdint>
+#include <signal.h>
+#include <sys/types.h>
+#include <vector>
+
+// Prefork mode: the master process forks the workers, which share nothing
+// but the listening sockets and the metrics, and respawns any worker that
+// dies, so a crash only costs the connections of that one worker. The
+// master also answers hot-upgrade requests, and drains the workers with
+// SIGQUIT once the new server has taken over or on its own SIGQUIT.
+class WorkerSupervisor
+{
+public:
+    // Workers are pinned round-robin to cpus, or to the CPUs this process
+    // may run on when it is empty. A pinned worker with numa_local takes
+    // its memory from the NUMA node of its CPU.
+    WorkerSupervisor(int workers, bool pin_cpus, const std::vector<int>& cpus, bool numa_local);
+
+    // Forks the workers and supervises them. Returns in each worker with
+    // its index, and in the master with -1 once it has been told to stop,
+    // by SIGTERM, SIGINT, SIGQUIT or a hand-over on upgrade, and all
+    // workers have exited.
+    int run(UpgradeSocket* upgrade, const std::vector<int>& listeners);
+    // The CPU a worker is pinned to, -1 when workers are not pinned.
+    int get_cpu(int worker) const;
+
+private:
+    // Returns true in the new worker.
+    bool spawn(int worker);
+    // Returns false if the worker could not be pinned.
+    bool pin_to_cpu(int worker) const;
+    void signal_workers(int signum);
+    bool has_workers() const;
+
+private:
+    int m_workers;
+    bool m_pin_cpus;
+    bool m_numa_local;
+    std::vector<pid_t> m_pids;
+    std::vector<uint64_t> m_started_ms;
+    std::vector<int> m_cpus;
+    sigset_t m_original_mask;
+};
+
+#endif // WORKER_SUPERVISOR_H